@@ -0,0 +1,68 @@
+#pragma once
+
+#include "pico/stdlib.h"
+
+// number of ADC inputs, 0-3 for GPIO 26-29 and 4 for the temperature sensor
+#define ADC_INPUT_COUNT 5u
+// the input wired to VSYS / 3, shared with the CYW43 clock on the Pico W
+#define ADC_INPUT_VSYS 3u
+// the input wired to the internal temperature sensor
+#define ADC_INPUT_TEMP 4u
+
+// number of conversions summed per input per scan, override at build time
+#ifndef ADC_SAMPLE_COUNT
+#define ADC_SAMPLE_COUNT 1000u
+#endif
+
+// ADC clock divider per input, each input is converted at 48MHz / (1 + div).
+// The divider is scaled down by the number of inputs in a scan, so a scan
+// takes the same time regardless of how many inputs it covers, down to the
+// hardware minimum of 96 cycles per conversion. Defaults to 100kS/s per
+// input, i.e. 10ms per scan.
+#ifndef ADC_CLKDIV
+#define ADC_CLKDIV 479.0f
+#endif
+
+/**
+ * Initializes the ADC FIFO for free-running conversions and claims a DMA
+ * channel to drain it into the sample buffer. Completion is signalled by the
+ * DMA interrupt, so a scan runs without any CPU involvement.
+ */
+void adc_dma_init(void);
+
+/**
+ * Starts a background scan of `ADC_SAMPLE_COUNT` conversions on each of a set
+ * of ADC inputs. The inputs are sampled in one hardware round-robin pass, so
+ * their samples are interleaved in time. A finished scan that was never
+ * polled is discarded.
+ *
+ * @param input_mask Bitmask of the ADC inputs to sample
+ *
+ * @return `true` if the scan started, `false` if one is already running
+ */
+bool adc_dma_start(uint8_t input_mask);
+
+/**
+ * Whether a scan is currently running.
+ */
+bool adc_dma_busy(void);
+
+/**
+ * Checks whether the last scan has finished. If so, sums the samples of each
+ * input and marks the scan as consumed.
+ *
+ * @param sums Array to store the sum of the samples, indexed by ADC input.
+ * Inputs which were not scanned are set to zero.
+ *
+ * @return `true` if a finished scan was consumed, `false` otherwise
+ */
+bool adc_dma_poll(uint32_t sums[ADC_INPUT_COUNT]);
+
+/**
+ * Runs a scan and waits for it to finish. Waits out any scan already in
+ * progress first. Only for use where blocking is acceptable, i.e. calibration.
+ *
+ * @param input_mask Bitmask of the ADC inputs to sample
+ * @param sums Array to store the sum of the samples, indexed by ADC input
+ */
+void adc_dma_read_blocking(uint8_t input_mask, uint32_t sums[ADC_INPUT_COUNT]);
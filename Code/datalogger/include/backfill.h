@@ -0,0 +1,41 @@
+#pragma once
+
+#include "pico/stdlib.h"
+
+#include "sensors.h"
+
+// how long measurements are held in RAM until the clock is first set, older
+// ones go to the flash log, override at build time
+#ifndef BACKFILL_HOLD_MS
+#define BACKFILL_HOLD_MS 1800000ul // 30min
+#endif
+
+// measurements held in RAM, one per sample period over the hold time
+#define BACKFILL_CAPACITY (BACKFILL_HOLD_MS / SENSORS_PERIOD_MS)
+
+/**
+ * Holds a measurement taken before the clock was set. Its time is since
+ * boot, which the first sync maps onto UTC, so it's logged once that
+ * happens. If full, the oldest measurement is pushed out to make room, for
+ * the caller to keep elsewhere.
+ *
+ * @param measure Pointer to the measurement to copy in
+ * @param oldest Pointer to copy the measurement pushed out into
+ *
+ * @return `true` if one was pushed out, `false` if there was room
+ */
+bool backfill_push(const measurement_t *measure, measurement_t *oldest);
+
+/**
+ * Takes the oldest held measurement.
+ *
+ * @param measure Pointer to copy the measurement into
+ *
+ * @return `true` if a measurement was taken, `false` if none are held
+ */
+bool backfill_pop(measurement_t *measure);
+
+/**
+ * Returns the number of measurements held.
+ */
+uint32_t backfill_count(void);
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "pico/stdlib.h"
+#include "hardware/structs/systick.h"
+
+// SysTick is a 24 bit down-counter
+#define BENCH_COUNTER_MASK 0x00ffffffu
+
+/**
+ * Starts SysTick free-running from the processor clock, so it can be used as
+ * a cycle counter. The Cortex-M0+ has no DWT, so this is the closest option.
+ * Periods longer than 2^24 cycles (~134ms at 125MHz) wrap around.
+ */
+static inline void bench_init(void)
+{
+    systick_hw->rvr = BENCH_COUNTER_MASK;
+    systick_hw->cvr = 0;
+    // enable, clocked from the processor, no interrupt
+    systick_hw->csr = 0x5;
+}
+
+/**
+ * Returns the current cycle counter value, to pass to `bench_cycles()`.
+ */
+static inline uint32_t bench_start(void)
+{
+    return systick_hw->cvr;
+}
+
+/**
+ * Returns the number of cycles elapsed since `start`.
+ */
+static inline uint32_t bench_cycles(uint32_t start)
+{
+    // the counter counts down, so the difference is reversed
+    return (start - systick_hw->cvr) & BENCH_COUNTER_MASK;
+}
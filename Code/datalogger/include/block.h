@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "record.h"
+
+// Fixed-size compressed blocks of measurements, shared with the host tools so
+// keep this portable. Each block stands alone:
+//
+//   CRC-32 of the rest (LE32) | version | count | samples (LE16) |
+//   first timestamp (LE32) | first values (LE16 each) | bitstream
+//
+// The bitstream holds every later sample, most significant bit first. The
+// timestamp is stored as its delta-of-delta, and each value as its delta from
+// the previous sample, both zig-zag encoded with a variable length prefix:
+//
+//   timestamp: 0 | 10 + 7 bits | 110 + 9 bits | 1110 + 12 bits | 1111 + 32 bits
+//   value:     0 | 10 + 6 bits | 110 + 10 bits | 111 + 17 bits
+
+// format version, bumped on any incompatible change
+#define BLOCK_VERSION 1u
+// size of every block, a flash page
+#define BLOCK_SIZE 256u
+
+/**
+ * Encoder state, a block being filled.
+ */
+typedef struct
+{
+    uint8_t data[BLOCK_SIZE];
+    uint16_t bits;    // bits used, from the start of the block
+    uint16_t samples; // samples in the block
+    uint8_t count;    // values per sample, fixed by the first
+    uint32_t timestamp;
+    int32_t delta; // the last timestamp delta
+    int16_t values[RECORD_MAX_CHANNELS];
+} block_encoder_t;
+
+/**
+ * Reader state, a position within a block.
+ */
+typedef struct
+{
+    const uint8_t *data;
+    uint16_t bits;    // bits read, from the start of the block
+    uint16_t samples; // samples in the block
+    uint16_t sample;  // samples read so far
+    uint8_t count;
+    uint32_t timestamp;
+    int32_t delta;
+    int16_t values[RECORD_MAX_CHANNELS];
+} block_reader_t;
+
+/**
+ * Starts a new, empty block.
+ *
+ * @param enc Pointer to the encoder
+ */
+void block_encoder_init(block_encoder_t *enc);
+
+/**
+ * Appends a sample to the block.
+ *
+ * @param enc Pointer to the encoder
+ * @param timestamp Unix time in seconds
+ * @param values The fixed-point channel values
+ * @param count Number of values, at most `RECORD_MAX_CHANNELS`
+ *
+ * @return `true` if it was added, `false` if the block is full or the count
+ * differs from the first sample, in which case the block should be finished
+ * and a new one started
+ */
+bool block_append(block_encoder_t *enc, uint32_t timestamp,
+                  const int16_t *values, uint8_t count);
+
+/**
+ * Completes the block's header and CRC. The encoder must be reset with
+ * `block_encoder_init()` before it's used again.
+ *
+ * @param enc Pointer to the encoder
+ *
+ * @return The finished block, `BLOCK_SIZE` bytes
+ */
+const uint8_t *block_finish(block_encoder_t *enc);
+
+/**
+ * Starts reading a block, after checking its CRC and version.
+ *
+ * @param reader Pointer to the reader
+ * @param block The block, `BLOCK_SIZE` bytes
+ *
+ * @return `true` if the block is valid, `false` otherwise
+ */
+bool block_reader_init(block_reader_t *reader, const uint8_t *block);
+
+/**
+ * Reads the next sample from a block.
+ *
+ * @param reader Pointer to the reader
+ * @param rec Set to the sample
+ *
+ * @return `true` if a sample was read, `false` at the end of the block
+ */
+bool block_read(block_reader_t *reader, record_t *rec);
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Computes the standard CRC-32 (IEEE 802.3, as used by zlib) of a buffer.
+ * Table driven a nibble at a time, to keep the table small.
+ *
+ * @param data Pointer to the data
+ * @param len Number of bytes
+ *
+ * @return The CRC
+ */
+uint32_t crc32(const void *data, size_t len);
@@ -14,6 +14,7 @@ enum ErrorCode
     WARNING_RECALIBRATING = 0b00001000,   // in calibration mode
     WARNING_INTIALIZING = 0b00010000,     // doing initial system setup
     NOTIF_SENSOR_THRESHOLD = 0b00100000,  // soil too dry
+    ERROR_SD_FAILED = 0b01000000,         // sd card missing or failing
 };
 
 /**
@@ -24,9 +25,15 @@ enum ErrorCode
 void init_errors(uint8_t code);
 
 /**
- * Set an error code and update the LED state if needed.
+ * Set an error code and update the LED state if needed. Safe to call from
+ * either core, but not from interrupts.
  *
  * @param code The error code to set
  * @param enabled Whether the code should be on or off
  */
 void set_error(uint8_t code, bool enabled);
+
+/**
+ * Returns the current error code mask.
+ */
+uint8_t get_errors(void);
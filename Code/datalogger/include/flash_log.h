@@ -0,0 +1,151 @@
+#pragma once
+
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+
+#include "persist.h"
+#include "sensors.h"
+
+// sectors reserved for the log, just below the persisted records
+#define FLASH_LOG_SECTOR_COUNT 128u
+// size of the log region
+#define FLASH_LOG_REGION_SIZE (FLASH_LOG_SECTOR_COUNT * FLASH_SECTOR_SIZE)
+// offset of the log region from the start of flash
+#define FLASH_LOG_REGION_OFFSET (PERSIST_REGION_OFFSET - FLASH_LOG_REGION_SIZE)
+// pages in the log
+#define FLASH_LOG_PAGE_COUNT (FLASH_LOG_REGION_SIZE / FLASH_PAGE_SIZE)
+// bytes of records a page can hold, after its header
+#define FLASH_LOG_PAYLOAD_SIZE (FLASH_PAGE_SIZE - 20u)
+
+/**
+ * One page of the log, a run of records starting with a keyframe, so each
+ * page decodes on its own. A page's sequence number modulo the page count is
+ * its position, so a page is found directly from its sequence number.
+ *
+ * Records are stamped in UTC, except those logged before the clock was first
+ * set, which are stamped in seconds since boot. Those pages are dated with
+ * the UTC of boot once the clock is set.
+ */
+typedef struct
+{
+    uint32_t crc;      // CRC-32 of the sequence through the payload
+    uint32_t sent;     // 0 once forwarded, left erased otherwise, so it can be programmed later
+    uint32_t boot_utc; // 0 if stamped in UTC, else the UTC of boot to add, left erased until known
+    uint32_t sequence; // incremented with each page, the newest is the head
+    uint16_t length;   // bytes of records in the payload
+    uint16_t count;    // number of records in the payload
+    uint8_t payload[FLASH_LOG_PAYLOAD_SIZE];
+} flash_log_page_t;
+
+/**
+ * Finds the end of the log after a reset. Each sector's first page is
+ * binary searched for the newest sector, then its pages for the first free
+ * one, so only a handful of pages are read.
+ *
+ * @return `true` if successful, `false` if the region overlaps the program
+ */
+bool flash_log_init(void);
+
+/**
+ * Dating of a page's timestamps, see `flash_log_page_epoch()`.
+ */
+typedef enum
+{
+    FLASH_LOG_DATED,     // the timestamps plus the epoch are UTC
+    FLASH_LOG_UNDATED,   // logged since boot, dated once the clock is set
+    FLASH_LOG_UNDATABLE, // logged before the clock was set on an earlier boot
+} FlashLogDating;
+
+/**
+ * Appends a measurement to the page being filled in RAM. A full page is
+ * written by `flash_log_task()`. Until the clock is first set, measurements
+ * are stamped in seconds since boot, and their pages are dated once it is.
+ *
+ * @param measure Pointer to the measurement to log
+ */
+void flash_log_write(const measurement_t *measure);
+
+/**
+ * Writes a finished page to flash, erasing the next sector first if needed,
+ * and programs any pending sent mark, or the date of a page written before
+ * the clock was set. Both cores are paused meanwhile, so it waits until the
+ * sensors are idle. Must be polled regularly.
+ */
+void flash_log_task(void);
+
+/**
+ * Whether a finished page is waiting to be written. Meanwhile, filling
+ * another page would drop this one, so a burst of measurements should wait.
+ */
+bool flash_log_busy(void);
+
+/**
+ * Returns the number of measurements logged since boot, so a reader of the
+ * log can tell when there are new ones without looking through the pages.
+ */
+uint32_t flash_log_records(void);
+
+/**
+ * Returns the sequence number the next page written will have. Pages before
+ * it are readable with `flash_log_page()` until they're overwritten, about a
+ * full region later.
+ */
+uint32_t flash_log_sequence(void);
+
+/**
+ * Returns the sequence number of the page being filled. Pages from
+ * `flash_log_sequence()` up to it are still in RAM, numbered as they'll be
+ * written unless a torn page has to be skipped after a reset.
+ */
+uint32_t flash_log_filling(void);
+
+/**
+ * Returns a page by its sequence number, read straight from flash, or from
+ * RAM if it isn't written yet. The page being filled grows as measurements
+ * are logged.
+ *
+ * @param sequence The page's sequence number
+ *
+ * @return Pointer to the page, or `NULL` if it's torn, skipped or overwritten
+ */
+const flash_log_page_t *flash_log_page(uint32_t sequence);
+
+/**
+ * Finds what to add to a page's timestamps to make them UTC.
+ *
+ * @param sequence The page's sequence number
+ * @param p Pointer to the page, from `flash_log_page()`
+ * @param epoch Where to put the number to add, if the page is dated
+ *
+ * @return Whether the page is dated, waits for the clock, or never can be
+ */
+FlashLogDating flash_log_page_epoch(uint32_t sequence, const flash_log_page_t *p,
+                                    uint32_t *epoch);
+
+/**
+ * Reads back, in order, the measurements logged since boot before the clock
+ * was first set, with their times since boot, e.g. to copy them to the SD
+ * card once it's set. Stops at the first measurement logged after.
+ *
+ * @param measure Pointer to copy the measurement into
+ *
+ * @return `true` if a measurement was read, `false` once there are no more
+ */
+bool flash_log_read_held(measurement_t *measure);
+
+/**
+ * Marks a finished page as forwarded, once the sensors are idle, or as it's
+ * written if it's still in RAM. Only the newest mark is kept, so only the
+ * last page of each batch needs marking.
+ *
+ * @param sequence The page's sequence number
+ */
+void flash_log_mark_sent(uint32_t sequence);
+
+/**
+ * Finds where forwarding should resume after a reset, the page after the
+ * newest one marked sent. Reads every page, so it's only meant for startup.
+ *
+ * @return The sequence number of the first page to forward
+ */
+uint32_t flash_log_first_unsent(void);
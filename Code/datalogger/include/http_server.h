@@ -0,0 +1,33 @@
+#pragma once
+
+#include "pico/stdlib.h"
+
+#include "sensors.h"
+
+// TCP port the server listens on
+#ifndef DATALOGGER_HTTP_PORT
+#define DATALOGGER_HTTP_PORT 80u
+#endif
+
+/**
+ * Starts listening for HTTP requests. `GET /metrics` returns the latest
+ * readings, error state, uptime, sync age and internal counters in the
+ * Prometheus text format, and `GET /latest` the latest readings as JSON.
+ *
+ * @return `true` if successful, `false` otherwise
+ */
+bool http_server_init(void);
+
+/**
+ * Keeps a copy of a measurement to serve as the latest readings.
+ *
+ * @param measure Pointer to the completed measurement
+ */
+void http_server_set_latest(const measurement_t *measure);
+
+/**
+ * Renders responses for requests that have arrived, and starts sending
+ * them. Requests are parsed and responses sent in the background by lwIP,
+ * only rendering needs the main loop. Must be polled regularly.
+ */
+void http_server_task(void);
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Compile-time tokenization of log format strings, for
+ * `DATALOGGER_LOG_TOKENIZED`. Only depends on the C library, so the host
+ * tools can share it.
+ */
+
+// characters of a format string which are hashed, the rest only count towards
+// its length. `tools/log_tokens.py` must use the same value.
+#define LOG_TOKEN_HASH_LENGTH 80u
+
+/**
+ * The token of a format string literal, i.e. its 65599 hash. Folds to a
+ * constant, so the literal itself is never emitted into the image.
+ *
+ * The hash starts at the string's length, then adds each character times
+ * successive powers of 65599, all modulo 2^32.
+ */
+#define LOG_TOKEN(str) \
+    ((uint32_t)(sizeof(str) - 1u) + _LOG_HASH(str))
+
+// a character of `str` times its coefficient, or 0 past the end of it
+#define _LOG_HASH_CHAR(str, i, k) \
+    ((uint32_t)(uint8_t)(str)[(i) < sizeof(str) ? (i) : sizeof(str) - 1u] * (k))
+
+// generated by `tools/log_tokens.py --header`
+#define _LOG_HASH(str) \
+    (_LOG_HASH_CHAR(str, 0, 0x0001003fu) + \
+     _LOG_HASH_CHAR(str, 1, 0x007e0f81u) + \
+     _LOG_HASH_CHAR(str, 2, 0x2e86d0bfu) + \
+     _LOG_HASH_CHAR(str, 3, 0x43ec5f01u) + \
+     _LOG_HASH_CHAR(str, 4, 0x162c613fu) + \
+     _LOG_HASH_CHAR(str, 5, 0xd62aee81u) + \
+     _LOG_HASH_CHAR(str, 6, 0xa311b1bfu) + \
+     _LOG_HASH_CHAR(str, 7, 0xd319be01u) + \
+     _LOG_HASH_CHAR(str, 8, 0xb156c23fu) + \
+     _LOG_HASH_CHAR(str, 9, 0x6698cd81u) + \
+     _LOG_HASH_CHAR(str, 10, 0x0d1b92bfu) + \
+     _LOG_HASH_CHAR(str, 11, 0xcc881d01u) + \
+     _LOG_HASH_CHAR(str, 12, 0x7280233fu) + \
+     _LOG_HASH_CHAR(str, 13, 0x50c7ac81u) + \
+     _LOG_HASH_CHAR(str, 14, 0x8da473bfu) + \
+     _LOG_HASH_CHAR(str, 15, 0x4f377c01u) + \
+     _LOG_HASH_CHAR(str, 16, 0xfaa8843fu) + \
+     _LOG_HASH_CHAR(str, 17, 0x33b78b81u) + \
+     _LOG_HASH_CHAR(str, 18, 0x45ac54bfu) + \
+     _LOG_HASH_CHAR(str, 19, 0x7a27db01u) + \
+     _LOG_HASH_CHAR(str, 20, 0xeacfe53fu) + \
+     _LOG_HASH_CHAR(str, 21, 0xae686a81u) + \
+     _LOG_HASH_CHAR(str, 22, 0x563335bfu) + \
+     _LOG_HASH_CHAR(str, 23, 0x6c593a01u) + \
+     _LOG_HASH_CHAR(str, 24, 0xe3f6463fu) + \
+     _LOG_HASH_CHAR(str, 25, 0x5fda4981u) + \
+     _LOG_HASH_CHAR(str, 26, 0xe03916bfu) + \
+     _LOG_HASH_CHAR(str, 27, 0x44cb9901u) + \
+     _LOG_HASH_CHAR(str, 28, 0x871ba73fu) + \
+     _LOG_HASH_CHAR(str, 29, 0xe70d2881u) + \
+     _LOG_HASH_CHAR(str, 30, 0x04bdf7bfu) + \
+     _LOG_HASH_CHAR(str, 31, 0x227ef801u) + \
+     _LOG_HASH_CHAR(str, 32, 0x7540083fu) + \
+     _LOG_HASH_CHAR(str, 33, 0xe3010781u) + \
+     _LOG_HASH_CHAR(str, 34, 0xe4c1d8bfu) + \
+     _LOG_HASH_CHAR(str, 35, 0x24735701u) + \
+     _LOG_HASH_CHAR(str, 36, 0x4f63693fu) + \
+     _LOG_HASH_CHAR(str, 37, 0xf2b5e681u) + \
+     _LOG_HASH_CHAR(str, 38, 0xa144b9bfu) + \
+     _LOG_HASH_CHAR(str, 39, 0x69a8b601u) + \
+     _LOG_HASH_CHAR(str, 40, 0xb685ca3fu) + \
+     _LOG_HASH_CHAR(str, 41, 0xb52bc581u) + \
+     _LOG_HASH_CHAR(str, 42, 0x5b469abfu) + \
+     _LOG_HASH_CHAR(str, 43, 0x111f1501u) + \
+     _LOG_HASH_CHAR(str, 44, 0x4ba72b3fu) + \
+     _LOG_HASH_CHAR(str, 45, 0xc962a481u) + \
+     _LOG_HASH_CHAR(str, 46, 0x33c77bbfu) + \
+     _LOG_HASH_CHAR(str, 47, 0x39d67401u) + \
+     _LOG_HASH_CHAR(str, 48, 0xafc78c3fu) + \
+     _LOG_HASH_CHAR(str, 49, 0xce5a8381u) + \
+     _LOG_HASH_CHAR(str, 50, 0x4bc75cbfu) + \
+     _LOG_HASH_CHAR(str, 51, 0x02ced301u) + \
+     _LOG_HASH_CHAR(str, 52, 0x83e6ed3fu) + \
+     _LOG_HASH_CHAR(str, 53, 0x63136281u) + \
+     _LOG_HASH_CHAR(str, 54, 0xc4463dbfu) + \
+     _LOG_HASH_CHAR(str, 55, 0x8b083201u) + \
+     _LOG_HASH_CHAR(str, 56, 0x69054e3fu) + \
+     _LOG_HASH_CHAR(str, 57, 0x268d4181u) + \
+     _LOG_HASH_CHAR(str, 58, 0xbe441ebfu) + \
+     _LOG_HASH_CHAR(str, 59, 0xf1829101u) + \
+     _LOG_HASH_CHAR(str, 60, 0x0022af3fu) + \
+     _LOG_HASH_CHAR(str, 61, 0xb7c82081u) + \
+     _LOG_HASH_CHAR(str, 62, 0x5ac0ffbfu) + \
+     _LOG_HASH_CHAR(str, 63, 0x553df001u) + \
+     _LOG_HASH_CHAR(str, 64, 0xea3f103fu) + \
+     _LOG_HASH_CHAR(str, 65, 0xb5c3ff81u) + \
+     _LOG_HASH_CHAR(str, 66, 0xbabce0bfu) + \
+     _LOG_HASH_CHAR(str, 67, 0xd53a4f01u) + \
+     _LOG_HASH_CHAR(str, 68, 0xc85a713fu) + \
+     _LOG_HASH_CHAR(str, 69, 0xbf80de81u) + \
+     _LOG_HASH_CHAR(str, 70, 0xff37c1bfu) + \
+     _LOG_HASH_CHAR(str, 71, 0x9077ae01u) + \
+     _LOG_HASH_CHAR(str, 72, 0x3b74d23fu) + \
+     _LOG_HASH_CHAR(str, 73, 0x73febd81u) + \
+     _LOG_HASH_CHAR(str, 74, 0x4931a2bfu) + \
+     _LOG_HASH_CHAR(str, 75, 0xa5f60d01u) + \
+     _LOG_HASH_CHAR(str, 76, 0xe48e333fu) + \
+     _LOG_HASH_CHAR(str, 77, 0x723d9c81u) + \
+     _LOG_HASH_CHAR(str, 78, 0xb9aa83bfu) + \
+     _LOG_HASH_CHAR(str, 79, 0x34b56c01u))
+
+/**
+ * The kinds of argument which can be packed into a frame, as found by
+ * `LOG_ARG_TYPES()`.
+ */
+typedef enum
+{
+    LOG_ARG_INT32,  // int, or anything smaller, as a zig-zag varint
+    LOG_ARG_INT64,  // long long, as a zig-zag varint
+    LOG_ARG_DOUBLE, // floating point, as a 32 bit float
+    LOG_ARG_STRING, // a string, as its length then its characters
+} LogArgType;
+
+// bits of the types word holding the argument count
+#define LOG_ARG_COUNT_BITS 4u
+// bits of the types word per argument
+#define LOG_ARG_TYPE_BITS 2u
+// the most arguments a tokenized message can take
+#define LOG_ARG_MAX 8u
+
+// the kind of argument `arg` is packed as
+#define _LOG_ARG_TYPE(arg)                    \
+    _Generic((arg),                           \
+        float: LOG_ARG_DOUBLE,                \
+        double: LOG_ARG_DOUBLE,               \
+        long double: LOG_ARG_DOUBLE,          \
+        char *: LOG_ARG_STRING,               \
+        const char *: LOG_ARG_STRING,         \
+        default: sizeof(arg) <= sizeof(int32_t) ? LOG_ARG_INT32 : LOG_ARG_INT64)
+
+// the number of arguments after the first, 0 to `LOG_ARG_MAX`
+#define LOG_ARG_COUNT(...) _LOG_ARG_COUNT(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0, _)
+#define _LOG_ARG_COUNT(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+
+// the type of argument `i` shifted into place
+#define _LOG_ARG_BITS(arg, i) \
+    ((uint32_t)_LOG_ARG_TYPE(arg) << (LOG_ARG_COUNT_BITS + (i) * LOG_ARG_TYPE_BITS))
+
+/**
+ * Describes the arguments of a message, for `log_tokenized()`. Holds the count
+ * in the low bits, then the `LogArgType` of each argument. The first argument
+ * is the format, which is skipped, so that the list is never empty.
+ */
+#define LOG_ARG_TYPES(...)                      \
+    ((uint32_t)LOG_ARG_COUNT(__VA_ARGS__) |     \
+     _LOG_CONCAT(_LOG_TYPES_, LOG_ARG_COUNT(__VA_ARGS__))(__VA_ARGS__))
+
+#define _LOG_CONCAT(a, b) _LOG_CONCAT_INNER(a, b)
+#define _LOG_CONCAT_INNER(a, b) a##b
+
+#define _LOG_TYPES_0(fmt) 0u
+#define _LOG_TYPES_1(fmt, a) _LOG_ARG_BITS(a, 0)
+#define _LOG_TYPES_2(fmt, a, b) _LOG_TYPES_1(fmt, a) | _LOG_ARG_BITS(b, 1)
+#define _LOG_TYPES_3(fmt, a, b, c) _LOG_TYPES_2(fmt, a, b) | _LOG_ARG_BITS(c, 2)
+#define _LOG_TYPES_4(fmt, a, b, c, d) _LOG_TYPES_3(fmt, a, b, c) | _LOG_ARG_BITS(d, 3)
+#define _LOG_TYPES_5(fmt, a, b, c, d, e) _LOG_TYPES_4(fmt, a, b, c, d) | _LOG_ARG_BITS(e, 4)
+#define _LOG_TYPES_6(fmt, a, b, c, d, e, f) _LOG_TYPES_5(fmt, a, b, c, d, e) | _LOG_ARG_BITS(f, 5)
+#define _LOG_TYPES_7(fmt, a, b, c, d, e, f, g) _LOG_TYPES_6(fmt, a, b, c, d, e, f) | _LOG_ARG_BITS(g, 6)
+#define _LOG_TYPES_8(fmt, a, b, c, d, e, f, g, h) _LOG_TYPES_7(fmt, a, b, c, d, e, f, g) | _LOG_ARG_BITS(h, 7)
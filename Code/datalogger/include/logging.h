@@ -2,6 +2,10 @@
 
 #include "pico/stdlib.h"
 
+#ifdef DATALOGGER_LOG_TOKENIZED
+#include "log_token.h"
+#endif
+
 /**
  * The levels of log messages.
  */
@@ -11,6 +15,7 @@ typedef enum
     LOG_WARN,   // undesirable state but no user intervention required
     LOG_INFO,   // general output
     LOG_DEBUG,  // low level messages for debugging use
+    LOG_LEVEL_COUNT,
 } LogLevel;
 
 /**
@@ -25,16 +30,119 @@ typedef enum
     LOG_RTC,     // related to the RTC
     LOG_BUTTON,  // related to the button
     LOG_LED,     // related to the indicator light
+    LOG_STORAGE, // related to the SD card and flash logs
+    LOG_UPLINK,  // related to forwarding measurements over the network
+    LOG_HTTP,    // related to the HTTP server
+    LOG_CATEGORY_COUNT,
 } LogCategory;
 
+// the most verbose level compiled in, calls above it are removed entirely.
+// Override at build time, e.g. with `LOG_DEBUG`.
+#ifndef DATALOGGER_LOG_LEVEL
+#define DATALOGGER_LOG_LEVEL LOG_INFO
+#endif
+
+// for each level, the categories enabled at runtime, one bit per category
+extern uint32_t log_category_mask[LOG_LEVEL_COUNT];
+
+/**
+ * Whether a message would be logged. Folds to `false` for a constant level
+ * above `DATALOGGER_LOG_LEVEL`, otherwise checks the runtime mask.
+ */
+#define LOG_ENABLED(lvl, cat) \
+    ((lvl) <= DATALOGGER_LOG_LEVEL && ((log_category_mask[(lvl)] >> (cat)) & 1u))
+
+/**
+ * Sets up the logger. Messages logged before this are printed immediately.
+ */
+void init_logging(void);
+
+/**
+ * Sets the most verbose level logged for a category at runtime. Levels above
+ * `DATALOGGER_LOG_LEVEL` stay off, as their calls aren't compiled in.
+ *
+ * @param cat The category to change
+ * @param lvl The most verbose level to log
+ */
+void log_set_level(LogCategory cat, LogLevel lvl);
+
+/**
+ * Structured logging macro. If the level is compiled in and the category is
+ * enabled at that level, the message will be printed with a timestamp, the
+ * message level, and the message category. Formats strings using `printf`.
+ * Otherwise the arguments aren't evaluated and no function is called.
+ *
+ * When built with `DATALOGGER_LOG_DEFERRED`, the message is instead copied
+ * into a ring as raw arguments, and only formatted by `log_flush()`. This is
+ * safe from interrupts and either core. The format must be a string literal,
+ * as only its pointer is kept, but `%s` arguments are copied.
+ *
+ * When built with `DATALOGGER_LOG_TOKENIZED`, this is a macro which hashes the
+ * format into a token at compile time, so the string never reaches the image.
+ * Only the token, timestamp and packed arguments are sent, as a binary frame
+ * which `tools/detokenize` turns back into text. The format must be a string
+ * literal, with at most `LOG_ARG_MAX` arguments.
+ *
+ * @param lvl The log level of the message
+ * @param cat The category of the message
+ * @param fmt A string to print
+ * @param ... Additional formatting parameters
+ */
+#define log_message(lvl, cat, fmt, ...)                     \
+    do                                                      \
+    {                                                       \
+        if (LOG_ENABLED(lvl, cat))                          \
+        {                                                   \
+            _LOG_WRITE((lvl), (cat), fmt, ##__VA_ARGS__);   \
+        }                                                   \
+    } while (0)
+
+#ifdef DATALOGGER_LOG_TOKENIZED
+#define _LOG_WRITE(lvl, cat, fmt, ...)                          \
+    log_tokenized((lvl), (cat), LOG_TOKEN("" fmt ""),           \
+                  LOG_ARG_TYPES(fmt, ##__VA_ARGS__), ##__VA_ARGS__)
+#else
+#define _LOG_WRITE(lvl, cat, fmt, ...) log_write((lvl), (cat), fmt, ##__VA_ARGS__)
+#endif
+
+#ifndef DATALOGGER_LOG_TOKENIZED
 /**
- * Structured logging function. If the log level is above the defined logging
- * level, the message will be printed with a timestamp, the message level, and
- * the message category. Formats strings using `printf`.
- * 
+ * Prints a message, regardless of the log level. Called through
+ * `log_message()`, which does the filtering.
+ *
  * @param lvl The log level of the message
  * @param cat The category of the message
  * @param fmt A string to print
  * @param ... Additional formatting parameters
  */
-void log_message(LogLevel lvl, LogCategory cat, const char *fmt, ...);
+void log_write(LogLevel lvl, LogCategory cat, const char *fmt, ...);
+#else
+/**
+ * Sends a tokenized message, regardless of the log level. Called through
+ * `log_message()`, which does the filtering and works out the token and
+ * argument types.
+ *
+ * @param lvl The log level of the message
+ * @param cat The category of the message
+ * @param token The token of the format string, see `LOG_TOKEN()`
+ * @param types The types of the arguments, see `LOG_ARG_TYPES()`
+ * @param ... The arguments, matching `types`
+ */
+void log_tokenized(LogLevel lvl, LogCategory cat, uint32_t token, uint32_t types, ...);
+#endif
+
+/**
+ * Formats and prints every deferred message, oldest first, then reports any
+ * dropped because the ring was full. Does nothing unless built with
+ * `DATALOGGER_LOG_DEFERRED`. Safe from either core, but not from interrupts.
+ */
+void log_flush(void);
+
+#ifdef DATALOGGER_BENCH
+/**
+ * Measures the cycle cost of a typical `log_message()` call, i.e. what it adds
+ * to an interrupt, and of one filtered out at runtime, and logs both. Requires
+ * `bench_init()` to have been called.
+ */
+void logging_benchmark(void);
+#endif
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "pico/stdlib.h"
+
+#include "sensors.h"
+
+// capacity of the queue, must be a power of two
+#define MEASURE_QUEUE_SIZE 16u
+
+/**
+ * Pushes a completed measurement onto the queue. Lock-free, must only be
+ * called by the single producer, i.e. the core running the sensors. If the
+ * queue is full the measurement is dropped and counted as an overrun.
+ *
+ * @param measure Pointer to the measurement to copy in
+ *
+ * @return `true` if queued, `false` if the queue was full
+ */
+bool measure_queue_push(const measurement_t *measure);
+
+/**
+ * Pops the oldest measurement off the queue. Lock-free, must only be called
+ * by the single consumer, i.e. core0.
+ *
+ * @param measure Pointer to copy the measurement into
+ *
+ * @return `true` if a measurement was popped, `false` if the queue was empty
+ */
+bool measure_queue_pop(measurement_t *measure);
+
+/**
+ * Returns the number of measurements waiting in the queue.
+ */
+uint32_t measure_queue_depth(void);
+
+/**
+ * Returns the highest number of measurements that have been waiting at once.
+ */
+uint32_t measure_queue_high_water(void);
+
+/**
+ * Returns the number of measurements dropped because the queue was full.
+ */
+uint32_t measure_queue_overruns(void);
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+
+// sectors reserved at the top of flash, two per record
+#define PERSIST_SECTOR_COUNT 4u
+// size of the reserved region
+#define PERSIST_REGION_SIZE (PERSIST_SECTOR_COUNT * FLASH_SECTOR_SIZE)
+// offset of the reserved region from the start of flash
+#define PERSIST_REGION_OFFSET (PICO_FLASH_SIZE_BYTES - PERSIST_REGION_SIZE)
+// largest payload a record can hold, a page less the slot header
+#define PERSIST_MAX_SIZE (FLASH_PAGE_SIZE - 16u)
+
+/**
+ * Records kept in flash. Each owns two sectors, which are split into page
+ * sized slots that are written in turn. Once one sector is full, the other is
+ * erased for the next copy, so the newest copy is never erased, and a sector
+ * is only erased once every sixteen saves.
+ */
+typedef enum
+{
+    PERSIST_SOIL_CAL, // soil probe calibrations
+    PERSIST_WIFI,     // the last good Wi-Fi connection
+    PERSIST_COUNT,
+} PersistRecord;
+
+/**
+ * Loads the most recent valid copy of a record. A copy is valid if its CRC
+ * matches, and its version and size are the ones expected.
+ *
+ * @param rec The record to load
+ * @param version The layout version the caller expects
+ * @param data Pointer to copy the payload into
+ * @param size Size of the payload
+ *
+ * @return `true` if a valid copy was loaded, `false` otherwise
+ */
+bool persist_load(PersistRecord rec, uint16_t version, void *data, size_t size);
+
+/**
+ * Saves a new copy of a record into the next free slot, erasing the record's
+ * other sector first if this one is full. The previous copy is left intact,
+ * so losing power part way through still leaves it to load. Both cores are
+ * paused while flash is written.
+ *
+ * @param rec The record to save
+ * @param version The layout version of the payload
+ * @param data Pointer to the payload
+ * @param size Size of the payload, at most `PERSIST_MAX_SIZE`
+ *
+ * @return `true` if successful, `false` otherwise
+ */
+bool persist_save(PersistRecord rec, uint16_t version, const void *data, size_t size);
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary measurement records, shared with the host tools so keep this
+// portable. A stream is a series of records, each either:
+//
+//   keyframe: RECORD_SYNC | version | count | timestamp (LE32) |
+//             value varints | CRC-32 of the preceding bytes (LE32)
+//   delta:    count | timestamp delta varint | value delta varints
+//
+// All varints are zig-zag encoded. Keyframes are absolute, so decoding can
+// resume from the next one after a corrupt or missing record.
+
+// format version, bumped on any incompatible change
+#define RECORD_VERSION 1u
+// first byte of a keyframe, never the first byte of a delta record
+#define RECORD_SYNC 0xd7u
+// the most channels a record can hold
+#define RECORD_MAX_CHANNELS 8u
+// a keyframe is written at least this often, in records
+#define RECORD_KEYFRAME_INTERVAL 60u
+
+// the longest a single record can be
+#define RECORD_MAX_SIZE (3u + 4u + RECORD_MAX_CHANNELS * 3u + 4u)
+
+/**
+ * A decoded record.
+ */
+typedef struct
+{
+    uint32_t timestamp;                  // Unix time in seconds
+    uint8_t count;                       // number of values
+    bool keyframe;                       // whether it was a keyframe
+    int16_t values[RECORD_MAX_CHANNELS]; // fixed-point channel values
+} record_t;
+
+/**
+ * Encoder state, i.e. the last record written.
+ */
+typedef struct
+{
+    uint32_t timestamp;
+    int16_t values[RECORD_MAX_CHANNELS];
+    uint8_t count;           // 0 until the first keyframe
+    uint16_t since_keyframe; // records since the last keyframe
+} record_encoder_t;
+
+/**
+ * Decoder state, i.e. the last record read.
+ */
+typedef struct
+{
+    record_t last;
+    bool synced; // whether a keyframe has been read since the last error
+} record_decoder_t;
+
+/**
+ * Outcome of decoding a record.
+ */
+typedef enum
+{
+    RECORD_OK,         // a record was decoded
+    RECORD_INCOMPLETE, // more data is needed to decode the next record
+    RECORD_CORRUPT,    // bytes were skipped while looking for a keyframe
+} RecordResult;
+
+/**
+ * Resets an encoder, so that the next record is a keyframe. Used at the start
+ * of every stream.
+ *
+ * @param enc Pointer to the encoder
+ */
+void record_encoder_init(record_encoder_t *enc);
+
+/**
+ * Encodes a record, as a keyframe if it's the first, the interval is up or the
+ * channel count changed, or as the difference from the last record otherwise.
+ *
+ * @param enc Pointer to the encoder
+ * @param timestamp Unix time in seconds
+ * @param values The fixed-point channel values
+ * @param count Number of values, at most `RECORD_MAX_CHANNELS`
+ * @param out Buffer for the record
+ * @param size Size of the buffer, `RECORD_MAX_SIZE` always fits
+ *
+ * @return Length of the record, 0 if it didn't fit and nothing was encoded
+ */
+size_t record_encode(record_encoder_t *enc, uint32_t timestamp,
+                     const int16_t *values, uint8_t count,
+                     uint8_t *out, size_t size);
+
+/**
+ * Resets a decoder, so that it waits for a keyframe.
+ *
+ * @param dec Pointer to the decoder
+ */
+void record_decoder_init(record_decoder_t *dec);
+
+/**
+ * Decodes the next record from a buffer. After an error, bytes are skipped
+ * until the next valid keyframe.
+ *
+ * @param dec Pointer to the decoder
+ * @param data The encoded stream
+ * @param len Number of bytes available
+ * @param used Set to the number of bytes consumed
+ * @param rec Set to the record, if one was decoded
+ *
+ * @return `RECORD_OK` with a record, `RECORD_CORRUPT` if bytes were skipped,
+ * or `RECORD_INCOMPLETE` if the buffer ends part way through a record
+ */
+RecordResult record_decode(record_decoder_t *dec, const uint8_t *data,
+                           size_t len, size_t *used, record_t *rec);
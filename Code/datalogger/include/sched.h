@@ -0,0 +1,53 @@
+#pragma once
+
+#include "pico/stdlib.h"
+
+/**
+ * The main loop's subsystems that wait on deadlines. Each sets its next
+ * deadline as it runs, and the loop sleeps until the earliest.
+ */
+typedef enum
+{
+    SCHED_WIFI,      // the connection attempt or retry, or renewing the address
+    SCHED_NTP,       // the next sync, or the round in progress
+    SCHED_SENSORS,   // the next measurement, or polling the one in progress
+    SCHED_SD_LOG,    // flushing buffered records, or retrying the card
+    SCHED_FLASH_LOG, // writing a partly filled page, or the next operation
+    SCHED_UPLINK,    // the next batch, or its ack timing out
+    SCHED_TASK_COUNT,
+} SchedTask;
+
+/**
+ * Sets when a subsystem next needs the main loop, replacing any deadline it
+ * had. Deadlines are one-shot, a subsystem sets the next as it runs. Must
+ * only be called from the main loop, on core0.
+ *
+ * @param task The subsystem
+ * @param due When it's due, a time in the past runs the loop again straight away
+ */
+void sched_at(SchedTask task, absolute_time_t due);
+
+/**
+ * Makes the main loop run without waiting for a deadline, e.g. once a
+ * callback has left it work to do. Safe from interrupts and either core.
+ */
+void sched_wake(void);
+
+/**
+ * Sleeps until the earliest deadline, or until woken by `sched_wake()`.
+ * Other interrupts wake the core, but it goes straight back to sleep. Counts
+ * wake-ups and how late deadlines are met, and logs them hourly.
+ */
+void sched_wait(void);
+
+/**
+ * Returns the number of times the main loop ran in the last full hour.
+ */
+uint32_t sched_wakeups_per_hour(void);
+
+/**
+ * Returns the latest a deadline was met in the last full hour.
+ *
+ * @return The lateness in microseconds
+ */
+uint32_t sched_jitter_max_us(void);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "pico/stdlib.h"
+
+#include "sensors.h"
+
+/**
+ * Mounts the SD card and opens a new log file, pre-allocated so that writes
+ * don't have to grow it. Failure isn't fatal, the card is tried again at the
+ * next flush.
+ *
+ * @return `true` if successful, `false` otherwise
+ */
+bool sd_log_init(void);
+
+/**
+ * Whether the card is mounted and a log file open.
+ */
+bool sd_log_ready(void);
+
+/**
+ * Appends a measurement to the RAM buffer as a line of CSV. Whole sectors are
+ * written to the card once enough have filled up.
+ *
+ * @param measure Pointer to the measurement to log
+ */
+void sd_log_write(const measurement_t *measure);
+
+/**
+ * Whether buffered measurements have waited long enough to be flushed.
+ */
+bool should_flush_sd_log(void);
+
+/**
+ * Writes everything buffered to the card, padding the last partial sector.
+ * That sector stays buffered, and is written again once more data arrives.
+ */
+void sd_log_flush(void);
+
+#ifdef DATALOGGER_BENCH
+/**
+ * Encodes a simulated day of measurements, and logs the bytes per sample of
+ * binary records, compressed blocks and CSV, and the cycle cost of encoding. Requires
+ * `bench_init()` and `init_sensors()` to have been called.
+ */
+void sd_log_benchmark(void);
+#endif
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "pico/stdlib.h"
+
+#include "sensors.h"
+
+/**
+ * The state of a sensor's measurement in progress.
+ */
+typedef enum
+{
+    SENSOR_PENDING, // still measuring, poll again later
+    SENSOR_READY,   // measurement finished, ready to convert
+    SENSOR_FAILED,  // measurement failed, the whole set is retried
+} SensorStatus;
+
+typedef struct sensor_driver sensor_driver_t;
+
+/**
+ * Interface every sensor implements to be registered. A measurement starts
+ * every registered driver, polls them until none are pending, then converts
+ * each into its slice of the measurement. None of the functions may block.
+ */
+struct sensor_driver
+{
+    const char *name;                 // used when logging failures
+    const sensor_channel_t *channels; // the channels filled by `convert`
+    uint8_t channel_count;            // number of `channels`
+    uint8_t error_code;               // raised when retries are exhausted
+    const void *ctx;                  // driver specific configuration
+
+    /**
+     * Sets up the hardware. Called once when the driver is registered.
+     */
+    void (*init)(const sensor_driver_t *drv);
+
+    /**
+     * Kicks off a measurement in the background.
+     */
+    void (*start)(const sensor_driver_t *drv);
+
+    /**
+     * Checks on the measurement started by `start`.
+     */
+    SensorStatus (*poll)(const sensor_driver_t *drv);
+
+    /**
+     * Writes the finished measurement as fixed-point values.
+     *
+     * @param values Where to write the driver's `channel_count` values
+     */
+    void (*convert)(const sensor_driver_t *drv, int16_t *values);
+};
+
+/**
+ * Adds a driver to the registry and initializes it. Its channels are appended
+ * to every measurement from then on.
+ *
+ * @param drv Pointer to the driver, must stay valid forever
+ *
+ * @return `true` if registered, `false` if there's no room for its channels
+ */
+bool sensors_register(const sensor_driver_t *drv);
+
+// DHT11 humidity and temperature, on PIO
+extern const sensor_driver_t dht11_driver;
+// analog soil probes, one per ADC input starting from 0
+extern const sensor_driver_t soil_drivers[SOIL_PROBE_COUNT];
+// the RP2040's internal temperature sensor
+extern const sensor_driver_t core_temp_driver;
+// the supply voltage, through the Pico W's VSYS divider
+extern const sensor_driver_t vsys_driver;
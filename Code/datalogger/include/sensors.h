@@ -2,33 +2,118 @@
 
 #include "pico/stdlib.h"
 
+// number of soil probes, on ADC inputs 0 upwards, override at build time
+#ifndef SOIL_PROBE_COUNT
+#define SOIL_PROBE_COUNT 1u
+#endif
+
+// the most channels a measurement can hold
+#define SENSOR_MAX_CHANNELS 8u
+
+// time between measurements in milliseconds
+#define SENSORS_PERIOD_MS 6000ul
+
+/**
+ * Description of a measurement channel, i.e. one value in a measurement.
+ */
+typedef struct
+{
+    const char *name; // human readable label
+    const char *unit; // printed after the value
+    uint16_t scale;   // stored value per unit, e.g. 100 for hundredths
+    uint8_t decimals; // decimal places worth printing
+} sensor_channel_t;
+
+// a completed set of sensor readings, in the order channels are registered
+typedef struct
+{
+    absolute_time_t time;                // when the measurement completed
+    int16_t values[SENSOR_MAX_CHANNELS]; // fixed-point, see `sensor_channel_t`
+} measurement_t;
+
 /**
- * Initializes GPIO pins needed for sensor input. Also sets up the soil
+ * Initializes and registers every sensor driver. Also sets up the soil
  * indicator light.
  */
 void init_sensors(void);
 
+/**
+ * Returns the number of channels in each measurement.
+ */
+uint8_t sensors_channel_count(void);
+
+/**
+ * Returns the description of a measurement channel.
+ *
+ * @param channel Index of the channel
+ *
+ * @return Pointer to the description, `NULL` if out of range
+ */
+const sensor_channel_t *sensors_channel(uint8_t channel);
+
 /**
  * Whether enough time has passed since the last sensor measurement.
  */
 bool should_update_sensors(void);
 
 /**
-* Calibration sequence for the soil moisture sensor. Records an air meaurement,
+ * Whether no measurement is in progress or due, so that work which stalls
+ * interrupts, like writing flash, won't disturb one.
+ */
+bool sensors_idle(void);
+
+/**
+ * Loads the soil calibration saved by the last `calibrate_soil()`.
+ *
+ * @return `true` if a valid calibration was loaded, `false` otherwise
+ */
+bool load_soil_calibration(void);
+
+/**
+* Calibration sequence for the soil moisture sensors. Records an air meaurement,
 * then a wet measurement, and sets the slope-intercept based on those. Maps the
 * ADC range to a percentage range. Uses button input to trigger measurements.
+* All probes are calibrated together, and the result is saved to flash.
 */
 void calibrate_soil(void);
 
 /**
- * Updates all sensor readings.
- * 
- * @return `true` if successful, `false` otherwise
+ * Updates all sensor readings. Starts every registered sensor in the
+ * background and returns, then polls them on later calls. Must be called
+ * again until it completes.
+ *
+ * @return `true` if a new measurement is complete, `false` if the measurement
+ * is still in progress or failed
  */
 bool update_sensors(void);
 
 /**
- * Prints readings to serial. Temporary until more universal measurement
- * struct has been established.
+ * Prints a measurement to serial.
+ *
+ * @param measure Pointer to the measurement to print
+ */
+void print_readings(const measurement_t *measure);
+
+/**
+ * Runs one pass of the sensor routine. Recalibrates on a long press, and
+ * pushes each completed measurement onto the measurement queue. Must be
+ * polled regularly by whichever core owns the sensors.
+ */
+void sensors_task(void);
+
+#ifdef DATALOGGER_SENSOR_CORE1
+/**
+ * Launches `sensors_task()` in a loop on core1. From then on, core1 owns the
+ * sensors and the button, and core0 only consumes the measurement queue.
+ */
+void sensors_launch_core1(void);
+#endif
+
+#ifdef DATALOGGER_BENCH
+/**
+ * Measures the cycle cost of the soil conversion and calibration math, both
+ * for the fixed-point path and the float path it replaced, and logs both.
+ * Requires `bench_init()` to have been called.
  */
-void print_readings(void);
+void sensors_benchmark(void);
+#endif
@@ -10,7 +10,8 @@
 bool rtc_safe_init(void);
 
 /**
- * Formats the current local time in a readable, printable format.
+ * Formats the current local time in a readable, printable format, in the
+ * zone selected by `time_zone_select()`, followed by its abbreviation.
  * 
  * @param buffer Pointer to a string buffer
  * @param buffer_size Size of the string buffer
@@ -25,31 +26,161 @@ void get_pretty_datetime(char* buffer, size_t buffer_size);
  */
 void get_timestamp(char* buffer, size_t buffer_size);
 
+/**
+ * Formats the UTC of a time since boot, e.g. when a measurement completed,
+ * according to ISO8601.
+ * 
+ * @param time The time since boot
+ * @param buffer Pointer to a string buffer
+ * @param buffer_size Size of the string buffer
+ */
+void get_timestamp_at(absolute_time_t time, char* buffer, size_t buffer_size);
+
+/**
+ * Returns the current UTC as Unix time.
+ * 
+ * @return Seconds since 1970, 0 if the RTC isn't initialized
+ */
+uint32_t get_unix_time(void);
+
+/**
+ * Returns the UTC of a time since boot as Unix time.
+ * 
+ * @param time The time since boot
+ * @return Seconds since 1970, 0 if the RTC isn't initialized
+ */
+uint32_t get_unix_time_at(absolute_time_t time);
+
+/**
+ * Returns the current UTC from the 64-bit hardware timer, without touching
+ * the RTC. The timer is mapped to UTC at each NTP sync, including the
+ * frequency correction, so this is a multiply and a shift. Lock-free, so
+ * safe to call from interrupts and either core.
+ * 
+ * @return Microseconds since 1970, counting from the default time until the
+ * first sync
+ */
+int64_t get_utc_us(void);
+
+/**
+ * Converts a time since boot to UTC, in the same way as `get_utc_us()`.
+ * 
+ * @param time The time since boot
+ * @return Microseconds since 1970
+ */
+int64_t get_utc_us_at(absolute_time_t time);
+
+/**
+ * Formats a UTC according to ISO8601, e.g. `2025-01-01T00:00:00.000000Z`.
+ * The calendar fields are cached, and moved on a second at a time, so
+ * successive times only cost a compare and writing the digits. Requires
+ * `rtc_safe_init()` to have been called.
+ * 
+ * @param utc_us Microseconds since 1970
+ * @param with_micros Whether to include the microseconds
+ * @param buffer Pointer to a string buffer, 28 bytes holds any result
+ * @param buffer_size Size of the string buffer
+ * @return Length of the string, 0 if it didn't fit
+ */
+size_t format_utc(int64_t utc_us, bool with_micros, char* buffer, size_t buffer_size);
+
+/**
+ * Formats a UTC as local time in a readable format, in the zone selected by
+ * `time_zone_select()`, followed by its abbreviation, e.g.
+ * `Thursday, January 01, 2026  00:00:00 EST`. The zone's offset is kept until
+ * its next transition, and the local calendar fields are cached and moved on
+ * a second at a time, as in `format_utc()`. Only meant for core0, like
+ * `time_zone_offset()`.
+ *
+ * @param utc_us Microseconds since 1970
+ * @param buffer Pointer to a string buffer, 48 bytes holds any result
+ * @param buffer_size Size of the string buffer
+ * @return Length of the string, 0 if it didn't fit
+ */
+size_t format_local(int64_t utc_us, char* buffer, size_t buffer_size);
+
 /**
  * Whether the rtc has been synchronized within the defined time period.
  */
 bool rtc_synchronized(void);
 
+/**
+ * Whether the rtc has been synchronized at least once, so that the time it
+ * holds is real rather than the default. Times taken before then, since
+ * boot, are real from then on too.
+ */
+bool rtc_time_valid(void);
+
+/**
+ * Returns the seconds since the RTC was last synchronized with NTP.
+ *
+ * @return The age in seconds, `UINT32_MAX` if it never was
+ */
+uint32_t rtc_sync_age(void);
+
+/**
+ * Returns the crystal's frequency error, estimated from the offsets measured
+ * at past syncs. Timestamps and the RTC are corrected for it between syncs.
+ *
+ * @return Parts per billion, positive if the crystal runs slow
+ */
+int32_t rtc_frequency_error(void);
+
+/**
+ * Returns the drift left over after correcting for the frequency error, from
+ * how far the clock was off at the last sync over the time since the one
+ * before.
+ *
+ * @return Parts per billion, positive if the clock was behind
+ */
+int32_t rtc_residual_drift(void);
+
+/**
+ * Returns the wait between NTP syncs. It widens while the clock keeps well
+ * within its drift budget between syncs, and narrows when it doesn't.
+ *
+ * @return The interval in seconds
+ */
+uint32_t ntp_poll_interval(void);
+
 /**
  * Initializes the UDP control block used for NTP requests. Sets up callbacks.
- * Begins aggressively (no retry delay) trying to sync RTC with NTP. Will hang
- * if connection fails, is blocking.
+ * Doesn't wait for a sync, the first is tried by `ntp_request_time()` as
+ * soon as the wifi connects, and `rtc_time_valid()` reports once it's done.
  * 
  * @return `true` id successful, `false` otherwisee
  */
 bool ntp_init(void);
 
 /**
- * Runs the NTP sync routine. If there is request already in progress and not
- * timed out, or we are waiting to retry, do nothing. Otherwise, tries to
- * resolve the IP address for the NTP server.
+ * Runs the NTP sync routine if the RTC isn't synchronized, otherwise waits
+ * for the next sync to be due. Must be polled regularly.
+ */
+void ntp_task(void);
+
+/**
+ * Runs the NTP sync routine. If a round of requests is in progress, waits
+ * until every server has answered or failed, or the rest have had long
+ * enough after the first answer, then sets the RTC from the lowest delay
+ * sample that agrees with the others. If waiting to retry, or the wifi isn't
+ * connected, do nothing. Otherwise, starts a round of requests to several
+ * pool servers at once.
  * 
- * If the IP address has already been resolved (in a previous attempt, for
- * example), immediately send the NTP request. Otherwise, wait for the DNS
- * callback.
+ * Servers whose address is cached are sent their request immediately, the
+ * rest are resolved first and sent it from the DNS callback.
  * 
  * If any error takes place, handle it gracefully.
  * 
- * @return `true` if an NTP request is in progress, `false` otherwise
+ * @return `true` if a round of requests was started, `false` otherwise
  */
 bool ntp_request_time(void);
+
+#ifdef DATALOGGER_BENCH
+/**
+ * Measures the cycle cost of a timestamp from the RTC and `gmtime()`, as it
+ * was, and from the timer and cached calendar, and the same for the time in
+ * a log header, and logs them. Requires `bench_init()` to have been called,
+ * the clock needn't be set.
+ */
+void time_sync_benchmark(void);
+#endif
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "pico/stdlib.h"
+
+/**
+ * One kind of local time a zone keeps, e.g. standard or daylight time.
+ */
+typedef struct
+{
+    int32_t offset_s; // local time minus UTC
+    bool is_dst;      // whether it's daylight saving time
+    const char *abbr; // abbreviation, e.g. "EDT"
+} time_zone_type_t;
+
+/**
+ * A zone's UTC offset changes, generated from its rules at build time by
+ * `tools/tz_rules.py`. Before the first transition the zone keeps its first
+ * type, and after each one the type it lists.
+ */
+typedef struct
+{
+    const char *name;                // e.g. "America/New_York"
+    const time_zone_type_t *types;   // the kinds of local time it keeps
+    const uint32_t *transitions;     // Unix times of each change, ascending
+    const uint8_t *kinds;            // index into types from each change on
+    uint16_t transition_count;
+} time_zone_t;
+
+// the zones built in, the first is used unless another is selected
+extern const time_zone_t time_zones[];
+extern const uint8_t time_zone_count;
+
+/**
+ * Selects the zone local times are given in.
+ *
+ * @param name The zone's name, e.g. "Europe/London"
+ *
+ * @return `true` if it's built in, `false` otherwise, leaving the zone as it was
+ */
+bool time_zone_select(const char *name);
+
+/**
+ * Returns the name of the zone local times are given in.
+ */
+const char *time_zone_name(void);
+
+/**
+ * Returns how far local time is ahead of UTC at a given time. The result is
+ * kept until the zone's next transition, so most calls are a comparison,
+ * and the rest a binary search of its table. Only meant for core0.
+ *
+ * @param unix_time The time, as Unix time
+ * @param abbr Where to put the zone abbreviation in effect, ignored if `NULL`
+ *
+ * @return The offset in seconds
+ */
+int32_t time_zone_offset(uint32_t unix_time, const char **abbr);
+
+#ifdef DATALOGGER_BENCH
+/**
+ * Measures the cycle cost of the offset from the table, both while the
+ * result is cached and after a transition. Then measures a readable local
+ * time formatted with `gmtime()` and `strftime()`, from a fixed offset and
+ * from the table, against `format_local()` after a transition and a second
+ * later, and logs them. The clock needn't be set.
+ */
+void time_zone_benchmark(void);
+#endif
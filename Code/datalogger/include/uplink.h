@@ -0,0 +1,24 @@
+#pragma once
+
+#include "pico/stdlib.h"
+
+// largest datagram sent, within a single Ethernet frame
+#define UPLINK_DATAGRAM_SIZE 1400u
+
+/**
+ * Opens the UDP socket to the collector set by `DATALOGGER_UPLINK_HOST`, and
+ * finds where forwarding left off before the last reset. Requires the flash
+ * log to be initialized first.
+ *
+ * @return `true` if successful, `false` if disabled or failed
+ */
+bool uplink_init(void);
+
+/**
+ * Sends measurements from the flash log to the collector in batches, once
+ * enough have been logged or the oldest has waited long enough, and a
+ * backlog in full datagrams. One batch is in flight at a time, sent again
+ * until it's acknowledged, and pages are marked sent as their last record
+ * is acknowledged. Never blocks, must be polled regularly.
+ */
+void uplink_task(void);
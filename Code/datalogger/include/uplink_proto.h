@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The uplink's datagram format, shared with the host tools so keep this
+// portable. Every datagram starts with the same header:
+//
+//   magic (LE16) | version | type | session (LE32) | sequence (LE32) |
+//   count (LE16)
+//
+// A batch is followed by `count` measurement records, starting with a
+// keyframe so it decodes on its own. The collector answers each batch with
+// an ack echoing its session and sequence number. Until then the device
+// sends the same batch again, so the collector may see it more than once.
+
+// first bytes of every datagram, "DL"
+#define UPLINK_MAGIC 0x4c44u
+// format version, bumped on any incompatible change
+#define UPLINK_VERSION 1u
+// bytes before the records
+#define UPLINK_HEADER_SIZE 14u
+
+/**
+ * Kinds of datagram.
+ */
+typedef enum
+{
+    UPLINK_BATCH = 1, // device to collector, a run of records
+    UPLINK_ACK = 2,   // collector to device, a batch was received
+} UplinkType;
+
+/**
+ * A datagram header.
+ */
+typedef struct
+{
+    UplinkType type;
+    uint32_t session;  // picked at random on every boot
+    uint32_t sequence; // incremented with each new batch in a session
+    uint16_t count;    // records in a batch, or acknowledged
+} uplink_header_t;
+
+/**
+ * Writes a datagram header.
+ *
+ * @param header The header to write
+ * @param out Buffer with room for `UPLINK_HEADER_SIZE` bytes
+ *
+ * @return Length of the header
+ */
+size_t uplink_header_write(const uplink_header_t *header, uint8_t *out);
+
+/**
+ * Reads a datagram header, checking the magic and version.
+ *
+ * @param header Set to the header read
+ * @param data The datagram
+ * @param len Length of the datagram
+ *
+ * @return `true` if successful, `false` if it isn't a valid datagram
+ */
+bool uplink_header_read(uplink_header_t *header, const uint8_t *data, size_t len);
@@ -3,25 +3,21 @@
 #include "pico/stdlib.h"
 
 /**
- * Intializes cyw43 and connects to thd network.a64l
- * 
- * @return `true` upon success, `false` otherwise
+ * Intializes cyw43 and starts connecting to the network in the background.
+ * The connection is carried on by `wifi_task()`.
+ *
+ * @return `true` upon success, `false` if the chip failed to initialize
  */
 bool wifi_init(void);
 
 /**
- * Whether it's been long enough since the wifi was last checked, or since
- * the last reconnection attempt.
+ * Steps the connection along without blocking. Checks on a join in progress,
+ * notices when the link drops, and starts a new attempt once the retry delay
+ * has passed. Must be polled regularly.
  */
-bool should_check_wifi(void);
+void wifi_task(void);
 
 /**
- * Checks the wifi connection and updates the flag. If disconnected, try to
- * reconnect.
- */
-void wifi_check_reconnect(void);
-
-/**
- * Returns whether the wifi connection was running when last checked.
+ * Returns whether the wifi connection was up when last checked.
  */
 bool wifi_connected(void);
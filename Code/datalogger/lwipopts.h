@@ -22,6 +22,9 @@
 #define MEM_SIZE                    4000
 #define MEMP_NUM_TCP_SEG            32
 #define MEMP_NUM_ARP_QUEUE          10
+// DHCP, NTP and the uplink, plus DNS's random source ports for the NTP
+// servers resolved together
+#define MEMP_NUM_UDP_PCB            8
 #define PBUF_POOL_SIZE              24
 #define LWIP_ARP                    1
 #define LWIP_ETHERNET               1
@@ -47,7 +50,9 @@
 #define LWIP_UDP                    1
 #define LWIP_DNS                    1
 #define LWIP_TCP_KEEPALIVE          1
-#define LWIP_NETIF_TX_SINGLE_PBUF   1
+// off, so tcp_write() without the copy flag really references the data,
+// the cyw43 driver copies chained pbufs into its own buffer anyway
+#define LWIP_NETIF_TX_SINGLE_PBUF   0
 #define DHCP_DOES_ARP_CHECK         0
 #define LWIP_DHCP_DOES_ACD_CHECK    0
 
@@ -0,0 +1,161 @@
+#include <string.h>
+
+#include "adc_dma.h"
+
+#include "hardware/adc.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+
+// the first round of conversions after selecting an input is discarded
+#define ADC_BUFFER_SIZE ((ADC_SAMPLE_COUNT + 1u) * ADC_INPUT_COUNT)
+// fastest the ADC can convert, in ADC clock cycles
+#define ADC_MIN_CYCLES 96.0f
+
+// raw conversions written by the DMA channel, interleaved by input
+static uint16_t samples[ADC_BUFFER_SIZE];
+// the DMA channel draining the ADC FIFO
+static int dma_chan = -1;
+// whether a scan has been started and not yet consumed
+static volatile bool capture_running = false;
+// whether the DMA channel has finished the current scan
+static volatile bool capture_done = false;
+// the inputs of the current scan, in the order they are converted
+static uint8_t scan_inputs[ADC_INPUT_COUNT];
+// the number of inputs in the current scan
+static uint8_t scan_count = 0;
+// the clock divider to use for each number of inputs in a scan
+static float scan_clkdiv[ADC_INPUT_COUNT + 1u];
+
+/**
+ * DMA completion interrupt. Stops the free-running ADC, clears out any
+ * conversions left in the FIFO, and flags the scan as finished.
+ */
+static void _dma_irq_handler(void);
+
+void adc_dma_init(void)
+{
+    adc_init();
+
+    // write each conversion to the FIFO and request DMA when there's one
+    adc_fifo_setup(true, true, 1, false, false);
+
+    // work out the dividers up front, so starting a scan needs no float math
+    for (uint8_t i = 1; i <= ADC_INPUT_COUNT; i++)
+    {
+        float div = (ADC_CLKDIV + 1.0f) / i - 1.0f;
+        scan_clkdiv[i] = div < ADC_MIN_CYCLES - 1.0f ? 0.0f : div;
+    }
+
+    // claim a channel which moves 16 bit samples from the FIFO to the buffer
+    dma_chan = dma_claim_unused_channel(true);
+    dma_channel_config cfg = dma_channel_get_default_config(dma_chan);
+    channel_config_set_transfer_data_size(&cfg, DMA_SIZE_16);
+    channel_config_set_read_increment(&cfg, false);
+    channel_config_set_write_increment(&cfg, true);
+    channel_config_set_dreq(&cfg, DREQ_ADC);
+    dma_channel_configure(dma_chan, &cfg, samples, &adc_hw->fifo,
+                          ADC_BUFFER_SIZE, false);
+
+    // shared so the DHT driver's DMA channel is free to use the same line
+    irq_add_shared_handler(DMA_IRQ_1, _dma_irq_handler,
+                           PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    dma_channel_set_irq1_enabled(dma_chan, true);
+    irq_set_enabled(DMA_IRQ_1, true);
+}
+
+bool adc_dma_start(uint8_t input_mask)
+{
+    if (adc_dma_busy() || input_mask == 0)
+    {
+        return false;
+    }
+
+    // the round robin visits inputs in ascending order
+    scan_count = 0;
+    for (uint8_t i = 0; i < ADC_INPUT_COUNT; i++)
+    {
+        if (input_mask & (1u << i))
+        {
+            scan_inputs[scan_count++] = i;
+        }
+    }
+
+    // the temperature sensor draws current, only power it when needed
+    adc_set_temp_sensor_enabled((input_mask & (1u << ADC_INPUT_TEMP)) != 0);
+
+    // start from the lowest input and cycle through the rest
+    adc_select_input(scan_inputs[0]);
+    adc_set_round_robin(scan_count > 1 ? input_mask : 0);
+    adc_set_clkdiv(scan_clkdiv[scan_count]);
+    // make sure no stale conversions are left
+    adc_fifo_drain();
+
+    capture_done = false;
+    capture_running = true;
+
+    // arm the DMA channel, then let the ADC run freely
+    dma_channel_set_write_addr(dma_chan, samples, false);
+    dma_channel_set_trans_count(dma_chan, (ADC_SAMPLE_COUNT + 1u) * scan_count,
+                                true);
+    adc_run(true);
+    return true;
+}
+
+bool adc_dma_busy(void)
+{
+    return capture_running && !capture_done;
+}
+
+bool adc_dma_poll(uint32_t sums[ADC_INPUT_COUNT])
+{
+    if (!capture_running || !capture_done)
+    {
+        return false;
+    }
+
+    // add up the samples of each input, skipping the first round
+    memset(sums, 0, ADC_INPUT_COUNT * sizeof(sums[0]));
+    const uint16_t *sample = &samples[scan_count];
+    for (uint16_t i = 0; i < ADC_SAMPLE_COUNT; i++)
+    {
+        for (uint8_t j = 0; j < scan_count; j++)
+        {
+            sums[scan_inputs[j]] += *sample++;
+        }
+    }
+
+    capture_running = false;
+    return true;
+}
+
+void adc_dma_read_blocking(uint8_t input_mask, uint32_t sums[ADC_INPUT_COUNT])
+{
+    // let any scan in progress run to completion
+    while (adc_dma_busy())
+    {
+        tight_loop_contents();
+    }
+
+    adc_dma_start(input_mask);
+
+    while (!adc_dma_poll(sums))
+    {
+        tight_loop_contents();
+    }
+}
+
+static void _dma_irq_handler(void)
+{
+    // the line is shared, only handle our own channel
+    if (dma_chan < 0 || !dma_channel_get_irq1_status(dma_chan))
+    {
+        return;
+    }
+    dma_channel_acknowledge_irq1(dma_chan);
+
+    // stop converting and throw away anything captured past the buffer
+    adc_run(false);
+    adc_fifo_drain();
+
+    capture_done = true;
+}
@@ -0,0 +1,43 @@
+#include "backfill.h"
+
+_Static_assert(BACKFILL_CAPACITY > 0, "The backfill must hold at least one measurement");
+
+// the held measurements, oldest at the tail
+static measurement_t ring[BACKFILL_CAPACITY];
+// free-running count of pushes
+static uint32_t head = 0;
+// free-running count of pops
+static uint32_t tail = 0;
+
+bool backfill_push(const measurement_t *measure, measurement_t *oldest)
+{
+    // make room by handing back the oldest, the newest are the most useful
+    // to have to hand
+    bool is_full = head - tail >= BACKFILL_CAPACITY;
+    if (is_full)
+    {
+        *oldest = ring[tail % BACKFILL_CAPACITY];
+        tail++;
+    }
+
+    ring[head % BACKFILL_CAPACITY] = *measure;
+    head++;
+    return is_full;
+}
+
+bool backfill_pop(measurement_t *measure)
+{
+    if (tail == head)
+    {
+        return false;
+    }
+
+    *measure = ring[tail % BACKFILL_CAPACITY];
+    tail++;
+    return true;
+}
+
+uint32_t backfill_count(void)
+{
+    return head - tail;
+}
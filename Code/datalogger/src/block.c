@@ -0,0 +1,318 @@
+#include <string.h>
+
+#include "block.h"
+#include "crc.h"
+
+// bytes in the header before the first values
+#define HEADER_SIZE 12u
+// bits available in a block
+#define BLOCK_BITS (BLOCK_SIZE * 8u)
+
+/**
+ * Zig-zag encodes a signed value, so small magnitudes stay small.
+ */
+static inline uint32_t _zigzag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+/**
+ * Reverses `_zigzag()`.
+ */
+static inline int32_t _unzigzag(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1u);
+}
+
+/**
+ * Returns the number of bits a timestamp delta-of-delta takes, prefix
+ * included.
+ */
+static inline uint8_t _timestamp_bits(uint32_t zigzag)
+{
+    return zigzag == 0 ? 1u : zigzag < 128u ? 9u : zigzag < 512u ? 12u : zigzag < 4096u ? 16u : 36u;
+}
+
+/**
+ * Returns the number of bits a value delta takes, prefix included.
+ */
+static inline uint8_t _value_bits(uint32_t zigzag)
+{
+    return zigzag == 0 ? 1u : zigzag < 64u ? 8u : zigzag < 1024u ? 13u : 20u;
+}
+
+/**
+ * Writes bits to the block, most significant first. The block must have been
+ * zeroed.
+ *
+ * @param enc Pointer to the encoder
+ * @param value The bits, right aligned
+ * @param n Number of bits, at most 32
+ */
+static void _put_bits(block_encoder_t *enc, uint32_t value, uint8_t n);
+
+/**
+ * Reads bits from a block, most significant first.
+ *
+ * @param reader Pointer to the reader
+ * @param n Number of bits, at most 32
+ * @param value Set to the bits, right aligned
+ *
+ * @return `true` if successful, `false` if the block ended first
+ */
+static bool _get_bits(block_reader_t *reader, uint8_t n, uint32_t *value);
+
+/**
+ * Counts the 1 bits before a 0 bit, for reading a prefix.
+ *
+ * @param reader Pointer to the reader
+ * @param max The most 1 bits the prefix can have, the 0 is left out after it
+ * @param ones Set to the number of 1 bits
+ *
+ * @return `true` if successful, `false` if the block ended first
+ */
+static bool _get_prefix(block_reader_t *reader, uint8_t max, uint8_t *ones);
+
+void block_encoder_init(block_encoder_t *enc)
+{
+    memset(enc, 0, sizeof(*enc));
+}
+
+bool block_append(block_encoder_t *enc, uint32_t timestamp,
+                  const int16_t *values, uint8_t count)
+{
+    // the first sample is stored whole in the header
+    if (enc->samples == 0)
+    {
+        if (count == 0 || count > RECORD_MAX_CHANNELS)
+        {
+            return false;
+        }
+        enc->count = count;
+        enc->timestamp = timestamp;
+        memcpy(&enc->values[0], values, count * sizeof(values[0]));
+        for (uint8_t i = 0; i < 4u; i++)
+        {
+            enc->data[8u + i] = (uint8_t)(timestamp >> (8u * i));
+        }
+        for (uint8_t i = 0; i < count; i++)
+        {
+            enc->data[HEADER_SIZE + 2u * i] = (uint8_t)values[i];
+            enc->data[HEADER_SIZE + 2u * i + 1u] = (uint8_t)((uint16_t)values[i] >> 8);
+        }
+        enc->bits = (HEADER_SIZE + 2u * count) * 8u;
+        enc->samples = 1;
+        return true;
+    }
+    if (count != enc->count || enc->samples == UINT16_MAX)
+    {
+        return false;
+    }
+
+    // check it all fits before writing anything
+    int32_t delta = (int32_t)(timestamp - enc->timestamp);
+    uint32_t dod = _zigzag((int32_t)((uint32_t)delta - (uint32_t)enc->delta));
+    uint32_t diffs[RECORD_MAX_CHANNELS];
+    uint16_t bits = _timestamp_bits(dod);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        diffs[i] = _zigzag((int32_t)values[i] - enc->values[i]);
+        bits += _value_bits(diffs[i]);
+    }
+    if (enc->bits + bits > BLOCK_BITS)
+    {
+        return false;
+    }
+
+    switch (_timestamp_bits(dod))
+    {
+    case 1u:
+        _put_bits(enc, 0x0u, 1u);
+        break;
+    case 9u:
+        _put_bits(enc, (0x2u << 7) | dod, 9u);
+        break;
+    case 12u:
+        _put_bits(enc, (0x6u << 9) | dod, 12u);
+        break;
+    case 16u:
+        _put_bits(enc, (0xeu << 12) | dod, 16u);
+        break;
+    default:
+        _put_bits(enc, 0xfu, 4u);
+        _put_bits(enc, dod, 32u);
+        break;
+    }
+    for (uint8_t i = 0; i < count; i++)
+    {
+        switch (_value_bits(diffs[i]))
+        {
+        case 1u:
+            _put_bits(enc, 0x0u, 1u);
+            break;
+        case 8u:
+            _put_bits(enc, (0x2u << 6) | diffs[i], 8u);
+            break;
+        case 13u:
+            _put_bits(enc, (0x6u << 10) | diffs[i], 13u);
+            break;
+        default:
+            _put_bits(enc, (0x7u << 17) | diffs[i], 20u);
+            break;
+        }
+    }
+
+    enc->timestamp = timestamp;
+    enc->delta = delta;
+    memcpy(&enc->values[0], values, count * sizeof(values[0]));
+    enc->samples++;
+    return true;
+}
+
+const uint8_t *block_finish(block_encoder_t *enc)
+{
+    uint8_t *data = &enc->data[0];
+    data[4] = BLOCK_VERSION;
+    data[5] = enc->count;
+    data[6] = (uint8_t)enc->samples;
+    data[7] = (uint8_t)(enc->samples >> 8);
+
+    uint32_t crc = crc32(&data[4], BLOCK_SIZE - 4u);
+    for (uint8_t i = 0; i < 4u; i++)
+    {
+        data[i] = (uint8_t)(crc >> (8u * i));
+    }
+    return data;
+}
+
+bool block_reader_init(block_reader_t *reader, const uint8_t *block)
+{
+    memset(reader, 0, sizeof(*reader));
+    uint32_t crc = 0;
+    for (uint8_t i = 0; i < 4u; i++)
+    {
+        crc |= (uint32_t)block[i] << (8u * i);
+    }
+    if (crc != crc32(&block[4], BLOCK_SIZE - 4u) || block[4] != BLOCK_VERSION)
+    {
+        return false;
+    }
+
+    reader->count = block[5];
+    reader->samples = (uint16_t)(block[6] | (block[7] << 8));
+    if (reader->count == 0 || reader->count > RECORD_MAX_CHANNELS)
+    {
+        return false;
+    }
+    reader->data = block;
+    reader->bits = (HEADER_SIZE + 2u * reader->count) * 8u;
+    return true;
+}
+
+bool block_read(block_reader_t *reader, record_t *rec)
+{
+    if (reader->sample >= reader->samples)
+    {
+        return false;
+    }
+
+    const uint8_t *data = reader->data;
+    if (reader->sample == 0)
+    {
+        reader->timestamp = 0;
+        for (uint8_t i = 0; i < 4u; i++)
+        {
+            reader->timestamp |= (uint32_t)data[8u + i] << (8u * i);
+        }
+        for (uint8_t i = 0; i < reader->count; i++)
+        {
+            const uint8_t *value = &data[HEADER_SIZE + 2u * i];
+            reader->values[i] = (int16_t)(value[0] | (value[1] << 8));
+        }
+    }
+    else
+    {
+        static const uint8_t timestamp_widths[] = {0u, 7u, 9u, 12u, 32u};
+        static const uint8_t value_widths[] = {0u, 6u, 10u, 17u};
+        uint8_t ones;
+        uint32_t zigzag = 0;
+        if (!_get_prefix(reader, 4u, &ones) ||
+            !_get_bits(reader, timestamp_widths[ones], &zigzag))
+        {
+            return false;
+        }
+        reader->delta = (int32_t)((uint32_t)reader->delta + (uint32_t)_unzigzag(zigzag));
+        reader->timestamp += (uint32_t)reader->delta;
+
+        for (uint8_t i = 0; i < reader->count; i++)
+        {
+            zigzag = 0;
+            if (!_get_prefix(reader, 3u, &ones) ||
+                !_get_bits(reader, value_widths[ones], &zigzag))
+            {
+                return false;
+            }
+            reader->values[i] = (int16_t)(reader->values[i] + _unzigzag(zigzag));
+        }
+    }
+
+    rec->timestamp = reader->timestamp;
+    rec->count = reader->count;
+    rec->keyframe = reader->sample == 0;
+    memcpy(&rec->values[0], &reader->values[0], reader->count * sizeof(rec->values[0]));
+    reader->sample++;
+    return true;
+}
+
+static void _put_bits(block_encoder_t *enc, uint32_t value, uint8_t n)
+{
+    // fill the current byte, then whole bytes
+    while (n > 0)
+    {
+        uint8_t free = 8u - (enc->bits & 7u);
+        uint8_t take = n < free ? n : free;
+        uint8_t chunk = (uint8_t)((value >> (n - take)) & ((1u << take) - 1u));
+        enc->data[enc->bits >> 3] |= (uint8_t)(chunk << (free - take));
+        enc->bits += take;
+        n -= take;
+    }
+}
+
+static bool _get_bits(block_reader_t *reader, uint8_t n, uint32_t *value)
+{
+    if (reader->bits + n > BLOCK_BITS)
+    {
+        return false;
+    }
+    uint32_t out = 0;
+    while (n > 0)
+    {
+        uint8_t left = 8u - (reader->bits & 7u);
+        uint8_t take = n < left ? n : left;
+        uint8_t byte = reader->data[reader->bits >> 3];
+        out = (out << take) | ((byte >> (left - take)) & ((1u << take) - 1u));
+        reader->bits += take;
+        n -= take;
+    }
+    *value = out;
+    return true;
+}
+
+static bool _get_prefix(block_reader_t *reader, uint8_t max, uint8_t *ones)
+{
+    *ones = 0;
+    while (*ones < max)
+    {
+        uint32_t bit;
+        if (!_get_bits(reader, 1u, &bit))
+        {
+            return false;
+        }
+        if (bit == 0)
+        {
+            return true;
+        }
+        (*ones)++;
+    }
+    return true;
+}
@@ -1,6 +1,7 @@
 #include "button.h"
 #include "utils.h"
 #include "logging.h"
+#include "sched.h"
 
 #define BUTTON_PIN 2u
 
@@ -107,8 +108,9 @@ static void _button_cb(uint __unused, uint32_t events)
             if (time_delta > long_press_min_ms &&
                 time_delta < long_press_max_ms)
             {
-                // register a long press
+                // register a long press, and have the main loop see it
                 button_state = BUTTON_LONG_PRESSED;
+                sched_wake();
             }
             else
             {
@@ -0,0 +1,22 @@
+#include "crc.h"
+
+// CRC-32 of each nibble value, reflected polynomial 0xEDB88320
+static const uint32_t crc32_table[16] = {
+    0x00000000ul, 0x1db71064ul, 0x3b6e20c8ul, 0x26d930acul,
+    0x76dc4190ul, 0x6b6b51f4ul, 0x4db26158ul, 0x5005713cul,
+    0xedb88320ul, 0xf00f9344ul, 0xd6d6a3e8ul, 0xcb61b38cul,
+    0x9b64c2b0ul, 0x86d3d2d4ul, 0xa00ae278ul, 0xbdbdf21cul,
+};
+
+uint32_t crc32(const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    uint32_t crc = 0xfffffffful;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= bytes[i];
+        crc = (crc >> 4) ^ crc32_table[crc & 0x0fu];
+        crc = (crc >> 4) ^ crc32_table[crc & 0x0fu];
+    }
+    return ~crc;
+}
@@ -1,6 +1,8 @@
 #include "error_mgr.h"
 #include "logging.h"
 
+#include "pico/mutex.h"
+
 #define LED_PIN 22u
 
 /**
@@ -24,6 +26,8 @@ static bool led_on = false;
 static LedState led_state = LED_OFF;
 // the repeating timer to toggle the LED in the background
 static repeating_timer_t led_timer;
+// guards the error state, the sensors may run on the other core
+auto_init_mutex(error_mutex);
 
 /**
  * Update the LED state based on the current error state. Prioritizes
@@ -69,6 +73,7 @@ void init_errors(uint8_t code) {
 }
 
 void set_error(uint8_t code, bool enabled) {
+    mutex_enter_blocking(&error_mutex);
     uint8_t prev = error_state;
     if (enabled) {
         // Set the error bit
@@ -83,6 +88,11 @@ void set_error(uint8_t code, bool enabled) {
     {
         _update_led_state();
     }
+    mutex_exit(&error_mutex);
+}
+
+uint8_t get_errors(void) {
+    return error_state;
 }
 
 static void _update_led_state(void) {
@@ -97,7 +107,8 @@ static void _update_led_state(void) {
     uint8_t error = (
         ERROR_WIFI_DISCONNECTED |
         ERROR_NTP_SYNC_FAILED   |
-        ERROR_DHT11_READ_FAILED
+        ERROR_DHT11_READ_FAILED |
+        ERROR_SD_FAILED
     );
     // if user attention is needed, flash
     if ((error_state & error) != ERROR_NONE) {
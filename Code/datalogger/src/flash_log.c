@@ -0,0 +1,737 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "flash_log.h"
+#include "record.h"
+#include "crc.h"
+#include "time_sync.h"
+#include "logging.h"
+#include "sched.h"
+#include "utils.h"
+
+#include "pico/flash.h"
+
+// pages in each sector
+#define FLASH_LOG_SECTOR_PAGES (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+// a word left erased, to be programmed later
+#define FLASH_LOG_ERASED 0xfffffffful
+
+_Static_assert(sizeof(flash_log_page_t) == FLASH_PAGE_SIZE,
+               "Log pages must be exactly one flash page");
+
+// an erase and/or program to run with both cores paused
+typedef struct
+{
+    uint32_t offset;     // the page to program
+    bool erase;          // whether to erase its sector first
+    const uint8_t *data; // a page to program, erased bytes leave flash as it was
+    uint32_t erase_us;   // set to how long the erase took
+} flash_log_op_t;
+
+// the end of the program image, from the linker script
+extern char __flash_binary_end;
+
+// how long to wait for the other core to pause
+static const uint32_t flash_lockout_timeout_ms = 100ul; // 100ms
+// longest a partly filled page waits in RAM before being written
+static const uint32_t flash_log_flush_interval_ms = 1800000ul; // 30min
+// gap between one operation and the next, or a retry, one per loop pass
+static const uint32_t flash_log_op_interval_ms = 10ul; // 10ms
+
+// flag for whether the region is usable
+static bool is_ready = false;
+// index of the next page to write, from the start of the region
+static uint32_t head = 0;
+// sequence number of the next page written
+static uint32_t sequence = 0;
+// sequence number of the first page written since boot
+static uint32_t boot_sequence = 0;
+
+// the page being filled
+static flash_log_page_t page;
+// the last record in the page being filled
+static record_encoder_t encoder;
+// tracks when the page being filled is written regardless
+static absolute_time_t timeout = 0;
+// flag for whether the page being filled is stamped in time since boot
+static bool is_held = false;
+// measurements logged since boot
+static uint32_t records = 0;
+
+// a finished page, waiting for the sensors to be idle
+static flash_log_page_t pending;
+// flag for whether `pending` holds a page
+static bool is_pending = false;
+// pages lost because the previous one was still waiting
+static uint32_t dropped = 0;
+
+// sequence number of the page waiting to be marked sent
+static uint32_t mark_sequence = 0;
+// flag for whether `mark_sequence` is waiting
+static bool is_mark_pending = false;
+// all erased but the sent word, programmed over a page to mark it, or the
+// date word to date it
+static flash_log_page_t mark;
+
+// UTC of boot in seconds, 0 until the clock is set
+static uint32_t boot_utc = 0;
+// sequence number of the next written page to check for a date to program
+static uint32_t date_sequence = 0;
+
+// where `flash_log_read_held()` is up to: the page, the records read from it
+// and their length, and the last one
+static uint32_t held_page = 0;
+static uint16_t held_record = 0;
+static uint16_t held_offset = 0;
+static record_decoder_t held_decoder;
+
+// the slowest erase and program seen, with interrupts off
+static uint32_t max_erase_us = 0;
+static uint32_t max_program_us = 0;
+
+/**
+ * Returns a pointer to a page, through the XIP window.
+ */
+static const flash_log_page_t *_page(uint32_t index);
+
+/**
+ * Computes the CRC of a page, covering the sequence through the payload.
+ */
+static uint32_t _page_crc(const flash_log_page_t *p);
+
+/**
+ * Returns a written page by its sequence number, or `NULL` if it's torn,
+ * skipped or overwritten.
+ */
+static const flash_log_page_t *_written_page(uint32_t seq);
+
+/**
+ * Whether a page holds an intact copy.
+ */
+static bool _page_valid(const flash_log_page_t *p);
+
+/**
+ * Whether a page is erased, and so can be programmed.
+ */
+static bool _page_blank(const flash_log_page_t *p);
+
+/**
+ * Whether a sector's first page is intact and was written no earlier than
+ * the given sequence number.
+ */
+static bool _sector_since(uint32_t sector, uint32_t since);
+
+/**
+ * Sets `head` and `sequence` from what's in flash.
+ */
+static void _find_head(void);
+
+/**
+ * Clears the page being filled, so the next record is a keyframe.
+ */
+static void _start_page(void);
+
+/**
+ * Hands the page being filled over to be written.
+ */
+static void _finish_page(void);
+
+/**
+ * Programs the pending page at the head, and moves the head on.
+ *
+ * @return `true` if successful, `false` otherwise
+ */
+static bool _program_page(void);
+
+/**
+ * Programs the sent word of the page waiting to be marked.
+ *
+ * @return `true` if successful, `false` otherwise
+ */
+static bool _program_mark(void);
+
+/**
+ * Moves `date_sequence` on to the next written page stamped since boot
+ * that's still undated, once the clock is set.
+ *
+ * @return `true` if there's one to program, `false` otherwise
+ */
+static bool _find_undated(void);
+
+/**
+ * Programs the date word of the page at `date_sequence`.
+ *
+ * @return `true` if successful, `false` otherwise
+ */
+static bool _program_date(void);
+
+/**
+ * Runs a flash operation. Called through `flash_safe_execute()`, with
+ * interrupts disabled and the other core paused.
+ */
+static void _flash_op(void *param);
+
+/**
+ * Sets when the main loop next needs to run `flash_log_task()`.
+ */
+static void _schedule(void);
+
+bool flash_log_init(void)
+{
+    // the program grows upwards, and mustn't reach the log
+    uint32_t binary_end = (uint32_t)(uintptr_t)&__flash_binary_end - XIP_BASE;
+    if (binary_end > FLASH_LOG_REGION_OFFSET)
+    {
+        log_message(LOG_ERROR, LOG_STORAGE, "Program overlaps the flash log by %lu bytes!",
+                    binary_end - FLASH_LOG_REGION_OFFSET);
+        return false;
+    }
+
+    absolute_time_t start = get_absolute_time();
+    _find_head();
+    boot_sequence = sequence;
+    date_sequence = sequence;
+    held_page = sequence;
+    record_decoder_init(&held_decoder);
+    _start_page();
+    is_ready = true;
+    log_message(LOG_INFO, LOG_STORAGE, "Flash log head at page %lu of %lu (seq %lu), "
+                                       "found in %lu us",
+                head, FLASH_LOG_PAGE_COUNT, sequence,
+                (uint32_t)absolute_time_diff_us(start, get_absolute_time()));
+    return true;
+}
+
+void flash_log_write(const measurement_t *measure)
+{
+    if (!is_ready)
+    {
+        return;
+    }
+
+    // stamped in time since boot until the clock is set, and each page holds
+    // one or the other
+    bool is_since_boot = !rtc_time_valid();
+    if (page.count > 0 && is_since_boot != is_held)
+    {
+        _finish_page();
+    }
+    is_held = is_since_boot;
+    page.boot_utc = is_held ? FLASH_LOG_ERASED : 0;
+
+    uint32_t timestamp = is_held ? (uint32_t)(to_us_since_boot(measure->time) / 1000000u)
+                                 : get_unix_time_at(measure->time);
+    uint8_t count = sensors_channel_count();
+    size_t len = record_encode(&encoder, timestamp, &measure->values[0], count,
+                               &page.payload[page.length],
+                               FLASH_LOG_PAYLOAD_SIZE - page.length);
+    if (len == 0)
+    {
+        // full, the record starts the next page instead
+        _finish_page();
+        page.boot_utc = is_held ? FLASH_LOG_ERASED : 0;
+        len = record_encode(&encoder, timestamp, &measure->values[0], count,
+                            &page.payload[0], FLASH_LOG_PAYLOAD_SIZE);
+    }
+
+    // the first record in a page starts the clock
+    if (page.count == 0)
+    {
+        timeout = make_timeout_time_ms(flash_log_flush_interval_ms);
+    }
+    page.length += (uint16_t)len;
+    page.count++;
+    records++;
+    _schedule();
+}
+
+void flash_log_task(void)
+{
+    if (!is_ready)
+    {
+        return;
+    }
+
+    // don't let a partly filled page wait forever
+    if (!is_pending && page.count > 0 && is_timed_out(timeout))
+    {
+        _finish_page();
+    }
+
+    // once the clock is set, pages stamped since boot can be dated. Those
+    // still in RAM are written dated, those in flash are programmed below.
+    if (boot_utc == 0 && rtc_time_valid())
+    {
+        boot_utc = (uint32_t)(get_utc_us_at(from_us_since_boot(0)) / 1000000);
+        if (is_pending && pending.boot_utc == FLASH_LOG_ERASED)
+        {
+            pending.boot_utc = boot_utc;
+        }
+        if (page.count > 0 && page.boot_utc == FLASH_LOG_ERASED)
+        {
+            page.boot_utc = boot_utc;
+        }
+        log_message(LOG_INFO, LOG_STORAGE, "Dating flash log pages since boot (seq %lu to %lu)",
+                    boot_sequence, flash_log_filling());
+    }
+
+    // wait for a gap between measurements, as writing pauses both cores. One
+    // operation at a time, to keep each pause short.
+    if (sensors_idle())
+    {
+        if (is_pending)
+        {
+            _program_page();
+        }
+        else if (is_mark_pending)
+        {
+            _program_mark();
+        }
+        else if (_find_undated())
+        {
+            _program_date();
+        }
+    }
+    _schedule();
+}
+
+bool flash_log_busy(void)
+{
+    return is_pending;
+}
+
+uint32_t flash_log_records(void)
+{
+    return records;
+}
+
+uint32_t flash_log_sequence(void)
+{
+    return sequence;
+}
+
+uint32_t flash_log_filling(void)
+{
+    return sequence + (is_pending ? 1u : 0u);
+}
+
+const flash_log_page_t *flash_log_page(uint32_t seq)
+{
+    if (!is_ready)
+    {
+        return NULL;
+    }
+
+    // the pending page is written first, then the one being filled
+    if (is_pending && seq == sequence)
+    {
+        return &pending;
+    }
+    if (seq == flash_log_filling())
+    {
+        return &page;
+    }
+    return _written_page(seq);
+}
+
+FlashLogDating flash_log_page_epoch(uint32_t seq, const flash_log_page_t *p, uint32_t *epoch)
+{
+    if (p->boot_utc != FLASH_LOG_ERASED)
+    {
+        *epoch = p->boot_utc;
+        return FLASH_LOG_DATED;
+    }
+
+    // pages since boot are known as soon as the clock is, before their date
+    // is programmed. Earlier boots never had the clock set.
+    if ((int32_t)(seq - boot_sequence) < 0)
+    {
+        return FLASH_LOG_UNDATABLE;
+    }
+    if (boot_utc == 0)
+    {
+        return FLASH_LOG_UNDATED;
+    }
+    *epoch = boot_utc;
+    return FLASH_LOG_DATED;
+}
+
+bool flash_log_read_held(measurement_t *measure)
+{
+    uint32_t filling = flash_log_filling();
+    while (is_ready && (int32_t)(filling - held_page) >= 0)
+    {
+        // pages stamped since boot come first, so the first in UTC ends them
+        const flash_log_page_t *p = flash_log_page(held_page);
+        if (p != NULL && p->boot_utc == 0)
+        {
+            return false;
+        }
+
+        record_t rec;
+        size_t used;
+        if (p != NULL && held_record < p->count &&
+            record_decode(&held_decoder, &p->payload[held_offset], p->length - held_offset,
+                          &used, &rec) == RECORD_OK)
+        {
+            held_offset += (uint16_t)used;
+            held_record++;
+            memset(measure, 0, sizeof(*measure));
+            measure->time = from_us_since_boot((uint64_t)rec.timestamp * 1000000u);
+            memcpy(&measure->values[0], &rec.values[0],
+                   MIN(rec.count, SENSOR_MAX_CHANNELS) * sizeof(rec.values[0]));
+            return true;
+        }
+
+        // the page being filled may still grow
+        if (held_page == filling)
+        {
+            return false;
+        }
+        held_page++;
+        held_record = 0;
+        held_offset = 0;
+        record_decoder_init(&held_decoder);
+    }
+    return false;
+}
+
+void flash_log_mark_sent(uint32_t seq)
+{
+    // the sent word isn't covered by the CRC, so a page still in RAM just
+    // gets written marked
+    if (is_pending && seq == sequence)
+    {
+        pending.sent = 0;
+        is_mark_pending = false;
+        return;
+    }
+    mark_sequence = seq;
+    is_mark_pending = true;
+    _schedule();
+}
+
+uint32_t flash_log_first_unsent(void)
+{
+    if (!is_ready)
+    {
+        return 0;
+    }
+
+    // pages are marked in order, so resume after the newest mark, or from the
+    // oldest page if none are marked
+    uint32_t first = sequence > FLASH_LOG_PAGE_COUNT ? sequence - FLASH_LOG_PAGE_COUNT : 0;
+    for (uint32_t i = 0; i < FLASH_LOG_PAGE_COUNT; i++)
+    {
+        const flash_log_page_t *p = _page(i);
+        if (p->sent == 0 && _page_valid(p) && (int32_t)(p->sequence + 1u - first) > 0 &&
+            (int32_t)(sequence - p->sequence) > 0)
+        {
+            first = p->sequence + 1u;
+        }
+    }
+    return first;
+}
+
+static const flash_log_page_t *_page(uint32_t index)
+{
+    return (const flash_log_page_t *)(XIP_BASE + FLASH_LOG_REGION_OFFSET +
+                                      index * FLASH_PAGE_SIZE);
+}
+
+static const flash_log_page_t *_written_page(uint32_t seq)
+{
+    // not written yet, or long since overwritten
+    if ((int32_t)(sequence - seq) <= 0 || sequence - seq > FLASH_LOG_PAGE_COUNT)
+    {
+        return NULL;
+    }
+
+    const flash_log_page_t *p = _page(seq % FLASH_LOG_PAGE_COUNT);
+    if (!_page_valid(p) || p->sequence != seq)
+    {
+        return NULL;
+    }
+    return p;
+}
+
+static uint32_t _page_crc(const flash_log_page_t *p)
+{
+    return crc32(&p->sequence, offsetof(flash_log_page_t, payload) -
+                                   offsetof(flash_log_page_t, sequence) +
+                                   p->length);
+}
+
+static bool _page_valid(const flash_log_page_t *p)
+{
+    if (p->length > FLASH_LOG_PAYLOAD_SIZE || p->count == 0)
+    {
+        return false;
+    }
+    return _page_crc(p) == p->crc;
+}
+
+static bool _page_blank(const flash_log_page_t *p)
+{
+    const uint32_t *words = (const uint32_t *)p;
+    for (uint32_t i = 0; i < FLASH_PAGE_SIZE / sizeof(uint32_t); i++)
+    {
+        if (words[i] != 0xfffffffful)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool _sector_since(uint32_t sector, uint32_t since)
+{
+    const flash_log_page_t *p = _page(sector * FLASH_LOG_SECTOR_PAGES);
+    // compare as a difference, so the sequence can wrap
+    return _page_valid(p) && (int32_t)(p->sequence - since) >= 0;
+}
+
+static void _find_head(void)
+{
+    // sectors are filled in order, so from sector 0 up to the newest they
+    // were all started no earlier than sector 0, and after it are older or
+    // erased. Binary search for the last one started since sector 0.
+    int32_t newest = -1;
+    const flash_log_page_t *first = _page(0);
+    if (_page_valid(first))
+    {
+        uint32_t low = 0;
+        uint32_t high = FLASH_LOG_SECTOR_COUNT - 1u;
+        while (low < high)
+        {
+            uint32_t mid = (low + high + 1u) / 2u;
+            if (_sector_since(mid, first->sequence))
+            {
+                low = mid;
+            }
+            else
+            {
+                high = mid - 1u;
+            }
+        }
+        newest = (int32_t)low;
+    }
+    else
+    {
+        // either empty, or reset while sector 0 was erased to wrap around.
+        // Rare enough to just check every sector.
+        uint32_t newest_sequence = 0;
+        for (uint32_t i = 0; i < FLASH_LOG_SECTOR_COUNT; i++)
+        {
+            if (newest < 0 ? _page_valid(_page(i * FLASH_LOG_SECTOR_PAGES))
+                           : _sector_since(i, newest_sequence + 1u))
+            {
+                newest = (int32_t)i;
+                newest_sequence = _page(i * FLASH_LOG_SECTOR_PAGES)->sequence;
+            }
+        }
+    }
+    if (newest < 0)
+    {
+        head = 0;
+        sequence = 0;
+        return;
+    }
+
+    // the sector was erased before its first page, so its pages are written
+    // up to some point and blank after. Binary search for the last written.
+    uint32_t base = (uint32_t)newest * FLASH_LOG_SECTOR_PAGES;
+    uint32_t low = 0;
+    uint32_t high = FLASH_LOG_SECTOR_PAGES - 1u;
+    while (low < high)
+    {
+        uint32_t mid = (low + high + 1u) / 2u;
+        if (_page_valid(_page(base + mid)))
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1u;
+        }
+    }
+    head = (base + low + 1u) % FLASH_LOG_PAGE_COUNT;
+    sequence = _page(base + low)->sequence + 1u;
+}
+
+static void _start_page(void)
+{
+    memset(&page, 0xff, sizeof(page));
+    page.length = 0;
+    page.count = 0;
+    record_encoder_init(&encoder);
+}
+
+static void _finish_page(void)
+{
+    if (is_pending)
+    {
+        dropped++;
+        log_message(LOG_WARN, LOG_STORAGE, "Flash log page dropped, %lu so far", dropped);
+    }
+    pending = page;
+    is_pending = true;
+    _start_page();
+}
+
+static bool _program_page(void)
+{
+    // a sector is erased as the head enters it. Anything else not blank is
+    // from a reset part way through, so skip to the next sector.
+    const flash_log_page_t *target = _page(head);
+    bool erase = head % FLASH_LOG_SECTOR_PAGES == 0;
+    if (!erase && !_page_blank(target))
+    {
+        // the sequence skips along too, so it still matches the position
+        uint32_t next = (head / FLASH_LOG_SECTOR_PAGES + 1u) * FLASH_LOG_SECTOR_PAGES % FLASH_LOG_PAGE_COUNT;
+        sequence += (next - head) % FLASH_LOG_PAGE_COUNT;
+        head = next;
+        erase = true;
+    }
+
+    pending.sequence = sequence;
+    pending.crc = _page_crc(&pending);
+    flash_log_op_t op = {
+        .offset = FLASH_LOG_REGION_OFFSET + head * FLASH_PAGE_SIZE,
+        .erase = erase,
+        .data = (const uint8_t *)&pending,
+    };
+
+    uint32_t start = time_us_32();
+    int err = flash_safe_execute(_flash_op, &op, flash_lockout_timeout_ms);
+    uint32_t program_us = time_us_32() - start - op.erase_us;
+    if (err != PICO_OK)
+    {
+        // the page stays pending, and is tried again next time
+        log_message(LOG_ERROR, LOG_STORAGE, "Failed to write flash log page, error: %d", err);
+        return false;
+    }
+    is_pending = false;
+
+    if (!_page_valid(_page(head)))
+    {
+        log_message(LOG_ERROR, LOG_STORAGE, "Flash log page %lu failed verification!", head);
+    }
+    max_program_us = MAX(max_program_us, program_us);
+    max_erase_us = MAX(max_erase_us, op.erase_us);
+    log_message(LOG_DEBUG, LOG_STORAGE, "Wrote flash log page %lu (seq %lu, %u records): "
+                                        "program %lu us (max %lu), erase %lu us (max %lu)",
+                head, sequence, pending.count, program_us, max_program_us,
+                op.erase_us, max_erase_us);
+
+    head = (head + 1u) % FLASH_LOG_PAGE_COUNT;
+    sequence++;
+    return true;
+}
+
+static bool _program_mark(void)
+{
+    // skip it if the page was overwritten meanwhile, or is already marked
+    is_mark_pending = false;
+    const flash_log_page_t *p = _written_page(mark_sequence);
+    if (p == NULL || p->sent == 0)
+    {
+        return true;
+    }
+
+    // programming only clears bits, so the erased bytes leave the rest alone
+    memset(&mark, 0xff, sizeof(mark));
+    mark.sent = 0;
+    flash_log_op_t op = {
+        .offset = FLASH_LOG_REGION_OFFSET + (mark_sequence % FLASH_LOG_PAGE_COUNT) * FLASH_PAGE_SIZE,
+        .erase = false,
+        .data = (const uint8_t *)&mark,
+    };
+
+    uint32_t start = time_us_32();
+    int err = flash_safe_execute(_flash_op, &op, flash_lockout_timeout_ms);
+    if (err != PICO_OK)
+    {
+        log_message(LOG_ERROR, LOG_STORAGE, "Failed to mark flash log page sent, error: %d", err);
+        is_mark_pending = true;
+        return false;
+    }
+    log_message(LOG_DEBUG, LOG_STORAGE, "Marked flash log page %lu sent in %lu us",
+                mark_sequence, time_us_32() - start);
+    return true;
+}
+
+static bool _find_undated(void)
+{
+    if (boot_utc == 0)
+    {
+        return false;
+    }
+
+    // catches up with each page written, skipping those already dated
+    while (date_sequence != sequence)
+    {
+        const flash_log_page_t *p = _written_page(date_sequence);
+        if (p != NULL && p->boot_utc == FLASH_LOG_ERASED)
+        {
+            return true;
+        }
+        date_sequence++;
+    }
+    return false;
+}
+
+static bool _program_date(void)
+{
+    // the date word isn't covered by the CRC either
+    memset(&mark, 0xff, sizeof(mark));
+    mark.boot_utc = boot_utc;
+    flash_log_op_t op = {
+        .offset = FLASH_LOG_REGION_OFFSET + (date_sequence % FLASH_LOG_PAGE_COUNT) * FLASH_PAGE_SIZE,
+        .erase = false,
+        .data = (const uint8_t *)&mark,
+    };
+
+    uint32_t start = time_us_32();
+    int err = flash_safe_execute(_flash_op, &op, flash_lockout_timeout_ms);
+    if (err != PICO_OK)
+    {
+        // tried again next time
+        log_message(LOG_ERROR, LOG_STORAGE, "Failed to date flash log page, error: %d", err);
+        return false;
+    }
+    log_message(LOG_DEBUG, LOG_STORAGE, "Dated flash log page %lu in %lu us",
+                date_sequence, time_us_32() - start);
+    date_sequence++;
+    return true;
+}
+
+static void _flash_op(void *param)
+{
+    flash_log_op_t *op = param;
+    op->erase_us = 0;
+    if (op->erase)
+    {
+        uint32_t start = time_us_32();
+        flash_range_erase(op->offset & ~(FLASH_SECTOR_SIZE - 1u), FLASH_SECTOR_SIZE);
+        op->erase_us = time_us_32() - start;
+    }
+    flash_range_program(op->offset, op->data, FLASH_PAGE_SIZE);
+}
+
+static void _schedule(void)
+{
+    // an operation waiting on the sensors goes once they finish, which runs
+    // the loop anyway
+    if (is_pending || is_mark_pending || _find_undated())
+    {
+        if (sensors_idle())
+        {
+            sched_at(SCHED_FLASH_LOG, make_timeout_time_ms(flash_log_op_interval_ms));
+        }
+    }
+    else if (page.count > 0)
+    {
+        sched_at(SCHED_FLASH_LOG, timeout);
+    }
+}
@@ -0,0 +1,797 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "http_server.h"
+#include "error_mgr.h"
+#include "flash_log.h"
+#include "measure_queue.h"
+#include "time_sync.h"
+#include "wifi_mgr.h"
+#include "logging.h"
+#include "sched.h"
+#include "utils.h"
+
+#include "pico/cyw43_arch.h"
+
+#include "lwip/tcp.h"
+
+// connections served at once, within lwIP's default of 5 active TCP PCBs
+#define HTTP_MAX_CONNECTIONS 4u
+// rendered responses kept, shared by requests for the same path
+#define HTTP_RESPONSE_COUNT 2u
+// largest rendered response, headers included
+#define HTTP_RESPONSE_SIZE 4096u
+// room kept before a rendered body for the status line and headers
+#define HTTP_HEADER_SIZE 128u
+// bytes of the request line kept, enough for the method and path
+#define HTTP_REQUEST_SIZE 64u
+
+/**
+ * Enumeration of the states of a connection
+ */
+typedef enum
+{
+    HTTP_FREE,      // slot unused
+    HTTP_RECEIVING, // reading the request
+    HTTP_READY,     // request read, waiting for the main loop to respond
+    HTTP_SENDING,   // response queued, waiting for it to be acknowledged
+} HttpState;
+
+/**
+ * Enumeration of the responses
+ */
+typedef enum
+{
+    HTTP_METRICS,    // Prometheus text format
+    HTTP_LATEST,     // JSON
+    HTTP_NOT_FOUND,  // unknown path
+    HTTP_BAD_METHOD, // anything but GET
+} HttpRoute;
+
+// a response rendered into a static buffer, sent straight from it
+typedef struct
+{
+    HttpRoute route;
+    absolute_time_t rendered; // when it was rendered
+    volatile uint8_t refs;    // connections still sending it
+    const char *start;        // where the headers start
+    uint16_t len;             // length from `start`
+    uint16_t body_len;        // length of the body while rendering
+    char data[HTTP_RESPONSE_SIZE];
+} http_response_t;
+
+// a client connection
+typedef struct
+{
+    struct tcp_pcb *pcb;
+    volatile HttpState state;
+    HttpRoute route;
+    char request[HTTP_REQUEST_SIZE]; // the request line
+    uint8_t request_len;
+    uint8_t line_len;          // bytes in the current header line, but CR
+    bool is_request_line_done; // whether the request line was read
+    http_response_t *response; // the rendered response, `NULL` for a fixed one
+    const char *data;          // the response being sent
+    uint16_t len;              // length of the response
+    uint16_t queued;           // bytes handed to lwIP
+    uint16_t acked;            // bytes acknowledged by the client
+    uint32_t start_us;         // when the connection was accepted
+} http_conn_t;
+
+// a rendered response is shared with requests arriving up to this much later
+static const uint32_t http_render_max_age_ms = 1000ul; // 1s
+// a connection is dropped if it isn't done by now
+static const uint32_t http_timeout_ms = 10000ul; // 10s
+// lwIP polls idle connections this often, in 500ms ticks
+static const uint8_t http_poll_interval = 4u; // 2s
+
+static const char http_not_found[] = "HTTP/1.0 404 Not Found\r\n"
+                                     "Content-Type: text/plain\r\n"
+                                     "Content-Length: 10\r\n"
+                                     "Connection: close\r\n\r\n"
+                                     "Not found\n";
+static const char http_bad_method[] = "HTTP/1.0 405 Method Not Allowed\r\n"
+                                      "Allow: GET\r\n"
+                                      "Content-Type: text/plain\r\n"
+                                      "Content-Length: 19\r\n"
+                                      "Connection: close\r\n\r\n"
+                                      "Method not allowed\n";
+
+// names of the error bits, as metric labels
+static const struct
+{
+    uint8_t code;
+    const char *name;
+} http_error_names[] = {
+    {ERROR_WIFI_DISCONNECTED, "wifi_disconnected"},
+    {ERROR_NTP_SYNC_FAILED, "ntp_sync_failed"},
+    {ERROR_DHT11_READ_FAILED, "dht11_read_failed"},
+    {WARNING_RECALIBRATING, "recalibrating"},
+    {WARNING_INTIALIZING, "initializing"},
+    {NOTIF_SENSOR_THRESHOLD, "sensor_threshold"},
+    {ERROR_SD_FAILED, "sd_failed"},
+};
+
+// flag for whether the server is listening
+static bool is_ready = false;
+// the listening control block
+static struct tcp_pcb *listen_pcb = NULL;
+// client connections
+static http_conn_t conns[HTTP_MAX_CONNECTIONS];
+// rendered responses
+static http_response_t responses[HTTP_RESPONSE_COUNT];
+
+// the latest measurement, if there has been one
+static measurement_t latest;
+static bool has_latest = false;
+
+// requests served, and connections turned away with every slot in use
+static uint32_t requests = 0;
+static uint32_t rejected = 0;
+// time from accepting each connection to the last byte being acknowledged
+static uint64_t latency_sum_us = 0;
+static uint32_t latency_max_us = 0;
+
+/**
+ * Called by lwIP for each new connection.
+ */
+static err_t _accept(void *arg, struct tcp_pcb *pcb, err_t err);
+
+/**
+ * Called by lwIP with data from the client, or `NULL` once it closes.
+ */
+static err_t _recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err);
+
+/**
+ * Called by lwIP as sent data is acknowledged.
+ */
+static err_t _sent(void *arg, struct tcp_pcb *pcb, u16_t len);
+
+/**
+ * Called by lwIP every `http_poll_interval`, to time out stuck connections.
+ */
+static err_t _poll(void *arg, struct tcp_pcb *pcb);
+
+/**
+ * Called by lwIP when a connection fails, after its PCB is freed.
+ */
+static void _error(void *arg, err_t err);
+
+/**
+ * Reads request bytes, up to the blank line ending the headers, keeping
+ * the request line.
+ */
+static void _read_request(http_conn_t *conn, const struct pbuf *p);
+
+/**
+ * Picks a route from the request line.
+ */
+static HttpRoute _route(const char *request);
+
+/**
+ * Queues as much of the response as lwIP has room for. The data is
+ * referenced, not copied, so it must stay put until it's acknowledged.
+ */
+static void _send_more(http_conn_t *conn);
+
+/**
+ * Releases the connection's slot and response, and detaches its PCB.
+ *
+ * @return The PCB, `NULL` if lwIP already freed it
+ */
+static struct tcp_pcb *_release(http_conn_t *conn);
+
+/**
+ * Releases the connection and closes it.
+ *
+ * @return `ERR_OK`, or `ERR_ABRT` if it had to be aborted instead
+ */
+static err_t _close(http_conn_t *conn);
+
+/**
+ * Returns a rendered response for a route, sharing one rendered recently,
+ * or rendering into a buffer no connection is sending.
+ *
+ * @return Pointer to the response, or `NULL` if every buffer is in use
+ */
+static http_response_t *_response_for(HttpRoute route);
+
+/**
+ * Appends formatted text to a response body, cut short if it runs out of
+ * room.
+ */
+static void _append(http_response_t *resp, const char *fmt, ...);
+
+/**
+ * Appends a fixed-point value as a decimal, with as many places as the
+ * scale, which must be a power of 10.
+ */
+static void _append_fixed(http_response_t *resp, int16_t value, uint16_t scale);
+
+/**
+ * Appends the HELP and TYPE lines of a metric.
+ */
+static void _append_metric(http_response_t *resp, const char *name, const char *type,
+                           const char *help);
+
+/**
+ * Renders the metrics page.
+ */
+static void _render_metrics(http_response_t *resp);
+
+/**
+ * Renders the latest readings as JSON.
+ *
+ * @return `true` if there was a measurement, `false` otherwise
+ */
+static bool _render_latest(http_response_t *resp);
+
+bool http_server_init(void)
+{
+    cyw43_arch_lwip_begin();
+    struct tcp_pcb *pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
+    err_t err = pcb != NULL ? tcp_bind(pcb, IP_ANY_TYPE, DATALOGGER_HTTP_PORT) : ERR_MEM;
+    if (err == ERR_OK)
+    {
+        // frees `pcb`, replacing it with a smaller listening one
+        listen_pcb = tcp_listen_with_backlog(pcb, HTTP_MAX_CONNECTIONS);
+        if (listen_pcb != NULL)
+        {
+            tcp_accept(listen_pcb, _accept);
+        }
+        else
+        {
+            err = ERR_MEM;
+        }
+    }
+    else if (pcb != NULL)
+    {
+        tcp_close(pcb);
+    }
+    cyw43_arch_lwip_end();
+
+    if (err != ERR_OK)
+    {
+        log_message(LOG_ERROR, LOG_HTTP, "Failed to listen on port %u, error: %d",
+                    DATALOGGER_HTTP_PORT, err);
+        return false;
+    }
+    log_message(LOG_INFO, LOG_HTTP, "Serving /metrics and /latest on port %u, "
+                                    "up to %u connections",
+                DATALOGGER_HTTP_PORT, HTTP_MAX_CONNECTIONS);
+    is_ready = true;
+    return true;
+}
+
+void http_server_set_latest(const measurement_t *measure)
+{
+    latest = *measure;
+    has_latest = true;
+}
+
+void http_server_task(void)
+{
+    if (!is_ready)
+    {
+        return;
+    }
+
+    for (uint32_t i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+    {
+        http_conn_t *conn = &conns[i];
+        if (conn->state != HTTP_READY)
+        {
+            continue;
+        }
+
+        // render outside the lwIP lock, only into a buffer nothing is
+        // sending, so the background is never held up for it
+        http_response_t *resp = NULL;
+        if (conn->route == HTTP_METRICS || conn->route == HTTP_LATEST)
+        {
+            resp = _response_for(conn->route);
+            // every buffer is being sent, try again next time
+            if (resp == NULL)
+            {
+                continue;
+            }
+        }
+
+        cyw43_arch_lwip_begin();
+        // the client may have gone meanwhile
+        if (conn->state == HTTP_READY)
+        {
+            conn->response = resp;
+            if (resp != NULL)
+            {
+                resp->refs++;
+                conn->data = resp->start;
+                conn->len = resp->len;
+            }
+            else if (conn->route == HTTP_NOT_FOUND)
+            {
+                conn->data = &http_not_found[0];
+                conn->len = sizeof(http_not_found) - 1u;
+            }
+            else
+            {
+                conn->data = &http_bad_method[0];
+                conn->len = sizeof(http_bad_method) - 1u;
+            }
+            conn->queued = 0;
+            conn->acked = 0;
+            conn->state = HTTP_SENDING;
+            _send_more(conn);
+        }
+        cyw43_arch_lwip_end();
+    }
+}
+
+static err_t _accept(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+    (void)arg;
+    if (err != ERR_OK || pcb == NULL)
+    {
+        return ERR_VAL;
+    }
+
+    http_conn_t *conn = NULL;
+    for (uint32_t i = 0; i < HTTP_MAX_CONNECTIONS && conn == NULL; i++)
+    {
+        if (conns[i].state == HTTP_FREE)
+        {
+            conn = &conns[i];
+        }
+    }
+    if (conn == NULL)
+    {
+        rejected++;
+        tcp_abort(pcb);
+        return ERR_ABRT;
+    }
+
+    memset(conn, 0, sizeof(*conn));
+    conn->pcb = pcb;
+    conn->start_us = time_us_32();
+    conn->state = HTTP_RECEIVING;
+    tcp_arg(pcb, conn);
+    tcp_recv(pcb, _recv);
+    tcp_sent(pcb, _sent);
+    tcp_err(pcb, _error);
+    tcp_poll(pcb, _poll, http_poll_interval);
+    return ERR_OK;
+}
+
+static err_t _recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+    http_conn_t *conn = arg;
+    if (p == NULL)
+    {
+        // the client is done sending. A response being sent still needs
+        // its buffer until it's acknowledged, so that finishes first.
+        if (conn->state == HTTP_SENDING)
+        {
+            return ERR_OK;
+        }
+        return _close(conn);
+    }
+    if (err != ERR_OK)
+    {
+        pbuf_free(p);
+        return err;
+    }
+
+    if (conn->state == HTTP_RECEIVING)
+    {
+        _read_request(conn, p);
+        // rendered by the main loop
+        if (conn->state == HTTP_READY)
+        {
+            sched_wake();
+        }
+    }
+    tcp_recved(pcb, p->tot_len);
+    pbuf_free(p);
+    return ERR_OK;
+}
+
+static err_t _sent(void *arg, struct tcp_pcb *pcb, u16_t len)
+{
+    (void)pcb;
+    http_conn_t *conn = arg;
+    conn->acked += len;
+    if (conn->acked < conn->len)
+    {
+        _send_more(conn);
+        return ERR_OK;
+    }
+
+    uint32_t latency_us = time_us_32() - conn->start_us;
+    requests++;
+    latency_sum_us += latency_us;
+    latency_max_us = MAX(latency_max_us, latency_us);
+    log_message(LOG_DEBUG, LOG_HTTP, "Served %s (%u bytes) in %lu us",
+                conn->request, conn->len, latency_us);
+    // a request may be waiting for its buffer
+    sched_wake();
+    return _close(conn);
+}
+
+static err_t _poll(void *arg, struct tcp_pcb *pcb)
+{
+    http_conn_t *conn = arg;
+    if (time_us_32() - conn->start_us > http_timeout_ms * 1000u)
+    {
+        log_message(LOG_DEBUG, LOG_HTTP, "HTTP connection timed out");
+        _release(conn);
+        tcp_abort(pcb);
+        return ERR_ABRT;
+    }
+    // lwIP was out of room last time
+    if (conn->state == HTTP_SENDING && conn->queued < conn->len)
+    {
+        _send_more(conn);
+    }
+    return ERR_OK;
+}
+
+static void _error(void *arg, err_t err)
+{
+    http_conn_t *conn = arg;
+    if (conn == NULL)
+    {
+        return;
+    }
+
+    // lwIP has already freed the PCB, and any segments using the response
+    log_message(LOG_DEBUG, LOG_HTTP, "HTTP connection failed, error: %d", err);
+    conn->pcb = NULL;
+    _release(conn);
+}
+
+static void _read_request(http_conn_t *conn, const struct pbuf *p)
+{
+    for (u16_t i = 0; i < p->tot_len; i++)
+    {
+        char c = (char)pbuf_get_at(p, i);
+        if (!conn->is_request_line_done && c != '\r' && c != '\n' &&
+            conn->request_len < sizeof(conn->request) - 1u)
+        {
+            conn->request[conn->request_len++] = c;
+        }
+
+        if (c == '\n')
+        {
+            // a blank line ends the headers
+            if (conn->is_request_line_done && conn->line_len == 0)
+            {
+                conn->route = _route(&conn->request[0]);
+                conn->state = HTTP_READY;
+                return;
+            }
+            conn->is_request_line_done = true;
+            conn->line_len = 0;
+        }
+        else if (c != '\r' && conn->line_len < UINT8_MAX)
+        {
+            conn->line_len++;
+        }
+    }
+}
+
+static HttpRoute _route(const char *request)
+{
+    if (strncmp(request, "GET ", 4) != 0)
+    {
+        return HTTP_BAD_METHOD;
+    }
+
+    // the path runs to the query string or the protocol version
+    const char *path = &request[4];
+    size_t len = strcspn(path, " ?");
+    if (len == 8 && strncmp(path, "/metrics", len) == 0)
+    {
+        return HTTP_METRICS;
+    }
+    if (len == 7 && strncmp(path, "/latest", len) == 0)
+    {
+        return HTTP_LATEST;
+    }
+    return HTTP_NOT_FOUND;
+}
+
+static void _send_more(http_conn_t *conn)
+{
+    uint16_t len = MIN((uint16_t)(conn->len - conn->queued), tcp_sndbuf(conn->pcb));
+    if (len == 0)
+    {
+        return;
+    }
+
+    // no copy flag, so lwIP's segments point into the response
+    err_t err = tcp_write(conn->pcb, &conn->data[conn->queued], len, 0);
+    if (err != ERR_OK)
+    {
+        // out of segments, picked up again as data is acknowledged or polled
+        log_message(LOG_DEBUG, LOG_HTTP, "HTTP response deferred, error: %d", err);
+        return;
+    }
+    conn->queued += len;
+    tcp_output(conn->pcb);
+}
+
+static struct tcp_pcb *_release(http_conn_t *conn)
+{
+    if (conn->response != NULL)
+    {
+        conn->response->refs--;
+        conn->response = NULL;
+    }
+    conn->state = HTTP_FREE;
+
+    struct tcp_pcb *pcb = conn->pcb;
+    conn->pcb = NULL;
+    if (pcb != NULL)
+    {
+        tcp_arg(pcb, NULL);
+        tcp_recv(pcb, NULL);
+        tcp_sent(pcb, NULL);
+        tcp_err(pcb, NULL);
+        tcp_poll(pcb, NULL, 0);
+    }
+    return pcb;
+}
+
+static err_t _close(http_conn_t *conn)
+{
+    struct tcp_pcb *pcb = _release(conn);
+    if (pcb == NULL)
+    {
+        return ERR_OK;
+    }
+
+    if (tcp_close(pcb) != ERR_OK)
+    {
+        tcp_abort(pcb);
+        return ERR_ABRT;
+    }
+    return ERR_OK;
+}
+
+static http_response_t *_response_for(HttpRoute route)
+{
+    absolute_time_t now = get_absolute_time();
+    http_response_t *unused = NULL;
+    for (uint32_t i = 0; i < HTTP_RESPONSE_COUNT; i++)
+    {
+        http_response_t *resp = &responses[i];
+        if (resp->len > 0 && resp->route == route &&
+            absolute_time_diff_us(resp->rendered, now) < http_render_max_age_ms * 1000)
+        {
+            return resp;
+        }
+        if (resp->refs == 0 && unused == NULL)
+        {
+            unused = resp;
+        }
+    }
+    if (unused == NULL)
+    {
+        return NULL;
+    }
+
+    // the body goes after room for the headers, which are written once its
+    // length is known
+    http_response_t *resp = unused;
+    resp->route = route;
+    resp->body_len = 0;
+    const char *status = "200 OK";
+    const char *type = "text/plain; version=0.0.4; charset=utf-8";
+    if (route == HTTP_METRICS)
+    {
+        _render_metrics(resp);
+    }
+    else
+    {
+        type = "application/json; charset=utf-8";
+        if (!_render_latest(resp))
+        {
+            status = "503 Service Unavailable";
+        }
+    }
+
+    char header[HTTP_HEADER_SIZE];
+    int header_len = snprintf(&header[0], sizeof(header), "HTTP/1.0 %s\r\n"
+                                                          "Content-Type: %s\r\n"
+                                                          "Content-Length: %u\r\n"
+                                                          "Connection: close\r\n\r\n",
+                              status, type, resp->body_len);
+    header_len = MIN(header_len, (int)sizeof(header) - 1);
+    char *start = &resp->data[HTTP_HEADER_SIZE - (size_t)header_len];
+    memcpy(start, &header[0], (size_t)header_len);
+    resp->start = start;
+    resp->len = (uint16_t)header_len + resp->body_len;
+    resp->rendered = get_absolute_time();
+    log_message(LOG_DEBUG, LOG_HTTP, "Rendered %s (%u bytes) in %lu us",
+                route == HTTP_METRICS ? "/metrics" : "/latest", resp->len,
+                (uint32_t)absolute_time_diff_us(now, resp->rendered));
+    return resp;
+}
+
+static void _append(http_response_t *resp, const char *fmt, ...)
+{
+    size_t room = HTTP_RESPONSE_SIZE - HTTP_HEADER_SIZE - resp->body_len;
+    if (room <= 1u)
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(&resp->data[HTTP_HEADER_SIZE + resp->body_len], room, fmt, args);
+    va_end(args);
+    if (len > 0)
+    {
+        resp->body_len += (uint16_t)MIN((size_t)len, room - 1u);
+    }
+}
+
+static void _append_fixed(http_response_t *resp, int16_t value, uint16_t scale)
+{
+    uint32_t magnitude = (uint32_t)(value < 0 ? -(int32_t)value : value);
+    const char *sign = value < 0 ? "-" : "";
+    uint8_t decimals = 0;
+    for (uint16_t s = scale; s >= 10u; s /= 10u)
+    {
+        decimals++;
+    }
+    if (decimals == 0)
+    {
+        _append(resp, "%s%lu", sign, magnitude);
+    }
+    else
+    {
+        _append(resp, "%s%lu.%0*lu", sign, magnitude / scale, decimals, magnitude % scale);
+    }
+}
+
+static void _append_metric(http_response_t *resp, const char *name, const char *type,
+                           const char *help)
+{
+    _append(resp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void _render_metrics(http_response_t *resp)
+{
+    // the counters are updated in the background, so copy them in one go
+    cyw43_arch_lwip_begin();
+    uint32_t served = requests;
+    uint32_t turned_away = rejected;
+    uint64_t sum_us = latency_sum_us;
+    uint32_t max_us = latency_max_us;
+    cyw43_arch_lwip_end();
+
+    _append_metric(resp, "datalogger_uptime_seconds", "gauge", "Time since boot.");
+    _append(resp, "datalogger_uptime_seconds %llu\n", time_us_64() / 1000000u);
+
+    if (has_latest)
+    {
+        _append_metric(resp, "datalogger_reading", "gauge", "Latest value of each channel.");
+        for (uint8_t i = 0; i < sensors_channel_count(); i++)
+        {
+            const sensor_channel_t *ch = sensors_channel(i);
+            _append(resp, "datalogger_reading{channel=\"%s\",unit=\"%s\"} ", ch->name, ch->unit);
+            _append_fixed(resp, latest.values[i], ch->scale);
+            _append(resp, "\n");
+        }
+        _append_metric(resp, "datalogger_reading_age_seconds", "gauge",
+                       "Time since the latest measurement completed.");
+        _append(resp, "datalogger_reading_age_seconds %lld\n",
+                absolute_time_diff_us(latest.time, get_absolute_time()) / 1000000);
+        // only once the clock is set, it's known for readings taken before then
+        if (rtc_time_valid())
+        {
+            _append_metric(resp, "datalogger_reading_timestamp_seconds", "gauge",
+                           "Unix time of the latest measurement.");
+            _append(resp, "datalogger_reading_timestamp_seconds %lu\n",
+                    get_unix_time_at(latest.time));
+        }
+    }
+
+    uint8_t errors = get_errors();
+    _append_metric(resp, "datalogger_error_state", "gauge", "Error code bitmask.");
+    _append(resp, "datalogger_error_state %u\n", errors);
+    _append_metric(resp, "datalogger_error", "gauge", "Whether each error code is set.");
+    for (uint32_t i = 0; i < count_of(http_error_names); i++)
+    {
+        _append(resp, "datalogger_error{code=\"%s\"} %u\n", http_error_names[i].name,
+                (errors & http_error_names[i].code) != 0 ? 1u : 0u);
+    }
+
+    uint32_t sync_age = rtc_sync_age();
+    _append_metric(resp, "datalogger_time_sync_age_seconds", "gauge",
+                   "Time since the RTC was last synchronized with NTP.");
+    if (sync_age == UINT32_MAX)
+    {
+        _append(resp, "datalogger_time_sync_age_seconds NaN\n");
+    }
+    else
+    {
+        _append(resp, "datalogger_time_sync_age_seconds %lu\n", sync_age);
+    }
+    _append_metric(resp, "datalogger_clock_frequency_error_ratio", "gauge",
+                   "Estimated crystal frequency error, corrected for between syncs.");
+    _append(resp, "datalogger_clock_frequency_error_ratio %lde-9\n", rtc_frequency_error());
+    _append_metric(resp, "datalogger_clock_residual_drift_ratio", "gauge",
+                   "Drift left after the frequency correction, at the last sync.");
+    _append(resp, "datalogger_clock_residual_drift_ratio %lde-9\n", rtc_residual_drift());
+    _append_metric(resp, "datalogger_ntp_poll_interval_seconds", "gauge",
+                   "Wait between NTP syncs.");
+    _append(resp, "datalogger_ntp_poll_interval_seconds %lu\n", ntp_poll_interval());
+    _append_metric(resp, "datalogger_wifi_connected", "gauge", "Whether Wi-Fi is up.");
+    _append(resp, "datalogger_wifi_connected %u\n", wifi_connected() ? 1u : 0u);
+
+    _append_metric(resp, "datalogger_wakeups_per_hour", "gauge",
+                   "Times the main loop ran, over the last full hour.");
+    _append(resp, "datalogger_wakeups_per_hour %lu\n", sched_wakeups_per_hour());
+    uint32_t jitter_us = sched_jitter_max_us();
+    _append_metric(resp, "datalogger_scheduler_jitter_max_seconds", "gauge",
+                   "Latest a deadline was met, over the last full hour.");
+    _append(resp, "datalogger_scheduler_jitter_max_seconds %lu.%06lu\n",
+            jitter_us / 1000000u, jitter_us % 1000000u);
+
+    _append_metric(resp, "datalogger_measure_queue_overruns_total", "counter",
+                   "Measurements dropped with the queue full.");
+    _append(resp, "datalogger_measure_queue_overruns_total %lu\n", measure_queue_overruns());
+    _append_metric(resp, "datalogger_measure_queue_high_water", "gauge",
+                   "Most measurements ever queued at once.");
+    _append(resp, "datalogger_measure_queue_high_water %lu\n", measure_queue_high_water());
+    _append_metric(resp, "datalogger_flash_log_pages_total", "counter",
+                   "Pages written to the flash log.");
+    _append(resp, "datalogger_flash_log_pages_total %lu\n", flash_log_sequence());
+
+    _append_metric(resp, "datalogger_http_rejected_total", "counter",
+                   "HTTP connections turned away with every slot in use.");
+    _append(resp, "datalogger_http_rejected_total %lu\n", turned_away);
+    _append_metric(resp, "datalogger_http_request_duration_seconds", "summary",
+                   "Time from accepting a connection to the response being acknowledged.");
+    _append(resp, "datalogger_http_request_duration_seconds_sum %llu.%06llu\n",
+            sum_us / 1000000u, sum_us % 1000000u);
+    _append(resp, "datalogger_http_request_duration_seconds_count %lu\n", served);
+    _append_metric(resp, "datalogger_http_request_duration_max_seconds", "gauge",
+                   "Slowest HTTP request since boot.");
+    _append(resp, "datalogger_http_request_duration_max_seconds %lu.%06lu\n",
+            max_us / 1000000u, max_us % 1000000u);
+}
+
+static bool _render_latest(http_response_t *resp)
+{
+    if (!has_latest)
+    {
+        _append(resp, "{\"error\":\"no measurement yet\"}\n");
+        return false;
+    }
+
+    // null until the clock is set
+    if (rtc_time_valid())
+    {
+        _append(resp, "{\"time\":%lu,", get_unix_time_at(latest.time));
+    }
+    else
+    {
+        _append(resp, "{\"time\":null,");
+    }
+    _append(resp, "\"age_s\":%lld,\"readings\":[",
+            absolute_time_diff_us(latest.time, get_absolute_time()) / 1000000);
+    for (uint8_t i = 0; i < sensors_channel_count(); i++)
+    {
+        const sensor_channel_t *ch = sensors_channel(i);
+        _append(resp, "%s{\"channel\":\"%s\",\"unit\":\"%s\",\"value\":", i > 0 ? "," : "",
+                ch->name, ch->unit);
+        _append_fixed(resp, latest.values[i], ch->scale);
+        _append(resp, "}");
+    }
+    _append(resp, "]}\n");
+    return true;
+}
@@ -0,0 +1,49 @@
+#include "hw_config.h"
+
+// SD card on SPI0, using the default SPI0 pins
+#define SD_MISO_PIN 16u
+#define SD_CS_PIN 17u
+#define SD_SCK_PIN 18u
+#define SD_MOSI_PIN 19u
+
+// the SPI buses used by the FatFS driver. Its DMA completion interrupt stays
+// on DMA_IRQ_0, as the ADC capture uses DMA_IRQ_1.
+static spi_t spis[] = {
+    {
+        .hw_inst = spi0,
+        .miso_gpio = SD_MISO_PIN,
+        .mosi_gpio = SD_MOSI_PIN,
+        .sck_gpio = SD_SCK_PIN,
+        .baud_rate = 12500 * 1000, // 12.5MHz
+    },
+};
+
+// the SD cards used by the FatFS driver
+static sd_card_t sd_cards[] = {
+    {
+        .pcName = "0:",
+        .spi = &spis[0],
+        .ss_gpio = SD_CS_PIN,
+        .use_card_detect = false,
+    },
+};
+
+size_t sd_get_num(void)
+{
+    return count_of(sd_cards);
+}
+
+sd_card_t *sd_get_by_num(size_t num)
+{
+    return num < sd_get_num() ? &sd_cards[num] : NULL;
+}
+
+size_t spi_get_num(void)
+{
+    return count_of(spis);
+}
+
+spi_t *spi_get_by_num(size_t num)
+{
+    return num < spi_get_num() ? &spis[num] : NULL;
+}
@@ -1,9 +1,16 @@
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "logging.h"
+#include "bench.h"
+#include "time_sync.h"
 
-// the strings corresponding to LogLevel
+#include "hardware/sync.h"
+
+#ifndef DATALOGGER_LOG_TOKENIZED
+// the strings corresponding to LogLevel, also in `tools/src/detokenize.c`
 static const char *log_level_str[] = {
     "ERROR",
     "WARN",
@@ -11,7 +18,7 @@ static const char *log_level_str[] = {
     "DEBUG",
 };
 
-// the strings corresponding to LogCategory
+// the strings corresponding to LogCategory, also in `tools/src/detokenize.c`
 static const char *log_category_str[] = {
     "SYSTEM",
     "WIFI",
@@ -20,38 +27,867 @@ static const char *log_category_str[] = {
     "RTC",
     "BUTTON",
     "LED",
+    "STORE",
+    "UPLINK",
+    "HTTP",
 };
+#endif
+
+// a mask with every category set
+#define LOG_ALL_CATEGORIES ((1ul << LOG_CATEGORY_COUNT) - 1u)
+
+// every category starts enabled, at each level which is compiled in
+uint32_t log_category_mask[LOG_LEVEL_COUNT] = {
+    [LOG_ERROR] = LOG_ALL_CATEGORIES,
+    [LOG_WARN] = LOG_WARN <= DATALOGGER_LOG_LEVEL ? LOG_ALL_CATEGORIES : 0,
+    [LOG_INFO] = LOG_INFO <= DATALOGGER_LOG_LEVEL ? LOG_ALL_CATEGORIES : 0,
+    [LOG_DEBUG] = LOG_DEBUG <= DATALOGGER_LOG_LEVEL ? LOG_ALL_CATEGORIES : 0,
+};
+
+#ifdef DATALOGGER_LOG_DEFERRED
+// size of the ring in bytes, must be a power of two
+#define LOG_RING_SIZE 2048u
+
+// messages waiting to be flushed, packed back to back
+static uint8_t log_ring[LOG_RING_SIZE];
+// byte offset of the next record to write, only touched with the lock held
+static uint32_t log_head = 0;
+// byte offset of the next record to flush, only touched with the lock held
+static uint32_t log_tail = 0;
+// number of messages dropped because the ring was full
+static uint32_t log_dropped = 0;
+// number of dropped messages already reported
+static uint32_t log_dropped_reported = 0;
+// guards the ring against both cores and interrupts, `NULL` until initialized
+static spin_lock_t *log_lock = NULL;
+
+/**
+ * Copies a record into the ring, or counts it as dropped if there is no room.
+ * Interrupts are only disabled for the copy.
+ */
+static void _ring_push(const void *data, size_t size);
+
+/**
+ * Prints every record in the ring, oldest first.
+ */
+static void _ring_drain(void);
+
+/**
+ * Copies bytes into the ring at an offset, wrapping around its end.
+ */
+static void _ring_write(uint32_t offset, const void *data, size_t size);
+
+/**
+ * Copies bytes out of the ring at an offset, wrapping around its end.
+ */
+static void _ring_read(uint32_t offset, void *data, size_t size);
+#endif
+
+#ifdef DATALOGGER_LOG_TOKENIZED
+// the largest frame, before it is COBS encoded
+#define LOG_FRAME_SIZE 128u
+// the largest frame once COBS encoded, with its delimiter
+#define LOG_FRAME_ENCODED_SIZE (LOG_FRAME_SIZE + LOG_FRAME_SIZE / 254u + 2u)
+
+/**
+ * Packs a message into a frame. The frame holds the token as 4 bytes, little
+ * endian, the timestamp as a varint, the level and category as one byte, then
+ * each argument. Arguments which don't fit are left out.
+ *
+ * @return Size of the frame
+ */
+static size_t _build_frame(uint8_t *frame, uint64_t time_us, LogLevel lvl,
+                           LogCategory cat, uint32_t token, uint32_t types,
+                           va_list args);
+
+/**
+ * Appends a varint to a frame, 7 bits per byte, low bits first.
+ *
+ * @return The new size of the frame, or `LOG_FRAME_SIZE + 1` if it didn't fit
+ */
+static size_t _put_varint(uint8_t *frame, size_t len, uint64_t value);
+
+/**
+ * COBS encodes a frame and writes it out, followed by a zero delimiter.
+ */
+static void _write_frame(const uint8_t *frame, size_t size);
+#else
+#ifdef DATALOGGER_LOG_DEFERRED
+// bytes of arguments each record can hold, the rest of a message is cut off
+#define LOG_ARG_SIZE 128u
+
+/**
+ * The kinds of argument a conversion specifier consumes
+ */
+typedef enum
+{
+    ARG_NONE,    // `%%`, consumes nothing
+    ARG_INT,     // int, or anything promoted to it
+    ARG_LONG,    // `l` integers
+    ARG_LLONG,   // `ll` integers
+    ARG_SIZE,    // `z` integers
+    ARG_INTMAX,  // `j` integers
+    ARG_PTRDIFF, // `t` integers
+    ARG_DOUBLE,  // floating point, floats are promoted to double
+    ARG_PTR,     // `%p`
+    ARG_STRING,  // `%s`, copied into the record
+    ARG_INVALID, // anything which can't be deferred
+} ArgKind;
+
+// one conversion specifier in a format string
+typedef struct
+{
+    const char *start; // the '%'
+    const char *end;   // one past the conversion character
+    uint8_t stars;     // `*` widths and precisions, each takes an int first
+    ArgKind kind;      // the kind of the converted argument
+} log_spec_t;
+
+// a message waiting to be formatted, stored in the ring without unused `args`
+typedef struct
+{
+    uint64_t time_us;           // when the message was logged
+    const char *fmt;            // must outlive the record, i.e. a literal
+    uint8_t level;              // the `LogLevel`
+    uint8_t category;           // the `LogCategory`
+    uint8_t length;             // bytes of `args` used
+    bool truncated;             // whether some arguments didn't fit
+    uint8_t args[LOG_ARG_SIZE]; // the raw arguments, in order
+} log_record_t;
+
+/**
+ * Finds the next conversion specifier in a format string.
+ *
+ * @param fmt The rest of the format string
+ * @param spec Filled in with the specifier found
+ *
+ * @return `true` if a specifier was found, `false` at the end of the string
+ */
+static bool _next_spec(const char *fmt, log_spec_t *spec);
+
+/**
+ * Copies the arguments of a message into a record, as raw values.
+ */
+static void _encode(log_record_t *rec, va_list args);
+
+/**
+ * Formats a record, converting each argument with its original specifier.
+ *
+ * @return Number of characters written
+ */
+static size_t _decode(const log_record_t *rec, char *buffer, size_t size);
+
+/**
+ * Appends one raw value to a record.
+ *
+ * @return `true` if it fit, `false` otherwise
+ */
+static bool _put(log_record_t *rec, const void *value, size_t size);
+#endif
+
+/**
+ * Formats the timestamp and metadata which start every message.
+ *
+ * @return Number of characters written
+ */
+static size_t _format_header(char *buffer, size_t size, uint64_t time_us,
+                             LogLevel lvl, LogCategory cat);
+
+/**
+ * Formats and prints a message immediately.
+ */
+static void _print(LogLevel lvl, LogCategory cat, uint64_t time_us,
+                   const char *fmt, va_list args);
+#endif
+
+void init_logging(void)
+{
+#ifdef DATALOGGER_LOG_DEFERRED
+    log_lock = spin_lock_init(spin_lock_claim_unused(true));
+#endif
+}
+
+void log_set_level(LogCategory cat, LogLevel lvl)
+{
+    for (uint8_t i = 0; i < LOG_LEVEL_COUNT; i++)
+    {
+        if (i <= lvl && i <= DATALOGGER_LOG_LEVEL)
+        {
+            log_category_mask[i] |= 1ul << cat;
+        }
+        else
+        {
+            log_category_mask[i] &= ~(1ul << cat);
+        }
+    }
+}
 
-// the current log level to print
-static const LogLevel log_level = LOG_INFO;
+#ifdef DATALOGGER_LOG_TOKENIZED
+void log_tokenized(LogLevel lvl, LogCategory cat, uint32_t token, uint32_t types, ...)
+{
+    // prefixed with its size, for the ring
+    uint8_t frame[1u + LOG_FRAME_SIZE];
+    va_list args;
+    va_start(args, types);
+    frame[0] = (uint8_t)_build_frame(&frame[1], time_us_64(), lvl, cat,
+                                     token, types, args);
+    va_end(args);
 
-void log_message(LogLevel lvl, LogCategory cat, const char *fmt, ...)
+#ifdef DATALOGGER_LOG_DEFERRED
+    // sent straight away until the ring is set up
+    if (log_lock != NULL)
+    {
+        _ring_push(frame, 1u + frame[0]);
+        return;
+    }
+#endif
+    _write_frame(&frame[1], frame[0]);
+}
+#else
+void log_write(LogLevel lvl, LogCategory cat, const char *fmt, ...)
 {
-    // don't print anything if below the current log level
-    if (lvl > log_level) {
+    va_list args;
+    va_start(args, fmt);
+#ifdef DATALOGGER_LOG_DEFERRED
+    // printed straight away until the ring is set up
+    if (log_lock != NULL)
+    {
+        log_record_t rec = {
+            .time_us = time_us_64(),
+            .fmt = fmt,
+            .level = (uint8_t)lvl,
+            .category = (uint8_t)cat,
+        };
+        _encode(&rec, args);
+        va_end(args);
+        _ring_push(&rec, offsetof(log_record_t, args) + rec.length);
         return;
     }
+#endif
+    _print(lvl, cat, to_us_since_boot(get_absolute_time()), fmt, args);
+    va_end(args);
+}
+#endif
+
+void log_flush(void)
+{
+#ifdef DATALOGGER_LOG_DEFERRED
+    if (log_lock == NULL)
+    {
+        return;
+    }
+    _ring_drain();
+
+    // report anything dropped, now that there is room for the report
+    uint32_t save = spin_lock_blocking(log_lock);
+    uint32_t dropped = log_dropped - log_dropped_reported;
+    log_dropped_reported = log_dropped;
+    spin_unlock(log_lock, save);
+    if (dropped > 0)
+    {
+        log_message(LOG_WARN, LOG_SYSTEM, "%lu log messages dropped (%lu total)",
+                    dropped, log_dropped_reported);
+        _ring_drain();
+    }
+#endif
+}
+
+#ifdef DATALOGGER_BENCH
+void logging_benchmark(void)
+{
+    // a typical message, with an integer and a string argument
+    uint32_t start = bench_start();
+    log_message(LOG_INFO, LOG_SYSTEM, "Benchmark message %d of %s", 1, "1");
+    uint32_t cycles = bench_cycles(start);
+
+    // the same message with its category turned off at runtime
+    uint32_t saved = log_category_mask[LOG_INFO];
+    log_set_level(LOG_SYSTEM, LOG_WARN);
+    start = bench_start();
+    log_message(LOG_INFO, LOG_SYSTEM, "Benchmark message %d of %s", 1, "1");
+    uint32_t filtered = bench_cycles(start);
+    log_category_mask[LOG_INFO] = saved;
+
+#if defined(DATALOGGER_LOG_TOKENIZED) && defined(DATALOGGER_LOG_DEFERRED)
+    log_message(LOG_INFO, LOG_SYSTEM, "log_message: %lu cycles (tokenized, deferred), "
+                                      "%lu filtered", cycles, filtered);
+#elif defined(DATALOGGER_LOG_TOKENIZED)
+    log_message(LOG_INFO, LOG_SYSTEM, "log_message: %lu cycles (tokenized), "
+                                      "%lu filtered", cycles, filtered);
+#elif defined(DATALOGGER_LOG_DEFERRED)
+    log_message(LOG_INFO, LOG_SYSTEM, "log_message: %lu cycles (deferred), "
+                                      "%lu filtered", cycles, filtered);
+#else
+    log_message(LOG_INFO, LOG_SYSTEM, "log_message: %lu cycles (synchronous), "
+                                      "%lu filtered", cycles, filtered);
+#endif
+    log_flush();
+}
+#endif
+
+#ifdef DATALOGGER_LOG_DEFERRED
+static void _ring_push(const void *data, size_t size)
+{
+    uint32_t save = spin_lock_blocking(log_lock);
+    if (LOG_RING_SIZE - (log_head - log_tail) < size)
+    {
+        log_dropped++;
+    }
+    else
+    {
+        _ring_write(log_head, data, size);
+        log_head += size;
+    }
+    spin_unlock(log_lock, save);
+}
+
+static void _ring_drain(void)
+{
+    while (true)
+    {
+        // take the oldest record out, so the ring is free while it prints
+#ifdef DATALOGGER_LOG_TOKENIZED
+        uint8_t frame[LOG_FRAME_SIZE];
+        uint8_t size = 0;
+#else
+        log_record_t rec;
+#endif
+        uint32_t save = spin_lock_blocking(log_lock);
+        bool empty = log_head == log_tail;
+        if (!empty)
+        {
+#ifdef DATALOGGER_LOG_TOKENIZED
+            _ring_read(log_tail, &size, 1u);
+            _ring_read(log_tail + 1u, frame, size);
+            log_tail += 1u + size;
+#else
+            _ring_read(log_tail, &rec, offsetof(log_record_t, args));
+            _ring_read(log_tail + offsetof(log_record_t, args), rec.args, rec.length);
+            log_tail += offsetof(log_record_t, args) + rec.length;
+#endif
+        }
+        spin_unlock(log_lock, save);
+        if (empty)
+        {
+            break;
+        }
+
+#ifdef DATALOGGER_LOG_TOKENIZED
+        _write_frame(frame, size);
+#else
+        char buffer[256];
+        size_t len = _format_header(buffer, sizeof(buffer), rec.time_us,
+                                    rec.level, rec.category);
+        _decode(&rec, buffer + len, sizeof(buffer) - len);
+        stdio_puts(buffer);
+#endif
+    }
+}
+
+static void _ring_write(uint32_t offset, const void *data, size_t size)
+{
+    offset %= LOG_RING_SIZE;
+    size_t first = size < LOG_RING_SIZE - offset ? size : LOG_RING_SIZE - offset;
+    memcpy(&log_ring[offset], data, first);
+    memcpy(log_ring, (const uint8_t *)data + first, size - first);
+}
+
+static void _ring_read(uint32_t offset, void *data, size_t size)
+{
+    offset %= LOG_RING_SIZE;
+    size_t first = size < LOG_RING_SIZE - offset ? size : LOG_RING_SIZE - offset;
+    memcpy(data, &log_ring[offset], first);
+    memcpy((uint8_t *)data + first, log_ring, size - first);
+}
+#endif
+
+#ifdef DATALOGGER_LOG_TOKENIZED
+static size_t _build_frame(uint8_t *frame, uint64_t time_us, LogLevel lvl,
+                           LogCategory cat, uint32_t token, uint32_t types,
+                           va_list args)
+{
+    size_t len = 0;
+    for (uint8_t i = 0; i < 4u; i++)
+    {
+        frame[len++] = (uint8_t)(token >> (8u * i));
+    }
+    len = _put_varint(frame, len, time_us);
+    frame[len++] = (uint8_t)((lvl << 4) | cat);
+
+    uint8_t count = types & ((1u << LOG_ARG_COUNT_BITS) - 1u);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        LogArgType type = (types >> (LOG_ARG_COUNT_BITS + i * LOG_ARG_TYPE_BITS)) &
+                          ((1u << LOG_ARG_TYPE_BITS) - 1u);
 
-    // decompose the micros timestamp
-    uint64_t timestamp = to_us_since_boot(get_absolute_time());
-    uint32_t hours = (uint32_t)(timestamp / 3600000000ull);
-    uint8_t minutes = (uint8_t)((timestamp / 60000000ul) % 60);
-    uint8_t seconds = (uint8_t)((timestamp / 1000000ul) % 60);
-    uint16_t millis = (uint32_t)(timestamp % 1000000ul);
+        size_t next = len;
+        switch (type)
+        {
+        case LOG_ARG_INT32:
+        {
+            // zig-zag, so small negative numbers stay short
+            int32_t value = va_arg(args, int);
+            next = _put_varint(frame, len, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+            break;
+        }
+        case LOG_ARG_INT64:
+        {
+            int64_t value = va_arg(args, long long);
+            next = _put_varint(frame, len, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+            break;
+        }
+        case LOG_ARG_DOUBLE:
+        {
+            // single precision is plenty for a log
+            float value = (float)va_arg(args, double);
+            next = len + sizeof(value);
+            if (next <= LOG_FRAME_SIZE)
+            {
+                memcpy(&frame[len], &value, sizeof(value));
+            }
+            break;
+        }
+        case LOG_ARG_STRING:
+        {
+            // the length byte's top bit marks a string which was cut short
+            const char *str = va_arg(args, const char *);
+            if (str == NULL)
+            {
+                str = "(null)";
+            }
+            size_t room = len < LOG_FRAME_SIZE ? LOG_FRAME_SIZE - len - 1u : 0;
+            room = room < 0x7fu ? room : 0x7fu;
+            size_t str_len = 0;
+            while (str_len < room && str[str_len] != '\0')
+            {
+                str_len++;
+            }
+            if (len < LOG_FRAME_SIZE)
+            {
+                frame[len] = (uint8_t)str_len | (str[str_len] != '\0' ? 0x80u : 0);
+                memcpy(&frame[len + 1u], str, str_len);
+                next = len + 1u + str_len;
+            }
+            else
+            {
+                next = LOG_FRAME_SIZE + 1u;
+            }
+            break;
+        }
+        }
+
+        // leave out this argument and the rest
+        if (next > LOG_FRAME_SIZE)
+        {
+            break;
+        }
+        len = next;
+    }
+    return len;
+}
+
+static size_t _put_varint(uint8_t *frame, size_t len, uint64_t value)
+{
+    do
+    {
+        if (len >= LOG_FRAME_SIZE)
+        {
+            return LOG_FRAME_SIZE + 1u;
+        }
+        frame[len++] = (uint8_t)(value & 0x7fu) | (value > 0x7fu ? 0x80u : 0);
+        value >>= 7;
+    } while (value > 0);
+    return len;
+}
+
+static void _write_frame(const uint8_t *frame, size_t size)
+{
+    // each block starts with the offset to the next zero, so the only zero
+    // byte sent is the delimiter
+    uint8_t encoded[LOG_FRAME_ENCODED_SIZE];
+    size_t code_at = 0;
+    size_t len = 1;
+    uint8_t code = 1;
+    for (size_t i = 0; i < size; i++)
+    {
+        if (frame[i] != 0)
+        {
+            encoded[len++] = frame[i];
+            code++;
+        }
+        if (frame[i] == 0 || code == 0xffu)
+        {
+            encoded[code_at] = code;
+            code_at = len++;
+            code = 1;
+        }
+    }
+    encoded[code_at] = code;
+    encoded[len++] = 0;
+
+    stdio_put_string((const char *)encoded, (int)len, false, false);
+}
+#else
+static size_t _format_header(char *buffer, size_t size, uint64_t time_us,
+                             LogLevel lvl, LogCategory cat)
+{
+    // UTC once the clock has been set, read from the cached calendar
+    if (rtc_time_valid())
+    {
+        char stamp[28];
+        format_utc(get_utc_us_at(from_us_since_boot(time_us)), true, &stamp[0], sizeof(stamp));
+        int len = snprintf(buffer, size, "[%s][%5s][%6s] ", stamp, log_level_str[lvl],
+                           log_category_str[cat]);
+        return len < 0 ? 0 : ((size_t)len < size ? (size_t)len : size - 1);
+    }
+
+    // otherwise decompose the micros since boot
+    uint32_t hours = (uint32_t)(time_us / 3600000000ull);
+    uint8_t minutes = (uint8_t)((time_us / 60000000ul) % 60);
+    uint8_t seconds = (uint8_t)((time_us / 1000000ul) % 60);
+    uint32_t micros = (uint32_t)(time_us % 1000000ul);
 
     // format the timestamp and metadata to a string buffer
+    int len = snprintf(buffer, size, "[%lu:%02u:%02u.%06lu][%5s][%6s] ",
+                       (unsigned long)hours, minutes, seconds,
+                       (unsigned long)micros, log_level_str[lvl],
+                       log_category_str[cat]);
+    return len < 0 ? 0 : ((size_t)len < size ? (size_t)len : size - 1);
+}
+
+static void _print(LogLevel lvl, LogCategory cat, uint64_t time_us,
+                   const char *fmt, va_list args)
+{
     char buffer[256];
-    uint8_t len = snprintf(buffer, sizeof(buffer),
-                           "[%u:%02u:%02u.%06u][%5s][%6s] ",
-                           hours, minutes, seconds, millis,
-                           log_level_str[lvl], log_category_str[cat]);
+    size_t len = _format_header(buffer, sizeof(buffer), time_us, lvl, cat);
 
     // append the specified output string
-    va_list args;
-    va_start(args, fmt);
     vsnprintf(buffer + len, sizeof(buffer) - len, fmt, args);
-    va_end(args);
-    
+
     // println the string to the terminal with no extra formatting
     stdio_puts(buffer);
 }
+#endif
+
+#if defined(DATALOGGER_LOG_DEFERRED) && !defined(DATALOGGER_LOG_TOKENIZED)
+static bool _next_spec(const char *fmt, log_spec_t *spec)
+{
+    const char *p = strchr(fmt, '%');
+    if (p == NULL)
+    {
+        return false;
+    }
+    spec->start = p++;
+    spec->stars = 0;
+
+    // skip the flags, width and precision, counting any taken as arguments
+    while (*p != '\0' && strchr("-+ #0", *p) != NULL)
+    {
+        p++;
+    }
+    while (*p == '*' || *p == '.' || (*p >= '0' && *p <= '9'))
+    {
+        spec->stars += *p == '*';
+        p++;
+    }
+
+    // the length modifier, doubled for `hh` and `ll`
+    char length = '\0';
+    bool doubled = false;
+    if (*p != '\0' && strchr("hlzjtL", *p) != NULL)
+    {
+        length = *p++;
+        if ((length == 'h' || length == 'l') && *p == length)
+        {
+            doubled = true;
+            p++;
+        }
+    }
+
+    char conv = *p;
+    spec->end = conv != '\0' ? p + 1 : p;
+    switch (conv)
+    {
+    case '%':
+        spec->kind = ARG_NONE;
+        break;
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'o':
+    case 'c':
+        switch (length)
+        {
+        case '\0':
+        case 'h':
+            spec->kind = ARG_INT;
+            break;
+        case 'l':
+            spec->kind = doubled ? ARG_LLONG : ARG_LONG;
+            break;
+        case 'z':
+            spec->kind = ARG_SIZE;
+            break;
+        case 'j':
+            spec->kind = ARG_INTMAX;
+            break;
+        case 't':
+            spec->kind = ARG_PTRDIFF;
+            break;
+        default:
+            spec->kind = ARG_INVALID;
+            break;
+        }
+        break;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        spec->kind = length == '\0' || length == 'l' ? ARG_DOUBLE : ARG_INVALID;
+        break;
+    case 's':
+        spec->kind = length == '\0' ? ARG_STRING : ARG_INVALID;
+        break;
+    case 'p':
+        spec->kind = ARG_PTR;
+        break;
+    default:
+        spec->kind = ARG_INVALID;
+        break;
+    }
+    return true;
+}
+
+static bool _put(log_record_t *rec, const void *value, size_t size)
+{
+    if (rec->length + size > LOG_ARG_SIZE)
+    {
+        return false;
+    }
+    memcpy(&rec->args[rec->length], value, size);
+    rec->length += (uint8_t)size;
+    return true;
+}
+
+// pulls an argument of the given type off the list and appends it
+#define PUT_ARG(type)                           \
+    {                                           \
+        type value = va_arg(args, type);        \
+        fit = _put(rec, &value, sizeof(value)); \
+    }
+
+static void _encode(log_record_t *rec, va_list args)
+{
+    log_spec_t spec;
+    const char *fmt = rec->fmt;
+    while (_next_spec(fmt, &spec))
+    {
+        fmt = spec.end;
+
+        bool fit = true;
+        for (uint8_t i = 0; i < spec.stars && fit; i++)
+        {
+            PUT_ARG(int);
+        }
+        if (!fit)
+        {
+            rec->truncated = true;
+            return;
+        }
+
+        switch (spec.kind)
+        {
+        case ARG_NONE:
+            break;
+        case ARG_INT:
+            PUT_ARG(int);
+            break;
+        case ARG_LONG:
+            PUT_ARG(long);
+            break;
+        case ARG_LLONG:
+            PUT_ARG(long long);
+            break;
+        case ARG_SIZE:
+            PUT_ARG(size_t);
+            break;
+        case ARG_INTMAX:
+            PUT_ARG(intmax_t);
+            break;
+        case ARG_PTRDIFF:
+            PUT_ARG(ptrdiff_t);
+            break;
+        case ARG_DOUBLE:
+            PUT_ARG(double);
+            break;
+        case ARG_PTR:
+            PUT_ARG(void *);
+            break;
+        case ARG_STRING:
+        {
+            // the string may not outlive the call, so it is copied
+            const char *str = va_arg(args, const char *);
+            if (str == NULL)
+            {
+                str = "(null)";
+            }
+            size_t room = LOG_ARG_SIZE - rec->length;
+            size_t len = 0;
+            while (len < room && str[len] != '\0')
+            {
+                len++;
+            }
+            fit = len < room;
+            if (room > 0)
+            {
+                len = fit ? len : room - 1;
+                memcpy(&rec->args[rec->length], str, len);
+                rec->args[rec->length + len] = '\0';
+                rec->length += (uint8_t)(len + 1);
+            }
+            break;
+        }
+        default:
+            fit = false;
+            break;
+        }
+
+        // nothing after a missing argument can be recovered
+        if (!fit)
+        {
+            rec->truncated = true;
+            return;
+        }
+    }
+}
+
+// takes a value of the given type from the record and converts it
+#define GET_ARG(type)                                                  \
+    {                                                                  \
+        type value;                                                    \
+        memcpy(&value, &rec->args[pos], sizeof(value));                \
+        pos += sizeof(value);                                          \
+        written = snprintf(buffer + len, size - len, spec_buf, value); \
+    }
+
+static size_t _decode(const log_record_t *rec, char *buffer, size_t size)
+{
+    // the size of each kind of argument, as stored
+    static const uint8_t arg_size[] = {
+        [ARG_NONE] = 0,
+        [ARG_INT] = sizeof(int),
+        [ARG_LONG] = sizeof(long),
+        [ARG_LLONG] = sizeof(long long),
+        [ARG_SIZE] = sizeof(size_t),
+        [ARG_INTMAX] = sizeof(intmax_t),
+        [ARG_PTRDIFF] = sizeof(ptrdiff_t),
+        [ARG_DOUBLE] = sizeof(double),
+        [ARG_PTR] = sizeof(void *),
+        [ARG_STRING] = 1u,
+        [ARG_INVALID] = 0,
+    };
+
+    log_spec_t spec;
+    const char *fmt = rec->fmt;
+    size_t len = 0;
+    size_t pos = 0;
+    bool complete = true;
+    while (len < size && _next_spec(fmt, &spec))
+    {
+        // the literal text before the specifier
+        int written = snprintf(buffer + len, size - len, "%.*s",
+                               (int)(spec.start - fmt), fmt);
+        len += written > 0 ? (size_t)written : 0;
+        fmt = spec.end;
+        if (len >= size)
+        {
+            break;
+        }
+
+        // stop at the first argument which didn't fit
+        size_t needed = spec.stars * sizeof(int) + arg_size[spec.kind];
+        if (spec.kind == ARG_INVALID || pos + needed > rec->length)
+        {
+            complete = false;
+            break;
+        }
+
+        // rebuild the specifier, with any `*` replaced by its value
+        char spec_buf[32];
+        size_t spec_len = 0;
+        for (const char *c = spec.start; c < spec.end && spec_len < sizeof(spec_buf) - 12u; c++)
+        {
+            if (*c == '*')
+            {
+                int value;
+                memcpy(&value, &rec->args[pos], sizeof(value));
+                pos += sizeof(value);
+                spec_len += snprintf(&spec_buf[spec_len], sizeof(spec_buf) - spec_len, "%d", value);
+            }
+            else
+            {
+                spec_buf[spec_len++] = *c;
+            }
+        }
+        spec_buf[spec_len] = '\0';
+
+        written = 0;
+        switch (spec.kind)
+        {
+        case ARG_NONE:
+            written = snprintf(buffer + len, size - len, "%%");
+            break;
+        case ARG_INT:
+            GET_ARG(int);
+            break;
+        case ARG_LONG:
+            GET_ARG(long);
+            break;
+        case ARG_LLONG:
+            GET_ARG(long long);
+            break;
+        case ARG_SIZE:
+            GET_ARG(size_t);
+            break;
+        case ARG_INTMAX:
+            GET_ARG(intmax_t);
+            break;
+        case ARG_PTRDIFF:
+            GET_ARG(ptrdiff_t);
+            break;
+        case ARG_DOUBLE:
+            GET_ARG(double);
+            break;
+        case ARG_PTR:
+            GET_ARG(void *);
+            break;
+        case ARG_STRING:
+        {
+            const char *str = (const char *)&rec->args[pos];
+            pos += strlen(str) + 1u;
+            written = snprintf(buffer + len, size - len, spec_buf, str);
+            break;
+        }
+        default:
+            break;
+        }
+        len += written > 0 ? (size_t)written : 0;
+    }
+
+    if (len < size)
+    {
+        // the rest of the literal text, or a marker where it was cut off
+        int written = complete && !rec->truncated
+                          ? snprintf(buffer + len, size - len, "%s", fmt)
+                          : snprintf(buffer + len, size - len, "...");
+        len += written > 0 ? (size_t)written : 0;
+    }
+    return len < size ? len : size - 1;
+}
+#endif
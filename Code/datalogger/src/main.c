@@ -1,72 +1,253 @@
 #include "pico/stdlib.h"
+#include "pico/stdio_usb.h"
+#include "pico/cyw43_arch.h"
 
 #include "wifi_mgr.h"
 #include "time_sync.h"
+#include "time_zone.h"
 #include "sensors.h"
+#include "measure_queue.h"
+#include "backfill.h"
+#include "sd_log.h"
+#include "flash_log.h"
+#include "uplink.h"
+#include "http_server.h"
 #include "logging.h"
 #include "button.h"
 #include "error_mgr.h"
+#include "sched.h"
+#include "bench.h"
+#include "utils.h"
+
+// measurements copied back from the flash log to the card per pass
+static const uint32_t backfill_replay_batch = 32ul;
+
+/**
+ * Logs a measurement to the SD card, if there is one, and the flash log.
+ * The clock must be set, the records are stamped in UTC.
+ *
+ * @param measure Pointer to the measurement to log
+ */
+static void store_measurement(const measurement_t *measure);
 
 int main()
 {
-    // wait up to five seconds for the serial port to open
     stdio_init_all();
-    sleep_ms(5000);
-    log_message(LOG_INFO, LOG_SYSTEM, "Initializing datalogger...");
+    init_logging();
 
     // initialize error indicator state machine
     init_errors(WARNING_INTIALIZING | WARNING_RECALIBRATING);
 
-    // try to connect to WiFi
+    // start connecting to WiFi, which carries on while waiting below
     if (!wifi_init())
     {
+        log_flush();
         return -1;
     }
 
+    // wait up to five seconds for the serial port to open, but only when
+    // powered over USB, as otherwise nothing will open it
+    absolute_time_t usb_timeout = make_timeout_time_ms(5000u);
+    while (cyw43_arch_gpio_get(CYW43_WL_GPIO_VBUS_PIN) && !stdio_usb_connected() &&
+           !is_timed_out(usb_timeout))
+    {
+        wifi_task();
+        sleep_ms(10);
+    }
+    log_message(LOG_INFO, LOG_SYSTEM, "Initializing datalogger... (%lu ms since boot)",
+                to_ms_since_boot(get_absolute_time()));
+
     // try to setup RTC
     if (!rtc_safe_init())
     {
+        log_flush();
         return -1;
     }
 
-    // try to setup NTP
+    // try to setup NTP, which syncs in the background from the main loop
     if (!ntp_init())
     {
+        log_flush();
         return -1;
     }
 
-    // initialize sensors
+    // initialize sensors, measuring right away, before the clock is set
     init_button();
     init_sensors();
 
+    // start logging to the SD card, it's retried later if missing, and to
+    // the on-board flash log, which also queues measurements for the uplink
+    sd_log_init();
+    flash_log_init();
+    uplink_init();
+    http_server_init();
+
+#ifdef DATALOGGER_BENCH
+    // report the cost of the hot paths before entering the main loop
+    bench_init();
+    sensors_benchmark();
+    logging_benchmark();
+    time_sync_benchmark();
+    time_zone_benchmark();
+    sd_log_benchmark();
+#endif
+
+#ifdef DATALOGGER_SENSOR_CORE1
+    // hand the sensors over to core1 for the rest of runtime
+    sensors_launch_core1();
+#endif
+
+    // overruns already reported
+    uint32_t overruns = 0;
+    // whether a measurement has completed yet
+    bool has_measured = false;
+    // when the measurements held until the clock was set started being logged
+    absolute_time_t backfill_start = 0;
+    // held measurements pushed out of RAM into the flash log
+    uint32_t spilled = 0;
+
     while (true)
     {
-        // checks once every ten seconds, blocking if reconnecting
-        if (should_check_wifi())
-            wifi_check_reconnect();
+        // keeps the connection up, reconnecting in the background
+        wifi_task();
 
         // ntp needs wifi, if not synchronized update the ntp routine
-        if (!rtc_synchronized())
-            ntp_request_time();
+        ntp_task();
 
-        if (check_long_press())
-            calibrate_soil();
+#ifndef DATALOGGER_SENSOR_CORE1
+        // reads sensors every few seconds, and handles recalibration
+        sensors_task();
+#endif
 
-        // reads sensors once per minute
-        if (should_update_sensors())
+        // print any measurements which have completed
+        measurement_t measure;
+        while (measure_queue_pop(&measure))
         {
-            // assume the rtc is more or less fine after init
-            char buffer[64];
-            get_pretty_datetime(&buffer[0], sizeof(buffer));
-            log_message(LOG_INFO, LOG_RTC, "Local time: %s", buffer);
+            if (!has_measured)
+            {
+                has_measured = true;
+                log_message(LOG_INFO, LOG_SENSOR, "First measurement %lu ms after boot",
+                            to_ms_since_boot(measure.time));
+            }
+            if (rtc_time_valid())
+            {
+                char buffer[64];
+                get_pretty_datetime(&buffer[0], sizeof(buffer));
+                log_message(LOG_INFO, LOG_RTC, "Local time: %s", buffer);
+            }
+
+            print_readings(&measure);
+            http_server_set_latest(&measure);
 
-            // update the sensors, print readings only if successful
-            if (update_sensors())
+            // held until the clock is set, and behind any still held, so the
+            // logs stay in order. The oldest are pushed out into the flash
+            // log, which stamps them in time since boot until then.
+            if (!rtc_time_valid() || backfill_count() > 0)
             {
-                print_readings();
+                measurement_t oldest;
+                if (backfill_push(&measure, &oldest))
+                {
+                    if (rtc_time_valid())
+                    {
+                        store_measurement(&oldest);
+                    }
+                    else
+                    {
+                        flash_log_write(&oldest);
+                        spilled++;
+                    }
+                }
+            }
+            else
+            {
+                store_measurement(&measure);
             }
         }
 
-        sleep_ms(10);
+        // once the clock is set, log the measurements held until then. Their
+        // times since boot map onto UTC the same as any later ones. As fast as
+        // the flash log takes them, as filling a page while one waits to be
+        // written would drop it.
+        if (rtc_time_valid() && backfill_count() > 0)
+        {
+            if (backfill_start == 0)
+            {
+                backfill_start = get_absolute_time();
+                log_message(LOG_INFO, LOG_STORAGE, "Clock set, logging %lu measurements "
+                                                   "held since boot (%lu more in the flash log)",
+                            backfill_count(), spilled);
+            }
+
+            // those in the flash log are copied to the card first, a batch per
+            // pass, as each sector written to it blocks
+            bool is_replaying = false;
+            if (spilled > 0 && sd_log_ready())
+            {
+                for (uint32_t i = 0; i < backfill_replay_batch; i++)
+                {
+                    is_replaying = flash_log_read_held(&measure);
+                    if (!is_replaying)
+                    {
+                        break;
+                    }
+                    sd_log_write(&measure);
+                }
+            }
+            while (!is_replaying && !flash_log_busy() && backfill_pop(&measure))
+            {
+                store_measurement(&measure);
+            }
+            if (backfill_count() == 0)
+            {
+                log_message(LOG_INFO, LOG_STORAGE, "Held measurements logged in %lu ms",
+                            (uint32_t)(absolute_time_diff_us(backfill_start,
+                                                             get_absolute_time()) / 1000));
+            }
+        }
+
+        // write buffered records to the card once they've waited long enough
+        if (should_flush_sd_log())
+        {
+            sd_log_flush();
+        }
+
+        // write a finished flash log page in a gap between measurements
+        flash_log_task();
+
+        // send batches of logged measurements while the link is up
+        uplink_task();
+
+        // answer any scrapes that have arrived
+        http_server_task();
+
+        // report if the consumer fell behind the sensors
+        if (measure_queue_overruns() != overruns)
+        {
+            overruns = measure_queue_overruns();
+            log_message(LOG_WARN, LOG_SENSOR, "Measurement queue overrun, "
+                                              "%lu dropped (high water %lu)",
+                        overruns, measure_queue_high_water());
+        }
+
+        // carry on with the held measurements once the flash log has room
+        if (rtc_time_valid() && backfill_count() > 0 && !flash_log_busy())
+        {
+            sched_wake();
+        }
+
+        // print anything logged since the last pass
+        log_flush();
+
+        // sleep until a subsystem's deadline, or a callback has work for the loop
+        sched_wait();
+    }
+}
+
+static void store_measurement(const measurement_t *measure)
+{
+    if (sd_log_ready())
+    {
+        sd_log_write(measure);
     }
+    flash_log_write(measure);
 }
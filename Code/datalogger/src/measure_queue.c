@@ -0,0 +1,72 @@
+#include "measure_queue.h"
+
+#include "hardware/sync.h"
+
+// mask to wrap indices into the ring
+#define MEASURE_QUEUE_MASK (MEASURE_QUEUE_SIZE - 1u)
+
+_Static_assert(MEASURE_QUEUE_SIZE > 0 && (MEASURE_QUEUE_SIZE & MEASURE_QUEUE_MASK) == 0,
+               "The measurement queue size must be a power of two");
+
+// the ring of queued measurements
+static measurement_t ring[MEASURE_QUEUE_SIZE];
+// free-running count of pushes, only written by the producer
+static volatile uint32_t head = 0;
+// free-running count of pops, only written by the consumer
+static volatile uint32_t tail = 0;
+// deepest the queue has been, only written by the producer
+static volatile uint32_t high_water = 0;
+// number of measurements dropped, only written by the producer
+static volatile uint32_t overruns = 0;
+
+bool measure_queue_push(const measurement_t *measure)
+{
+    uint32_t depth = head - tail;
+    if (depth >= MEASURE_QUEUE_SIZE)
+    {
+        overruns++;
+        return false;
+    }
+
+    ring[head & MEASURE_QUEUE_MASK] = *measure;
+    // make sure the slot is written before it is published
+    __dmb();
+    head++;
+
+    if (depth + 1u > high_water)
+    {
+        high_water = depth + 1u;
+    }
+    return true;
+}
+
+bool measure_queue_pop(measurement_t *measure)
+{
+    if (tail == head)
+    {
+        return false;
+    }
+
+    // make sure the slot is read after the head was seen to move
+    __dmb();
+    *measure = ring[tail & MEASURE_QUEUE_MASK];
+    // make sure the slot is read before it is handed back
+    __dmb();
+    tail++;
+    return true;
+}
+
+uint32_t measure_queue_depth(void)
+{
+    return head - tail;
+}
+
+uint32_t measure_queue_high_water(void)
+{
+    return high_water;
+}
+
+uint32_t measure_queue_overruns(void)
+{
+    return overruns;
+}
@@ -0,0 +1,234 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "persist.h"
+#include "crc.h"
+#include "logging.h"
+
+#include "pico/flash.h"
+
+// marks a written slot, "DLCF"
+#define PERSIST_MAGIC 0x46434c44ul
+// number of slots in each of a record's sectors
+#define PERSIST_SECTOR_SLOTS (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+// number of slots in each record, across both its sectors
+#define PERSIST_SLOT_COUNT (2u * PERSIST_SECTOR_SLOTS)
+
+// one copy of a record, exactly one flash page
+typedef struct
+{
+    uint32_t magic;    // `PERSIST_MAGIC` once written
+    uint32_t crc;      // CRC-32 of the sequence through the payload
+    uint32_t sequence; // incremented with each save, newest wins
+    uint16_t version;  // layout version of the payload
+    uint16_t length;   // size of the payload
+    uint8_t payload[PERSIST_MAX_SIZE];
+} persist_slot_t;
+
+_Static_assert(sizeof(persist_slot_t) == FLASH_PAGE_SIZE,
+               "Slots must be exactly one flash page");
+_Static_assert(2u * PERSIST_COUNT <= PERSIST_SECTOR_COUNT,
+               "Not enough sectors reserved for every record");
+
+// an erase and/or program to run with both cores paused
+typedef struct
+{
+    uint32_t offset;     // the page to program, in its sector to erase
+    bool erase;          // whether to erase the sector first
+    const uint8_t *data; // a page to program
+} flash_op_t;
+
+// how long to wait for the other core to pause
+static const uint32_t flash_lockout_timeout_ms = 100ul; // 100ms
+
+/**
+ * Returns the offset from the start of flash of the sector holding one of a
+ * record's slots. The first sector of each record comes first, then the
+ * second, so the first sectors are where they were when records had one.
+ */
+static uint32_t _sector_offset(PersistRecord rec, uint8_t index);
+
+/**
+ * Returns a pointer to a slot, through the XIP window.
+ */
+static const persist_slot_t *_slot(PersistRecord rec, uint8_t index);
+
+/**
+ * Computes the CRC of a slot, covering the sequence through the payload.
+ */
+static uint32_t _slot_crc(const persist_slot_t *slot);
+
+/**
+ * Whether a slot holds an intact copy.
+ */
+static bool _slot_valid(const persist_slot_t *slot);
+
+/**
+ * Finds the slot with the newest intact copy of a record.
+ *
+ * @return The slot index, or -1 if there is none
+ */
+static int8_t _find_latest(PersistRecord rec);
+
+/**
+ * Runs a flash operation. Called through `flash_safe_execute()`, with
+ * interrupts disabled and the other core paused.
+ */
+static void _flash_op(void *param);
+
+bool persist_load(PersistRecord rec, uint16_t version, void *data, size_t size)
+{
+    int8_t index = _find_latest(rec);
+    if (index < 0)
+    {
+        log_message(LOG_DEBUG, LOG_SYSTEM, "No saved copy of record %d", rec);
+        return false;
+    }
+
+    const persist_slot_t *slot = _slot(rec, index);
+    if (slot->version != version || slot->length != size)
+    {
+        log_message(LOG_WARN, LOG_SYSTEM, "Saved record %d is version %u, "
+                                          "expected %u",
+                    rec, slot->version, version);
+        return false;
+    }
+
+    memcpy(data, slot->payload, size);
+    log_message(LOG_DEBUG, LOG_SYSTEM, "Loaded record %d from slot %d (seq %lu)",
+                rec, index, slot->sequence);
+    return true;
+}
+
+bool persist_save(PersistRecord rec, uint16_t version, const void *data, size_t size)
+{
+    if (size > PERSIST_MAX_SIZE)
+    {
+        log_message(LOG_ERROR, LOG_SYSTEM, "Record %d too large to save!", rec);
+        return false;
+    }
+
+    // build the new copy in RAM, the rest of the page is left erased
+    static persist_slot_t page;
+    memset(&page, 0xff, sizeof(page));
+    page.magic = PERSIST_MAGIC;
+    page.version = version;
+    page.length = (uint16_t)size;
+    memcpy(page.payload, data, size);
+
+    // the copy goes in the slot after the newest one
+    int8_t latest = _find_latest(rec);
+    uint8_t index = 0;
+    page.sequence = 0;
+    if (latest >= 0)
+    {
+        index = (uint8_t)(latest + 1);
+        page.sequence = _slot(rec, latest)->sequence + 1u;
+    }
+
+    // wrap around to the first sector once the second is full
+    if (index >= PERSIST_SLOT_COUNT)
+    {
+        index = 0;
+    }
+
+    // a used slot means this sector is full, or a save was cut short, so the
+    // copy starts the other sector instead. That one only holds older copies
+    // and can be erased, while the newest is left in this one.
+    bool erase = false;
+    if (_slot(rec, index)->magic != 0xfffffffful)
+    {
+        if (latest >= 0)
+        {
+            index = latest < (int8_t)PERSIST_SECTOR_SLOTS ? PERSIST_SECTOR_SLOTS : 0u;
+        }
+        erase = true;
+    }
+
+    flash_op_t op = {
+        .offset = _sector_offset(rec, index) +
+                  (index % PERSIST_SECTOR_SLOTS) * FLASH_PAGE_SIZE,
+        .erase = erase,
+        .data = (const uint8_t *)&page,
+    };
+    page.crc = _slot_crc(&page);
+
+    int err = flash_safe_execute(_flash_op, &op, flash_lockout_timeout_ms);
+    if (err != PICO_OK)
+    {
+        log_message(LOG_ERROR, LOG_SYSTEM, "Failed to write record %d, error: %d", rec, err);
+        return false;
+    }
+
+    // read back through XIP to make sure it stuck
+    if (!_slot_valid(_slot(rec, index)))
+    {
+        log_message(LOG_ERROR, LOG_SYSTEM, "Record %d failed verification!", rec);
+        return false;
+    }
+    log_message(LOG_INFO, LOG_SYSTEM, "Saved record %d to slot %d (seq %lu)",
+                rec, index, page.sequence);
+    return true;
+}
+
+static uint32_t _sector_offset(PersistRecord rec, uint8_t index)
+{
+    uint32_t sector = (uint32_t)rec;
+    if (index >= PERSIST_SECTOR_SLOTS)
+    {
+        sector += PERSIST_COUNT;
+    }
+    return PERSIST_REGION_OFFSET + sector * FLASH_SECTOR_SIZE;
+}
+
+static const persist_slot_t *_slot(PersistRecord rec, uint8_t index)
+{
+    return (const persist_slot_t *)(XIP_BASE + _sector_offset(rec, index) +
+                                    (index % PERSIST_SECTOR_SLOTS) * FLASH_PAGE_SIZE);
+}
+
+static uint32_t _slot_crc(const persist_slot_t *slot)
+{
+    return crc32(&slot->sequence, offsetof(persist_slot_t, payload) -
+                                      offsetof(persist_slot_t, sequence) +
+                                      slot->length);
+}
+
+static bool _slot_valid(const persist_slot_t *slot)
+{
+    if (slot->magic != PERSIST_MAGIC || slot->length > PERSIST_MAX_SIZE)
+    {
+        return false;
+    }
+    return _slot_crc(slot) == slot->crc;
+}
+
+static int8_t _find_latest(PersistRecord rec)
+{
+    int8_t latest = -1;
+    for (uint8_t i = 0; i < PERSIST_SLOT_COUNT; i++)
+    {
+        const persist_slot_t *slot = _slot(rec, i);
+        if (!_slot_valid(slot))
+        {
+            continue;
+        }
+        // compare as a difference, so the sequence can wrap
+        if (latest < 0 ||
+            (int32_t)(slot->sequence - _slot(rec, latest)->sequence) > 0)
+        {
+            latest = (int8_t)i;
+        }
+    }
+    return latest;
+}
+
+static void _flash_op(void *param)
+{
+    const flash_op_t *op = param;
+    if (op->erase)
+    {
+        flash_range_erase(op->offset & ~(FLASH_SECTOR_SIZE - 1u), FLASH_SECTOR_SIZE);
+    }
+    flash_range_program(op->offset, op->data, FLASH_PAGE_SIZE);
+}
@@ -0,0 +1,288 @@
+#include <string.h>
+
+#include "record.h"
+#include "crc.h"
+
+// bytes in a keyframe before the values
+#define KEYFRAME_HEADER_SIZE 7u
+// longest varint of a 32 bit value
+#define VARINT_MAX_SIZE 5u
+
+/**
+ * Writes a signed value as a zig-zag varint.
+ *
+ * @param out Buffer to write to, with room for `VARINT_MAX_SIZE` bytes
+ * @param value The value to write
+ *
+ * @return Number of bytes written
+ */
+static size_t _put_varint(uint8_t *out, int32_t value);
+
+/**
+ * Reads a zig-zag varint.
+ *
+ * @param data The encoded bytes
+ * @param len Number of bytes available
+ * @param value Set to the value read
+ *
+ * @return Number of bytes read, 0 if the buffer ended first, or
+ * `VARINT_MAX_SIZE + 1` if the varint is too long to be valid
+ */
+static size_t _get_varint(const uint8_t *data, size_t len, int32_t *value);
+
+/**
+ * Decodes a keyframe at the start of a buffer.
+ *
+ * @return `RECORD_OK`, `RECORD_INCOMPLETE` or `RECORD_CORRUPT`, as for
+ * `record_decode()`
+ */
+static RecordResult _decode_keyframe(record_decoder_t *dec, const uint8_t *data,
+                                     size_t len, size_t *used, record_t *rec);
+
+/**
+ * Decodes a delta record at the start of a buffer.
+ *
+ * @return `RECORD_OK`, `RECORD_INCOMPLETE` or `RECORD_CORRUPT`, as for
+ * `record_decode()`
+ */
+static RecordResult _decode_delta(record_decoder_t *dec, const uint8_t *data,
+                                  size_t len, size_t *used, record_t *rec);
+
+void record_encoder_init(record_encoder_t *enc)
+{
+    memset(enc, 0, sizeof(*enc));
+}
+
+size_t record_encode(record_encoder_t *enc, uint32_t timestamp,
+                     const int16_t *values, uint8_t count,
+                     uint8_t *out, size_t size)
+{
+    if (count == 0 || count > RECORD_MAX_CHANNELS)
+    {
+        return 0;
+    }
+
+    // encode into a scratch buffer, so a record that doesn't fit leaves both
+    // the output and the encoder untouched
+    uint8_t record[RECORD_MAX_SIZE];
+    size_t len = 0;
+    bool keyframe = enc->count != count ||
+                    enc->since_keyframe >= RECORD_KEYFRAME_INTERVAL - 1u;
+    if (keyframe)
+    {
+        record[len++] = RECORD_SYNC;
+        record[len++] = RECORD_VERSION;
+        record[len++] = count;
+        for (uint8_t i = 0; i < 4u; i++)
+        {
+            record[len++] = (uint8_t)(timestamp >> (8u * i));
+        }
+        for (uint8_t i = 0; i < count; i++)
+        {
+            len += _put_varint(&record[len], values[i]);
+        }
+        uint32_t crc = crc32(&record[0], len);
+        for (uint8_t i = 0; i < 4u; i++)
+        {
+            record[len++] = (uint8_t)(crc >> (8u * i));
+        }
+    }
+    else
+    {
+        record[len++] = count;
+        len += _put_varint(&record[len], (int32_t)(timestamp - enc->timestamp));
+        for (uint8_t i = 0; i < count; i++)
+        {
+            len += _put_varint(&record[len], (int32_t)values[i] - enc->values[i]);
+        }
+    }
+    if (len > size)
+    {
+        return 0;
+    }
+
+    memcpy(out, &record[0], len);
+    enc->timestamp = timestamp;
+    memcpy(&enc->values[0], values, count * sizeof(values[0]));
+    enc->count = count;
+    enc->since_keyframe = keyframe ? 0 : enc->since_keyframe + 1u;
+    return len;
+}
+
+void record_decoder_init(record_decoder_t *dec)
+{
+    memset(dec, 0, sizeof(*dec));
+}
+
+RecordResult record_decode(record_decoder_t *dec, const uint8_t *data,
+                           size_t len, size_t *used, record_t *rec)
+{
+    *used = 0;
+    if (len == 0)
+    {
+        return RECORD_INCOMPLETE;
+    }
+
+    if (data[0] == RECORD_SYNC)
+    {
+        return _decode_keyframe(dec, data, len, used, rec);
+    }
+    if (dec->synced)
+    {
+        return _decode_delta(dec, data, len, used, rec);
+    }
+
+    // skip ahead to what might be the next keyframe
+    const uint8_t *sync = memchr(data, RECORD_SYNC, len);
+    *used = sync != NULL ? (size_t)(sync - data) : len;
+    return RECORD_CORRUPT;
+}
+
+static RecordResult _decode_keyframe(record_decoder_t *dec, const uint8_t *data,
+                                     size_t len, size_t *used, record_t *rec)
+{
+    if (len < KEYFRAME_HEADER_SIZE)
+    {
+        return RECORD_INCOMPLETE;
+    }
+
+    // a sync byte that isn't a keyframe, skip it and look for the next
+    uint8_t count = data[2];
+    if (data[1] != RECORD_VERSION || count == 0 || count > RECORD_MAX_CHANNELS)
+    {
+        dec->synced = false;
+        *used = 1;
+        return RECORD_CORRUPT;
+    }
+
+    size_t pos = KEYFRAME_HEADER_SIZE;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        int32_t value;
+        size_t n = _get_varint(&data[pos], len - pos, &value);
+        if (n == 0)
+        {
+            return RECORD_INCOMPLETE;
+        }
+        if (n > VARINT_MAX_SIZE || value < INT16_MIN || value > INT16_MAX)
+        {
+            dec->synced = false;
+            *used = 1;
+            return RECORD_CORRUPT;
+        }
+        rec->values[i] = (int16_t)value;
+        pos += n;
+    }
+    if (len - pos < 4u)
+    {
+        return RECORD_INCOMPLETE;
+    }
+
+    uint32_t crc = 0;
+    for (uint8_t i = 0; i < 4u; i++)
+    {
+        crc |= (uint32_t)data[pos + i] << (8u * i);
+    }
+    if (crc != crc32(data, pos))
+    {
+        dec->synced = false;
+        *used = 1;
+        return RECORD_CORRUPT;
+    }
+
+    rec->timestamp = 0;
+    for (uint8_t i = 0; i < 4u; i++)
+    {
+        rec->timestamp |= (uint32_t)data[3u + i] << (8u * i);
+    }
+    rec->count = count;
+    rec->keyframe = true;
+    dec->last = *rec;
+    dec->synced = true;
+    *used = pos + 4u;
+    return RECORD_OK;
+}
+
+static RecordResult _decode_delta(record_decoder_t *dec, const uint8_t *data,
+                                  size_t len, size_t *used, record_t *rec)
+{
+    // the channel count can only change at a keyframe
+    if (data[0] != dec->last.count)
+    {
+        dec->synced = false;
+        *used = 1;
+        return RECORD_CORRUPT;
+    }
+
+    size_t pos = 1;
+    int32_t delta;
+    size_t n = _get_varint(&data[pos], len - pos, &delta);
+    if (n == 0)
+    {
+        return RECORD_INCOMPLETE;
+    }
+    if (n > VARINT_MAX_SIZE)
+    {
+        dec->synced = false;
+        *used = 1;
+        return RECORD_CORRUPT;
+    }
+    rec->timestamp = dec->last.timestamp + (uint32_t)delta;
+    pos += n;
+
+    for (uint8_t i = 0; i < dec->last.count; i++)
+    {
+        n = _get_varint(&data[pos], len - pos, &delta);
+        if (n == 0)
+        {
+            return RECORD_INCOMPLETE;
+        }
+        int64_t value = (int64_t)dec->last.values[i] + delta;
+        if (n > VARINT_MAX_SIZE || value < INT16_MIN || value > INT16_MAX)
+        {
+            dec->synced = false;
+            *used = 1;
+            return RECORD_CORRUPT;
+        }
+        rec->values[i] = (int16_t)value;
+        pos += n;
+    }
+
+    rec->count = dec->last.count;
+    rec->keyframe = false;
+    dec->last = *rec;
+    *used = pos;
+    return RECORD_OK;
+}
+
+static size_t _put_varint(uint8_t *out, int32_t value)
+{
+    uint32_t zigzag = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+    size_t len = 0;
+    while (zigzag >= 0x80u)
+    {
+        out[len++] = (uint8_t)(zigzag | 0x80u);
+        zigzag >>= 7;
+    }
+    out[len++] = (uint8_t)zigzag;
+    return len;
+}
+
+static size_t _get_varint(const uint8_t *data, size_t len, int32_t *value)
+{
+    uint32_t zigzag = 0;
+    for (size_t i = 0; i < VARINT_MAX_SIZE; i++)
+    {
+        if (i >= len)
+        {
+            return 0;
+        }
+        zigzag |= (uint32_t)(data[i] & 0x7fu) << (7u * i);
+        if ((data[i] & 0x80u) == 0)
+        {
+            *value = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1u);
+            return i + 1u;
+        }
+    }
+    return VARINT_MAX_SIZE + 1u;
+}
@@ -0,0 +1,239 @@
+#include <stdio.h>
+
+#include "sched.h"
+#include "utils.h"
+#include "logging.h"
+
+#include "hardware/sync.h"
+
+// how often wake-ups and jitter are reported
+static const uint32_t sched_stats_interval_ms = 3600000ul; // 1hr
+
+// names of the subsystems, for the report
+static const char *const sched_task_names[SCHED_TASK_COUNT] = {
+    "wifi", "ntp", "sensors", "sd", "flash", "uplink",
+};
+
+// subsystems with a deadline, as a binary min-heap on their deadlines
+static SchedTask heap[SCHED_TASK_COUNT];
+static uint8_t heap_size = 0;
+// each subsystem's deadline, and its position in the heap plus one, 0 if
+// it has none
+static absolute_time_t due_at[SCHED_TASK_COUNT];
+static uint8_t heap_slot[SCHED_TASK_COUNT];
+
+// set by `sched_wake()`, cleared as the loop is let go
+static volatile bool is_woken = false;
+
+// counts since the last report
+static absolute_time_t stats_start = 0;
+static absolute_time_t stats_timeout = 0;
+static uint32_t stats_wakes = 0;          // times the loop ran
+static uint32_t stats_deadline_wakes = 0; // of which for a deadline
+static uint32_t stats_idle_wakes = 0;     // other interrupts, back to sleep
+static uint64_t stats_asleep_us = 0;
+static uint32_t stats_late_count = 0;
+static uint64_t stats_late_sum_us = 0;
+static uint32_t stats_late_max_us = 0;
+static uint32_t stats_task_wakes[SCHED_TASK_COUNT];
+
+// the last full hour, as reported
+static uint32_t last_wakes = 0;
+static uint32_t last_late_max_us = 0;
+
+/**
+ * Swaps two heap slots, keeping the positions up to date.
+ */
+static void _heap_swap(uint8_t a, uint8_t b);
+
+/**
+ * Moves a heap slot towards the root until its parent is due first.
+ */
+static void _heap_up(uint8_t i);
+
+/**
+ * Moves a heap slot towards the leaves until both children are due after it.
+ */
+static void _heap_down(uint8_t i);
+
+/**
+ * Whether heap slot a is due before heap slot b.
+ */
+static bool _heap_before(uint8_t a, uint8_t b);
+
+/**
+ * Logs the wake-ups and jitter since the last report, and starts counting
+ * again.
+ */
+static void _log_stats(void);
+
+void sched_at(SchedTask task, absolute_time_t due)
+{
+    due_at[task] = due;
+    if (heap_slot[task] == 0)
+    {
+        heap[heap_size] = task;
+        heap_size++;
+        heap_slot[task] = heap_size;
+    }
+    // earlier or later than before, only one of these moves it
+    _heap_up(heap_slot[task] - 1u);
+    _heap_down(heap_slot[task] - 1u);
+}
+
+void sched_wake(void)
+{
+    is_woken = true;
+    // wakes either core from `__wfe()`
+    __sev();
+}
+
+void sched_wait(void)
+{
+    if (stats_start == 0)
+    {
+        stats_start = get_absolute_time();
+        stats_timeout = make_timeout_time_ms(sched_stats_interval_ms);
+    }
+
+    // an interrupt or `__sev()` between the checks and `__wfe()` leaves the
+    // event flag set, so it can't be missed
+    absolute_time_t start = get_absolute_time();
+    absolute_time_t due = heap_size > 0 ? due_at[heap[0]] : at_the_end_of_time;
+    while (!is_woken && !time_reached(due))
+    {
+        if (!best_effort_wfe_or_timeout(due) && !is_woken && !time_reached(due))
+        {
+            stats_idle_wakes++;
+        }
+    }
+    is_woken = false;
+    absolute_time_t now = get_absolute_time();
+    stats_asleep_us += (uint64_t)absolute_time_diff_us(start, now);
+
+    // deadlines are one-shot, so every one reached is taken off the heap
+    bool is_deadline = false;
+    while (heap_size > 0 && time_reached(due_at[heap[0]]))
+    {
+        SchedTask task = heap[0];
+        uint32_t late_us = (uint32_t)MIN(absolute_time_diff_us(due_at[task], now), UINT32_MAX);
+        stats_late_count++;
+        stats_late_sum_us += late_us;
+        stats_late_max_us = MAX(stats_late_max_us, late_us);
+        stats_task_wakes[task]++;
+        is_deadline = true;
+
+        heap_size--;
+        heap_slot[task] = 0;
+        if (heap_size > 0)
+        {
+            heap[0] = heap[heap_size];
+            heap_slot[heap[0]] = 1u;
+            _heap_down(0);
+        }
+    }
+    stats_wakes++;
+    if (is_deadline)
+    {
+        stats_deadline_wakes++;
+    }
+
+    if (is_timed_out(stats_timeout))
+    {
+        _log_stats();
+    }
+}
+
+uint32_t sched_wakeups_per_hour(void)
+{
+    return last_wakes;
+}
+
+uint32_t sched_jitter_max_us(void)
+{
+    return last_late_max_us;
+}
+
+static void _heap_swap(uint8_t a, uint8_t b)
+{
+    SchedTask task = heap[a];
+    heap[a] = heap[b];
+    heap[b] = task;
+    heap_slot[heap[a]] = a + 1u;
+    heap_slot[heap[b]] = b + 1u;
+}
+
+static void _heap_up(uint8_t i)
+{
+    while (i > 0 && _heap_before(i, (uint8_t)((i - 1u) / 2u)))
+    {
+        _heap_swap(i, (uint8_t)((i - 1u) / 2u));
+        i = (uint8_t)((i - 1u) / 2u);
+    }
+}
+
+static void _heap_down(uint8_t i)
+{
+    while (true)
+    {
+        uint8_t first = i;
+        uint8_t left = (uint8_t)(2u * i + 1u);
+        uint8_t right = (uint8_t)(2u * i + 2u);
+        if (left < heap_size && _heap_before(left, first))
+        {
+            first = left;
+        }
+        if (right < heap_size && _heap_before(right, first))
+        {
+            first = right;
+        }
+        if (first == i)
+        {
+            return;
+        }
+        _heap_swap(i, first);
+        i = first;
+    }
+}
+
+static bool _heap_before(uint8_t a, uint8_t b)
+{
+    return absolute_time_diff_us(due_at[heap[a]], due_at[heap[b]]) > 0;
+}
+
+static void _log_stats(void)
+{
+    absolute_time_t now = get_absolute_time();
+    uint64_t elapsed_us = (uint64_t)MAX(absolute_time_diff_us(stats_start, now), 1);
+
+    // each subsystem's share of the deadlines
+    char tasks[96];
+    size_t len = 0;
+    for (uint8_t i = 0; i < SCHED_TASK_COUNT && len < sizeof(tasks); i++)
+    {
+        len += snprintf(&tasks[len], sizeof(tasks) - len, "%s%s %lu", i > 0 ? ", " : "",
+                        sched_task_names[i], stats_task_wakes[i]);
+        stats_task_wakes[i] = 0;
+    }
+
+    last_wakes = (uint32_t)(stats_wakes * 3600000000ull / elapsed_us);
+    last_late_max_us = stats_late_max_us;
+    log_message(LOG_INFO, LOG_SYSTEM, "Main loop in the last hour: %lu wake-ups (%lu for "
+                                      "deadlines), %lu other interrupts, asleep %lu%%",
+                stats_wakes, stats_deadline_wakes, stats_idle_wakes,
+                (uint32_t)(stats_asleep_us * 100u / elapsed_us));
+    log_message(LOG_INFO, LOG_SYSTEM, "Deadlines met %lu us late on average, at most %lu us "
+                                      "(%s)",
+                stats_late_count > 0 ? (uint32_t)(stats_late_sum_us / stats_late_count) : 0ul,
+                stats_late_max_us, tasks);
+
+    stats_start = now;
+    stats_timeout = make_timeout_time_ms(sched_stats_interval_ms);
+    stats_wakes = 0;
+    stats_deadline_wakes = 0;
+    stats_idle_wakes = 0;
+    stats_asleep_us = 0;
+    stats_late_count = 0;
+    stats_late_sum_us = 0;
+    stats_late_max_us = 0;
+}
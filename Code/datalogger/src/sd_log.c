@@ -0,0 +1,579 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "sd_log.h"
+#include "time_sync.h"
+#include "error_mgr.h"
+#include "logging.h"
+#include "sched.h"
+#include "utils.h"
+#include "record.h"
+#include "block.h"
+#include "bench.h"
+
+#include "hw_config.h"
+#include "f_util.h"
+
+// the card's block size, only whole blocks are written
+#define SD_SECTOR_SIZE 512u
+// blocks held in RAM between writes
+#define SD_BUFFER_SECTORS 4u
+// the longest a CSV line can be
+#define SD_LINE_SIZE 160u
+
+#ifdef DATALOGGER_SD_RECORDS
+// binary records, see `record.h`
+#define SD_FILE_NAME "DL%05u.BIN"
+#define SD_RECORD_SIZE RECORD_MAX_SIZE
+#else
+// a line of CSV per record
+#define SD_FILE_NAME "DL%05u.CSV"
+#define SD_RECORD_SIZE SD_LINE_SIZE
+#endif
+
+// full sectors buffered before they're written
+static const uint8_t sd_flush_sectors = 2u;
+// longest a record waits in RAM before being written
+static const uint32_t sd_flush_interval_ms = 600000ul; // 10min
+// space reserved for each log file, a new file is started once full
+static const FSIZE_t sd_file_size = 1048576ul; // 1MB
+
+// the card in use, from `hw_config.c`
+static sd_card_t *sd = NULL;
+// the open log file
+static FIL file;
+// number of the open log file, as in `DL00001.CSV`
+static uint16_t file_index = 0;
+// flag for whether the card is mounted and the file open
+static bool is_ready = false;
+
+// records waiting to be written, starting at a sector boundary of the file
+static uint8_t buffer[SD_BUFFER_SECTORS * SD_SECTOR_SIZE];
+// bytes used in the buffer
+static size_t buffered = 0;
+// offset of the start of the buffer in the file
+static FSIZE_t file_offset = 0;
+// flag for whether the buffer holds records not yet on the card
+static bool is_dirty = false;
+#ifdef DATALOGGER_SD_RECORDS
+// the last record written, each file starts over with a keyframe
+static record_encoder_t encoder;
+#endif
+
+// tracks when to flush, or to retry the card if it isn't ready
+static absolute_time_t timeout = 0;
+
+/**
+ * Initializes the driver if needed and mounts the card, then opens a new log
+ * file.
+ *
+ * @return `true` if successful, `false` otherwise
+ */
+static bool _mount(void);
+
+/**
+ * Closes the log file and unmounts the card after a failure, so that the next
+ * flush starts over.
+ */
+static void _unmount(void);
+
+/**
+ * Creates the next unused log file and reserves its space, then buffers the
+ * CSV header.
+ *
+ * @return `true` if successful, `false` otherwise
+ */
+static bool _open_file(void);
+
+/**
+ * Flushes and trims the log file to the data written, then opens the next.
+ *
+ * @return `true` if successful, `false` otherwise
+ */
+static bool _rotate_file(void);
+
+/**
+ * Writes the whole sectors in the buffer to the card, and keeps the rest.
+ *
+ * @param pad Whether to also write the last partial sector, padded with zeros.
+ * It's kept in the buffer and written again when more records arrive.
+ *
+ * @return `true` if successful, `false` otherwise
+ */
+static bool _write_sectors(bool pad);
+
+/**
+ * Appends text to the buffer. The caller makes sure it fits.
+ *
+ * @param text The text to append
+ * @param len Length of the text
+ */
+static void _append(const char *text, size_t len);
+
+/**
+ * Formats a measurement as it's stored on the card.
+ *
+ * @param measure Pointer to the measurement
+ * @param out Buffer for the record
+ * @param size Size of the buffer, `SD_RECORD_SIZE` always fits
+ *
+ * @return Length of the record, 0 if it didn't fit
+ */
+static size_t _format_record(const measurement_t *measure, uint8_t *out, size_t size);
+
+/**
+ * Formats a measurement as a line of CSV, with the RTC time and one column
+ * per channel.
+ *
+ * @param measure Pointer to the measurement
+ * @param out Buffer for the line
+ * @param size Size of the buffer
+ *
+ * @return Length of the line, 0 if it didn't fit
+ */
+static size_t _format_csv(const measurement_t *measure, char *out, size_t size);
+
+/**
+ * Formats a fixed-point channel value with its decimal places, without
+ * floats.
+ *
+ * @param out Buffer to format into
+ * @param size Size of the buffer
+ * @param value The stored value
+ * @param ch Description of the channel
+ *
+ * @return Length of the formatted value, as for `snprintf()`
+ */
+static int _format_value(char *out, size_t size, int16_t value, const sensor_channel_t *ch);
+
+bool sd_log_init(void)
+{
+    log_message(LOG_INFO, LOG_STORAGE, "Mounting SD card...");
+    if (!_mount())
+    {
+        // not fatal, measurements are still printed
+        timeout = make_timeout_time_ms(sd_flush_interval_ms);
+        sched_at(SCHED_SD_LOG, timeout);
+        return false;
+    }
+    return true;
+}
+
+void sd_log_write(const measurement_t *measure)
+{
+    if (!is_ready)
+    {
+        return;
+    }
+
+    // start a new file rather than outgrow the reserved space
+    if (file_offset + buffered + SD_RECORD_SIZE > sd_file_size && !_rotate_file())
+    {
+        return;
+    }
+
+    // make room, this only happens if the last write failed
+    if (buffered + SD_RECORD_SIZE > sizeof(buffer) && !_write_sectors(false))
+    {
+        return;
+    }
+
+    uint8_t record[SD_RECORD_SIZE];
+    size_t len = _format_record(measure, &record[0], sizeof(record));
+    if (len == 0)
+    {
+        log_message(LOG_WARN, LOG_STORAGE, "Record too long, skipped");
+        return;
+    }
+    _append((const char *)&record[0], len);
+
+    // write once enough whole sectors have built up
+    if (buffered >= sd_flush_sectors * SD_SECTOR_SIZE)
+    {
+        _write_sectors(false);
+    }
+}
+
+bool sd_log_ready(void)
+{
+    return is_ready;
+}
+
+bool should_flush_sd_log(void)
+{
+    // either retry the card, or flush records that have waited long enough
+    if (!is_ready || is_dirty)
+    {
+        return is_timed_out(timeout);
+    }
+    return false;
+}
+
+void sd_log_flush(void)
+{
+    if (!is_ready)
+    {
+        if (!_mount())
+        {
+            timeout = make_timeout_time_ms(sd_flush_interval_ms);
+            sched_at(SCHED_SD_LOG, timeout);
+        }
+        return;
+    }
+    _write_sectors(true);
+}
+
+#ifdef DATALOGGER_BENCH
+void sd_log_benchmark(void)
+{
+    // a day of one-minute samples, each channel wandering by a printed digit
+    static const uint16_t samples = 1440u;
+    uint8_t count = sensors_channel_count();
+    measurement_t measure = {0};
+    for (uint8_t i = 0; i < count; i++)
+    {
+        measure.values[i] = (int16_t)(sensors_channel(i)->scale * 20);
+    }
+
+    record_encoder_t enc;
+    record_encoder_init(&enc);
+    // too big for the stack
+    static block_encoder_t block;
+    block_encoder_init(&block);
+    uint32_t seed = 1u;
+    uint32_t record_bytes = 0;
+    uint32_t block_bytes = 0;
+    uint32_t csv_bytes = 0;
+    uint32_t cycles = 0;
+    uint32_t max_cycles = 0;
+    uint32_t block_cycles = 0;
+    uint32_t block_max_cycles = 0;
+    for (uint16_t n = 0; n < samples; n++)
+    {
+        for (uint8_t i = 0; i < count; i++)
+        {
+            const sensor_channel_t *ch = sensors_channel(i);
+            uint16_t step = ch->scale;
+            for (uint8_t d = 0; d < ch->decimals && step >= 10u; d++)
+            {
+                step /= 10u;
+            }
+            seed = seed * 1103515245u + 12345u;
+            measure.values[i] += (int16_t)step * (int16_t)((seed >> 16) % 3u - 1);
+        }
+
+        uint32_t timestamp = 1735689600ul + 60ul * n;
+        uint8_t record[RECORD_MAX_SIZE];
+        uint32_t start = bench_start();
+        size_t len = record_encode(&enc, timestamp, &measure.values[0],
+                                   count, &record[0], sizeof(record));
+        uint32_t elapsed = bench_cycles(start);
+        cycles += elapsed;
+        max_cycles = MAX(max_cycles, elapsed);
+        record_bytes += len;
+
+        // a full block is finished and a new one started, as a sink would
+        start = bench_start();
+        if (!block_append(&block, timestamp, &measure.values[0], count))
+        {
+            block_finish(&block);
+            block_encoder_init(&block);
+            block_append(&block, timestamp, &measure.values[0], count);
+            block_bytes += BLOCK_SIZE;
+        }
+        elapsed = bench_cycles(start);
+        block_cycles += elapsed;
+        block_max_cycles = MAX(block_max_cycles, elapsed);
+
+        char line[SD_LINE_SIZE];
+        csv_bytes += _format_csv(&measure, &line[0], sizeof(line));
+    }
+
+    // count the last block as far as it's filled
+    block_bytes += (block.bits + 7u) / 8u;
+
+    log_message(LOG_INFO, LOG_STORAGE, "Records: %lu.%02lu bytes/sample binary, "
+                                       "%lu.%02lu bytes/sample CSV, "
+                                       "%lu.%02lu bytes/sample blocks",
+                record_bytes / samples, record_bytes * 100u / samples % 100u,
+                csv_bytes / samples, csv_bytes * 100u / samples % 100u,
+                block_bytes / samples, block_bytes * 100u / samples % 100u);
+    log_message(LOG_INFO, LOG_STORAGE, "record_encode: %lu cycles average, %lu max",
+                cycles / samples, max_cycles);
+    log_message(LOG_INFO, LOG_STORAGE, "block_append: %lu cycles average, %lu max "
+                                       "(including block_finish)",
+                block_cycles / samples, block_max_cycles);
+}
+#endif
+
+static bool _mount(void)
+{
+    // the driver sets up the SPI bus and its DMA channels once
+    static bool driver_init = false;
+    if (!driver_init)
+    {
+        if (!sd_init_driver())
+        {
+            log_message(LOG_ERROR, LOG_STORAGE, "SD driver init failed!");
+            set_error(ERROR_SD_FAILED, true);
+            return false;
+        }
+        sd = sd_get_by_num(0);
+        driver_init = true;
+    }
+
+    FRESULT fr = f_mount(&sd->fatfs, sd->pcName, 1);
+    if (fr != FR_OK)
+    {
+        log_message(LOG_ERROR, LOG_STORAGE, "SD mount failed! %s (%d)", FRESULT_str(fr), fr);
+        set_error(ERROR_SD_FAILED, true);
+        return false;
+    }
+
+    if (!_open_file())
+    {
+        f_unmount(sd->pcName);
+        set_error(ERROR_SD_FAILED, true);
+        return false;
+    }
+
+    is_ready = true;
+    set_error(ERROR_SD_FAILED, false);
+    return true;
+}
+
+static void _unmount(void)
+{
+    // the card may be gone, so failures here don't matter
+    f_close(&file);
+    f_unmount(sd->pcName);
+    is_ready = false;
+    buffered = 0;
+    is_dirty = false;
+    set_error(ERROR_SD_FAILED, true);
+    timeout = make_timeout_time_ms(sd_flush_interval_ms);
+    sched_at(SCHED_SD_LOG, timeout);
+}
+
+static bool _open_file(void)
+{
+    // find the first unused file number
+    char name[16];
+    FRESULT fr;
+    do
+    {
+        file_index++;
+        snprintf(&name[0], sizeof(name), SD_FILE_NAME, file_index);
+        fr = f_stat(&name[0], NULL);
+    } while (fr == FR_OK && file_index < 65535u);
+    if (fr != FR_NO_FILE)
+    {
+        log_message(LOG_ERROR, LOG_STORAGE, "No free log file name! %s (%d)", FRESULT_str(fr), fr);
+        return false;
+    }
+
+    fr = f_open(&file, &name[0], FA_CREATE_NEW | FA_WRITE);
+    if (fr != FR_OK)
+    {
+        log_message(LOG_ERROR, LOG_STORAGE, "Couldn't create %s! %s (%d)", name, FRESULT_str(fr), fr);
+        return false;
+    }
+
+    // reserve the whole file up front, so appending never has to allocate
+#if FF_USE_EXPAND
+    fr = f_expand(&file, sd_file_size, 1);
+#else
+    fr = f_lseek(&file, sd_file_size);
+    if (fr == FR_OK && f_size(&file) != sd_file_size)
+    {
+        fr = FR_DENIED;
+    }
+#endif
+    if (fr != FR_OK)
+    {
+        log_message(LOG_ERROR, LOG_STORAGE, "Couldn't reserve space for %s! %s (%d)", name, FRESULT_str(fr), fr);
+        f_close(&file);
+        f_unlink(&name[0]);
+        return false;
+    }
+    log_message(LOG_INFO, LOG_STORAGE, "Logging to %s", name);
+
+    // buffer the column names, they're written along with the first records.
+    // Binary records are fixed-point, so their scale is given too.
+    file_offset = 0;
+    buffered = 0;
+    _append("time", 4);
+    for (uint8_t i = 0; i < sensors_channel_count(); i++)
+    {
+        char column[48];
+        const sensor_channel_t *ch = sensors_channel(i);
+#ifdef DATALOGGER_SD_RECORDS
+        int len = snprintf(&column[0], sizeof(column), ",%s (%s)/%u", ch->name, ch->unit, ch->scale);
+#else
+        int len = snprintf(&column[0], sizeof(column), ",%s (%s)", ch->name, ch->unit);
+#endif
+        _append(&column[0], MIN((size_t)len, sizeof(column) - 1));
+    }
+    _append("\r\n", 2);
+#ifdef DATALOGGER_SD_RECORDS
+    record_encoder_init(&encoder);
+#endif
+    return true;
+}
+
+static bool _rotate_file(void)
+{
+    if (!_write_sectors(true))
+    {
+        return false;
+    }
+
+    // trim the unused space and the padding from the end
+    FRESULT fr = f_lseek(&file, file_offset + buffered);
+    if (fr == FR_OK)
+    {
+        fr = f_truncate(&file);
+    }
+    if (fr == FR_OK)
+    {
+        fr = f_close(&file);
+    }
+    if (fr != FR_OK)
+    {
+        log_message(LOG_ERROR, LOG_STORAGE, "Couldn't close log file! %s (%d)", FRESULT_str(fr), fr);
+        _unmount();
+        return false;
+    }
+
+    if (!_open_file())
+    {
+        _unmount();
+        return false;
+    }
+    return true;
+}
+
+static bool _write_sectors(bool pad)
+{
+    size_t whole = buffered / SD_SECTOR_SIZE * SD_SECTOR_SIZE;
+    size_t tail = buffered - whole;
+    size_t len = whole;
+    if (pad && tail > 0)
+    {
+        memset(&buffer[buffered], 0, SD_SECTOR_SIZE - tail);
+        len += SD_SECTOR_SIZE;
+    }
+    if (len == 0)
+    {
+        is_dirty = false;
+        return true;
+    }
+
+    // the first sector pays for waking the card, so time it on its own
+    absolute_time_t start = get_absolute_time();
+    UINT written = 0;
+    FRESULT fr = f_lseek(&file, file_offset);
+    if (fr == FR_OK)
+    {
+        fr = f_write(&file, &buffer[0], SD_SECTOR_SIZE, &written);
+    }
+    absolute_time_t woken = get_absolute_time();
+    if (fr == FR_OK && len > SD_SECTOR_SIZE)
+    {
+        UINT rest = 0;
+        fr = f_write(&file, &buffer[SD_SECTOR_SIZE], len - SD_SECTOR_SIZE, &rest);
+        written += rest;
+    }
+    if (fr == FR_OK)
+    {
+        fr = f_sync(&file);
+    }
+    if (fr == FR_OK && written != len)
+    {
+        fr = FR_DENIED;
+    }
+    if (fr != FR_OK)
+    {
+        log_message(LOG_ERROR, LOG_STORAGE, "SD write failed! %s (%d)", FRESULT_str(fr), fr);
+        _unmount();
+        return false;
+    }
+
+    int64_t total_us = absolute_time_diff_us(start, get_absolute_time());
+    log_message(LOG_DEBUG, LOG_STORAGE, "Wrote %u bytes in %lu us (wake %lu us, %lu kB/s)",
+                len, (uint32_t)total_us, (uint32_t)absolute_time_diff_us(start, woken),
+                (uint32_t)(len * 1000ull / (uint64_t)MAX(total_us, 1)));
+
+    // keep the partial sector, it's written again in full next time
+    file_offset += whole;
+    memmove(&buffer[0], &buffer[whole], tail);
+    buffered = tail;
+    if (pad || tail == 0)
+    {
+        is_dirty = false;
+    }
+    return true;
+}
+
+static void _append(const char *text, size_t len)
+{
+    memcpy(&buffer[buffered], text, len);
+    buffered += len;
+
+    // the first record since a flush starts the clock
+    if (!is_dirty)
+    {
+        is_dirty = true;
+        timeout = make_timeout_time_ms(sd_flush_interval_ms);
+        sched_at(SCHED_SD_LOG, timeout);
+    }
+}
+
+static size_t _format_record(const measurement_t *measure, uint8_t *out, size_t size)
+{
+#ifdef DATALOGGER_SD_RECORDS
+    return record_encode(&encoder, get_unix_time_at(measure->time), &measure->values[0],
+                         sensors_channel_count(), out, size);
+#else
+    return _format_csv(measure, (char *)out, size);
+#endif
+}
+
+static size_t _format_csv(const measurement_t *measure, char *out, size_t size)
+{
+    // timestamp, then one column per channel
+    get_timestamp_at(measure->time, out, size);
+    size_t len = strlen(out);
+    for (uint8_t i = 0; i < sensors_channel_count() && len < size; i++)
+    {
+        out[len++] = ',';
+        len += _format_value(&out[len], size - len, measure->values[i],
+                             sensors_channel(i));
+    }
+    if (len + 2 > size)
+    {
+        return 0;
+    }
+    out[len++] = '\r';
+    out[len++] = '\n';
+    return len;
+}
+
+static int _format_value(char *out, size_t size, int16_t value, const sensor_channel_t *ch)
+{
+    uint32_t pow = 1;
+    for (uint8_t i = 0; i < ch->decimals; i++)
+    {
+        pow *= 10;
+    }
+
+    // round the magnitude to the decimal places, then split it
+    uint32_t magnitude = value < 0 ? -(int32_t)value : value;
+    uint32_t scaled = (magnitude * pow + ch->scale / 2) / ch->scale;
+    const char *sign = value < 0 && scaled > 0 ? "-" : "";
+    if (ch->decimals == 0)
+    {
+        return snprintf(out, size, "%s%lu", sign, scaled);
+    }
+    return snprintf(out, size, "%s%lu.%0*lu", sign, scaled / pow, ch->decimals, scaled % pow);
+}
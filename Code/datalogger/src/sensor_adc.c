@@ -0,0 +1,539 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sensor_driver.h"
+#include "adc_dma.h"
+#include "button.h"
+#include "error_mgr.h"
+#include "logging.h"
+#include "bench.h"
+#include "persist.h"
+
+#include "hardware/adc.h"
+#include "pico/cyw43_arch.h"
+
+// the first ADC input's GPIO, inputs 0-3 map to consecutive pins
+#define ADC_FIRST_PIN 26u
+
+// fractional bits of the soil calibration slope
+#define CAL_SHIFT 24u
+// full scale of moisture readings, in centi-percent
+#define MOISTURE_FULL_SCALE 10000l
+// full scale shifted into the slope format
+#define MOISTURE_FULL_SCALE_Q ((int64_t)MOISTURE_FULL_SCALE << CAL_SHIFT)
+// ADC reference voltage, in microvolts
+#define ADC_VREF_UV 3300000ll
+// the VSYS input is divided by three on the board
+#define VSYS_DIVIDER 3ll
+// conversions averaged for VSYS, read on their own while the CYW43 bus is
+// held, so kept short
+#define VSYS_SAMPLE_COUNT 64u
+
+/**
+ * Enumeration to keep track of the shared ADC scan
+ */
+typedef enum
+{
+    SCAN_IDLE,      // no scan requested
+    SCAN_REQUESTED, // drivers have added inputs, not yet started
+    SCAN_RUNNING,   // DMA filling the sample buffer
+    SCAN_DONE,      // sums available for conversion
+} ScanState;
+
+// to store soil sensor calibration in slope-intercept form, where the
+// intercept is the raw ADC sum which maps to 0%
+typedef struct
+{
+    int32_t slope;  // centi-percent per raw count, Q8.24
+    int32_t origin; // raw ADC sum at 0%
+} calibration_t;
+
+// layout version of the saved calibration, bump whenever it changes
+#define SOIL_CAL_VERSION 1u
+
+// the calibration as saved to flash
+typedef struct
+{
+    uint16_t sample_count; // the `ADC_SAMPLE_COUNT` the sums were taken with
+    uint16_t probe_count;  // the `SOIL_PROBE_COUNT` when calibrated
+    calibration_t probes[SOIL_PROBE_COUNT];
+} soil_cal_record_t;
+
+// configuration shared by every ADC backed driver
+typedef struct
+{
+    uint8_t input; // the ADC input sampled
+    uint8_t index; // the probe number, for soil probes
+} adc_sensor_t;
+
+// the state of the shared scan
+static ScanState scan_state = SCAN_IDLE;
+// the inputs requested for the next scan
+static uint8_t scan_mask = 0;
+// the sums of the last scan, indexed by ADC input. VSYS is summed over
+// `VSYS_SAMPLE_COUNT` conversions rather than `ADC_SAMPLE_COUNT`.
+static uint32_t scan_sums[ADC_INPUT_COUNT];
+
+// number of soil moisture meaurements to average
+static const uint16_t soil_count = ADC_SAMPLE_COUNT;
+// minumum difference between endpoints, as a sum of raw counts
+static const int32_t min_cal_diff = 100l * ADC_SAMPLE_COUNT;
+// the calibration for each soil probe, defaults to the inverted full range
+static calibration_t soil_cal[SOIL_PROBE_COUNT];
+// the threshold for soil to count as dry
+static const int16_t soil_threshold = 1000; // 10%
+// bitmask of the probes currently below the threshold
+static uint8_t dry_mask = 0;
+
+// the channel filled by each soil probe
+static const sensor_channel_t soil_channels[] = {
+    {.name = "Soil moisture 0", .unit = "%", .scale = 100u, .decimals = 1u},
+    {.name = "Soil moisture 1", .unit = "%", .scale = 100u, .decimals = 1u},
+    {.name = "Soil moisture 2", .unit = "%", .scale = 100u, .decimals = 1u},
+};
+// the channel filled by the internal temperature sensor
+static const sensor_channel_t core_temp_channel = {
+    .name = "Core temperature", .unit = "°C", .scale = 100u, .decimals = 1u};
+// the channel filled by the supply voltage
+static const sensor_channel_t vsys_channel = {
+    .name = "VSYS", .unit = "V", .scale = 1000u, .decimals = 2u};
+
+// the configuration of each soil probe
+static const adc_sensor_t soil_sensors[] = {
+    {.input = 0u, .index = 0u},
+    {.input = 1u, .index = 1u},
+    {.input = 2u, .index = 2u},
+};
+// the configuration of the internal temperature sensor
+static const adc_sensor_t core_temp_sensor = {.input = ADC_INPUT_TEMP};
+// the configuration of the supply voltage
+static const adc_sensor_t vsys_sensor = {.input = ADC_INPUT_VSYS};
+
+/**
+ * Sets up the GPIO of an ADC input, if it has one. VSYS is skipped, as its
+ * pin is only switched over while its read holds the CYW43 bus.
+ */
+static void _adc_init(const sensor_driver_t *drv);
+
+/**
+ * Adds the driver's input to the next scan. The scan itself is started by the
+ * first poll, once every driver has added its input.
+ */
+static void _adc_start(const sensor_driver_t *drv);
+
+/**
+ * Starts the shared scan if needed, then checks whether it has finished.
+ */
+static SensorStatus _adc_poll(const sensor_driver_t *drv);
+
+/**
+ * Reads VSYS with a short burst of single conversions. On the Pico W its pin
+ * doubles as the CYW43 SPI clock, so the bus is held for just the burst, and
+ * kept out of the DMA scan, which would hold it for the whole scan.
+ *
+ * @return The sum of `VSYS_SAMPLE_COUNT` raw conversions
+ */
+static uint32_t _read_vsys(void);
+
+/**
+ * Maps a soil probe's sum to moisture, and updates the dry notification.
+ */
+static void _soil_convert(const sensor_driver_t *drv, int16_t *values);
+
+/**
+ * Maps the temperature sensor's sum to centi-degrees, using the datasheet's
+ * 0.706V at 27°C and -1.721mV/°C.
+ */
+static void _core_temp_convert(const sensor_driver_t *drv, int16_t *values);
+
+/**
+ * Maps the VSYS input's sum to millivolts.
+ */
+static void _vsys_convert(const sensor_driver_t *drv, int16_t *values);
+
+/**
+ * Maps a raw ADC sum to moisture using a calibration. Integer only, so it
+ * avoids soft-float on the RP2040.
+ *
+ * @param cal Pointer to the probe's calibration
+ * @param sum The sum of the raw ADC values
+ *
+ * @return The soil moisture in centi-percent, clamped to 0-100%
+ */
+static int16_t _convert_soil(const calibration_t *cal, int32_t sum);
+
+/**
+ * Returns the average voltage of an ADC input over the last scan.
+ *
+ * @return The voltage in microvolts
+ */
+static int32_t _input_microvolts(uint8_t input);
+
+// expands to a driver for one soil probe
+#define SOIL_DRIVER(i)                             \
+    {                                              \
+        .name = "Soil probe " #i,                  \
+        .channels = &soil_channels[i],             \
+        .channel_count = 1u,                       \
+        .error_code = ERROR_NONE,                  \
+        .ctx = &soil_sensors[i],                   \
+        .init = _adc_init,                         \
+        .start = _adc_start,                       \
+        .poll = _adc_poll,                         \
+        .convert = _soil_convert,                  \
+    }
+
+const sensor_driver_t soil_drivers[SOIL_PROBE_COUNT] = {
+    SOIL_DRIVER(0),
+#if SOIL_PROBE_COUNT > 1
+    SOIL_DRIVER(1),
+#endif
+#if SOIL_PROBE_COUNT > 2
+    SOIL_DRIVER(2),
+#endif
+};
+
+_Static_assert(SOIL_PROBE_COUNT >= 1 && SOIL_PROBE_COUNT <= 3,
+               "Soil probes are limited to ADC inputs 0-2");
+
+const sensor_driver_t core_temp_driver = {
+    .name = "Core temperature",
+    .channels = &core_temp_channel,
+    .channel_count = 1u,
+    .error_code = ERROR_NONE,
+    .ctx = &core_temp_sensor,
+    .init = _adc_init,
+    .start = _adc_start,
+    .poll = _adc_poll,
+    .convert = _core_temp_convert,
+};
+
+const sensor_driver_t vsys_driver = {
+    .name = "VSYS",
+    .channels = &vsys_channel,
+    .channel_count = 1u,
+    .error_code = ERROR_NONE,
+    .ctx = &vsys_sensor,
+    .init = _adc_init,
+    .start = _adc_start,
+    .poll = _adc_poll,
+    .convert = _vsys_convert,
+};
+
+void calibrate_soil(void)
+{
+    set_error(WARNING_RECALIBRATING, true);
+
+    // every probe is calibrated from the same pair of scans
+    uint8_t mask = 0;
+    for (uint8_t i = 0; i < SOIL_PROBE_COUNT; i++)
+    {
+        mask |= 1u << soil_sensors[i].input;
+    }
+    uint32_t dry[ADC_INPUT_COUNT];
+    uint32_t wet[ADC_INPUT_COUNT];
+
+    log_message(LOG_INFO, LOG_SENSOR, "Calibrating soil sensors...");
+    bool valid = false;
+    while (!valid)
+    {
+        log_message(LOG_INFO, LOG_SENSOR, "Please wave soil sensors in air and press button");
+        while (!check_press())
+        {
+            log_flush();
+            tight_loop_contents();
+        }
+        adc_dma_read_blocking(mask, dry);
+
+        log_message(LOG_INFO, LOG_SENSOR, "Please place soil sensors in a cup of water");
+        while (!check_press())
+        {
+            log_flush();
+            tight_loop_contents();
+        }
+        adc_dma_read_blocking(mask, wet);
+
+        valid = true;
+        for (uint8_t i = 0; i < SOIL_PROBE_COUNT; i++)
+        {
+            uint8_t input = soil_sensors[i].input;
+            log_message(LOG_DEBUG, LOG_SENSOR, "Probe %u dry reading: %.2f, wet reading: %.2f",
+                        i, (float)dry[input] / soil_count,
+                        (float)wet[input] / soil_count);
+
+            if (abs((int32_t)wet[input] - (int32_t)dry[input]) < min_cal_diff)
+            {
+                log_message(LOG_WARN, LOG_SENSOR, "Probe %u measurements too similar, please try again", i);
+                valid = false;
+            }
+        }
+    }
+
+    for (uint8_t i = 0; i < SOIL_PROBE_COUNT; i++)
+    {
+        uint8_t input = soil_sensors[i].input;
+        // full scale over the raw span, only divides once per calibration
+        soil_cal[i].slope = (int32_t)(MOISTURE_FULL_SCALE_Q /
+                                      ((int32_t)wet[input] - (int32_t)dry[input]));
+        soil_cal[i].origin = (int32_t)dry[input];
+        log_message(LOG_DEBUG, LOG_SENSOR, "Probe %u slope: %ld (Q8.24), origin: %ld",
+                    i, soil_cal[i].slope, soil_cal[i].origin);
+    }
+    log_message(LOG_INFO, LOG_SENSOR, "Soil sensors calibrated");
+
+    // save it so the next boot can skip calibration
+    soil_cal_record_t record = {
+        .sample_count = ADC_SAMPLE_COUNT,
+        .probe_count = SOIL_PROBE_COUNT,
+    };
+    memcpy(record.probes, soil_cal, sizeof(soil_cal));
+    if (!persist_save(PERSIST_SOIL_CAL, SOIL_CAL_VERSION, &record, sizeof(record)))
+    {
+        log_message(LOG_WARN, LOG_SENSOR, "Soil calibration not saved, "
+                                          "will recalibrate on next boot");
+    }
+
+    set_error(WARNING_RECALIBRATING, false);
+}
+
+bool load_soil_calibration(void)
+{
+    soil_cal_record_t record;
+    if (!persist_load(PERSIST_SOIL_CAL, SOIL_CAL_VERSION, &record, sizeof(record)))
+    {
+        log_message(LOG_INFO, LOG_SENSOR, "No saved soil calibration");
+        return false;
+    }
+
+    // sums taken with a different sample count don't map the same way
+    if (record.sample_count != ADC_SAMPLE_COUNT ||
+        record.probe_count != SOIL_PROBE_COUNT)
+    {
+        log_message(LOG_WARN, LOG_SENSOR, "Saved soil calibration doesn't "
+                                          "match this build");
+        return false;
+    }
+
+    memcpy(soil_cal, record.probes, sizeof(soil_cal));
+    log_message(LOG_INFO, LOG_SENSOR, "Loaded saved soil calibration");
+    return true;
+}
+
+static void _adc_init(const sensor_driver_t *drv)
+{
+    const adc_sensor_t *sensor = drv->ctx;
+
+    // the DMA scan is shared by every ADC driver, set it up once
+    static bool scan_ready = false;
+    if (!scan_ready)
+    {
+        adc_dma_init();
+        // default to the inverted full range until calibrated
+        for (uint8_t i = 0; i < SOIL_PROBE_COUNT; i++)
+        {
+            soil_cal[i].slope = (int32_t)(-MOISTURE_FULL_SCALE_Q /
+                                          (4095ll * ADC_SAMPLE_COUNT));
+            soil_cal[i].origin = 4095l * ADC_SAMPLE_COUNT;
+        }
+        scan_ready = true;
+    }
+
+    if (sensor->input < ADC_INPUT_VSYS)
+    {
+        adc_gpio_init(ADC_FIRST_PIN + sensor->input);
+    }
+}
+
+static void _adc_start(const sensor_driver_t *drv)
+{
+    const adc_sensor_t *sensor = drv->ctx;
+
+    // the first driver of a new measurement clears out the last scan
+    if (scan_state != SCAN_REQUESTED)
+    {
+        scan_mask = 0;
+        scan_state = SCAN_REQUESTED;
+    }
+    scan_mask |= 1u << sensor->input;
+}
+
+static SensorStatus _adc_poll(const sensor_driver_t *drv)
+{
+    switch (scan_state)
+    {
+    case SCAN_REQUESTED:
+    {
+        // the ADC is free for single conversions only between scans
+        if (adc_dma_busy())
+        {
+            return SENSOR_PENDING;
+        }
+        uint32_t vsys_sum = 0;
+        if (scan_mask & (1u << ADC_INPUT_VSYS))
+        {
+            vsys_sum = _read_vsys();
+        }
+
+        // the other inputs share one DMA scan
+        uint8_t dma_mask = scan_mask & ~(1u << ADC_INPUT_VSYS);
+        if (dma_mask == 0)
+        {
+            memset(scan_sums, 0, sizeof(scan_sums));
+            scan_sums[ADC_INPUT_VSYS] = vsys_sum;
+            scan_state = SCAN_DONE;
+            return SENSOR_READY;
+        }
+        if (!adc_dma_start(dma_mask))
+        {
+            return SENSOR_PENDING;
+        }
+        scan_sums[ADC_INPUT_VSYS] = vsys_sum;
+        scan_state = SCAN_RUNNING;
+        return SENSOR_PENDING;
+    }
+
+    case SCAN_RUNNING:
+    {
+        // the scan clears every input it didn't cover, VSYS included
+        uint32_t vsys_sum = scan_sums[ADC_INPUT_VSYS];
+        if (!adc_dma_poll(scan_sums))
+        {
+            return SENSOR_PENDING;
+        }
+        scan_sums[ADC_INPUT_VSYS] = vsys_sum;
+        scan_state = SCAN_DONE;
+        return SENSOR_READY;
+    }
+
+    case SCAN_DONE:
+        return SENSOR_READY;
+
+    default:
+        return SENSOR_FAILED;
+    }
+}
+
+static uint32_t _read_vsys(void)
+{
+    cyw43_thread_enter();
+    adc_gpio_init(ADC_FIRST_PIN + ADC_INPUT_VSYS);
+    adc_set_round_robin(0);
+    adc_select_input(ADC_INPUT_VSYS);
+
+    // single conversions, about 2us each
+    uint32_t sum = 0;
+    for (uint16_t i = 0; i < VSYS_SAMPLE_COUNT; i++)
+    {
+        sum += adc_read();
+    }
+    // the FIFO is left enabled for the DMA scan, don't leave these in it
+    adc_fifo_drain();
+
+    // the CYW43 driver reclaims its clock pin on the next transfer
+    cyw43_thread_exit();
+    return sum;
+}
+
+static void _soil_convert(const sensor_driver_t *drv, int16_t *values)
+{
+    const adc_sensor_t *sensor = drv->ctx;
+
+    int16_t value = _convert_soil(&soil_cal[sensor->index],
+                                  (int32_t)scan_sums[sensor->input]);
+    values[0] = value;
+
+    // notify if any of the probes is dry
+    if (value < soil_threshold)
+    {
+        dry_mask |= 1u << sensor->index;
+    }
+    else
+    {
+        dry_mask &= ~(1u << sensor->index);
+    }
+    set_error(NOTIF_SENSOR_THRESHOLD, dry_mask != 0);
+}
+
+static void _core_temp_convert(const sensor_driver_t *drv, int16_t *values)
+{
+    const adc_sensor_t *sensor = drv->ctx;
+
+    int32_t microvolts = _input_microvolts(sensor->input);
+    values[0] = (int16_t)(2700l - (microvolts - 706000l) * 100l / 1721l);
+}
+
+static void _vsys_convert(const sensor_driver_t *drv, int16_t *values)
+{
+    const adc_sensor_t *sensor = drv->ctx;
+
+    int32_t microvolts = (int32_t)((int64_t)scan_sums[sensor->input] * ADC_VREF_UV /
+                                   (4096ll * VSYS_SAMPLE_COUNT));
+    values[0] = (int16_t)(microvolts * VSYS_DIVIDER / 1000l);
+}
+
+static int16_t _convert_soil(const calibration_t *cal, int32_t sum)
+{
+    // 64 bit product, as the span times the slope can exceed 32 bits
+    int32_t value = (int32_t)(((int64_t)(sum - cal->origin) *
+                               cal->slope) >> CAL_SHIFT);
+    if (value > MOISTURE_FULL_SCALE)
+    {
+        value = MOISTURE_FULL_SCALE;
+    }
+    else if (value < 0)
+    {
+        value = 0;
+    }
+    return (int16_t)value;
+}
+
+static int32_t _input_microvolts(uint8_t input)
+{
+    return (int32_t)((int64_t)scan_sums[input] * ADC_VREF_UV /
+                     (4096ll * ADC_SAMPLE_COUNT));
+}
+
+#ifdef DATALOGGER_BENCH
+void sensors_benchmark(void)
+{
+    // inputs and outputs are volatile so the work can't be folded away
+    volatile int32_t sum = 2048l * ADC_SAMPLE_COUNT;
+    volatile int32_t ends[2] = {3000l * ADC_SAMPLE_COUNT, 1200l * ADC_SAMPLE_COUNT};
+    volatile float result_f;
+    volatile int32_t result_i;
+
+    // the previous float conversion: divide, multiply-add and clamp
+    float slope_f = 100.0f / (float)(ends[1] - ends[0]);
+    float intercept_f = -slope_f * (float)ends[0];
+    uint32_t start = bench_start();
+    float value = ((float)sum / soil_count) * slope_f + intercept_f;
+    result_f = value > 100.0f ? 100.0f : (value < 0.0f ? 0.0f : value);
+    uint32_t float_convert = bench_cycles(start);
+
+    // the previous float calibration math
+    start = bench_start();
+    slope_f = 100.0f / (((float)ends[1] - (float)ends[0]) / soil_count);
+    intercept_f = -slope_f * ((float)ends[0] / soil_count);
+    result_f = intercept_f;
+    uint32_t float_cal = bench_cycles(start);
+
+    // the fixed-point conversion
+    start = bench_start();
+    result_i = _convert_soil(&soil_cal[0], sum);
+    uint32_t fixed_convert = bench_cycles(start);
+
+    // the fixed-point calibration math
+    start = bench_start();
+    result_i = (int32_t)(MOISTURE_FULL_SCALE_Q / (ends[1] - ends[0]));
+    uint32_t fixed_cal = bench_cycles(start);
+
+    (void)result_f;
+    (void)result_i;
+    log_message(LOG_INFO, LOG_SENSOR, "Soil conversion: %lu cycles float, "
+                                      "%lu cycles fixed",
+                float_convert, fixed_convert);
+    log_message(LOG_INFO, LOG_SENSOR, "Soil calibration math: %lu cycles float, "
+                                      "%lu cycles fixed",
+                float_cal, fixed_cal);
+}
+#endif
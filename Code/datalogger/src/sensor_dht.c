@@ -0,0 +1,106 @@
+#include "sensor_driver.h"
+#include "utils.h"
+#include "error_mgr.h"
+#include "logging.h"
+
+#include "hardware/dma.h"
+
+#include "dht.h"
+
+#define DHT_MODEL DHT11
+#define DHT_PIN 6u
+
+// how long to give the DHT11 to respond, a full frame takes ~25ms
+static const uint32_t dht_timeout_ms = 50ul; // 50ms
+// when a DHT11 measurement in progress is considered lost
+static absolute_time_t dht_deadline = 0;
+// dht sensor object
+static dht_t dht;
+// the last successful reading
+static float humidity = 0.0f;
+static float temp_celsius = 0.0f;
+
+// the channels filled by the DHT11
+static const sensor_channel_t dht_channels[] = {
+    {.name = "Humidity", .unit = "%", .scale = 100u, .decimals = 0u},
+    {.name = "Temperature", .unit = "°C", .scale = 100u, .decimals = 0u},
+};
+
+/**
+ * Claims a PIO state machine and DMA channel for the DHT11.
+ */
+static void _dht_init(const sensor_driver_t *drv);
+
+/**
+ * Starts a measurement. The PIO program sends the start signal, waits for
+ * acknowledgement, then reads 40 bits of sensor data into a DMA buffer. Ones
+ * and zeroes are determined by pulse length.
+ */
+static void _dht_start(const sensor_driver_t *drv);
+
+/**
+ * Collects the result once the DMA transfer has finished or the deadline has
+ * passed. Verifies the checksum and stores the reading.
+ */
+static SensorStatus _dht_poll(const sensor_driver_t *drv);
+
+/**
+ * Writes humidity and temperature in hundredths.
+ */
+static void _dht_convert(const sensor_driver_t *drv, int16_t *values);
+
+const sensor_driver_t dht11_driver = {
+    .name = "DHT11",
+    .channels = dht_channels,
+    .channel_count = count_of(dht_channels),
+    .error_code = ERROR_DHT11_READ_FAILED,
+    .ctx = NULL,
+    .init = _dht_init,
+    .start = _dht_start,
+    .poll = _dht_poll,
+    .convert = _dht_convert,
+};
+
+static void _dht_init(const sensor_driver_t *drv)
+{
+    dht_init(&dht, DHT_MODEL, pio0, DHT_PIN, false);
+}
+
+static void _dht_start(const sensor_driver_t *drv)
+{
+    dht_start_measurement(&dht);
+    dht_deadline = make_timeout_time_ms(dht_timeout_ms);
+}
+
+static SensorStatus _dht_poll(const sensor_driver_t *drv)
+{
+    // check back on a later pass until the DHT11 has answered
+    if (dma_channel_is_busy(dht.dma_chan) && !is_timed_out(dht_deadline))
+    {
+        return SENSOR_PENDING;
+    }
+
+    // store the result of the dht measurement, doesn't block once ready
+    dht_result_t result = dht_finish_measurement_blocking(&dht, &humidity,
+                                                          &temp_celsius);
+    switch (result)
+    {
+    case DHT_RESULT_OK:
+        log_message(LOG_DEBUG, LOG_SENSOR, "DHT read successful");
+        return SENSOR_READY;
+    case DHT_RESULT_BAD_CHECKSUM:
+        log_message(LOG_DEBUG, LOG_SENSOR, "DHT read failed due to bad checksum");
+        break;
+    case DHT_RESULT_TIMEOUT:
+        log_message(LOG_DEBUG, LOG_SENSOR, "DHT read timed out");
+        break;
+    }
+    return SENSOR_FAILED;
+}
+
+static void _dht_convert(const sensor_driver_t *drv, int16_t *values)
+{
+    // the driver only reports floats, convert once at the edge
+    values[0] = (int16_t)(humidity * 100.0f);
+    values[1] = (int16_t)(temp_celsius * 100.0f);
+}
@@ -1,154 +1,133 @@
-#include <math.h>
 #include <stdio.h>
 
 #include "sensors.h"
+#include "sensor_driver.h"
 #include "utils.h"
 #include "button.h"
 #include "error_mgr.h"
 #include "logging.h"
+#include "measure_queue.h"
+#include "sched.h"
 
-#include "hardware/adc.h"
-#include "hardware/dma.h"
+#include "pico/multicore.h"
+#include "pico/flash.h"
 
-#include "dht.h"
+// the most drivers which can be registered
+#define SENSOR_MAX_DRIVERS 8u
 
-#define DHT_MODEL DHT11
-#define DHT_PIN 6u
-#define SOIL_PIN 26u
-
-// to store temperature and humidity readings
-typedef struct
-{
-    float humidity;
-    float temp_celsius;
-    float soil_moisture;
-} measurement_t;
-
-// to store soil sensor calibration in slope-intercept form
-typedef struct
+/**
+ * Enumeration to keep track of the measurement in progress
+ */
+typedef enum
 {
-    float slope;
-    float intercept;
-} calibration_t;
+    SENSORS_IDLE,    // no measurement in progress
+    SENSORS_POLLING, // drivers started, waiting until none are pending
+} SensorState;
 
 // how long to wait between measurements
-static const uint32_t update_delay_ms = 6000ul; // 1min
+static const uint32_t update_delay_ms = SENSORS_PERIOD_MS; // 6s
 // how long to wait between measurement retries
 static const uint32_t retry_delay_ms = 1000ul; // 1sec
+// how often the drivers are polled while they measure
+static const uint32_t poll_interval_ms = 10ul; // 10ms
+// how many failed attempts before giving up until the next measurement
+static const uint8_t max_attempts = 10u;
 // tracks when to take the next measurement
 static absolute_time_t timeout = 0;
 // number of failed measurement attempts
 static uint8_t attempts = 0;
-// dht sensor object
-static dht_t dht;
-
-// number of soil moisture meaurements to average
-static const uint16_t soil_count = 1000u;
-// minumum difference between endpoints
-static const float min_cal_diff = 100.0f;
-// the calibration for the soil sensor
-static calibration_t soil_cal = {
-    .slope = -1.0f / (1u << 12u),
-    .intercept = (1u << 12u) - 1u,
-};
-// the threshold for soil to count as dry
-static const float soil_threshold = 10.0f;
-
-// stores the last recorded measurement
-static measurement_t prev_measure = {
-    .humidity = -1.0f,
-    .temp_celsius = -1.0f,
-    .soil_moisture = -1.0f,
-};
+// the stage of the measurement in progress
+static SensorState sensor_state = SENSORS_IDLE;
+
+// the registered drivers, in the order their channels appear
+static const sensor_driver_t *registry[SENSOR_MAX_DRIVERS];
+// number of registered drivers
+static uint8_t driver_count = 0;
+// total number of channels across all drivers
+static uint8_t channel_count = 0;
+// the status of each driver in the measurement in progress
+static SensorStatus driver_status[SENSOR_MAX_DRIVERS];
+
 // stores the most recent reading, even if faulty
 static measurement_t measure;
 
 /**
- * Records 100 ADC readings and returns the average.
+ * Handles a failed measurement. Retries after a short delay, unless this was
+ * the last attempt, in which case the driver's error is raised and the
+ * measurement is skipped until the next period.
  *
- * @return The average ADC valus
+ * @param drv The driver which failed
  */
-static float _read_soil(void);
-
-/**
- * Reads from the DHT11. Single bus IO. Sends a start signal, waits for
- * acknowledgement, then reads 40 bits of sensor data. Ones and zeroes
- * determined by pulse length. Verifies checksum, then writes data to the
- * measurement struct.
- *
- * @param measure Pointer to the measurement struct
- *
- * @return `true` if successful, `false` otherwise
- */
-static bool _read_dht(measurement_t *measure);
+static void _handle_failure(const sensor_driver_t *drv);
 
 void init_sensors(void)
 {
-    // set up DHT11
-    dht_init(&dht, DHT_MODEL, pio0, DHT_PIN, false);
-
-    // set up soil moisture sensor
-    gpio_init(SOIL_PIN);
-    adc_init();
-    adc_select_input(0);
+    // the order here is the order of channels in each measurement
+    sensors_register(&dht11_driver);
+    for (uint8_t i = 0; i < SOIL_PROBE_COUNT; i++)
+    {
+        sensors_register(&soil_drivers[i]);
+    }
+    sensors_register(&core_temp_driver);
+    sensors_register(&vsys_driver);
 
-    calibrate_soil();
+    // only wait on the user if there's no usable calibration saved
+    if (!load_soil_calibration())
+    {
+        calibrate_soil();
+    }
+    // take the first measurement straight away, it's held until the clock is set
+    timeout = get_absolute_time();
 }
 
-void calibrate_soil(void)
+bool sensors_register(const sensor_driver_t *drv)
 {
-    set_error(WARNING_RECALIBRATING, true);
-    float endpoints[2] = {0};
-
-    log_message(LOG_INFO, LOG_SENSOR, "Calibrating soil sensor...");
-    bool valid = false;
-    while (!valid)
+    if (driver_count == SENSOR_MAX_DRIVERS ||
+        channel_count + drv->channel_count > SENSOR_MAX_CHANNELS)
     {
-        log_message(LOG_INFO, LOG_SENSOR, "Please wave soil sensor in air and press button");
-        while (!check_press())
-        {
-            tight_loop_contents();
-        }
-
-        endpoints[0] = _read_soil();
-        log_message(LOG_DEBUG, LOG_SENSOR, "Dry reading: %.2f", endpoints[0]);
+        log_message(LOG_ERROR, LOG_SENSOR, "No room to register %s!", drv->name);
+        return false;
+    }
 
-        log_message(LOG_INFO, LOG_SENSOR, "Please place soil sensor in a cup of water");
-        while (!check_press())
-        {
-            tight_loop_contents();
-        }
+    drv->init(drv);
+    registry[driver_count++] = drv;
+    channel_count += drv->channel_count;
+    log_message(LOG_DEBUG, LOG_SENSOR, "Registered %s", drv->name);
+    return true;
+}
 
-        endpoints[1] = _read_soil();
-        log_message(LOG_DEBUG, LOG_SENSOR, "Wet reading: %.2f", endpoints[1]);
+uint8_t sensors_channel_count(void)
+{
+    return channel_count;
+}
 
-        if (fabsf(endpoints[1] - endpoints[0]) < min_cal_diff)
-        {
-            log_message(LOG_WARN, LOG_SENSOR, "Measurements too similar, please try again");
-        }
-        else
+const sensor_channel_t *sensors_channel(uint8_t channel)
+{
+    // walk the drivers to find which one owns the channel
+    for (uint8_t i = 0; i < driver_count; i++)
+    {
+        if (channel < registry[i]->channel_count)
         {
-            valid = true;
+            return &registry[i]->channels[channel];
         }
+        channel -= registry[i]->channel_count;
     }
-
-    soil_cal.slope = 100.0f / (endpoints[1] - endpoints[0]);
-    soil_cal.intercept = -soil_cal.slope * endpoints[0];
-    log_message(LOG_INFO, LOG_SENSOR, "Soil sensor calibrated");
-    log_message(LOG_DEBUG, LOG_SENSOR, "Slope: %.5f, Intercept: %.1f",
-                soil_cal.slope, soil_cal.intercept);
-
-    set_error(WARNING_RECALIBRATING, false);
-
-    timeout = make_timeout_time_ms(update_delay_ms);
+    return NULL;
 }
 
-void print_readings(void)
+void print_readings(const measurement_t *measure)
 {
-    // formats most recent measurement
-    log_message(LOG_INFO, LOG_SENSOR, "Temperature: %.0f°C, Humidity: %.0f%%, "
-                                      "Soil moisture: %.1f%%",
-                measure.temp_celsius, measure.humidity, measure.soil_moisture);
+    // formats each channel, the only place floats are needed
+    char buffer[256];
+    size_t len = 0;
+    for (uint8_t i = 0; i < channel_count && len < sizeof(buffer); i++)
+    {
+        const sensor_channel_t *ch = sensors_channel(i);
+        len += snprintf(&buffer[len], sizeof(buffer) - len, "%s%s: %.*f%s",
+                        i > 0 ? ", " : "", ch->name, ch->decimals,
+                        (float)measure->values[i] / ch->scale, ch->unit);
+    }
+    log_message(LOG_INFO, LOG_SENSOR, "%s", buffer);
 }
 
 bool should_update_sensors(void)
@@ -156,26 +135,68 @@ bool should_update_sensors(void)
     return is_timed_out(timeout);
 }
 
+bool sensors_idle(void)
+{
+    // read across cores when sensors run on core1, a stale answer only delays
+    // the caller's work to its next pass
+    return sensor_state == SENSORS_IDLE && !is_timed_out(timeout);
+}
+
 bool update_sensors(void)
 {
-    // try to read dht11
-    if (!_read_dht(&measure))
+    if (sensor_state == SENSORS_IDLE)
     {
+        // start every driver, they run in the background
+        for (uint8_t i = 0; i < driver_count; i++)
+        {
+            registry[i]->start(registry[i]);
+            driver_status[i] = SENSOR_PENDING;
+        }
+        sensor_state = SENSORS_POLLING;
         return false;
     }
 
-    // read soil moisture level
-    float value = _read_soil() * soil_cal.slope + soil_cal.intercept;
-    if (value > 100.0f)
+    // poll every driver still pending, even after a failure, so that each
+    // has let go of its hardware before the next attempt
+    bool pending = false;
+    const sensor_driver_t *failed = NULL;
+    for (uint8_t i = 0; i < driver_count; i++)
     {
-        value = 100.0f;
+        if (driver_status[i] == SENSOR_PENDING)
+        {
+            driver_status[i] = registry[i]->poll(registry[i]);
+        }
+        pending |= driver_status[i] == SENSOR_PENDING;
+        if (driver_status[i] == SENSOR_FAILED && failed == NULL)
+        {
+            failed = registry[i];
+        }
     }
-    else if (value < 0.0f)
+    // check back on a later pass
+    if (pending)
     {
-        value = 0.0f;
+        return false;
+    }
+    sensor_state = SENSORS_IDLE;
+
+    if (failed != NULL)
+    {
+        _handle_failure(failed);
+        return false;
+    }
+
+    // write each driver's slice of the measurement
+    uint8_t channel = 0;
+    for (uint8_t i = 0; i < driver_count; i++)
+    {
+        registry[i]->convert(registry[i], &measure.values[channel]);
+        channel += registry[i]->channel_count;
+        if (registry[i]->error_code != ERROR_NONE)
+        {
+            set_error(registry[i]->error_code, false);
+        }
     }
-    set_error(NOTIF_SENSOR_THRESHOLD, value < soil_threshold);
-    measure.soil_moisture = value;
+    measure.time = get_absolute_time();
 
     // update timeout after sensor reading
     timeout = make_timeout_time_ms(update_delay_ms);
@@ -183,58 +204,76 @@ bool update_sensors(void)
     return true;
 }
 
-static float _read_soil(void)
+void sensors_task(void)
 {
-    uint32_t sum = 0;
-
-    // discard first reading to avoid incorrect measurements
-    adc_read();
+    // recalibrate on request, handled by whichever core runs the sensors.
+    // The press stays latched until no measurement is holding the ADC.
+    if (sensor_state == SENSORS_IDLE && check_long_press())
+    {
+        calibrate_soil();
+        timeout = make_timeout_time_ms(update_delay_ms);
+    }
 
-    for (uint16_t i = 0; i < soil_count; i++)
+    // reads sensors every few seconds, over several passes
+    if (should_update_sensors() && update_sensors())
     {
-        sleep_us(10);
-        sum += adc_read();
+        measure_queue_push(&measure);
+#ifdef DATALOGGER_SENSOR_CORE1
+        // core0 may be asleep
+        sched_wake();
+#endif
     }
-    return (float)sum / soil_count;
+
+#ifndef DATALOGGER_SENSOR_CORE1
+    // poll the drivers until they're done, then wait for the next measurement
+    sched_at(SCHED_SENSORS, sensor_state == SENSORS_POLLING
+                                ? make_timeout_time_ms(poll_interval_ms)
+                                : timeout);
+#endif
 }
 
-static bool _read_dht(measurement_t *measure)
+#ifdef DATALOGGER_SENSOR_CORE1
+/**
+ * Entry point for core1. Runs the sensors on their own schedule, so blocking
+ * work on core0 can't delay them.
+ */
+static void _core1_main(void)
 {
-    // start the dht measurement
-    dht_start_measurement(&dht);
-    // store the result of the dht measurement
-    dht_result_t result = dht_finish_measurement_blocking(&dht, &measure->humidity, &measure->temp_celsius);
-    // report success if the measurement succeeded
-    if (result == DHT_RESULT_OK)
-    {
-        log_message(LOG_INFO, LOG_SENSOR, "DHT read successful");
-        set_error(ERROR_DHT11_READ_FAILED, false);
-        return true;
-    }
+    // let core0 pause this core while it writes to flash
+    flash_safe_execute_core_init();
 
-    // add a string to a buffer depending on the failure mode
-    char msg[256];
-    switch (result)
+    while (true)
     {
-    case DHT_RESULT_BAD_CHECKSUM:
-        snprintf(&msg[0], sizeof(msg), "DHT read failed due to bad checksum");
-        break;
-    case DHT_RESULT_TIMEOUT:
-        snprintf(&msg[0], sizeof(msg), "DHT read timed out");
-        break;
+        sensors_task();
+        sleep_ms(poll_interval_ms);
     }
+}
+
+void sensors_launch_core1(void)
+{
+    log_message(LOG_INFO, LOG_SENSOR, "Handing sensors over to core1");
+    // let core1 pause this core while it saves a calibration
+    flash_safe_execute_core_init();
+    multicore_launch_core1(_core1_main);
+}
+#endif
+
+static void _handle_failure(const sensor_driver_t *drv)
+{
     // if tenth failure, report an error and try again later
     attempts++;
-    if (attempts == 10u)
+    if (attempts == max_attempts)
     {
-        set_error(ERROR_DHT11_READ_FAILED, true);
-        log_message(LOG_ERROR, LOG_SENSOR, "%s! (%d)", msg, attempts);
+        if (drv->error_code != ERROR_NONE)
+        {
+            set_error(drv->error_code, true);
+        }
+        log_message(LOG_ERROR, LOG_SENSOR, "%s read failed! (%d)", drv->name, attempts);
         timeout = make_timeout_time_ms(update_delay_ms);
         attempts = 0;
-        return false;
+        return;
     }
     // otherwise, report a warning
-    log_message(LOG_WARN, LOG_SENSOR, "%s (%d)", msg, attempts);
+    log_message(LOG_WARN, LOG_SENSOR, "%s read failed (%d)", drv->name, attempts);
     timeout = make_timeout_time_ms(retry_delay_ms);
-    return false;
 }
@@ -2,13 +2,21 @@
 #include <stdarg.h>
 
 #include "time_sync.h"
+#include "time_zone.h"
 #include "utils.h"
 #include "wifi_mgr.h"
 #include "error_mgr.h"
 #include "logging.h"
+#include "sched.h"
 
+#include "pico/cyw43_arch.h"
 #include "pico/util/datetime.h"
 #include "hardware/rtc.h"
+#include "hardware/sync.h"
+
+#ifdef DATALOGGER_BENCH
+#include "bench.h"
+#endif
 
 #include "lwip/udp.h"
 #include "lwip/pbuf.h"
@@ -16,8 +24,7 @@
 
 // NTP server configuration
 #define NTP_PORT 123u
-#define NTP_SERVER "pool.ntp.org"
-#define TIME_ZONE_OFFSET -4l
+#define NTP_SERVER_COUNT 4u
 
 // NTP packet structure (48 bytes)
 typedef struct __attribute__((packed))
@@ -39,6 +46,81 @@ typedef struct __attribute__((packed))
     uint32_t tx_ts_frac;      // Transmit timestamp fraction
 } ntp_packet_t;
 
+// progress of one server through a round of requests
+typedef enum
+{
+    NTP_SERVER_IDLE,      // not part of the current round
+    NTP_SERVER_RESOLVING, // waiting for DNS
+    NTP_SERVER_SENT,      // waiting for its answer
+    NTP_SERVER_ANSWERED,  // answered with a usable sample
+    NTP_SERVER_FAILED,    // no sample this round
+} NtpServerState;
+
+// one of the servers queried together
+typedef struct
+{
+    ip_addr_t addr;          // its resolved address
+    absolute_time_t expires; // when to resolve it again, 0 if not resolved
+    uint8_t misses;          // rounds in a row without a usable answer
+    NtpServerState state;
+    uint32_t tx_sec;         // transmit timestamp sent, echoed by the server
+    uint32_t tx_frac;
+    uint64_t sent_us;        // when the request was sent, since boot
+    uint64_t mid_us;         // halfway through the round trip, since boot
+    int64_t offset_us;       // UTC minus time since boot
+    uint32_t delay_us;       // round trip
+} ntp_server_t;
+
+// an offset measured at one sync, kept to estimate the frequency error
+typedef struct
+{
+    uint64_t mono_us;  // when it was measured, since boot
+    int64_t offset_us; // UTC minus time since boot
+    uint32_t delay_us; // its round trip, which bounds its error
+} clock_sample_t;
+
+// number of past syncs the frequency is estimated from
+#define CLOCK_HISTORY_SIZE 8u
+
+// maps time since boot to UTC, see `get_utc_us_at()`
+typedef struct
+{
+    uint64_t mono_us; // a time since boot
+    int64_t utc_us;   // UTC at that time, in microseconds since 1970
+    int32_t rate_q32; // frequency error, in units of 2^-32
+} time_base_t;
+
+// calendar fields of one second, in UTC or local time
+typedef struct
+{
+    int64_t start_us;   // when the second starts, in microseconds since 1970
+    uint32_t unix_time; // the second, counted as Unix time
+    uint16_t year;
+    uint8_t month;      // 1-12
+    uint8_t day;        // 1-31
+    uint8_t weekday;    // 0-6, from Sunday
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t second;
+} calendar_t;
+
+// names for readable local times
+static const char *const weekday_names[7] = {
+    "Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday",
+};
+static const char *const month_names[12] = {
+    "January", "February", "March", "April", "May", "June",
+    "July", "August", "September", "October", "November", "December",
+};
+
+// queried together, each name resolves to a different member of the pool
+static const char *const ntp_server_names[NTP_SERVER_COUNT] = {
+    "0.pool.ntp.org",
+    "1.pool.ntp.org",
+    "2.pool.ntp.org",
+    "3.pool.ntp.org",
+};
+
 // create and set default date and time
 static const datetime_t t_default = {
     .year = 2025u,
@@ -56,8 +138,27 @@ static const uint16_t rtc_init_timeout_ms = 5000u; // 5sec
 static const uint16_t ntp_timeout_ms = 15000u; // 15sec
 // how long to wait for the first NTP request sent to timeout
 static const uint16_t ntp_init_timeout_ms = 1000u; // 1sec
-// how long to wait before resyncing is needed
-static const uint64_t sync_timeout_ms = 86400000ull; // 24hr
+// shortest and longest wait between syncs, as powers of two seconds
+static const uint8_t min_poll_exponent = 10u; // 17min
+static const uint8_t max_poll_exponent = 17u; // 36hr
+// timestamp error allowed to build up between syncs
+static const uint32_t drift_budget_us = 200000ul; // 200ms
+// an error beyond this means the clock was stepped, not that it drifted
+static const uint32_t clock_step_us = 1000000ul; // 1sec
+// most frequency error believed of a crystal
+static const int32_t max_frequency_ppb = 500000l; // 500ppm
+// span of samples needed before estimating the frequency
+static const uint32_t min_frequency_span_s = 3600ul; // 1hr
+// how often the RTC is stepped back onto the disciplined clock
+static const uint32_t rtc_trim_interval_s = 600ul; // 10min
+// longest round trip accepted, the offset is only known to within half of it
+static const uint32_t ntp_max_delay_us = 250000ul; // 250ms
+// how long to keep using a resolved server address
+static const uint32_t ntp_address_lifetime_ms = 86400000ul; // 24hr
+// rounds in a row a server can miss before its name is resolved again
+static const uint8_t ntp_max_misses = 2u;
+// how far apart two samples can be, beyond their round trips, and still agree
+static const uint32_t ntp_agree_us = 20000ul; // 20ms
 
 // baseline wait between failed NTP requests
 static const uint32_t base_retry_delay_ms = ntp_timeout_ms; // 15sec
@@ -75,18 +176,63 @@ static absolute_time_t sync_timeout = 0;
 
 // whether the RTC has been synced recently
 static bool is_synchronized = false;
+// tracks when the RTC was last synchronized, if it ever was
+static absolute_time_t last_sync = 0;
 // whether the RTC has been synced at least once
 static bool init_flag = false;
 
+// the mapping handed out, and a count which is odd while it's being written
+static time_base_t time_base;
+static volatile uint32_t time_base_seq = 0;
+// the second last looked up, which usually moves on by one at a time, in
+// UTC and in local time. 1970 started on a Thursday.
+static calendar_t calendar = {.year = 1970u, .month = 1u, .day = 1u, .weekday = 4u};
+static calendar_t local_calendar = {.year = 1970u, .month = 1u, .day = 1u, .weekday = 4u};
+static spin_lock_t *calendar_lock = NULL;
+
 // offset between NTP epoch (1900) and the Unix epoch (1970)
 static const uint64_t epoch_conversion = 2208988800ull; // 70yr
 
 // UDP control block
 static struct udp_pcb *ntp_pcb = NULL;
-// NTP server IP address
-static ip_addr_t ntp_server_addr;
-// whether an NTP action is in progress
+// the servers and their samples from the current round
+static ntp_server_t ntp_servers[NTP_SERVER_COUNT];
+// whether a round of requests is in progress
 static bool ntp_request_pending = false;
+// whether the first answer of the round has arrived
+static bool is_collecting = false;
+// when to stop waiting for the rest of the answers
+static absolute_time_t collect_timeout = 0;
+
+// UTC minus time since boot, in microseconds, at `clock_ref_us`
+static int64_t utc_offset_us = 0;
+// when `utc_offset_us` was measured, since boot
+static uint64_t clock_ref_us = 0;
+// how fast UTC runs against time since boot, less one, in parts per billion,
+// positive if the crystal runs slow
+static int32_t clock_frequency_ppb = 0;
+// drift left over at the last sync, after correcting for the frequency
+static int32_t clock_residual_ppb = 0;
+// whether `utc_offset_us` has been measured
+static bool has_utc_offset = false;
+// offsets measured at past syncs, oldest first once full
+static clock_sample_t clock_history[CLOCK_HISTORY_SIZE];
+static uint8_t clock_history_count = 0;
+static uint8_t clock_history_next = 0;
+// current wait between syncs, as a power of two seconds
+static uint8_t poll_exponent = min_poll_exponent;
+
+// the second the RTC is set to, once its boundary comes around
+static int64_t rtc_pending_second = 0;
+static datetime_t rtc_pending_datetime;
+// when to write `rtc_pending_datetime`, at the start of its second
+static absolute_time_t rtc_pending_time = 0;
+// the alarm that writes the RTC, 0 if none is set
+static alarm_id_t rtc_alarm = 0;
+// whether the next RTC write completes a sync
+static bool is_sync_pending = false;
+// how long after its second boundary the RTC was last written
+static uint32_t rtc_write_late_us = 0;
 
 /**
  * Handles any sort of error from the NTP sync routine. Resets the pending flag,
@@ -95,33 +241,183 @@ static bool ntp_request_pending = false;
 static void _ntp_handle_error(const char *fmt, ...);
 
 /**
- * Function to create an NTP request packet, and send it to the resolved IP
- * address via the UDP control block. Handles errors gracefully.
+ * Runs the NTP sync routine, with the lwIP lock held.
+ *
+ * @return `true` if a round of requests was started, `false` otherwise
+ */
+static bool _ntp_poll(void);
+
+/**
+ * Starts a round of requests, one to each server. Servers with a cached
+ * address are sent theirs straight away, the rest are resolved first.
+ *
+ * @return `true` if any request is in progress, `false` otherwise
+ */
+static bool _ntp_start_round(void);
+
+/**
+ * Whether the round is over: every server has answered or failed, or the
+ * answers still missing have had long enough since the first arrived.
+ */
+static bool _ntp_round_done(void);
+
+/**
+ * Ends the round. Counts a miss against each server that didn't answer, to
+ * resolve it again if it keeps missing, and sets the RTC from the best
+ * sample. Handles errors gracefully.
+ */
+static void _ntp_finish_round(void);
+
+/**
+ * Picks the sample to use: the lowest delay among those that agree with at
+ * least half the others, or the lowest delay overall if none do.
+ *
+ * @return Index of the server, or -1 if none answered
+ */
+static int8_t _ntp_select(void);
+
+/**
+ * Takes a sample's offset as the current one, updates the frequency estimate
+ * and poll interval, and schedules the RTC to be set at the next second
+ * boundary.
+ */
+static void _ntp_apply(const ntp_server_t *server);
+
+/**
+ * Adds a sample to the history and estimates the frequency error from it,
+ * as the slope of a least squares fit of offset against time, weighting each
+ * sample by its accuracy. Keeps the old estimate until the samples span long
+ * enough.
+ */
+static void _clock_update_frequency(const ntp_server_t *server);
+
+/**
+ * Widens the poll interval while the clock stays well within the drift
+ * budget between syncs, and narrows it when it doesn't.
+ *
+ * @param error_us How far the last sample was from the prediction
+ */
+static void _clock_update_poll(int64_t error_us);
+
+/**
+ * Schedules the RTC to be written at the start of a UTC second, from the
+ * disciplined clock.
+ *
+ * @param second The second to write, as Unix time
+ * @return `true` if scheduled, `false` if no alarm was free
+ */
+static bool _rtc_schedule(int64_t second);
+
+/**
+ * Function to create an NTP request packet, and send it to a server's
+ * resolved IP address via the UDP control block. Marks the server failed if
+ * it can't be sent.
  *
  * @return `true` if sent successfully, `false` otherwise
  */
-static bool _ntp_send_request(void);
+static bool _ntp_send_request(uint8_t index);
 
 /**
- * Callback function for when an IP address for the NTP server is successfully
- * resolved. Checks that the address is valid, then sends the NTP request.
+ * Callback function for when an IP address for a NTP server is resolved.
+ * Caches the address, then sends that server its request.
  */
 static void _ntp_dns_callback(const char *name, const ip_addr_t *addr,
                               void *arg);
 
 /**
- * Callback function for when a NTP packet is recieved. Tries to set the RTC
- * based on the timestamp. Handles errors gracefully.
+ * Callback function for when a NTP packet is recieved. Checks it answers a
+ * request in flight, and computes that server's clock offset and round trip
+ * delay from all four timestamps.
  */
 static void _ntp_recv_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p,
                                const ip_addr_t *addr, u16_t port);
 
+/**
+ * Alarm callback, run at the start of a UTC second. Writes the RTC, which
+ * restarts its 1Hz divider, so its seconds tick over in step with UTC. Then
+ * repeats at the next trim, so the RTC follows the disciplined clock rather
+ * than drifting with the crystal.
+ */
+static int64_t _rtc_alarm_callback(alarm_id_t id, void *user_data);
+
+/**
+ * Publishes a new mapping from time since boot to UTC. Interrupts are held
+ * off meanwhile, as a reader interrupting the write would spin forever.
+ *
+ * @param mono_us A time since boot
+ * @param utc_us UTC at that time, in microseconds since 1970
+ * @param ppb Frequency error, in parts per billion
+ */
+static void _time_base_set(uint64_t mono_us, int64_t utc_us, int32_t ppb);
+
+/**
+ * Finds the calendar fields of a time. Moving on by a second just increments
+ * the cached fields, only a jump recomputes them from scratch.
+ *
+ * @param cache The cached fields to start from, `calendar` for UTC or
+ * `local_calendar` for local time
+ * @param time_us Microseconds since 1970, in the cache's time
+ * @param out Where to copy the fields
+ * @return Microseconds into the second
+ */
+static uint32_t _calendar_seek(calendar_t *cache, int64_t time_us, calendar_t *out);
+
+/**
+ * Moves cached calendar fields on by one second.
+ */
+static void _calendar_advance(calendar_t *cal);
+
+/**
+ * Computes cached calendar fields from scratch, converting days since 1970
+ * to a civil date without `gmtime()`.
+ */
+static void _calendar_set(calendar_t *cal, int64_t time_us);
+
+/**
+ * Copies a string without its terminator.
+ *
+ * @return Number of characters copied
+ */
+static size_t _put_string(char *out, const char *str);
+
+/**
+ * Writes a number as a fixed count of decimal digits, zero padded.
+ */
+static void _put_digits(char *out, uint32_t value, uint8_t count);
+
+/**
+ * Converts a time since boot to UTC on the disciplined clock, exactly, for
+ * the NTP routine.
+ *
+ * @return Microseconds since the Unix epoch
+ */
+static int64_t _utc_at(uint64_t mono_us);
+
+/**
+ * Converts UTC on the disciplined clock to a time since boot.
+ *
+ * @param utc_us Microseconds since the Unix epoch
+ */
+static absolute_time_t _mono_at(int64_t utc_us);
+
+/**
+ * Converts an NTP timestamp, in host byte order, to microseconds since the
+ * Unix epoch.
+ */
+static int64_t _ntp_to_unix_us(uint32_t sec, uint32_t frac);
+
 bool rtc_safe_init(void)
 {
+    calendar_lock = spin_lock_init(spin_lock_claim_unused(true));
+
     // initialize the RTC
     rtc_init();
     // set the default datetime
     rtc_set_datetime(&t_default);
+    // timestamps count from it until the first sync
+    time_t epoch;
+    datetime_to_time(&t_default, &epoch);
+    _time_base_set(time_us_64(), (int64_t)epoch * 1000000, 0);
     // wait for the RTC to start running
     log_message(LOG_INFO, LOG_RTC, "Initializing RTC...");
     timeout = make_timeout_time_ms(rtc_init_timeout_ms);
@@ -155,23 +451,15 @@ void get_pretty_datetime(char *buffer, size_t buffer_size)
         return;
     }
 
-    // read from the RTC
-    datetime_t t;
-    rtc_get_datetime(&t);
-
-    // convert to epoch time
-    time_t epoch;
-    datetime_to_time(&t, &epoch);
-    // adjust to the local timezone
-    epoch += TIME_ZONE_OFFSET * 3600l;
-    // convert to a standard datetime struct
-    struct tm dt = *gmtime(&epoch);
-
-    // return the pointer to a formatted string
-    strftime(buffer, buffer_size, "%A, %B %d, %Y  %H:%M:%S", &dt);
+    format_local(get_utc_us(), buffer, buffer_size);
 }
 
 void get_timestamp(char *buffer, size_t buffer_size)
+{
+    get_timestamp_at(get_absolute_time(), buffer, buffer_size);
+}
+
+void get_timestamp_at(absolute_time_t time, char *buffer, size_t buffer_size)
 {
     // validate parameters
     if (buffer == NULL || buffer_size < 1)
@@ -188,16 +476,130 @@ void get_timestamp(char *buffer, size_t buffer_size)
         return;
     }
 
-    // read from the RTC
-    datetime_t t;
-    rtc_get_datetime(&t);
+    format_utc(get_utc_us_at(time), false, buffer, buffer_size);
+}
 
-    // convert to a standard datetime format
-    struct tm dt;
-    datetime_to_tm(&t, &dt);
+uint32_t get_unix_time(void)
+{
+    return get_unix_time_at(get_absolute_time());
+}
 
-    // return the pointer to a formatted string
-    strftime(buffer, buffer_size, "%Y-%m-%dT%H:%M:%SZ", &dt);
+uint32_t get_unix_time_at(absolute_time_t time)
+{
+    if (!init_flag)
+    {
+        log_message(LOG_WARN, LOG_RTC, "Tried to read time but RTC not initialized");
+        return 0;
+    }
+
+    calendar_t cal;
+    _calendar_seek(&calendar, get_utc_us_at(time), &cal);
+    return cal.unix_time;
+}
+
+int64_t get_utc_us(void)
+{
+    return get_utc_us_at(get_absolute_time());
+}
+
+int64_t get_utc_us_at(absolute_time_t time)
+{
+    // retry if the base changed while it was copied
+    time_base_t base;
+    uint32_t seq;
+    do
+    {
+        seq = time_base_seq;
+        __dmb();
+        base = time_base;
+        __dmb();
+    } while ((seq & 1u) != 0 || seq != time_base_seq);
+
+    int64_t elapsed_us = (int64_t)(to_us_since_boot(time) - base.mono_us);
+    return base.utc_us + elapsed_us + ((elapsed_us * base.rate_q32) >> 32);
+}
+
+size_t format_utc(int64_t utc_us, bool with_micros, char *buffer, size_t buffer_size)
+{
+    // YYYY-MM-DDTHH:MM:SS[.uuuuuu]Z
+    size_t len = with_micros ? 27u : 20u;
+    if (buffer == NULL || buffer_size <= len)
+    {
+        if (buffer != NULL && buffer_size > 0)
+        {
+            buffer[0] = '\0';
+        }
+        return 0;
+    }
+
+    calendar_t cal;
+    uint32_t micros = _calendar_seek(&calendar, utc_us, &cal);
+    _put_digits(&buffer[0], cal.year, 4);
+    buffer[4] = '-';
+    _put_digits(&buffer[5], cal.month, 2);
+    buffer[7] = '-';
+    _put_digits(&buffer[8], cal.day, 2);
+    buffer[10] = 'T';
+    _put_digits(&buffer[11], cal.hour, 2);
+    buffer[13] = ':';
+    _put_digits(&buffer[14], cal.minute, 2);
+    buffer[16] = ':';
+    _put_digits(&buffer[17], cal.second, 2);
+    if (with_micros)
+    {
+        buffer[19] = '.';
+        _put_digits(&buffer[20], micros, 6);
+    }
+    buffer[len - 1] = 'Z';
+    buffer[len] = '\0';
+    return len;
+}
+
+size_t format_local(int64_t utc_us, char *buffer, size_t buffer_size)
+{
+    if (buffer == NULL || buffer_size < 1)
+    {
+        return 0;
+    }
+    buffer[0] = '\0';
+
+    // adjust to the local timezone, daylight saving time included. The
+    // offset is cached until the next transition, and the local calendar
+    // moves on a second at a time, like the UTC one.
+    const char *abbr;
+    int32_t offset = time_zone_offset((uint32_t)(utc_us / 1000000), &abbr);
+    calendar_t cal;
+    _calendar_seek(&local_calendar, utc_us + (int64_t)offset * 1000000, &cal);
+
+    // e.g. "Thursday, January 01, 2026  00:00:00 EST"
+    const char *weekday = weekday_names[cal.weekday];
+    const char *month = month_names[cal.month - 1u];
+    size_t len = strlen(weekday) + strlen(month) + strlen(abbr) + 22u;
+    if (len >= buffer_size)
+    {
+        return 0;
+    }
+    char *out = buffer;
+    out += _put_string(out, weekday);
+    out += _put_string(out, ", ");
+    out += _put_string(out, month);
+    *out++ = ' ';
+    _put_digits(out, cal.day, 2);
+    out += 2;
+    out += _put_string(out, ", ");
+    _put_digits(out, cal.year, 4);
+    out += 4;
+    out += _put_string(out, "  ");
+    _put_digits(out, cal.hour, 2);
+    out[2] = ':';
+    _put_digits(&out[3], cal.minute, 2);
+    out[5] = ':';
+    _put_digits(&out[6], cal.second, 2);
+    out += 8;
+    *out++ = ' ';
+    out += _put_string(out, abbr);
+    *out = '\0';
+    return len;
 }
 
 bool rtc_synchronized(void)
@@ -210,6 +612,83 @@ bool rtc_synchronized(void)
     return is_synchronized;
 }
 
+bool rtc_time_valid(void)
+{
+    return init_flag;
+}
+
+uint32_t rtc_sync_age(void)
+{
+    if (last_sync == 0)
+    {
+        return UINT32_MAX;
+    }
+    return (uint32_t)(absolute_time_diff_us(last_sync, get_absolute_time()) / 1000000);
+}
+
+int32_t rtc_frequency_error(void)
+{
+    return clock_frequency_ppb;
+}
+
+int32_t rtc_residual_drift(void)
+{
+    return clock_residual_ppb;
+}
+
+uint32_t ntp_poll_interval(void)
+{
+    return 1ul << poll_exponent;
+}
+
+#ifdef DATALOGGER_BENCH
+void time_sync_benchmark(void)
+{
+    char buffer[32];
+
+    // the previous timestamp: read the RTC, convert to Unix time and back
+    uint32_t start = bench_start();
+    datetime_t t;
+    rtc_get_datetime(&t);
+    time_t epoch;
+    datetime_to_time(&t, &epoch);
+    struct tm dt = *gmtime(&epoch);
+    strftime(&buffer[0], sizeof(buffer), "%Y-%m-%dT%H:%M:%SZ", &dt);
+    uint32_t rtc_cycles = bench_cycles(start);
+
+    // the timer and the cached calendar, warmed up by the call before. The
+    // clock may not be set yet, so not through get_timestamp().
+    format_utc(get_utc_us(), false, &buffer[0], sizeof(buffer));
+    start = bench_start();
+    format_utc(get_utc_us(), false, &buffer[0], sizeof(buffer));
+    uint32_t timer_cycles = bench_cycles(start);
+
+    start = bench_start();
+    volatile int64_t utc_us = get_utc_us();
+    uint32_t utc_cycles = bench_cycles(start);
+    (void)utc_us;
+
+    // the previous log header time, split from time since boot
+    volatile uint64_t time_us = time_us_64();
+    start = bench_start();
+    snprintf(&buffer[0], sizeof(buffer), "%lu:%02u:%02u.%06lu",
+             (uint32_t)(time_us / 3600000000ull), (uint8_t)((time_us / 60000000ul) % 60),
+             (uint8_t)((time_us / 1000000ul) % 60), (uint32_t)(time_us % 1000000ul));
+    uint32_t boot_cycles = bench_cycles(start);
+
+    start = bench_start();
+    format_utc(get_utc_us_at(from_us_since_boot(time_us)), true, &buffer[0], sizeof(buffer));
+    uint32_t micros_cycles = bench_cycles(start);
+
+    log_message(LOG_INFO, LOG_RTC, "Timestamp: %lu cycles from the RTC and gmtime(), "
+                                   "%lu from the timer, %lu for get_utc_us()",
+                rtc_cycles, timer_cycles, utc_cycles);
+    log_message(LOG_INFO, LOG_RTC, "Log time: %lu cycles since boot, %lu as UTC to the "
+                                   "microsecond",
+                boot_cycles, micros_cycles);
+}
+#endif
+
 bool ntp_init(void)
 {
     // Create a new UDP control block
@@ -224,141 +703,469 @@ bool ntp_init(void)
     udp_recv(ntp_pcb, _ntp_recv_callback, NULL);
 
     log_message(LOG_INFO, LOG_NTP, "NTP control block initialized");
+    // the first sync is tried as soon as the wifi connects
     timeout = get_absolute_time();
+    return true;
+}
 
-    while (!is_synchronized)
+void ntp_task(void)
+{
+    // between syncs, only the next one is waited for
+    if (rtc_synchronized())
     {
-        ntp_request_time();
-        sleep_ms(10);
+        sched_at(SCHED_NTP, sync_timeout);
+        return;
     }
-    init_flag = true;
-    set_error(WARNING_INTIALIZING, false);
-
-    // print the universal timestamp
-    char buffer[32];
-    get_timestamp(&buffer[0], sizeof(buffer));
-    log_message(LOG_INFO, LOG_RTC, "UTC: %s", buffer);
-
-    return true;
+    ntp_request_time();
 }
 
 bool ntp_request_time(void)
 {
+    cyw43_arch_lwip_begin();
+    bool is_started = _ntp_poll();
+    // the round's timeout, cut short once the first answer is in, or the
+    // retry. One already passed is waiting on the wifi, which wakes the loop.
+    absolute_time_t due = timeout;
+    if (ntp_request_pending && is_collecting)
+    {
+        due = absolute_time_min(due, collect_timeout);
+    }
+    cyw43_arch_lwip_end();
+    if (!time_reached(due))
+    {
+        sched_at(SCHED_NTP, due);
+    }
+    return is_started;
+}
 
-    // if a request is already pending
+static bool _ntp_poll(void)
+{
+    // if a round is in progress, wait for the answers or its timeout
     if (ntp_request_pending)
     {
-        // check if previous request timed out
-        if (is_timed_out(timeout))
+        if (!_ntp_round_done() && !is_timed_out(timeout))
         {
-            _ntp_handle_error("NTP request timed out");
-        }
-        else
-        {
-            return false; // Still waiting for response
+            return false; // Still waiting for responses
         }
+        _ntp_finish_round();
     }
     // check if waiting to retry
-    if (!ntp_request_pending && !is_timed_out(timeout))
+    if (!is_timed_out(timeout))
     {
         return false;
     }
 
-    // Check WiFi connectivity first
-    wifi_check_reconnect();
+    // wait for the wifi manager to connect, trying again on the next call
     if (!wifi_connected())
     {
-        log_message(LOG_WARN, LOG_NTP, "Cannot send NTP request because Wi-Fi not connected");
         return false;
     }
 
-    // resolve NTP server address
-    err_t err = dns_gethostbyname(NTP_SERVER, &ntp_server_addr, _ntp_dns_callback, NULL);
-
-    if (err == ERR_OK)
-    {
-        // address already resolved, send NTP request immediately
-        return _ntp_send_request();
-    }
-    else if (err == ERR_INPROGRESS)
-    {
-        // DNS resolution in progress, callback will send request
-        log_message(LOG_INFO, LOG_NTP, "Resolving NTP server address...");
-        ntp_request_pending = true;
-        timeout = make_timeout_time_ms(ntp_timeout_ms);
-        return true;
-    }
-    else
-    {
-        _ntp_handle_error("DNS resolution failed with error %d", err);
-        return false;
-    }
+    return _ntp_start_round();
 }
 
 static void _ntp_handle_error(const char* fmt, ...)
 {
     // reset the pending flag
     ntp_request_pending = false;
+
+    // format the message here, the logger may only keep the format pointer
+    char message[128];
     va_list args;
     va_start(args, fmt);
-    // if not the first attempt, and this isn't the startup sequence
-    if (sync_attempts > 0 && init_flag)
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+
+    // if not the first attempt. Nothing waits on the first sync, measurements
+    // are held until it, so it backs off too.
+    if (sync_attempts > 0)
     {
         // update the timeout based on the retry delayt
         timeout = make_timeout_time_ms(sync_retry_delay);
         // double the next retry delay
         sync_retry_delay *= 2;
         // cap the retry delay
-        char temp[256];
         if (sync_retry_delay > max_retry_delay_ms)
         {
             sync_retry_delay = max_retry_delay_ms;
             // add an exclamation to the warning message
-            snprintf(temp, sizeof(temp), "%s! (%d)", fmt, sync_attempts);
+            log_message(LOG_ERROR, LOG_NTP, "%s! (%d)", message, sync_attempts);
             set_error(ERROR_NTP_SYNC_FAILED, true);
         }
         else 
         {
-            snprintf(temp, sizeof(temp), "%s (%d)", fmt, sync_attempts);
+            log_message(LOG_ERROR, LOG_NTP, "%s (%d)", message, sync_attempts);
         }
-        log_message(LOG_ERROR, LOG_NTP, temp, args);
     }
     else
     {
         // otherwise no retry delay
         timeout = get_absolute_time();
-        log_message(LOG_WARN, LOG_NTP, fmt, args);
+        log_message(LOG_WARN, LOG_NTP, "%s", message);
     }
-    va_end(args);
     // increment the attempt counter
     sync_attempts++;
 }
 
+static bool _ntp_start_round(void)
+{
+    ntp_request_pending = true;
+    is_collecting = false;
+    timeout = make_timeout_time_ms(ntp_timeout_ms);
+
+    bool is_any_pending = false;
+    for (uint8_t i = 0; i < NTP_SERVER_COUNT; i++)
+    {
+        ntp_server_t *server = &ntp_servers[i];
+
+        // address already resolved, send NTP request immediately
+        if (server->expires != 0 && !is_timed_out(server->expires))
+        {
+            is_any_pending |= _ntp_send_request(i);
+            continue;
+        }
+
+        // resolve NTP server address
+        server->state = NTP_SERVER_RESOLVING;
+        err_t err = dns_gethostbyname(ntp_server_names[i], &server->addr,
+                                      _ntp_dns_callback, (void *)(uintptr_t)i);
+        if (err == ERR_OK)
+        {
+            server->expires = make_timeout_time_ms(ntp_address_lifetime_ms);
+            is_any_pending |= _ntp_send_request(i);
+        }
+        else if (err == ERR_INPROGRESS)
+        {
+            // DNS resolution in progress, callback will send request
+            log_message(LOG_DEBUG, LOG_NTP, "Resolving %s...", ntp_server_names[i]);
+            is_any_pending = true;
+        }
+        else
+        {
+            server->state = NTP_SERVER_FAILED;
+            log_message(LOG_WARN, LOG_NTP, "DNS resolution of %s failed with error %d",
+                        ntp_server_names[i], err);
+        }
+    }
+
+    if (!is_any_pending)
+    {
+        _ntp_handle_error("No NTP server could be reached");
+        return false;
+    }
+    log_message(LOG_INFO, LOG_NTP, "NTP requests started...");
+    return true;
+}
+
+static bool _ntp_round_done(void)
+{
+    if (is_collecting && is_timed_out(collect_timeout))
+    {
+        return true;
+    }
+
+    for (uint8_t i = 0; i < NTP_SERVER_COUNT; i++)
+    {
+        if (ntp_servers[i].state == NTP_SERVER_RESOLVING ||
+            ntp_servers[i].state == NTP_SERVER_SENT)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void _ntp_finish_round(void)
+{
+    ntp_request_pending = false;
+
+    for (uint8_t i = 0; i < NTP_SERVER_COUNT; i++)
+    {
+        ntp_server_t *server = &ntp_servers[i];
+        if (server->state == NTP_SERVER_ANSWERED)
+        {
+            server->misses = 0;
+        }
+        // a server that keeps missing may have left the pool, so look again
+        else if (++server->misses >= ntp_max_misses)
+        {
+            server->misses = 0;
+            server->expires = 0;
+        }
+    }
+
+    int8_t best = _ntp_select();
+    // late answers are ignored from here on
+    for (uint8_t i = 0; i < NTP_SERVER_COUNT; i++)
+    {
+        ntp_servers[i].state = NTP_SERVER_IDLE;
+    }
+    if (best < 0)
+    {
+        _ntp_handle_error("No usable NTP response");
+        return;
+    }
+    _ntp_apply(&ntp_servers[best]);
+}
+
+static int8_t _ntp_select(void)
+{
+    int8_t best = -1;
+    int8_t fastest = -1;
+    uint8_t answered = 0;
+    uint8_t consistent = 0;
+    for (uint8_t i = 0; i < NTP_SERVER_COUNT; i++)
+    {
+        const ntp_server_t *a = &ntp_servers[i];
+        if (a->state != NTP_SERVER_ANSWERED)
+        {
+            continue;
+        }
+        answered++;
+
+        // the true offsets lie within half a round trip of each sample, so
+        // two honest servers' samples are at most the sum of those apart
+        uint8_t others = 0;
+        uint8_t agree = 0;
+        for (uint8_t j = 0; j < NTP_SERVER_COUNT; j++)
+        {
+            const ntp_server_t *b = &ntp_servers[j];
+            if (j == i || b->state != NTP_SERVER_ANSWERED)
+            {
+                continue;
+            }
+            others++;
+            int64_t apart = a->offset_us - b->offset_us;
+            int64_t limit = (int64_t)(a->delay_us + b->delay_us) / 2 + ntp_agree_us;
+            if (apart <= limit && apart >= -limit)
+            {
+                agree++;
+            }
+        }
+
+        if (fastest < 0 || a->delay_us < ntp_servers[fastest].delay_us)
+        {
+            fastest = (int8_t)i;
+        }
+        if (agree * 2u >= others)
+        {
+            consistent++;
+            if (best < 0 || a->delay_us < ntp_servers[best].delay_us)
+            {
+                best = (int8_t)i;
+            }
+        }
+    }
+
+    if (answered == 0)
+    {
+        return -1;
+    }
+    if (best < 0)
+    {
+        log_message(LOG_WARN, LOG_NTP, "NTP servers disagree, using the fastest");
+        best = fastest;
+    }
+    log_message(LOG_INFO, LOG_NTP, "Using NTP server %s, %u of %u answered, %u consistent",
+                ipaddr_ntoa(&ntp_servers[best].addr), answered, NTP_SERVER_COUNT, consistent);
+    return best;
+}
+
+static void _ntp_apply(const ntp_server_t *server)
+{
+    // the alarm reads the clock, so it's stopped while that changes
+    if (rtc_alarm > 0)
+    {
+        cancel_alarm(rtc_alarm);
+        rtc_alarm = 0;
+    }
+
+    // how far off the clock was, from the disciplined clock or else the RTC
+    int64_t correction_us;
+    if (has_utc_offset)
+    {
+        correction_us = server->offset_us - (_utc_at(server->mid_us) - (int64_t)server->mid_us);
+        int64_t magnitude_us = correction_us < 0 ? -correction_us : correction_us;
+        if (magnitude_us > clock_step_us)
+        {
+            // the old samples no longer line up with the new ones
+            log_message(LOG_WARN, LOG_NTP, "Clock stepped by %lld us, estimating its frequency again",
+                        correction_us);
+            clock_history_count = 0;
+            clock_history_next = 0;
+            poll_exponent = min_poll_exponent;
+        }
+        else
+        {
+            int64_t span_us = (int64_t)(server->mid_us - clock_ref_us);
+            clock_residual_ppb = (int32_t)(correction_us * 1000000000 / MAX(span_us, 1));
+            _clock_update_poll(correction_us);
+        }
+    }
+    else
+    {
+        correction_us = server->offset_us + (int64_t)time_us_64() - get_utc_us();
+    }
+    _clock_update_frequency(server);
+
+    utc_offset_us = server->offset_us;
+    clock_ref_us = server->mid_us;
+    has_utc_offset = true;
+    _time_base_set(clock_ref_us, (int64_t)clock_ref_us + utc_offset_us, clock_frequency_ppb);
+    if (!init_flag)
+    {
+        // the time base holds from here, for anything timed since boot too
+        init_flag = true;
+        set_error(WARNING_INTIALIZING, false);
+
+        // print the universal timestamp
+        char buffer[32];
+        get_timestamp(&buffer[0], sizeof(buffer));
+        log_message(LOG_INFO, LOG_RTC, "UTC: %s", buffer);
+    }
+    log_message(LOG_INFO, LOG_NTP, "NTP offset corrected by %lld us, round trip %lu us, "
+                                   "accurate to +/-%lu us (last RTC write %lu us late)",
+                correction_us, server->delay_us, server->delay_us / 2, rtc_write_late_us);
+    log_message(LOG_INFO, LOG_NTP, "Clock frequency error %ld ppb, residual drift %ld ppb, "
+                                   "next sync in %lu s",
+                clock_frequency_ppb, clock_residual_ppb, ntp_poll_interval());
+
+    // the RTC only holds whole seconds, so it's set to the next one just as
+    // that second starts
+    if (!_rtc_schedule(get_utc_us() / 1000000 + 1))
+    {
+        _ntp_handle_error("No alarm free to set the RTC");
+        return;
+    }
+    is_sync_pending = true;
+
+    // no new round until the RTC is set, within the second
+    timeout = make_timeout_time_ms(ntp_timeout_ms);
+    // resets the attempts and retry delay for next sync routing
+    sync_attempts = 0;
+    sync_retry_delay = base_retry_delay_ms;
+    set_error(ERROR_NTP_SYNC_FAILED, false);
+}
+
+static void _clock_update_frequency(const ntp_server_t *server)
+{
+    clock_sample_t *sample = &clock_history[clock_history_next];
+    sample->mono_us = server->mid_us;
+    sample->offset_us = server->offset_us;
+    sample->delay_us = server->delay_us;
+    clock_history_next = (uint8_t)((clock_history_next + 1u) % CLOCK_HISTORY_SIZE);
+    if (clock_history_count < CLOCK_HISTORY_SIZE)
+    {
+        clock_history_count++;
+    }
+
+    // measured from the newest sample, in seconds and microseconds, each
+    // weighted by the inverse square of its error, half its round trip
+    // plus a millisecond for timestamping
+    double sum_w = 0.0, sum_x = 0.0, sum_y = 0.0;
+    uint64_t span_us = 0;
+    for (uint8_t i = 0; i < clock_history_count; i++)
+    {
+        const clock_sample_t *c = &clock_history[i];
+        double error = c->delay_us / 2.0 + 1000.0;
+        double w = 1.0 / (error * error);
+        sum_w += w;
+        sum_x += w * ((double)(int64_t)(c->mono_us - server->mid_us) / 1e6);
+        sum_y += w * (double)(c->offset_us - server->offset_us);
+        span_us = MAX(span_us, server->mid_us - c->mono_us);
+    }
+    if (span_us < min_frequency_span_s * 1000000ull)
+    {
+        return;
+    }
+
+    double mean_x = sum_x / sum_w;
+    double mean_y = sum_y / sum_w;
+    double sum_xx = 0.0, sum_xy = 0.0;
+    for (uint8_t i = 0; i < clock_history_count; i++)
+    {
+        const clock_sample_t *c = &clock_history[i];
+        double error = c->delay_us / 2.0 + 1000.0;
+        double w = 1.0 / (error * error);
+        double x = (double)(int64_t)(c->mono_us - server->mid_us) / 1e6 - mean_x;
+        double y = (double)(c->offset_us - server->offset_us) - mean_y;
+        sum_xx += w * x * x;
+        sum_xy += w * x * y;
+    }
+
+    // the slope is in microseconds per second, so parts per million
+    double ppb = sum_xy / sum_xx * 1000.0;
+    if (ppb > max_frequency_ppb || ppb < -max_frequency_ppb)
+    {
+        log_message(LOG_WARN, LOG_NTP, "Ignored an implausible frequency error of %ld ppb",
+                    (int32_t)ppb);
+        return;
+    }
+    clock_frequency_ppb = (int32_t)ppb;
+}
+
+static void _clock_update_poll(int64_t error_us)
+{
+    int64_t magnitude_us = error_us < 0 ? -error_us : error_us;
+    if (magnitude_us > drift_budget_us && poll_exponent > min_poll_exponent)
+    {
+        poll_exponent--;
+    }
+    // a quarter of the budget leaves room for the error to double with the
+    // interval, and for the noise in the next sample
+    else if (magnitude_us < drift_budget_us / 4 && poll_exponent < max_poll_exponent)
+    {
+        poll_exponent++;
+    }
+}
+
+static bool _rtc_schedule(int64_t second)
+{
+    rtc_pending_second = second;
+    time_to_datetime((time_t)second, &rtc_pending_datetime);
+    rtc_pending_time = _mono_at(second * 1000000);
+    rtc_alarm = add_alarm_at(rtc_pending_time, _rtc_alarm_callback, NULL, true);
+    return rtc_alarm >= 0;
+}
+
 static void _ntp_dns_callback(const char *name, const ip_addr_t *addr,
                               void *arg)
 {
+    uint8_t index = (uint8_t)(uintptr_t)arg;
+    ntp_server_t *server = &ntp_servers[index];
+    // the round may have ended without it
+    if (!ntp_request_pending || server->state != NTP_SERVER_RESOLVING)
+    {
+        return;
+    }
+    // a failure may end the round, so the main loop checks
+    sched_wake();
     if (addr == NULL)
     {
-        _ntp_handle_error("NTP server DNS resolution failed");
+        server->state = NTP_SERVER_FAILED;
+        log_message(LOG_WARN, LOG_NTP, "DNS resolution of %s failed", name);
         return;
     }
 
     // save NTP server address
-    memcpy(&ntp_server_addr, addr, sizeof(ip_addr_t));
-    log_message(LOG_INFO, LOG_NTP, "DNS resolution succeeded");
-    log_message(LOG_DEBUG, LOG_NTP, "NTP server IP address: %s", ipaddr_ntoa(addr));
+    memcpy(&server->addr, addr, sizeof(ip_addr_t));
+    server->expires = make_timeout_time_ms(ntp_address_lifetime_ms);
+    log_message(LOG_DEBUG, LOG_NTP, "%s resolved to %s", name, ipaddr_ntoa(addr));
 
     // send NTP request
-    _ntp_send_request();
+    _ntp_send_request(index);
 }
 
-static bool _ntp_send_request(void)
+static bool _ntp_send_request(uint8_t index)
 {
+    ntp_server_t *server = &ntp_servers[index];
+    server->state = NTP_SERVER_FAILED;
+
     // create packet buffer for payload size of NTP request (48 bytes)
     struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, sizeof(ntp_packet_t), PBUF_RAM);
     if (p == NULL)
     {
-        _ntp_handle_error("Failed to allocate packet buffer for NTP request");
+        log_message(LOG_WARN, LOG_NTP, "Failed to allocate packet buffer for NTP request");
         return false;
     }
 
@@ -366,27 +1173,34 @@ static bool _ntp_send_request(void)
     memset(p->payload, 0, sizeof(ntp_packet_t));
     ntp_packet_t *ntp_packet = (ntp_packet_t *)p->payload;
 
-    // set version number to 3 and mode to 3 (client)
-    ntp_packet->li_vn_mode = 0x1B; // 00 011 011: LI=0, VN=3, Mode=3 (client)
+    // set version number to 4 and mode to 3 (client)
+    ntp_packet->li_vn_mode = 0x23; // 00 100 011: LI=0, VN=4, Mode=3 (client)
 
-    // send the packet
-    err_t err = udp_sendto(ntp_pcb, p, &ntp_server_addr, NTP_PORT);
+    // the server echoes the transmit timestamp back as the originate
+    // timestamp, which ties the response to this request
+    int64_t utc_us = get_utc_us();
+    server->tx_sec = (uint32_t)(utc_us / 1000000 + (int64_t)epoch_conversion);
+    server->tx_frac = (uint32_t)(((uint64_t)(utc_us % 1000000) << 32) / 1000000u);
+    ntp_packet->tx_ts_sec = htonl(server->tx_sec);
+    ntp_packet->tx_ts_frac = htonl(server->tx_frac);
+
+    // send the packet, noting when it left
+    server->sent_us = time_us_64();
+    err_t err = udp_sendto(ntp_pcb, p, &server->addr, NTP_PORT);
     pbuf_free(p);
 
     if (err != ERR_OK)
     {
-        _ntp_handle_error("Failed to send NTP request, error: %d", err);
+        log_message(LOG_WARN, LOG_NTP, "Failed to send NTP request to %s, error: %d",
+                    ntp_server_names[index], err);
         return false;
     }
 
-    log_message(LOG_INFO, LOG_NTP, "NTP request sent...");
-    ntp_request_pending = true;
-    // sends the first request with a smaller timeout to avoid needless waiting
-    if (sync_attempts > 0)
-    {
-        timeout = make_timeout_time_ms(ntp_timeout_ms);
-    }
-    else
+    log_message(LOG_DEBUG, LOG_NTP, "NTP request sent to %s", ipaddr_ntoa(&server->addr));
+    server->state = NTP_SERVER_SENT;
+    // the first round times out quickly to avoid needless waiting, in case
+    // every first packet is dropped
+    if (sync_attempts == 0)
     {
         timeout = make_timeout_time_ms(ntp_init_timeout_ms);
     }
@@ -396,53 +1210,248 @@ static bool _ntp_send_request(void)
 static void _ntp_recv_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p,
                                const ip_addr_t *addr, u16_t port)
 {
+    // the fourth timestamp, as soon as the response arrives
+    uint64_t rx_us = time_us_64();
+    // any answer may end the round, or start the wait for the rest
+    sched_wake();
 
     if (p == NULL)
     {
-        _ntp_handle_error("Received NULL NTP response");
         return;
     }
-    log_message(LOG_INFO, LOG_NTP, "Received NTP response, processing...");
 
-    // check packet size
-    if (p->len != sizeof(ntp_packet_t))
+    // check packet size, any extension fields past the header are ignored
+    if (p->tot_len < sizeof(ntp_packet_t))
     {
+        log_message(LOG_WARN, LOG_NTP, "Packet of incorrect size: %d bytes", p->tot_len);
         pbuf_free(p);
-        _ntp_handle_error("Packet of incorrect size: %d bytes", p->len);
         return;
     }
-    log_message(LOG_DEBUG, LOG_NTP, "Packet size OK: %d bytes", p->len);
 
-    // extract NTP packet from buffer
-    ntp_packet_t *ntp_packet = (ntp_packet_t *)p->payload;
+    // copy the NTP packet out of the buffer
+    ntp_packet_t packet;
+    pbuf_copy_partial(p, &packet, sizeof(packet), 0);
+    pbuf_free(p);
 
-    // swap the byte order
-    uint32_t tx_seconds = ntohl(ntp_packet->tx_ts_sec);
+    // find the request it answers, ignoring stray or duplicate responses
+    ntp_server_t *server = NULL;
+    for (uint8_t i = 0; i < NTP_SERVER_COUNT; i++)
+    {
+        ntp_server_t *s = &ntp_servers[i];
+        if (s->state == NTP_SERVER_SENT && ip_addr_cmp(&s->addr, addr) &&
+            ntohl(packet.orig_ts_sec) == s->tx_sec && ntohl(packet.orig_ts_frac) == s->tx_frac)
+        {
+            server = s;
+            break;
+        }
+    }
+    if (server == NULL)
+    {
+        log_message(LOG_WARN, LOG_NTP, "Ignored an NTP response from %s", ipaddr_ntoa(addr));
+        return;
+    }
+    server->state = NTP_SERVER_FAILED;
 
-    // adjust from NTP epoch (1900) to Unix epoch (1970)
-    uint32_t unix_seconds = tx_seconds - epoch_conversion;
+    // must be a server (mode 4) with a synchronized clock, not a kiss-o'-death
+    uint8_t leap = packet.li_vn_mode >> 6;
+    uint8_t mode = packet.li_vn_mode & 0x07u;
+    if (mode != 4u || leap == 3u || packet.stratum == 0 || packet.stratum > 15u ||
+        packet.tx_ts_sec == 0)
+    {
+        log_message(LOG_WARN, LOG_NTP, "Unusable NTP response from %s: mode %u, leap %u, stratum %u",
+                    ipaddr_ntoa(addr), mode, leap, packet.stratum);
+        return;
+    }
 
-    // convert from unixtime to RTC datetime structure
-    time_t epoch = (time_t)unix_seconds;
-    datetime_t t;
-    time_to_datetime(epoch, &t);
+    // the client's clock here is time since boot, so the offset is UTC minus
+    // time since boot. Both the offset and delay use all four timestamps:
+    // sent (t1), received by the server (t2), sent by it (t3), received (t4).
+    int64_t t1 = (int64_t)server->sent_us;
+    int64_t t2 = _ntp_to_unix_us(ntohl(packet.rx_ts_sec), ntohl(packet.rx_ts_frac));
+    int64_t t3 = _ntp_to_unix_us(ntohl(packet.tx_ts_sec), ntohl(packet.tx_ts_frac));
+    int64_t t4 = (int64_t)rx_us;
+    int64_t offset_us = ((t2 - t1) + (t3 - t4)) / 2;
+    int64_t delay_us = MAX((t4 - t1) - (t3 - t2), 0);
 
-    // Set RTC with synchronized time
-    if (!rtc_set_datetime(&t))
+    // the true offset is within half the round trip of the estimate, so a
+    // slow one isn't worth using
+    if (delay_us > ntp_max_delay_us)
     {
-        _ntp_handle_error("Invalid datetime recieved");
+        log_message(LOG_WARN, LOG_NTP, "NTP round trip to %s too slow: %lu ms",
+                    ipaddr_ntoa(addr), (uint32_t)(delay_us / 1000));
         return;
     }
-    // sets the sync flag and timeout
-    is_synchronized = true;
-    sync_timeout = make_timeout_time_ms(sync_timeout_ms);
-    // resets the attempts and retry delay for next sync routing
-    sync_attempts = 0;
-    sync_retry_delay = base_retry_delay_ms;
-    set_error(ERROR_NTP_SYNC_FAILED, false);
+    server->mid_us = (uint64_t)((t1 + t4) / 2);
+    server->offset_us = offset_us;
+    server->delay_us = (uint32_t)delay_us;
+    server->state = NTP_SERVER_ANSWERED;
+    log_message(LOG_DEBUG, LOG_NTP, "NTP response from %s, round trip %lu us",
+                ipaddr_ntoa(addr), server->delay_us);
 
-    log_message(LOG_INFO, LOG_RTC, "RTC synchronized with NTP");
+    // the requests went out together, so the rest have about as long again
+    // as an acceptable round trip
+    if (!is_collecting)
+    {
+        is_collecting = true;
+        collect_timeout = make_timeout_time_us(ntp_max_delay_us);
+    }
+}
 
-    // frees memory allocated to package buffer
-    pbuf_free(p);
+static int64_t _rtc_alarm_callback(alarm_id_t id, void *user_data)
+{
+    rtc_write_late_us = (uint32_t)absolute_time_diff_us(rtc_pending_time, get_absolute_time());
+    if (rtc_set_datetime(&rtc_pending_datetime) && is_sync_pending)
+    {
+        // sets the sync flag and the timeout for the next one
+        is_sync_pending = false;
+        is_synchronized = true;
+        last_sync = get_absolute_time();
+        sync_timeout = make_timeout_time_ms(ntp_poll_interval() * 1000ull);
+    }
+
+    // re-anchors the time base, which keeps its multiply small
+    absolute_time_t due = rtc_pending_time;
+    _time_base_set(to_us_since_boot(due), rtc_pending_second * 1000000, clock_frequency_ppb);
+
+    // repeats at the next trim, counted from when this one was due
+    rtc_pending_second += rtc_trim_interval_s;
+    time_to_datetime((time_t)rtc_pending_second, &rtc_pending_datetime);
+    rtc_pending_time = _mono_at(rtc_pending_second * 1000000);
+    return -absolute_time_diff_us(due, rtc_pending_time);
+}
+
+static void _time_base_set(uint64_t mono_us, int64_t utc_us, int32_t ppb)
+{
+    uint32_t save = save_and_disable_interrupts();
+    time_base_seq++;
+    __dmb();
+    time_base.mono_us = mono_us;
+    time_base.utc_us = utc_us;
+    time_base.rate_q32 = (int32_t)(((int64_t)ppb << 32) / 1000000000);
+    __dmb();
+    time_base_seq++;
+    restore_interrupts(save);
+}
+
+static uint32_t _calendar_seek(calendar_t *cache, int64_t time_us, calendar_t *out)
+{
+    uint32_t save = spin_lock_blocking(calendar_lock);
+    int64_t into_us = time_us - cache->start_us;
+    if (into_us >= 1000000 && into_us < 2000000)
+    {
+        _calendar_advance(cache);
+        into_us -= 1000000;
+    }
+    else if (into_us < 0 || into_us >= 1000000)
+    {
+        _calendar_set(cache, time_us);
+        into_us = time_us - cache->start_us;
+    }
+    *out = *cache;
+    spin_unlock(calendar_lock, save);
+    return (uint32_t)into_us;
+}
+
+static void _calendar_advance(calendar_t *cal)
+{
+    static const uint8_t days_in_month[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+    cal->start_us += 1000000;
+    cal->unix_time++;
+    if (++cal->second < 60u)
+    {
+        return;
+    }
+    cal->second = 0;
+    if (++cal->minute < 60u)
+    {
+        return;
+    }
+    cal->minute = 0;
+    if (++cal->hour < 24u)
+    {
+        return;
+    }
+    cal->hour = 0;
+    cal->weekday = cal->weekday < 6u ? cal->weekday + 1u : 0u;
+
+    // every fourth year is a leap year, except centuries not divisible by 400
+    bool is_leap = (cal->year % 4u == 0 && cal->year % 100u != 0) || cal->year % 400u == 0;
+    uint8_t month_days = days_in_month[cal->month - 1u] + (cal->month == 2u && is_leap ? 1u : 0u);
+    if (++cal->day <= month_days)
+    {
+        return;
+    }
+    cal->day = 1u;
+    if (++cal->month <= 12u)
+    {
+        return;
+    }
+    cal->month = 1u;
+    cal->year++;
+}
+
+static void _calendar_set(calendar_t *cal, int64_t time_us)
+{
+    uint32_t seconds = (uint32_t)(time_us / 1000000);
+    cal->start_us = (int64_t)seconds * 1000000;
+    cal->unix_time = seconds;
+    uint32_t days = seconds / 86400u;
+    uint32_t rest = seconds % 86400u;
+    cal->hour = (uint8_t)(rest / 3600u);
+    cal->minute = (uint8_t)(rest / 60u % 60u);
+    cal->second = (uint8_t)(rest % 60u);
+    // 1970 started on a Thursday
+    cal->weekday = (uint8_t)((days + 4u) % 7u);
+
+    // days to a civil date, with years starting in March so the leap day
+    // comes last, after Howard Hinnant's `civil_from_days()`
+    uint32_t z = days + 719468u;
+    uint32_t era = z / 146097u;
+    uint32_t day_of_era = z - era * 146097u;
+    uint32_t year_of_era = (day_of_era - day_of_era / 1460u + day_of_era / 36524u -
+                            day_of_era / 146096u) / 365u;
+    uint32_t day_of_year = day_of_era - (365u * year_of_era + year_of_era / 4u - year_of_era / 100u);
+    uint32_t march_month = (5u * day_of_year + 2u) / 153u;
+    cal->day = (uint8_t)(day_of_year - (153u * march_month + 2u) / 5u + 1u);
+    cal->month = (uint8_t)(march_month < 10u ? march_month + 3u : march_month - 9u);
+    cal->year = (uint16_t)(year_of_era + era * 400u + (cal->month <= 2u ? 1u : 0u));
+}
+
+static size_t _put_string(char *out, const char *str)
+{
+    size_t len = strlen(str);
+    memcpy(out, str, len);
+    return len;
+}
+
+static void _put_digits(char *out, uint32_t value, uint8_t count)
+{
+    for (uint8_t i = count; i > 0; i--)
+    {
+        out[i - 1u] = (char)('0' + value % 10u);
+        value /= 10u;
+    }
+}
+
+static int64_t _utc_at(uint64_t mono_us)
+{
+    int64_t elapsed_us = (int64_t)(mono_us - clock_ref_us);
+    return (int64_t)mono_us + utc_offset_us + elapsed_us * clock_frequency_ppb / 1000000000;
+}
+
+static absolute_time_t _mono_at(int64_t utc_us)
+{
+    // dividing by one plus the frequency error, to first order, which is
+    // out by its square, well under a microsecond a day
+    int64_t elapsed_us = utc_us - utc_offset_us - (int64_t)clock_ref_us;
+    return from_us_since_boot((uint64_t)((int64_t)clock_ref_us + elapsed_us -
+                                         elapsed_us * clock_frequency_ppb / 1000000000));
+}
+
+static int64_t _ntp_to_unix_us(uint32_t sec, uint32_t frac)
+{
+    // adjust from NTP epoch (1900) to Unix epoch (1970)
+    int64_t seconds = (int64_t)sec - (int64_t)epoch_conversion;
+    return seconds * 1000000 + (int64_t)(((uint64_t)frac * 1000000u) >> 32);
 }
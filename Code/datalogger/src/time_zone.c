@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "time_zone.h"
+#include "logging.h"
+
+#ifdef DATALOGGER_BENCH
+#include "bench.h"
+#include "time_sync.h"
+#endif
+
+// the zone local times are given in
+static const time_zone_t *zone = &time_zones[0];
+
+// the type in effect from one transition until the next, cached
+static const time_zone_type_t *cache_type = NULL;
+static uint32_t cache_from = UINT32_MAX;
+static uint32_t cache_until = 0;
+
+/**
+ * Finds the type in effect at a given time, and caches it along with the
+ * transitions either side.
+ *
+ * @param unix_time The time, as Unix time
+ */
+static void _time_zone_seek(uint32_t unix_time);
+
+bool time_zone_select(const char *name)
+{
+    for (uint8_t i = 0; i < time_zone_count; i++)
+    {
+        if (strcmp(time_zones[i].name, name) == 0)
+        {
+            zone = &time_zones[i];
+            // empty, so the next lookup searches the new table
+            cache_from = UINT32_MAX;
+            cache_until = 0;
+            log_message(LOG_INFO, LOG_RTC, "Time zone set to %s", zone->name);
+            return true;
+        }
+    }
+    log_message(LOG_WARN, LOG_RTC, "Time zone %s isn't built in", name);
+    return false;
+}
+
+const char *time_zone_name(void)
+{
+    return zone->name;
+}
+
+int32_t time_zone_offset(uint32_t unix_time, const char **abbr)
+{
+    if (unix_time < cache_from || unix_time >= cache_until)
+    {
+        _time_zone_seek(unix_time);
+    }
+
+    if (abbr != NULL)
+    {
+        *abbr = cache_type->abbr;
+    }
+    return cache_type->offset_s;
+}
+
+#ifdef DATALOGGER_BENCH
+void time_zone_benchmark(void)
+{
+    char buffer[64];
+
+    // the previous local time: a fixed offset, then gmtime() and strftime()
+    volatile uint32_t unix_time = 1767225600ul; // 2026-01-01
+    uint32_t start = bench_start();
+    time_t epoch = (time_t)unix_time - 5l * 3600l;
+    struct tm dt = *gmtime(&epoch);
+    strftime(&buffer[0], sizeof(buffer), "%A, %B %d, %Y  %H:%M:%S", &dt);
+    uint32_t gmtime_cycles = bench_cycles(start);
+
+    // the same with the offset from the table, as after a transition
+    cache_from = UINT32_MAX;
+    cache_until = 0;
+    start = bench_start();
+    const char *abbr;
+    epoch = (time_t)unix_time + time_zone_offset(unix_time, &abbr);
+    dt = *gmtime(&epoch);
+    size_t len = strftime(&buffer[0], sizeof(buffer), "%A, %B %d, %Y  %H:%M:%S", &dt);
+    snprintf(&buffer[len], sizeof(buffer) - len, " %s", abbr);
+    uint32_t table_gmtime_cycles = bench_cycles(start);
+
+    // the cached offset and calendar, worked out afresh after a transition,
+    // then moved on by a second
+    int64_t utc_us = (int64_t)unix_time * 1000000;
+    cache_from = UINT32_MAX;
+    cache_until = 0;
+    start = bench_start();
+    format_local(utc_us, &buffer[0], sizeof(buffer));
+    uint32_t format_seek_cycles = bench_cycles(start);
+
+    start = bench_start();
+    format_local(utc_us + 1000000, &buffer[0], sizeof(buffer));
+    uint32_t format_cached_cycles = bench_cycles(start);
+
+    // searching the table, as after a transition, then as cached
+    cache_from = UINT32_MAX;
+    cache_until = 0;
+    start = bench_start();
+    volatile int32_t offset = time_zone_offset(unix_time, NULL);
+    uint32_t seek_cycles = bench_cycles(start);
+
+    start = bench_start();
+    offset = time_zone_offset(unix_time + 1u, NULL);
+    uint32_t cached_cycles = bench_cycles(start);
+    (void)offset;
+
+    log_message(LOG_INFO, LOG_RTC, "Time zone offset (%s, %u transitions): %lu cycles "
+                                   "for a table search, %lu cached",
+                zone->name, zone->transition_count, seek_cycles, cached_cycles);
+    log_message(LOG_INFO, LOG_RTC, "Readable local time: %lu cycles with gmtime(), %lu "
+                                   "with the table and gmtime(), %lu cached after a "
+                                   "transition, %lu a second later",
+                gmtime_cycles, table_gmtime_cycles, format_seek_cycles,
+                format_cached_cycles);
+}
+#endif
+
+static void _time_zone_seek(uint32_t unix_time)
+{
+    // the number of transitions at or before the time
+    uint16_t low = 0;
+    uint16_t high = zone->transition_count;
+    while (low < high)
+    {
+        uint16_t mid = (low + high) / 2u;
+        if (zone->transitions[mid] <= unix_time)
+        {
+            low = mid + 1u;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    // past the end of the table the last type holds
+    cache_type = &zone->types[low == 0 ? 0 : zone->kinds[low - 1u]];
+    cache_from = low == 0 ? 0 : zone->transitions[low - 1u];
+    cache_until = low == zone->transition_count ? UINT32_MAX : zone->transitions[low];
+}
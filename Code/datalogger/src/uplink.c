@@ -0,0 +1,549 @@
+#include <string.h>
+
+#include "uplink.h"
+#include "uplink_proto.h"
+#include "flash_log.h"
+#include "record.h"
+#include "time_sync.h"
+#include "wifi_mgr.h"
+#include "logging.h"
+#include "sched.h"
+#include "utils.h"
+
+#include "pico/cyw43_arch.h"
+#include "pico/rand.h"
+
+#include "lwip/udp.h"
+#include "lwip/pbuf.h"
+
+// UDP port of the collector
+#ifndef DATALOGGER_UPLINK_PORT
+#define DATALOGGER_UPLINK_PORT 9000u
+#endif
+
+// records gathered before a batch is sent
+#ifndef DATALOGGER_UPLINK_BATCH
+#define DATALOGGER_UPLINK_BATCH 10u
+#endif
+
+// longest a record waits for the rest of its batch, in seconds
+#ifndef DATALOGGER_UPLINK_BATCH_AGE
+#define DATALOGGER_UPLINK_BATCH_AGE 900u
+#endif
+
+// a position in the flash log, a page and a record within it
+typedef struct
+{
+    uint32_t page;   // sequence number of the page
+    uint16_t record; // index of the record in the page
+} uplink_pos_t;
+
+// wait before trying a batch again that couldn't be sent
+static const uint32_t uplink_retry_interval_ms = 1000ul; // 1s
+// least time between backlog datagrams, so the radio and lwIP's heap are
+// left room for NTP
+static const uint32_t uplink_drain_interval_ms = 50ul; // 50ms
+// wait for the first ack, doubled for each resend
+static const uint32_t uplink_ack_timeout_ms = 500ul;      // 500ms
+static const uint32_t uplink_ack_timeout_max_ms = 30000ul; // 30s
+// how often the traffic is reported
+static const uint32_t uplink_stats_interval_ms = 3600000ul; // 1h
+// most flash log pages looked at per batch, skipping torn ones
+static const uint32_t uplink_scan_pages = 64u;
+
+// flag for whether the uplink is configured and open
+static bool is_ready = false;
+// UDP control block
+static struct udp_pcb *uplink_pcb = NULL;
+// collector IP address
+static ip_addr_t uplink_addr;
+// references `datagram` in place, allocated once and reused for every send
+static struct pbuf *uplink_pbuf = NULL;
+
+// picked on every boot, so the collector can tell a reset from a resend
+static uint32_t session = 0;
+// sequence number of the batch in flight, or the next one
+static uint32_t tx_sequence = 0;
+// everything before here has been acknowledged
+static uplink_pos_t acked = {0};
+// the end of the batch in flight
+static uplink_pos_t batch_end = {0};
+// records and bytes in the batch in flight
+static uint16_t batch_records = 0;
+static size_t batch_len = 0;
+// flag for whether the batch in flight filled the datagram
+static bool is_batch_full = false;
+// flag for whether a batch is waiting for its ack
+static bool is_in_flight = false;
+// tracks when the batch in flight was first sent
+static absolute_time_t sent_at = 0;
+// current wait for an ack
+static uint32_t ack_timeout_ms = 0;
+// tracks when to check for a batch, or resend the one in flight
+static absolute_time_t timeout = 0;
+// the flash log's record count, and whether the clock was set, as of the
+// last check for a batch
+static uint32_t seen_records = 0;
+static bool was_clock_valid = false;
+// the datagram being put together, or in flight
+static uint8_t datagram[UPLINK_DATAGRAM_SIZE];
+
+// the latest ack, set from lwIP's receive callback
+static volatile uint32_t ack_sequence = 0;
+static volatile bool is_ack_received = false;
+
+// flag for whether a backlog is being forwarded
+static bool is_draining = false;
+// tracks when forwarding the current backlog started
+static absolute_time_t drain_start = 0;
+// records and bytes of the current backlog forwarded so far
+static uint32_t drain_records = 0;
+static uint32_t drain_bytes = 0;
+// the most pages ever waiting to be forwarded
+static uint32_t high_water = 0;
+// pages overwritten in flash before they could be forwarded
+static uint32_t lost = 0;
+
+// traffic since it was last reported
+static absolute_time_t stats_timeout = 0;
+static uint32_t stats_batches = 0;
+static uint32_t stats_records = 0;
+static uint32_t stats_resends = 0;
+static uint32_t stats_wait_ms = 0;
+
+/**
+ * Called by lwIP with each datagram from the collector, in the background.
+ * Only notes the ack, it's handled by `uplink_task()`.
+ */
+static void _recv(void *arg, struct udp_pcb *pcb, struct pbuf *p,
+                  const ip_addr_t *addr, u16_t port);
+
+/**
+ * Handles an ack, then sends the next batch, or resends the one in flight,
+ * if it's due.
+ */
+static void _poll(void);
+
+/**
+ * Handles an ack for the batch in flight, moving on past its records.
+ */
+static void _acknowledged(void);
+
+/**
+ * Moves `acked` on to a position, then past pages that are finished with,
+ * marking the last page left behind sent. Pages gone from flash, or that can
+ * never be dated, are skipped, and a page that's finished but only partly
+ * acknowledged stays.
+ *
+ * @param pos Where to move to
+ */
+static void _advance(uplink_pos_t pos);
+
+/**
+ * Puts the next batch together in `datagram`, re-encoding records from
+ * `acked` onwards in UTC so the batch starts with a keyframe. Ends before a
+ * page logged before the clock was set, until it is.
+ *
+ * @param oldest Set to the timestamp of the first record
+ *
+ * @return Number of records in the batch
+ */
+static uint16_t _build_batch(uint32_t *oldest);
+
+/**
+ * Sends the batch in `datagram` to the collector.
+ *
+ * @return `true` if successful, `false` otherwise
+ */
+static bool _send(void);
+
+/**
+ * Logs the size and throughput of a forwarded backlog.
+ */
+static void _finish_drain(void);
+
+/**
+ * Logs the traffic since the last report.
+ */
+static void _log_stats(void);
+
+bool uplink_init(void)
+{
+#ifndef DATALOGGER_UPLINK_HOST
+    log_message(LOG_INFO, LOG_UPLINK, "Uplink disabled, no collector configured");
+    return false;
+#else
+    if (!ipaddr_aton(DATALOGGER_UPLINK_HOST, &uplink_addr))
+    {
+        log_message(LOG_ERROR, LOG_UPLINK, "Invalid uplink collector address: %s",
+                    DATALOGGER_UPLINK_HOST);
+        return false;
+    }
+
+    // create a new UDP control block, and the pbuf every batch is sent
+    // from. lwIP can't grow a reference pbuf, so it chains its own headers
+    // in front and the records are never copied.
+    cyw43_arch_lwip_begin();
+    uplink_pcb = udp_new();
+    if (uplink_pcb != NULL)
+    {
+        udp_recv(uplink_pcb, _recv, NULL);
+    }
+    uplink_pbuf = pbuf_alloc(PBUF_TRANSPORT, sizeof(datagram), PBUF_REF);
+    if (uplink_pbuf != NULL)
+    {
+        uplink_pbuf->payload = &datagram[0];
+    }
+    cyw43_arch_lwip_end();
+    if (uplink_pcb == NULL || uplink_pbuf == NULL)
+    {
+        log_message(LOG_ERROR, LOG_UPLINK, "Failed to create UDP PCB for uplink!");
+        return false;
+    }
+
+    // pick up after the last page forwarded before the reset
+    absolute_time_t start = get_absolute_time();
+    acked.page = flash_log_first_unsent();
+    acked.record = 0;
+    session = get_rand_32();
+    stats_timeout = make_timeout_time_ms(uplink_stats_interval_ms);
+    log_message(LOG_INFO, LOG_UPLINK, "Uplink to %s:%u, batches of %u records or %u s, "
+                                      "%lu pages waiting (found in %lu us)",
+                DATALOGGER_UPLINK_HOST, DATALOGGER_UPLINK_PORT, DATALOGGER_UPLINK_BATCH,
+                DATALOGGER_UPLINK_BATCH_AGE, flash_log_sequence() - acked.page,
+                (uint32_t)absolute_time_diff_us(start, get_absolute_time()));
+    is_ready = true;
+    return true;
+#endif
+}
+
+void uplink_task(void)
+{
+    if (!is_ready)
+    {
+        return;
+    }
+
+    _poll();
+
+    // one already passed is waiting on the wifi, which wakes the loop
+    absolute_time_t due = stats_timeout;
+    if (!time_reached(timeout))
+    {
+        due = absolute_time_min(due, timeout);
+    }
+    sched_at(SCHED_UPLINK, due);
+}
+
+static void _poll(void)
+{
+    if (is_timed_out(stats_timeout))
+    {
+        _log_stats();
+    }
+
+    if (is_in_flight && is_ack_received)
+    {
+        is_ack_received = false;
+        if (ack_sequence == tx_sequence)
+        {
+            _acknowledged();
+        }
+    }
+
+    // a batch held back is checked again as records are logged, or the clock
+    // is set, rather than on a timer. A backlog keeps to its own pace.
+    if (!is_in_flight && !is_batch_full &&
+        (flash_log_records() != seen_records || rtc_time_valid() != was_clock_valid))
+    {
+        seen_records = flash_log_records();
+        was_clock_valid = rtc_time_valid();
+        timeout = nil_time;
+    }
+
+    if (!is_timed_out(timeout))
+    {
+        return;
+    }
+
+    // the flash log wraps around, so a long enough backlog loses its oldest,
+    // reported once the link is back
+    uint32_t waiting = flash_log_filling() - acked.page;
+    if (waiting > FLASH_LOG_PAGE_COUNT)
+    {
+        lost += waiting - FLASH_LOG_PAGE_COUNT;
+        acked.page = flash_log_filling() - FLASH_LOG_PAGE_COUNT;
+        acked.record = 0;
+        waiting = FLASH_LOG_PAGE_COUNT;
+    }
+    high_water = MAX(high_water, waiting);
+
+    if (!wifi_connected())
+    {
+        return;
+    }
+
+    if (is_in_flight)
+    {
+        // no ack in time, so the same batch goes again, backing off in case
+        // the collector is down
+        ack_timeout_ms = MIN(ack_timeout_ms * 2u, uplink_ack_timeout_max_ms);
+        timeout = make_timeout_time_ms(ack_timeout_ms);
+        if (_send())
+        {
+            stats_resends++;
+            log_message(LOG_DEBUG, LOG_UPLINK, "Resent batch %lu, next wait %lu ms",
+                        tx_sequence, ack_timeout_ms);
+        }
+        return;
+    }
+
+    _advance(acked);
+    uint32_t oldest = 0;
+    batch_records = _build_batch(&oldest);
+    if (batch_records == 0)
+    {
+        // nothing until the next record is logged
+        timeout = at_the_end_of_time;
+        return;
+    }
+
+    // hold back a short batch until it's due, fewer datagrams keep the radio
+    // asleep for longer. Its age isn't known until the clock is set, records
+    // left from before a reset can wait until then.
+    uint32_t age = rtc_time_valid() ? get_unix_time() - oldest : 0;
+    if (!is_batch_full && batch_records < DATALOGGER_UPLINK_BATCH &&
+        age < DATALOGGER_UPLINK_BATCH_AGE)
+    {
+        timeout = rtc_time_valid()
+                      ? make_timeout_time_ms((DATALOGGER_UPLINK_BATCH_AGE - age) * 1000u)
+                      : at_the_end_of_time;
+        return;
+    }
+
+    uplink_header_t header = {
+        .type = UPLINK_BATCH,
+        .session = session,
+        .sequence = tx_sequence,
+        .count = batch_records,
+    };
+    uplink_header_write(&header, &datagram[0]);
+    is_ack_received = false;
+    if (!_send())
+    {
+        timeout = make_timeout_time_ms(uplink_retry_interval_ms);
+        return;
+    }
+    is_in_flight = true;
+    sent_at = get_absolute_time();
+    ack_timeout_ms = uplink_ack_timeout_ms;
+    timeout = make_timeout_time_ms(ack_timeout_ms);
+    stats_batches++;
+
+    if (is_batch_full && !is_draining)
+    {
+        log_message(LOG_INFO, LOG_UPLINK, "Forwarding a backlog of %lu pages", waiting);
+        if (lost > 0)
+        {
+            log_message(LOG_WARN, LOG_UPLINK, "Uplink backlog overran the flash log, "
+                                              "%lu pages lost so far",
+                        lost);
+        }
+        is_draining = true;
+        drain_start = get_absolute_time();
+        drain_records = 0;
+        drain_bytes = 0;
+    }
+}
+
+static void _recv(void *arg, struct udp_pcb *pcb, struct pbuf *p,
+                  const ip_addr_t *addr, u16_t port)
+{
+    (void)arg;
+    (void)pcb;
+    uint8_t data[UPLINK_HEADER_SIZE];
+    uplink_header_t header;
+    if (ip_addr_cmp(addr, &uplink_addr) && port == DATALOGGER_UPLINK_PORT &&
+        pbuf_copy_partial(p, &data[0], sizeof(data), 0) == sizeof(data) &&
+        uplink_header_read(&header, &data[0], sizeof(data)) &&
+        header.type == UPLINK_ACK && header.session == session)
+    {
+        ack_sequence = header.sequence;
+        is_ack_received = true;
+        sched_wake();
+    }
+    pbuf_free(p);
+}
+
+static void _acknowledged(void)
+{
+    uint32_t wait_ms = absolute_time_diff_ms(sent_at, get_absolute_time());
+    log_message(LOG_DEBUG, LOG_UPLINK, "Batch %lu of %u records acknowledged after %lu ms",
+                tx_sequence, batch_records, wait_ms);
+    stats_records += batch_records;
+    stats_wait_ms += wait_ms;
+    is_in_flight = false;
+    tx_sequence++;
+    _advance(batch_end);
+
+    if (is_draining)
+    {
+        drain_records += batch_records;
+        drain_bytes += batch_len;
+        if (!is_batch_full)
+        {
+            _finish_drain();
+        }
+    }
+
+    // straight on with the next batch, paced if there's a backlog
+    timeout = is_batch_full ? make_timeout_time_ms(uplink_drain_interval_ms) : nil_time;
+}
+
+static void _advance(uplink_pos_t pos)
+{
+    uint32_t start = acked.page;
+    acked = pos;
+    uint32_t filling = flash_log_filling();
+    while (acked.page != filling)
+    {
+        const flash_log_page_t *p = flash_log_page(acked.page);
+        uint32_t epoch;
+        if (p != NULL && p->sent != 0 && acked.record < p->count)
+        {
+            if (flash_log_page_epoch(acked.page, p, &epoch) != FLASH_LOG_UNDATABLE)
+            {
+                break;
+            }
+            log_message(LOG_WARN, LOG_UPLINK, "Skipped flash log page %lu, logged before the "
+                                              "clock was set on an earlier boot",
+                        acked.page);
+        }
+        acked.page++;
+        acked.record = 0;
+    }
+
+    // only the newest mark matters after a reset
+    if (acked.page != start)
+    {
+        flash_log_mark_sent(acked.page - 1u);
+    }
+}
+
+static uint16_t _build_batch(uint32_t *oldest)
+{
+    record_encoder_t encoder;
+    record_encoder_init(&encoder);
+    batch_len = UPLINK_HEADER_SIZE;
+    is_batch_full = false;
+    uint16_t count = 0;
+
+    uplink_pos_t pos = acked;
+    uint32_t filling = flash_log_filling();
+    for (uint32_t i = 0; i < uplink_scan_pages; i++)
+    {
+        const flash_log_page_t *p = flash_log_page(pos.page);
+        uint32_t epoch = 0;
+        FlashLogDating dating = p != NULL ? flash_log_page_epoch(pos.page, p, &epoch)
+                                          : FLASH_LOG_UNDATABLE;
+        if (dating == FLASH_LOG_UNDATED)
+        {
+            break;
+        }
+        if (dating == FLASH_LOG_DATED)
+        {
+            // pages start with a keyframe, so decode from the start and skip
+            // whatever was already acknowledged
+            record_decoder_t decoder;
+            record_decoder_init(&decoder);
+            size_t offset = 0;
+            for (uint16_t index = 0; index < p->count; index++)
+            {
+                record_t rec;
+                size_t used;
+                if (record_decode(&decoder, &p->payload[offset], p->length - offset,
+                                  &used, &rec) != RECORD_OK)
+                {
+                    break;
+                }
+                offset += used;
+                if (index < pos.record)
+                {
+                    continue;
+                }
+
+                uint32_t timestamp = rec.timestamp + epoch;
+                size_t len = record_encode(&encoder, timestamp, &rec.values[0], rec.count,
+                                           &datagram[batch_len], sizeof(datagram) - batch_len);
+                if (len == 0)
+                {
+                    is_batch_full = true;
+                    break;
+                }
+                if (count == 0)
+                {
+                    *oldest = timestamp;
+                }
+                batch_len += len;
+                count++;
+                pos.record = index + 1u;
+            }
+        }
+
+        // the page being filled may grow, so the batch ends with it
+        if (is_batch_full || pos.page == filling)
+        {
+            break;
+        }
+        pos.page++;
+        pos.record = 0;
+    }
+    batch_end = pos;
+    return count;
+}
+
+static bool _send(void)
+{
+    cyw43_arch_lwip_begin();
+    uplink_pbuf->len = (u16_t)batch_len;
+    uplink_pbuf->tot_len = (u16_t)batch_len;
+    err_t err = udp_sendto(uplink_pcb, uplink_pbuf, &uplink_addr, DATALOGGER_UPLINK_PORT);
+    cyw43_arch_lwip_end();
+
+    if (err != ERR_OK)
+    {
+        log_message(LOG_WARN, LOG_UPLINK, "Failed to send uplink datagram, error: %d", err);
+        return false;
+    }
+    return true;
+}
+
+static void _finish_drain(void)
+{
+    uint32_t elapsed_ms = MAX(absolute_time_diff_ms(drain_start, get_absolute_time()), 1);
+    log_message(LOG_INFO, LOG_UPLINK, "Backlog forwarded: %lu records, %lu bytes in %lu ms "
+                                      "(%lu records/s), high water %lu pages",
+                drain_records, drain_bytes, elapsed_ms,
+                drain_records * 1000u / elapsed_ms, high_water);
+    is_draining = false;
+}
+
+static void _log_stats(void)
+{
+    stats_timeout = make_timeout_time_ms(uplink_stats_interval_ms);
+    if (stats_batches == 0)
+    {
+        return;
+    }
+
+    // sent one per measurement, there'd be a datagram and an ack per record
+    log_message(LOG_INFO, LOG_UPLINK, "Uplink in the last hour: %lu datagrams (%lu resent) "
+                                      "for %lu records, %lu records/datagram, "
+                                      "%lu ms awaiting acks",
+                stats_batches + stats_resends, stats_resends, stats_records,
+                stats_records / stats_batches, stats_wait_ms);
+    stats_batches = 0;
+    stats_records = 0;
+    stats_resends = 0;
+    stats_wait_ms = 0;
+}
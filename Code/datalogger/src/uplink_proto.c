@@ -0,0 +1,63 @@
+#include "uplink_proto.h"
+
+/**
+ * Writes a little-endian value.
+ *
+ * @return Number of bytes written
+ */
+static size_t _put_le(uint8_t *out, uint32_t value, uint8_t size);
+
+/**
+ * Reads a little-endian value.
+ */
+static uint32_t _get_le(const uint8_t *data, uint8_t size);
+
+size_t uplink_header_write(const uplink_header_t *header, uint8_t *out)
+{
+    size_t len = 0;
+    len += _put_le(&out[len], UPLINK_MAGIC, 2u);
+    out[len++] = UPLINK_VERSION;
+    out[len++] = (uint8_t)header->type;
+    len += _put_le(&out[len], header->session, 4u);
+    len += _put_le(&out[len], header->sequence, 4u);
+    len += _put_le(&out[len], header->count, 2u);
+    return len;
+}
+
+bool uplink_header_read(uplink_header_t *header, const uint8_t *data, size_t len)
+{
+    if (len < UPLINK_HEADER_SIZE || _get_le(&data[0], 2u) != UPLINK_MAGIC ||
+        data[2] != UPLINK_VERSION)
+    {
+        return false;
+    }
+    if (data[3] != UPLINK_BATCH && data[3] != UPLINK_ACK)
+    {
+        return false;
+    }
+
+    header->type = (UplinkType)data[3];
+    header->session = _get_le(&data[4], 4u);
+    header->sequence = _get_le(&data[8], 4u);
+    header->count = (uint16_t)_get_le(&data[12], 2u);
+    return true;
+}
+
+static size_t _put_le(uint8_t *out, uint32_t value, uint8_t size)
+{
+    for (uint8_t i = 0; i < size; i++)
+    {
+        out[i] = (uint8_t)(value >> (8u * i));
+    }
+    return size;
+}
+
+static uint32_t _get_le(const uint8_t *data, uint8_t size)
+{
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < size; i++)
+    {
+        value |= (uint32_t)data[i] << (8u * i);
+    }
+    return value;
+}
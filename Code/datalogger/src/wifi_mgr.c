@@ -1,29 +1,137 @@
+#include <stddef.h>
+#include <string.h>
+
 #include "wifi_mgr.h"
 #include "utils.h"
 #include "error_mgr.h"
 #include "logging.h"
+#include "persist.h"
+#include "sensors.h"
+#include "time_sync.h"
+#include "sched.h"
 
 #include "pico/cyw43_arch.h"
 
+#include "lwip/dhcp.h"
+#include "lwip/dns.h"
+#include "lwip/netif.h"
+
 // MAC address is 28:CD:C1:0E:C6:5B
 #define SSID "WPI-PSK"
 #define PASS "photosynthesize"
 
-// flag for whether the wifi was connected when last checked
-static bool is_connected = false;
+// layout version of the saved connection
+#define WIFI_CACHE_VERSION 1u
+
+/**
+ * Enumeration to keep track of the connection
+ */
+typedef enum
+{
+    WIFI_DOWN,       // disconnected, waiting to retry
+    WIFI_CONNECTING, // joining and getting an address in the background
+    WIFI_UP,         // connected with an address
+} WifiState;
+
+/**
+ * The last good connection, saved so a reconnect can skip the scan and DHCP.
+ * Addresses are kept in network byte order.
+ */
+typedef struct
+{
+    uint8_t bssid[6];  // the access point joined
+    uint8_t channel;   // its channel
+    uint8_t reserved;  // padding, zero
+    uint32_t ip;       // the leased address
+    uint32_t netmask;  // the subnet mask
+    uint32_t gateway;  // the default gateway
+    uint32_t dns;      // the first DNS server
+    uint32_t lease_s;  // length of the lease
+    uint32_t obtained; // Unix time the lease began, 0 if unknown
+} wifi_cache_t;
 
-// timeout for library wifi functions
-static const uint32_t init_timeout_ms = 10000u; // 10sec
+// how long a connection attempt has to get an address
+static const uint32_t connect_timeout_ms = 20000ul; // 20sec
+// how often to check on a connection attempt, the driver doesn't say when
+static const uint32_t connect_poll_ms = 100ul; // 100ms
+// how long DHCP gets after joining, before the cached address is used instead
+static const uint32_t dhcp_fallback_ms = 5000ul; // 5sec
+// how long a cached address of unknown age is kept before asking DHCP again
+static const uint32_t static_recheck_ms = 600000ul; // 10min
+// how much of a cached lease must be left for it to be reused
+static const uint32_t lease_margin_s = 600ul; // 10min
 
 // baseline wait between reconnection attempts
-static const uint32_t base_retry_delay_ms = 3600000ul; // 1hr
+static const uint32_t base_retry_delay_ms = 5000ul; // 5sec
 // maximum wait between reconnection attempts
 static const uint32_t max_retry_delay_ms = 300000ul; // 5min
 
+// the stage of the connection
+static WifiState wifi_state = WIFI_DOWN;
 // dynamic wait between reconnection attempts
 static uint32_t retry_delay = base_retry_delay_ms;
-// tracks when a new wifi check can happen
+// tracks when the attempt in progress times out, or the next retry
 static absolute_time_t timeout = 0;
+// tracks when the attempt in progress started
+static absolute_time_t attempt_start = 0;
+// number of attempts since last connected
+static uint16_t attempts = 0;
+
+// the last good connection
+static wifi_cache_t cache;
+// flag for whether `cache` holds a connection
+static bool has_cache = false;
+// flag for whether the next attempt should join the cached access point
+static bool use_cache = false;
+// flag for whether the attempt in progress joined the cached access point
+static bool is_warm = false;
+// flag for whether the attempt in progress has joined, and is waiting on an address
+static bool is_joined = false;
+// flag for whether the address was set from the cache rather than by DHCP
+static bool is_static = false;
+// flag for whether DHCP is replacing a cached address
+static bool is_renewing = false;
+// flag for whether `cache` has changed and needs saving
+static bool is_cache_dirty = false;
+// tracks when to give up on DHCP, or when to renew a cached address with it
+static absolute_time_t address_timeout = 0;
+
+/**
+ * Starts joining the network in the background.
+ */
+static void _start_connect(void);
+
+/**
+ * Handles a failed attempt, or a dropped link. Waits for the retry delay,
+ * doubling it each time up to the maximum.
+ */
+static void _handle_failure(const char *reason, int status);
+
+/**
+ * Whether the cached lease is known to have time left on it.
+ */
+static bool _lease_valid(void);
+
+/**
+ * Sets the address, gateway and DNS server from the cache, instead of DHCP.
+ */
+static void _apply_cached_address(void);
+
+/**
+ * Records the connection just made in the cache, to save once idle.
+ */
+static void _update_cache(void);
+
+/**
+ * Sets when the main loop next needs to run `wifi_task()`.
+ */
+static void _schedule(void);
+
+/**
+ * Called by lwIP when the station interface's link or address changes, to
+ * have the main loop check on the connection. Runs in interrupt context.
+ */
+static void _netif_changed(struct netif *n);
 
 bool wifi_init(void)
 {
@@ -39,84 +147,303 @@ bool wifi_init(void)
     // enable station mode
     cyw43_arch_enable_sta_mode();
 
+    // the driver tells lwIP when the link goes up or down, which wakes the
+    // loop to check, rather than it polling
+    cyw43_arch_lwip_begin();
+    netif_set_link_callback(&cyw43_state.netif[CYW43_ITF_STA], _netif_changed);
+    netif_set_status_callback(&cyw43_state.netif[CYW43_ITF_STA], _netif_changed);
+    cyw43_arch_lwip_end();
+
     // find the MAC address of the pico
     uint8_t mac[6];
     cyw43_wifi_get_mac(&cyw43_state, CYW43_ITF_STA, &mac[0]);
     log_message(LOG_DEBUG, LOG_WIFI, "MAC address: %02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 
-    // connect to the network
-    log_message(LOG_INFO, LOG_WIFI, "Connecting to Wi-Fi network...");
-    int error = 1;
-    while (error != 0)
+    // load the last good connection, to skip the scan
+    has_cache = persist_load(PERSIST_WIFI, WIFI_CACHE_VERSION, &cache, sizeof(cache));
+    use_cache = has_cache;
+
+    // connect to the network, carried on by wifi_task()
+    _start_connect();
+    return true;
+}
+
+void wifi_task(void)
+{
+    switch (wifi_state)
     {
-        error = cyw43_arch_wifi_connect_timeout_ms(SSID, PASS,
-                                                   CYW43_AUTH_WPA2_AES_PSK, init_timeout_ms);
-        if (error != 0)
+    case WIFI_DOWN:
+        // wait out the retry delay
+        if (is_timed_out(timeout))
         {
-            log_message(LOG_ERROR, LOG_WIFI, "Network connection failed! Trying again...");
+            _start_connect();
         }
+        break;
+
+    case WIFI_CONNECTING:
+    {
+        // the link is only up once DHCP has given us an address
+        int status = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
+        uint32_t elapsed_ms = (uint32_t)absolute_time_diff_ms(attempt_start, get_absolute_time());
+        if (status == CYW43_LINK_UP)
+        {
+            log_message(LOG_INFO, LOG_WIFI, "Network connection success in %lu ms by %s join "
+                                            "and %s address (attempt %u, %lu ms since boot)",
+                        elapsed_ms, is_warm ? "directed" : "scanning",
+                        is_static ? "cached" : "DHCP", attempts,
+                        to_ms_since_boot(get_absolute_time()));
+            if (!is_static)
+            {
+                _update_cache();
+            }
+            wifi_state = WIFI_UP;
+            retry_delay = base_retry_delay_ms;
+            attempts = 0;
+            set_error(ERROR_WIFI_DISCONNECTED, false);
+        }
+        else if (status == CYW43_LINK_NOIP)
+        {
+            // joined, reuse the cached lease if it's still good, otherwise
+            // give DHCP a while before falling back to it
+            if (!is_joined)
+            {
+                is_joined = true;
+                log_message(LOG_DEBUG, LOG_WIFI, "Joined in %lu ms", elapsed_ms);
+                if (is_warm && _lease_valid())
+                {
+                    _apply_cached_address();
+                }
+                else
+                {
+                    address_timeout = make_timeout_time_ms(dhcp_fallback_ms);
+                }
+            }
+            else if (has_cache && !is_static && is_timed_out(address_timeout))
+            {
+                log_message(LOG_WARN, LOG_WIFI, "No DHCP lease after %lu ms, using the cached address",
+                            dhcp_fallback_ms);
+                _apply_cached_address();
+            }
+        }
+        else if (status < 0)
+        {
+            // failed, no network, or bad credentials
+            _handle_failure("Network connection failed", status);
+        }
+        else if (is_timed_out(timeout))
+        {
+            _handle_failure("Network connection timed out", status);
+        }
+        break;
     }
-    log_message(LOG_INFO, LOG_WIFI, "Network connection success");
 
-    // set flag and recheck timeout
-    timeout = make_timeout_time_ms(retry_delay);
-    is_connected = true;
-    return true;
+    case WIFI_UP:
+        // saving pauses both cores, so wait for a gap between measurements
+        if (is_cache_dirty && sensors_idle())
+        {
+            is_cache_dirty = false;
+            persist_save(PERSIST_WIFI, WIFI_CACHE_VERSION, &cache, sizeof(cache));
+        }
+
+        // a cached address is only borrowed until DHCP can renew it
+        if (is_static && is_timed_out(address_timeout))
+        {
+            log_message(LOG_INFO, LOG_WIFI, "Renewing the cached address with DHCP");
+            is_static = false;
+            is_renewing = true;
+            cyw43_arch_lwip_begin();
+            dhcp_start(&cyw43_state.netif[CYW43_ITF_STA]);
+            cyw43_arch_lwip_end();
+        }
+        else if (is_renewing && dhcp_supplied_address(&cyw43_state.netif[CYW43_ITF_STA]))
+        {
+            // keep the fresh lease for next time
+            is_renewing = false;
+            _update_cache();
+        }
+
+        // checked on every pass, as it only reads the driver's state. A drop
+        // wakes the loop through `_netif_changed()`, so there's no deadline,
+        // and the sensors run the loop every few seconds regardless.
+        int status = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
+        if (status != CYW43_LINK_UP)
+        {
+            // reconnect straight away the first time
+            log_message(LOG_WARN, LOG_WIFI, "Wi-Fi disconnected (status %d), "
+                                            "attempting reconnection...",
+                        status);
+            wifi_state = WIFI_DOWN;
+            retry_delay = base_retry_delay_ms;
+            timeout = get_absolute_time();
+        }
+        break;
+    }
+    _schedule();
 }
 
-bool should_check_wifi(void)
+bool wifi_connected(void)
 {
-    return is_timed_out(timeout);
+    return wifi_state == WIFI_UP;
 }
 
-void wifi_check_reconnect(void)
+static void _start_connect(void)
 {
-    // check whether the wifi connection is up
-    if (cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA) == CYW43_LINK_UP)
+    attempts++;
+    attempt_start = get_absolute_time();
+    is_warm = use_cache;
+    is_joined = false;
+    is_static = false;
+    is_renewing = false;
+    log_message(LOG_INFO, LOG_WIFI, "Connecting to Wi-Fi network... (attempt %u, %s)",
+                attempts, is_warm ? "cached access point" : "scanning");
+
+    // leave anything half finished from the last attempt first
+    cyw43_wifi_leave(&cyw43_state, CYW43_ITF_STA);
+    int err;
+    if (is_warm)
     {
-        // if up, reset delay, timout, flag
-        retry_delay = base_retry_delay_ms;
-        timeout = make_timeout_time_ms(retry_delay);
-        is_connected = true;
-        log_message(LOG_INFO, LOG_WIFI, "Wi-Fi connection nominal");
-        set_error(ERROR_WIFI_DISCONNECTED, false);
+        // a directed join to the last access point skips the scan
+        err = cyw43_wifi_join(&cyw43_state, strlen(SSID), (const uint8_t *)SSID,
+                              strlen(PASS), (const uint8_t *)PASS, CYW43_AUTH_WPA2_AES_PSK,
+                              &cache.bssid[0], cache.channel);
+    }
+    else
+    {
+        err = cyw43_arch_wifi_connect_async(SSID, PASS, CYW43_AUTH_WPA2_AES_PSK);
+    }
+    if (err != 0)
+    {
+        _handle_failure("Failed to start network connection", err);
         return;
     }
-    log_message(LOG_WARN, LOG_WIFI, "Wi-Fi disconnected, attempting reconnection...");
+    wifi_state = WIFI_CONNECTING;
+    timeout = make_timeout_time_ms(connect_timeout_ms);
+}
+
+static void _handle_failure(const char *reason, int status)
+{
+    uint32_t elapsed_ms = (uint32_t)absolute_time_diff_ms(attempt_start, get_absolute_time());
+    wifi_state = WIFI_DOWN;
 
-    // otherwise, attempt to reconnect
-    if (cyw43_arch_wifi_connect_timeout_ms(SSID, PASS,
-                                           CYW43_AUTH_WPA2_AES_PSK, init_timeout_ms) != 0)
+    // the access point may have moved, so scan again straight away
+    if (is_warm)
     {
-        // if failed, double the delay until the next retry
-        retry_delay *= 2;
-        // cap the maximum retry duration
-        if (retry_delay > max_retry_delay_ms)
-        {
-            retry_delay = max_retry_delay_ms;
-            log_message(LOG_ERROR, LOG_WIFI, "Wi-Fi reconnection repeatedly failed!");
-            set_error(ERROR_WIFI_DISCONNECTED, true);
-        }
-        else
-        {
-            log_message(LOG_WARN, LOG_WIFI, "Wi-Fi reconnection failed");
-        }
-        // update the timeout and flag
-        timeout = make_timeout_time_ms(retry_delay);
-        is_connected = false;
+        log_message(LOG_WARN, LOG_WIFI, "%s after %lu ms (status %d), trying a full scan",
+                    reason, elapsed_ms, status);
+        use_cache = false;
+        timeout = get_absolute_time();
         return;
     }
-    // if successfully reconnected, reset delay, timeout, flag
-    retry_delay = base_retry_delay_ms;
     timeout = make_timeout_time_ms(retry_delay);
-    log_message(LOG_INFO, LOG_WIFI, "Wi-Fi reconnection success");
 
-    is_connected = true;
-    set_error(ERROR_WIFI_DISCONNECTED, false);
-    return;
+    // double the delay until the next retry
+    retry_delay *= 2;
+    // cap the maximum retry duration
+    if (retry_delay > max_retry_delay_ms)
+    {
+        retry_delay = max_retry_delay_ms;
+        log_message(LOG_ERROR, LOG_WIFI, "%s after %lu ms (status %d)! Repeatedly failed",
+                    reason, elapsed_ms, status);
+        set_error(ERROR_WIFI_DISCONNECTED, true);
+    }
+    else
+    {
+        log_message(LOG_WARN, LOG_WIFI, "%s after %lu ms (status %d)", reason, elapsed_ms, status);
+    }
 }
 
-bool wifi_connected(void)
+static bool _lease_valid(void)
+{
+    // the RTC starts at a default date, so a lease can't be checked until synced
+    if (!has_cache || cache.obtained == 0 || !rtc_time_valid())
+    {
+        return false;
+    }
+    return get_unix_time() + lease_margin_s < cache.obtained + cache.lease_s;
+}
+
+static void _apply_cached_address(void)
+{
+    ip4_addr_t ip, netmask, gateway;
+    ip_addr_t dns;
+    ip4_addr_set_u32(&ip, cache.ip);
+    ip4_addr_set_u32(&netmask, cache.netmask);
+    ip4_addr_set_u32(&gateway, cache.gateway);
+    ip4_addr_set_u32(ip_2_ip4(&dns), cache.dns);
+
+    cyw43_arch_lwip_begin();
+    struct netif *n = &cyw43_state.netif[CYW43_ITF_STA];
+    dhcp_stop(n);
+    netif_set_addr(n, &ip, &netmask, &gateway);
+    dns_setserver(0, &dns);
+    cyw43_arch_lwip_end();
+
+    // renew it once the lease runs out, or after a while if its age is unknown
+    uint32_t renew_ms = static_recheck_ms;
+    if (_lease_valid())
+    {
+        uint32_t left_s = cache.obtained + cache.lease_s - lease_margin_s - get_unix_time();
+        renew_ms = MIN(left_s, 86400ul) * 1000u;
+    }
+    address_timeout = make_timeout_time_ms(renew_ms);
+    is_static = true;
+    log_message(LOG_INFO, LOG_WIFI, "Using cached address %s", ip4addr_ntoa(&ip));
+}
+
+static void _update_cache(void)
+{
+    struct netif *n = &cyw43_state.netif[CYW43_ITF_STA];
+    wifi_cache_t next = {0};
+    cyw43_wifi_get_bssid(&cyw43_state, &next.bssid[0]);
+
+    // the channel is the first word of the driver's channel info
+    uint32_t channel_info[3] = {0};
+    cyw43_ioctl(&cyw43_state, CYW43_IOCTL_GET_CHANNEL, sizeof(channel_info),
+                (uint8_t *)&channel_info[0], CYW43_ITF_STA);
+    next.channel = (uint8_t)channel_info[0];
+
+    cyw43_arch_lwip_begin();
+    next.ip = ip4_addr_get_u32(netif_ip4_addr(n));
+    next.netmask = ip4_addr_get_u32(netif_ip4_netmask(n));
+    next.gateway = ip4_addr_get_u32(netif_ip4_gw(n));
+    next.dns = ip4_addr_get_u32(ip_2_ip4(dns_getserver(0)));
+    struct dhcp *dhcp = netif_dhcp_data(n);
+    next.lease_s = dhcp != NULL ? dhcp->offered_t0_lease : 0;
+    cyw43_arch_lwip_end();
+    next.obtained = rtc_time_valid() ? get_unix_time() : 0;
+
+    // only worth a flash write if the connection changed, or the saved lease
+    // start is unknown or over half a lease old. Keeping an older start only
+    // makes the lease look shorter.
+    use_cache = true;
+    if (has_cache && memcmp(&next, &cache, offsetof(wifi_cache_t, obtained)) == 0 &&
+        (next.obtained == 0 ||
+         (cache.obtained != 0 && next.obtained - cache.obtained <= next.lease_s / 2u)))
+    {
+        return;
+    }
+    cache = next;
+    has_cache = true;
+    is_cache_dirty = true;
+}
+
+static void _schedule(void)
+{
+    // while up, only a borrowed address has a deadline, to renew it
+    absolute_time_t due = timeout;
+    if (wifi_state == WIFI_CONNECTING)
+    {
+        due = absolute_time_min(due, make_timeout_time_ms(connect_poll_ms));
+    }
+    else if (wifi_state == WIFI_UP)
+    {
+        due = is_static ? address_timeout : at_the_end_of_time;
+    }
+    sched_at(SCHED_WIFI, due);
+}
+
+static void _netif_changed(struct netif *n)
 {
-    return is_connected;
+    (void)n;
+    sched_wake();
 }
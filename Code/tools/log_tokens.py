@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+"""Builds the token database for the datalogger's tokenized logging.
+
+Scans the firmware sources for `log_message()` calls and `LOG_TOKEN()` uses,
+hashes each format string the same way as `include/log_token.h`, and writes a
+CSV of `token,"format"` lines for `detokenize` to read.
+
+Run with `--header` to print the `_LOG_HASH()` macro instead.
+"""
+
+import argparse
+import re
+import sys
+
+# must match `LOG_TOKEN_HASH_LENGTH` in include/log_token.h
+HASH_LENGTH = 80
+HASH_COEFFICIENT = 65599
+
+# one or more adjacent string literals
+LITERALS = r'((?:"(?:\\.|[^"\\\n])*"\s*)+)'
+# the format argument of a call, or the argument of a token macro
+CALL_PATTERNS = [
+    re.compile(r'\blog_message\s*\(\s*\w+\s*,\s*\w+\s*,\s*' + LITERALS + r'[,)]'),
+    re.compile(r'\bLOG_TOKEN\s*\(\s*' + LITERALS + r'\)'),
+]
+LITERAL = re.compile(r'"((?:\\.|[^"\\\n])*)"')
+COMMENTS = re.compile(r'//[^\n]*|/\*.*?\*/', re.DOTALL)
+
+ESCAPES = {
+    'n': '\n', 't': '\t', 'r': '\r', '0': '\0', '\\': '\\', '"': '"',
+    "'": "'", '?': '?', 'a': '\a', 'b': '\b', 'f': '\f', 'v': '\v',
+}
+
+
+def unescape(literal):
+    """Turns the body of a C string literal into its bytes."""
+    out = bytearray()
+    i = 0
+    while i < len(literal):
+        c = literal[i]
+        if c != '\\':
+            out += c.encode('utf-8')
+            i += 1
+            continue
+        nxt = literal[i + 1]
+        if nxt == 'x':
+            digits = re.match(r'[0-9a-fA-F]+', literal[i + 2:]).group(0)
+            out.append(int(digits, 16) & 0xff)
+            i += 2 + len(digits)
+        elif nxt in '01234567':
+            digits = re.match(r'[0-7]{1,3}', literal[i + 1:]).group(0)
+            out.append(int(digits, 8) & 0xff)
+            i += 1 + len(digits)
+        else:
+            out += ESCAPES[nxt].encode('utf-8')
+            i += 2
+    return bytes(out)
+
+
+def token(string):
+    """The 65599 hash of a format string, as `LOG_TOKEN()` computes it."""
+    value = len(string)
+    coefficient = HASH_COEFFICIENT
+    for byte in string[:HASH_LENGTH]:
+        value = (value + coefficient * byte) % 2**32
+        coefficient = (coefficient * HASH_COEFFICIENT) % 2**32
+    return value
+
+
+def scan(path):
+    """Yields every format string in a source file."""
+    with open(path, encoding='utf-8') as f:
+        source = COMMENTS.sub('', f.read())
+    for pattern in CALL_PATTERNS:
+        for match in pattern.finditer(source):
+            yield b''.join(unescape(s) for s in LITERAL.findall(match.group(1)))
+
+
+def quote(string):
+    """Quotes a format string for the CSV, doubling any quotes."""
+    text = string.decode('utf-8').replace('"', '""')
+    return '"' + text.replace('\n', '\\n') + '"'
+
+
+def print_header():
+    coefficient = HASH_COEFFICIENT
+    lines = []
+    for i in range(HASH_LENGTH):
+        lines.append('     _LOG_HASH_CHAR(str, %d, 0x%08xu)' % (i, coefficient))
+        coefficient = (coefficient * HASH_COEFFICIENT) % 2**32
+    print('#define _LOG_HASH(str) \\')
+    print('    (' + ' + \\\n'.join(lines).lstrip() + ')')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('sources', nargs='*', help='firmware sources to scan')
+    parser.add_argument('-o', '--output', help='database to write, stdout if omitted')
+    parser.add_argument('--header', action='store_true',
+                        help='print the hash macro for include/log_token.h')
+    args = parser.parse_args()
+
+    if args.header:
+        print_header()
+        return 0
+
+    database = {}
+    for path in args.sources:
+        for string in scan(path):
+            value = token(string)
+            if database.get(value, string) != string:
+                print('%s: token %08x collides: "%s" and "%s"' % (
+                    path, value, database[value].decode(), string.decode()),
+                    file=sys.stderr)
+                return 1
+            database[value] = string
+
+    lines = ['%08x,%s\n' % (value, quote(database[value]))
+             for value in sorted(database)]
+    if args.output:
+        with open(args.output, 'w', encoding='utf-8') as f:
+            f.writelines(lines)
+    else:
+        sys.stdout.writelines(lines)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,257 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "record.h"
+#include "uplink_proto.h"
+
+// largest datagram accepted
+#define DATAGRAM_SIZE 2048u
+// most devices tracked at once
+#define MAX_DEVICES 16u
+
+// what's been received from one device
+typedef struct
+{
+    struct sockaddr_in addr; // where its batches come from
+    bool in_use;
+    uint32_t session;        // the session of its last batch
+    uint32_t sequence;       // the sequence number of its last batch
+    uint32_t last_timestamp; // the newest record printed
+    uint32_t batches;        // batches received, not counting resends
+    uint32_t resends;        // batches received again
+    uint32_t records;        // records printed
+    uint32_t duplicates;     // records received again after a reset
+} device_t;
+
+static device_t devices[MAX_DEVICES];
+// set by the signal handler to stop
+static volatile sig_atomic_t is_stopping = 0;
+
+/**
+ * Stops the receive loop.
+ */
+static void _stop(int signum);
+
+/**
+ * Finds the device a datagram came from, taking a free slot for a new one.
+ *
+ * @return Pointer to the device, or `NULL` if there are too many
+ */
+static device_t *_find_device(const struct sockaddr_in *addr);
+
+/**
+ * Prints the new records in a batch as CSV, skipping any no newer than the
+ * device's last, as a reset resends the page it was part way through.
+ */
+static void _print_batch(device_t *dev, const uint8_t *data, size_t len);
+
+int main(int argc, char **argv)
+{
+    if (argc > 3)
+    {
+        fprintf(stderr, "usage: %s [port] [drop percent]\n"
+                        "Receives measurement batches from dataloggers, acknowledges "
+                        "them and prints the records as CSV. Dropping a share of the "
+                        "batches and acks at random tests the resends.\n",
+                argv[0]);
+        return 2;
+    }
+    uint16_t port = argc > 1 ? (uint16_t)strtoul(argv[1], NULL, 10) : 9000u;
+    unsigned drop = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 10) : 0u;
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+    struct sockaddr_in local = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (bind(sock, (struct sockaddr *)&local, sizeof(local)) < 0)
+    {
+        perror("bind");
+        return 1;
+    }
+
+    // no SA_RESTART, so the receive returns on a signal
+    struct sigaction action = {.sa_handler = _stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    srand((unsigned)time(NULL));
+
+    fprintf(stderr, "Listening on UDP port %u\n", port);
+    printf("device,time,values\n");
+    fflush(stdout);
+    while (!is_stopping)
+    {
+        uint8_t data[DATAGRAM_SIZE];
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t len = recvfrom(sock, &data[0], sizeof(data), 0,
+                               (struct sockaddr *)&from, &from_len);
+        if (len < 0)
+        {
+            if (errno != EINTR)
+            {
+                perror("recvfrom");
+            }
+            continue;
+        }
+
+        uplink_header_t header;
+        if (!uplink_header_read(&header, &data[0], (size_t)len) || header.type != UPLINK_BATCH)
+        {
+            fprintf(stderr, "%s: ignored %zd bytes, not a batch\n",
+                    inet_ntoa(from.sin_addr), len);
+            continue;
+        }
+        if ((unsigned)(rand() % 100) < drop)
+        {
+            continue;
+        }
+        device_t *dev = _find_device(&from);
+        if (dev == NULL)
+        {
+            fprintf(stderr, "%s: ignored, too many devices\n", inet_ntoa(from.sin_addr));
+            continue;
+        }
+
+        // a resend means the ack was lost, so just acknowledge it again
+        if (dev->batches > 0 && header.session == dev->session &&
+            header.sequence == dev->sequence)
+        {
+            dev->resends++;
+        }
+        else
+        {
+            if (dev->batches > 0 && header.session != dev->session)
+            {
+                fprintf(stderr, "%s: new session %08x, the device was reset\n",
+                        inet_ntoa(from.sin_addr), header.session);
+            }
+            dev->session = header.session;
+            dev->sequence = header.sequence;
+            dev->batches++;
+            _print_batch(dev, &data[UPLINK_HEADER_SIZE], (size_t)len - UPLINK_HEADER_SIZE);
+        }
+
+        if ((unsigned)(rand() % 100) < drop)
+        {
+            continue;
+        }
+        uint8_t ack[UPLINK_HEADER_SIZE];
+        uplink_header_t reply = {
+            .type = UPLINK_ACK,
+            .session = header.session,
+            .sequence = header.sequence,
+            .count = header.count,
+        };
+        uplink_header_write(&reply, &ack[0]);
+        if (sendto(sock, &ack[0], sizeof(ack), 0, (struct sockaddr *)&from, from_len) < 0)
+        {
+            perror("sendto");
+        }
+    }
+
+    close(sock);
+    for (uint32_t i = 0; i < MAX_DEVICES; i++)
+    {
+        const device_t *dev = &devices[i];
+        if (!dev->in_use)
+        {
+            continue;
+        }
+        fprintf(stderr, "%s: %u batches, %u resent, %u records (%.1f per batch), "
+                        "%u duplicates skipped\n",
+                inet_ntoa(dev->addr.sin_addr), dev->batches, dev->resends, dev->records,
+                dev->batches > 0 ? (double)dev->records / dev->batches : 0.0,
+                dev->duplicates);
+    }
+    return 0;
+}
+
+static void _stop(int signum)
+{
+    (void)signum;
+    is_stopping = 1;
+}
+
+static device_t *_find_device(const struct sockaddr_in *addr)
+{
+    device_t *free_slot = NULL;
+    for (uint32_t i = 0; i < MAX_DEVICES; i++)
+    {
+        device_t *dev = &devices[i];
+        if (dev->in_use && dev->addr.sin_addr.s_addr == addr->sin_addr.s_addr)
+        {
+            // the source port changes with each boot
+            dev->addr = *addr;
+            return dev;
+        }
+        if (!dev->in_use && free_slot == NULL)
+        {
+            free_slot = dev;
+        }
+    }
+    if (free_slot != NULL)
+    {
+        memset(free_slot, 0, sizeof(*free_slot));
+        free_slot->addr = *addr;
+        free_slot->in_use = true;
+    }
+    return free_slot;
+}
+
+static void _print_batch(device_t *dev, const uint8_t *data, size_t len)
+{
+    record_decoder_t dec;
+    record_decoder_init(&dec);
+    size_t pos = 0;
+    while (pos < len)
+    {
+        record_t rec;
+        size_t used;
+        RecordResult result = record_decode(&dec, &data[pos], len - pos, &used, &rec);
+        pos += used;
+        if (result == RECORD_INCOMPLETE)
+        {
+            break;
+        }
+        if (result != RECORD_OK)
+        {
+            continue;
+        }
+
+        if (dev->records > 0 && (int32_t)(rec.timestamp - dev->last_timestamp) <= 0)
+        {
+            dev->duplicates++;
+            continue;
+        }
+        dev->last_timestamp = rec.timestamp;
+        dev->records++;
+
+        char stamp[32];
+        time_t epoch = (time_t)rec.timestamp;
+        strftime(&stamp[0], sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&epoch));
+        printf("%s,%s", inet_ntoa(dev->addr.sin_addr), stamp);
+        for (uint8_t i = 0; i < rec.count; i++)
+        {
+            printf(",%d", rec.values[i]);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+}
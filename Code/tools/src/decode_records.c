@@ -0,0 +1,208 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "record.h"
+
+// bytes read from the input at a time
+#define READ_SIZE 4096u
+// the longest header line
+#define HEADER_SIZE 512u
+
+// a column from the header, `name (unit)/scale`
+typedef struct
+{
+    char name[64];    // the column name, with its unit
+    uint16_t scale;   // stored value per unit
+    uint8_t decimals; // decimal places the scale allows
+} column_t;
+
+// the columns from the header, if the stream had one
+static column_t columns[RECORD_MAX_CHANNELS];
+// number of columns in the header
+static uint8_t column_count = 0;
+
+/**
+ * Reads the header line, if the stream starts with one, and prints the CSV
+ * header for the decoded records.
+ *
+ * @return Number of bytes the header took up, 0 if there wasn't one
+ */
+static size_t _read_header(const uint8_t *data, size_t len);
+
+/**
+ * Prints a record as a line of CSV, scaling each value by its column.
+ */
+static void _print_record(const record_t *rec);
+
+int main(int argc, char **argv)
+{
+    if (argc > 2)
+    {
+        fprintf(stderr, "usage: %s [records]\n"
+                        "Reads binary measurement records from the file, or stdin, "
+                        "and prints them as CSV.\n",
+                argv[0]);
+        return 2;
+    }
+
+    FILE *input = stdin;
+    if (argc == 2)
+    {
+        input = fopen(argv[1], "rb");
+        if (input == NULL)
+        {
+            perror(argv[1]);
+            return 1;
+        }
+    }
+
+    // enough for a full read plus a partial record left over from the last
+    static uint8_t data[READ_SIZE + HEADER_SIZE];
+    size_t len = fread(&data[0], 1, sizeof(data), input);
+    size_t pos = _read_header(&data[0], len);
+
+    record_decoder_t dec;
+    record_decoder_init(&dec);
+    uint64_t total_bytes = 0;
+    uint32_t records = 0;
+    uint32_t keyframes = 0;
+    uint32_t skipped = 0;
+    bool eof = len < sizeof(data);
+    while (true)
+    {
+        // the zero padding after the last flush isn't a record, and a record
+        // never starts with a zero
+        size_t zeros = 0;
+        while (eof && pos + zeros < len && data[pos + zeros] == 0)
+        {
+            zeros++;
+        }
+        if (zeros > 0 && pos + zeros == len)
+        {
+            pos = len;
+            break;
+        }
+
+        record_t rec;
+        size_t used;
+        RecordResult result = record_decode(&dec, &data[pos], len - pos, &used, &rec);
+        pos += used;
+        total_bytes += used;
+        if (result == RECORD_OK)
+        {
+            _print_record(&rec);
+            records++;
+            keyframes += rec.keyframe;
+        }
+        else if (result == RECORD_CORRUPT)
+        {
+            skipped += used;
+        }
+        else if (!eof)
+        {
+            // keep the partial record, and read more after it
+            memmove(&data[0], &data[pos], len - pos);
+            len -= pos;
+            pos = 0;
+            size_t n = fread(&data[len], 1, READ_SIZE, input);
+            len += n;
+            eof = n < READ_SIZE;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (input != stdin)
+    {
+        fclose(input);
+    }
+
+    if (pos < len)
+    {
+        fprintf(stderr, "%zu bytes of a truncated record at the end\n", len - pos);
+    }
+
+    fprintf(stderr, "%u records, %u keyframes, %u bytes skipped",
+            records, keyframes, skipped);
+    if (records > 0)
+    {
+        fprintf(stderr, ", %.2f bytes/record", (double)(total_bytes - skipped) / records);
+    }
+    fprintf(stderr, "\n");
+    return 0;
+}
+
+static size_t _read_header(const uint8_t *data, size_t len)
+{
+    // records start with a keyframe, anything else is the header line
+    const uint8_t *end = memchr(data, '\n', len < HEADER_SIZE ? len : HEADER_SIZE);
+    if (len == 0 || data[0] == RECORD_SYNC || end == NULL)
+    {
+        printf("time\n");
+        return 0;
+    }
+
+    char line[HEADER_SIZE];
+    size_t size = (size_t)(end - data);
+    memcpy(&line[0], data, size);
+    line[size] = '\0';
+    if (size > 0 && line[size - 1] == '\r')
+    {
+        line[size - 1] = '\0';
+    }
+
+    // skip the time column, then split the rest on commas
+    char *field = strtok(&line[0], ",");
+    printf("%s", field != NULL ? field : "time");
+    while ((field = strtok(NULL, ",")) != NULL && column_count < RECORD_MAX_CHANNELS)
+    {
+        column_t *col = &columns[column_count++];
+        char *slash = strrchr(field, '/');
+        col->scale = 1;
+        if (slash != NULL)
+        {
+            *slash = '\0';
+            col->scale = (uint16_t)strtoul(slash + 1, NULL, 10);
+        }
+        if (col->scale == 0)
+        {
+            col->scale = 1;
+        }
+        col->decimals = 0;
+        for (uint16_t s = col->scale; s >= 10u; s /= 10u)
+        {
+            col->decimals++;
+        }
+        snprintf(&col->name[0], sizeof(col->name), "%s", field);
+        printf(",%s", col->name);
+    }
+    printf("\n");
+    return size + 1;
+}
+
+static void _print_record(const record_t *rec)
+{
+    char stamp[32];
+    time_t epoch = (time_t)rec->timestamp;
+    strftime(&stamp[0], sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&epoch));
+    printf("%s", stamp);
+
+    for (uint8_t i = 0; i < rec->count; i++)
+    {
+        if (i < column_count)
+        {
+            printf(",%.*f", columns[i].decimals, (double)rec->values[i] / columns[i].scale);
+        }
+        else
+        {
+            printf(",%d", rec->values[i]);
+        }
+    }
+    printf("\n");
+}
@@ -0,0 +1,498 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the largest frame, before COBS encoding, as in the firmware
+#define FRAME_SIZE 128u
+// the longest format string in the database
+#define FORMAT_SIZE 512u
+// number of elements in an array
+#define COUNT_OF(a) (sizeof(a) / sizeof((a)[0]))
+
+// the strings corresponding to LogLevel, as in the firmware's `logging.c`
+static const char *log_level_str[] = {
+    "ERROR",
+    "WARN",
+    "INFO",
+    "DEBUG",
+};
+
+// the strings corresponding to LogCategory, as in the firmware's `logging.c`
+static const char *log_category_str[] = {
+    "SYSTEM",
+    "WIFI",
+    "NTP",
+    "SENSOR",
+    "RTC",
+    "BUTTON",
+    "LED",
+    "STORE",
+    "UPLINK",
+    "HTTP",
+};
+
+// one line of the token database
+typedef struct
+{
+    uint32_t token; // the hash of the format string
+    char *format;   // the format string
+} token_entry_t;
+
+// a frame being decoded
+typedef struct
+{
+    const uint8_t *data; // the decoded frame
+    size_t size;         // size of the frame
+    size_t pos;          // the next byte to read
+} frame_reader_t;
+
+// the token database, sorted by token
+static token_entry_t *entries = NULL;
+// number of entries in the database
+static size_t entry_count = 0;
+
+/**
+ * Loads a database written by `log_tokens.py`.
+ *
+ * @return `true` if successful, `false` otherwise
+ */
+static bool _load_database(const char *path);
+
+/**
+ * Finds the format string of a token.
+ *
+ * @return The format string, `NULL` if the token is unknown
+ */
+static const char *_lookup(uint32_t token);
+
+/**
+ * Decodes a COBS encoded frame in place, without its delimiter.
+ *
+ * @return Size of the decoded frame, or 0 if it is malformed
+ */
+static size_t _cobs_decode(uint8_t *data, size_t size);
+
+/**
+ * Reads a varint from a frame.
+ *
+ * @return `true` if successful, `false` if the frame ran out
+ */
+static bool _read_varint(frame_reader_t *reader, uint64_t *value);
+
+/**
+ * Turns a frame back into the line the firmware would have printed.
+ */
+static void _print_frame(const uint8_t *data, size_t size);
+
+/**
+ * Formats a message from its format string and packed arguments. Stops with
+ * "..." at the first argument which was left out of the frame.
+ */
+static void _format_message(const char *fmt, frame_reader_t *reader,
+                            char *out, size_t out_size);
+
+/**
+ * Compares two database entries by token, for `qsort()` and `bsearch()`.
+ */
+static int _compare_entries(const void *a, const void *b);
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "usage: %s <log_tokens.csv> [capture]\n"
+                        "Reads tokenized log frames from the capture, or stdin, "
+                        "and prints them as text.\n",
+                argv[0]);
+        return 2;
+    }
+    if (!_load_database(argv[1]))
+    {
+        return 1;
+    }
+
+    FILE *input = stdin;
+    if (argc == 3)
+    {
+        input = fopen(argv[2], "rb");
+        if (input == NULL)
+        {
+            perror(argv[2]);
+            return 1;
+        }
+    }
+
+    // frames end with a zero byte, anything too long can't be one
+    uint8_t frame[FRAME_SIZE + FRAME_SIZE / 254u + 2u];
+    size_t len = 0;
+    bool overflow = false;
+    int c;
+    while ((c = fgetc(input)) != EOF)
+    {
+        if (c != 0)
+        {
+            if (len < sizeof(frame))
+            {
+                frame[len++] = (uint8_t)c;
+            }
+            else
+            {
+                overflow = true;
+            }
+            continue;
+        }
+
+        size_t size = overflow ? 0 : _cobs_decode(frame, len);
+        if (size > 0)
+        {
+            _print_frame(frame, size);
+        }
+        else if (len > 0)
+        {
+            fprintf(stderr, "Skipped %zu bytes which aren't a frame\n", len);
+        }
+        len = 0;
+        overflow = false;
+    }
+
+    if (input != stdin)
+    {
+        fclose(input);
+    }
+    return 0;
+}
+
+static bool _load_database(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        return false;
+    }
+
+    size_t capacity = 0;
+    char line[FORMAT_SIZE * 2u];
+    unsigned long line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+
+        // each line is `token,"format"`, with any quotes doubled
+        char *quote = strchr(line, '"');
+        unsigned int token;
+        if (sscanf(line, "%8x,", &token) != 1 || quote == NULL)
+        {
+            fprintf(stderr, "%s:%lu: malformed line\n", path, line_number);
+            continue;
+        }
+
+        char *format = malloc(strlen(quote) + 1u);
+        size_t len = 0;
+        for (char *p = quote + 1; *p != '\0'; p++)
+        {
+            if (*p == '"' && p[1] == '"')
+            {
+                p++;
+            }
+            else if (*p == '"')
+            {
+                break;
+            }
+            else if (*p == '\\' && p[1] == 'n')
+            {
+                format[len++] = '\n';
+                p++;
+                continue;
+            }
+            format[len++] = *p;
+        }
+        format[len] = '\0';
+
+        if (entry_count == capacity)
+        {
+            capacity = capacity > 0 ? capacity * 2u : 64u;
+            entries = realloc(entries, capacity * sizeof(*entries));
+        }
+        entries[entry_count++] = (token_entry_t){.token = token, .format = format};
+    }
+    fclose(file);
+
+    qsort(entries, entry_count, sizeof(*entries), _compare_entries);
+    return true;
+}
+
+static const char *_lookup(uint32_t token)
+{
+    token_entry_t key = {.token = token};
+    const token_entry_t *entry = bsearch(&key, entries, entry_count,
+                                         sizeof(*entries), _compare_entries);
+    return entry != NULL ? entry->format : NULL;
+}
+
+static int _compare_entries(const void *a, const void *b)
+{
+    uint32_t token_a = ((const token_entry_t *)a)->token;
+    uint32_t token_b = ((const token_entry_t *)b)->token;
+    return (token_a > token_b) - (token_a < token_b);
+}
+
+static size_t _cobs_decode(uint8_t *data, size_t size)
+{
+    // each block starts with the offset to the next zero
+    size_t in = 0;
+    size_t out = 0;
+    while (in < size)
+    {
+        uint8_t code = data[in++];
+        if (code == 0 || in + code - 1u > size)
+        {
+            return 0;
+        }
+        memmove(&data[out], &data[in], code - 1u);
+        out += code - 1u;
+        in += code - 1u;
+        if (code < 0xffu && in < size)
+        {
+            data[out++] = 0;
+        }
+    }
+    return out;
+}
+
+static bool _read_varint(frame_reader_t *reader, uint64_t *value)
+{
+    *value = 0;
+    for (uint8_t shift = 0; shift < 64u; shift += 7u)
+    {
+        if (reader->pos >= reader->size)
+        {
+            return false;
+        }
+        uint8_t byte = reader->data[reader->pos++];
+        *value |= (uint64_t)(byte & 0x7fu) << shift;
+        if ((byte & 0x80u) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void _print_frame(const uint8_t *data, size_t size)
+{
+    frame_reader_t reader = {.data = data, .size = size};
+
+    // the token, timestamp, then level and category
+    uint64_t time_us;
+    if (size < 5u)
+    {
+        fprintf(stderr, "Skipped a frame of %zu bytes\n", size);
+        return;
+    }
+    uint32_t token = (uint32_t)data[0] | (uint32_t)data[1] << 8 |
+                     (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+    reader.pos = 4u;
+    if (!_read_varint(&reader, &time_us) || reader.pos >= size)
+    {
+        fprintf(stderr, "Skipped a truncated frame\n");
+        return;
+    }
+    uint8_t meta = data[reader.pos++];
+    uint8_t lvl = meta >> 4;
+    uint8_t cat = meta & 0x0fu;
+
+    // decompose the micros timestamp
+    uint32_t hours = (uint32_t)(time_us / 3600000000ull);
+    uint8_t minutes = (uint8_t)((time_us / 60000000ul) % 60);
+    uint8_t seconds = (uint8_t)((time_us / 1000000ul) % 60);
+    uint32_t micros = (uint32_t)(time_us % 1000000ul);
+
+    char message[FORMAT_SIZE];
+    const char *fmt = _lookup(token);
+    if (fmt != NULL)
+    {
+        _format_message(fmt, &reader, message, sizeof(message));
+    }
+    else
+    {
+        snprintf(message, sizeof(message), "<unknown token %08x>", token);
+    }
+
+    printf("[%u:%02u:%02u.%06u][%5s][%6s] %s\n", hours, minutes, seconds,
+           micros, lvl < COUNT_OF(log_level_str) ? log_level_str[lvl] : "?",
+           cat < COUNT_OF(log_category_str) ? log_category_str[cat] : "?", message);
+    fflush(stdout);
+}
+
+static void _format_message(const char *fmt, frame_reader_t *reader,
+                            char *out, size_t out_size)
+{
+    size_t len = 0;
+    while (*fmt != '\0' && len + 1u < out_size)
+    {
+        if (*fmt != '%')
+        {
+            out[len++] = *fmt++;
+            continue;
+        }
+
+        // copy the flags, width and precision, filling in any `*`
+        char spec[64];
+        size_t spec_len = 0;
+        bool missing = false;
+        spec[spec_len++] = *fmt++;
+        while (*fmt != '\0' && strchr("-+ #0123456789.*", *fmt) != NULL &&
+               spec_len < sizeof(spec) - 24u)
+        {
+            if (*fmt == '*')
+            {
+                uint64_t value;
+                missing |= !_read_varint(reader, &value);
+                int32_t width = (int32_t)((value >> 1) ^ (~(value & 1u) + 1u));
+                spec_len += snprintf(&spec[spec_len], sizeof(spec) - spec_len,
+                                     "%d", width);
+            }
+            else
+            {
+                spec[spec_len++] = *fmt;
+            }
+            fmt++;
+        }
+
+        // the device's long is 32 bits, only `ll` and `j` are 64 bits
+        bool wide = false;
+        while (*fmt != '\0' && strchr("hlLzjt", *fmt) != NULL)
+        {
+            wide |= *fmt == 'j' || (fmt[0] == 'l' && fmt[1] == 'l');
+            fmt += fmt[0] == 'l' && fmt[1] == 'l' ? 2 : 1;
+        }
+        char conv = *fmt;
+        if (conv != '\0')
+        {
+            fmt++;
+        }
+
+        int written = 0;
+        size_t room = out_size - len;
+        switch (conv)
+        {
+        case '%':
+            written = snprintf(&out[len], room, "%%");
+            break;
+        case 'd':
+        case 'i':
+        case 'c':
+        {
+            uint64_t value;
+            missing |= !_read_varint(reader, &value);
+            int64_t decoded = (int64_t)(value >> 1) ^ -(int64_t)(value & 1u);
+            if (!wide)
+            {
+                decoded = (int32_t)decoded;
+            }
+            if (conv != 'c')
+            {
+                strcpy(&spec[spec_len], "ll");
+                spec_len += 2u;
+            }
+            spec[spec_len++] = conv;
+            spec[spec_len] = '\0';
+            if (!missing)
+            {
+                written = conv == 'c' ? snprintf(&out[len], room, spec, (int)decoded)
+                                      : snprintf(&out[len], room, spec, (long long)decoded);
+            }
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        case 'p':
+        {
+            uint64_t value;
+            missing |= !_read_varint(reader, &value);
+            uint64_t decoded = (uint64_t)((int64_t)(value >> 1) ^ -(int64_t)(value & 1u));
+            if (!wide)
+            {
+                decoded = (uint32_t)decoded;
+            }
+            if (conv == 'p')
+            {
+                strcpy(&spec[spec_len], "#llx");
+            }
+            else
+            {
+                snprintf(&spec[spec_len], sizeof(spec) - spec_len, "ll%c", conv);
+            }
+            if (!missing)
+            {
+                written = snprintf(&out[len], room, spec, (unsigned long long)decoded);
+            }
+            break;
+        }
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+        {
+            float value = 0;
+            missing |= reader->pos + sizeof(value) > reader->size;
+            if (!missing)
+            {
+                memcpy(&value, &reader->data[reader->pos], sizeof(value));
+                reader->pos += sizeof(value);
+                spec[spec_len++] = conv;
+                spec[spec_len] = '\0';
+                written = snprintf(&out[len], room, spec, (double)value);
+            }
+            break;
+        }
+        case 's':
+        {
+            // the length byte's top bit marks a string which was cut short
+            missing |= reader->pos >= reader->size;
+            if (missing)
+            {
+                break;
+            }
+            uint8_t header = reader->data[reader->pos++];
+            size_t str_len = header & 0x7fu;
+            if (reader->pos + str_len > reader->size)
+            {
+                missing = true;
+                break;
+            }
+            char str[0x80];
+            memcpy(str, &reader->data[reader->pos], str_len);
+            str[str_len] = '\0';
+            reader->pos += str_len;
+            spec[spec_len++] = 's';
+            spec[spec_len] = '\0';
+            written = snprintf(&out[len], room, spec, str);
+            missing = (header & 0x80u) != 0;
+            break;
+        }
+        default:
+            missing = true;
+            break;
+        }
+
+        len += written > 0 ? (size_t)written : 0;
+        len = len < out_size ? len : out_size - 1u;
+        // nothing after a missing argument can be recovered
+        if (missing)
+        {
+            snprintf(&out[len], out_size - len, "...");
+            return;
+        }
+    }
+    out[len] = '\0';
+}
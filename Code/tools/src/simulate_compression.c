@@ -0,0 +1,226 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "block.h"
+#include "record.h"
+
+// one sample a minute, for thirty days
+#define SAMPLE_COUNT (30u * 24u * 60u)
+// the simulated channels, as registered by the firmware with one soil probe
+#define CHANNEL_COUNT 5u
+// the start of the simulation, 2025-01-01T00:00:00Z
+#define START_TIME 1735689600ul
+#define PI 3.14159265358979323846
+
+// a simulated channel, stored the same way as the firmware's
+typedef struct
+{
+    const char *name;
+    uint16_t scale;   // stored value per unit
+    uint8_t decimals; // decimal places in the CSV
+} channel_t;
+
+static const channel_t channels[CHANNEL_COUNT] = {
+    {.name = "Humidity", .scale = 100u, .decimals = 0u},
+    {.name = "Temperature", .scale = 100u, .decimals = 0u},
+    {.name = "Soil moisture 0", .scale = 100u, .decimals = 1u},
+    {.name = "Core temperature", .scale = 100u, .decimals = 1u},
+    {.name = "VSYS", .scale = 1000u, .decimals = 2u},
+};
+
+// the simulated month
+static uint32_t timestamps[SAMPLE_COUNT];
+static int16_t values[SAMPLE_COUNT][CHANNEL_COUNT];
+
+/**
+ * Returns a normally distributed random number, by the Box-Muller transform.
+ */
+static double _gaussian(double sigma);
+
+/**
+ * Fills in a month of readings. Soil moisture dries out slowly and is watered
+ * every few days, the air follows a daily cycle at the DHT11's whole degree
+ * and percent resolution, and the ADC channels carry a little noise.
+ */
+static void _simulate(void);
+
+/**
+ * Returns the CSV line length the SD card sink would write for a sample.
+ */
+static size_t _csv_length(size_t sample);
+
+/**
+ * Returns the host's clock in seconds, for timing.
+ */
+static double _now(void);
+
+int main(int argc, char **argv)
+{
+    (void)argv;
+    if (argc > 1)
+    {
+        fprintf(stderr, "usage: %s\n"
+                        "Compresses a simulated month of measurements with each "
+                        "format, and prints the sizes.\n",
+                argv[0]);
+        return 2;
+    }
+    _simulate();
+
+    // the baseline, a timestamp and each value stored as-is
+    size_t raw_bytes = SAMPLE_COUNT * (4u + 2u * CHANNEL_COUNT);
+    size_t csv_bytes = 0;
+    for (size_t i = 0; i < SAMPLE_COUNT; i++)
+    {
+        csv_bytes += _csv_length(i);
+    }
+
+    // delta and varint records
+    record_encoder_t rec_enc;
+    record_encoder_init(&rec_enc);
+    size_t record_bytes = 0;
+    double start = _now();
+    for (size_t i = 0; i < SAMPLE_COUNT; i++)
+    {
+        uint8_t out[RECORD_MAX_SIZE];
+        record_bytes += record_encode(&rec_enc, timestamps[i], &values[i][0],
+                                      CHANNEL_COUNT, &out[0], sizeof(out));
+    }
+    double record_time = _now() - start;
+
+    // compressed blocks, kept for decoding afterwards. Even at the worst case
+    // for every value a block holds more than eight samples.
+    static uint8_t blocks[SAMPLE_COUNT / 8u][BLOCK_SIZE];
+    size_t block_count = 0;
+    static block_encoder_t block_enc;
+    block_encoder_init(&block_enc);
+    start = _now();
+    for (size_t i = 0; i < SAMPLE_COUNT; i++)
+    {
+        if (!block_append(&block_enc, timestamps[i], &values[i][0], CHANNEL_COUNT))
+        {
+            memcpy(&blocks[block_count++][0], block_finish(&block_enc), BLOCK_SIZE);
+            block_encoder_init(&block_enc);
+            block_append(&block_enc, timestamps[i], &values[i][0], CHANNEL_COUNT);
+        }
+    }
+    memcpy(&blocks[block_count++][0], block_finish(&block_enc), BLOCK_SIZE);
+    double block_time = _now() - start;
+    size_t block_bytes = block_count * BLOCK_SIZE;
+
+    // decode every block, and check it matches what went in
+    size_t decoded = 0;
+    start = _now();
+    for (size_t b = 0; b < block_count; b++)
+    {
+        block_reader_t reader;
+        if (!block_reader_init(&reader, &blocks[b][0]))
+        {
+            fprintf(stderr, "block %zu failed its CRC\n", b);
+            return 1;
+        }
+        record_t rec;
+        while (block_read(&reader, &rec))
+        {
+            if (decoded >= SAMPLE_COUNT || rec.timestamp != timestamps[decoded] ||
+                memcmp(&rec.values[0], &values[decoded][0], sizeof(values[0])) != 0)
+            {
+                fprintf(stderr, "sample %zu decoded wrong\n", decoded);
+                return 1;
+            }
+            decoded++;
+        }
+    }
+    double decode_time = _now() - start;
+    if (decoded != SAMPLE_COUNT)
+    {
+        fprintf(stderr, "decoded %zu of %u samples\n", decoded, SAMPLE_COUNT);
+        return 1;
+    }
+
+    printf("%u samples of %u channels, one a minute for 30 days\n",
+           SAMPLE_COUNT, CHANNEL_COUNT);
+    printf("%-8s %10s %14s %8s\n", "format", "bytes", "bytes/sample", "ratio");
+    printf("%-8s %10zu %14.2f %8.2f\n", "raw", raw_bytes,
+           (double)raw_bytes / SAMPLE_COUNT, 1.0);
+    printf("%-8s %10zu %14.2f %8.2f\n", "csv", csv_bytes,
+           (double)csv_bytes / SAMPLE_COUNT, (double)raw_bytes / csv_bytes);
+    printf("%-8s %10zu %14.2f %8.2f\n", "records", record_bytes,
+           (double)record_bytes / SAMPLE_COUNT, (double)raw_bytes / record_bytes);
+    printf("%-8s %10zu %14.2f %8.2f\n", "blocks", block_bytes,
+           (double)block_bytes / SAMPLE_COUNT, (double)raw_bytes / block_bytes);
+    printf("%zu blocks of %u bytes, %.1f samples each\n", block_count, BLOCK_SIZE,
+           (double)SAMPLE_COUNT / block_count);
+    printf("host: records %.0f ns/sample, blocks %.0f ns/sample encode, "
+           "%.0f ns/sample decode\n",
+           record_time * 1e9 / SAMPLE_COUNT, block_time * 1e9 / SAMPLE_COUNT,
+           decode_time * 1e9 / SAMPLE_COUNT);
+    return 0;
+}
+
+static double _gaussian(double sigma)
+{
+    double u1 = (rand() + 1.0) / ((double)RAND_MAX + 2.0);
+    double u2 = (rand() + 1.0) / ((double)RAND_MAX + 2.0);
+    return sigma * sqrt(-2.0 * log(u1)) * cos(2.0 * PI * u2);
+}
+
+static void _simulate(void)
+{
+    srand(1);
+    double soil = 70.0;
+    uint32_t timestamp = START_TIME;
+    for (size_t i = 0; i < SAMPLE_COUNT; i++)
+    {
+        // the sensor loop drifts by a second now and then
+        timestamp += 60u + (rand() % 100 == 0 ? 1u : 0u);
+        double day = 2.0 * PI * (double)(timestamp - START_TIME) / 86400.0;
+
+        // dries a little faster in the warmth of the day, watered every 4 days
+        soil -= 0.004 * (1.0 + 0.5 * sin(day));
+        if (i % (4u * 24u * 60u) == 0)
+        {
+            soil = 70.0;
+        }
+        double air = 21.0 + 4.0 * sin(day - PI / 2.0);
+        double humidity = 55.0 - 15.0 * sin(day - PI / 2.0);
+
+        double readings[CHANNEL_COUNT] = {
+            round(humidity + _gaussian(0.3)),
+            round(air + _gaussian(0.3)),
+            soil + _gaussian(0.05),
+            air + 4.0 + _gaussian(0.4),
+            5.05 + _gaussian(0.004),
+        };
+        timestamps[i] = timestamp;
+        for (uint8_t c = 0; c < CHANNEL_COUNT; c++)
+        {
+            values[i][c] = (int16_t)lround(readings[c] * channels[c].scale);
+        }
+    }
+}
+
+static size_t _csv_length(size_t sample)
+{
+    // an ISO 8601 timestamp, then each value with its decimal places
+    size_t len = strlen("2025-01-01T00:00:00Z") + 2u;
+    for (uint8_t c = 0; c < CHANNEL_COUNT; c++)
+    {
+        char value[16];
+        len += 1u + (size_t)snprintf(&value[0], sizeof(value), "%.*f", channels[c].decimals,
+                                     (double)values[sample][c] / channels[c].scale);
+    }
+    return len;
+}
+
+static double _now(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
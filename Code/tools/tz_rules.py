@@ -0,0 +1,231 @@
+#!/usr/bin/env python3
+"""Builds the datalogger's time zone tables from tzdata-style rules.
+
+Reads `Rule` and `Zone` lines in the format `zic` takes, works out every
+UTC offset change of each requested zone over a range of years, and writes
+a C source of transition tables for `include/time_zone.h`. Converting to
+local time is then a lookup in a sorted table, rather than working out the
+rules on the device.
+
+Only single-line zones, without an UNTIL column, are understood.
+"""
+
+import argparse
+import calendar
+import datetime
+import re
+import sys
+
+MONTHS = ['Jan', 'Feb', 'Mar', 'Apr', 'May', 'Jun',
+          'Jul', 'Aug', 'Sep', 'Oct', 'Nov', 'Dec']
+WEEKDAYS = ['Mon', 'Tue', 'Wed', 'Thu', 'Fri', 'Sat', 'Sun']
+
+# the tables hold Unix time in 32 bits
+MAX_TIME = 2**32 - 1
+
+
+def parse_offset(text):
+    """Seconds in a `[-]h[:mm[:ss]]` time, and any trailing w/s/u suffix."""
+    match = re.fullmatch(r'(-?)(\d+)(?::(\d+))?(?::(\d+))?([wsugz]?)', text)
+    if match is None:
+        raise ValueError('bad time "%s"' % text)
+    sign, hours, minutes, seconds, suffix = match.groups()
+    value = int(hours) * 3600 + int(minutes or 0) * 60 + int(seconds or 0)
+    return (-value if sign else value), (suffix or 'w')
+
+
+def parse_day(year, month, on):
+    """The date an ON field names, e.g. `lastSun`, `Sun>=8` or `5`."""
+    if on.startswith('last'):
+        weekday = WEEKDAYS.index(on[4:])
+        last = calendar.monthrange(year, month)[1]
+        date = datetime.date(year, month, last)
+        return date - datetime.timedelta(days=(date.weekday() - weekday) % 7)
+    match = re.fullmatch(r'(\w{3})([<>]=)(\d+)', on)
+    if match is not None:
+        weekday = WEEKDAYS.index(match.group(1))
+        date = datetime.date(year, month, int(match.group(3)))
+        if match.group(2) == '>=':
+            return date + datetime.timedelta(days=(weekday - date.weekday()) % 7)
+        return date - datetime.timedelta(days=(date.weekday() - weekday) % 7)
+    return datetime.date(year, month, int(on))
+
+
+def parse_year(text, previous=None):
+    if text == 'max' or text == 'maximum':
+        return 9999
+    if text == 'only':
+        return previous
+    return int(text)
+
+
+def load(path):
+    """Rules by name, and zones by name, from a rule file."""
+    rules = {}
+    zones = {}
+    with open(path, encoding='utf-8') as f:
+        for number, line in enumerate(f, 1):
+            fields = line.split('#', 1)[0].split()
+            if not fields:
+                continue
+            where = '%s:%d' % (path, number)
+            if fields[0] == 'Rule' and len(fields) == 10:
+                _, name, start, end, _, month, on, at, save, letter = fields
+                start = parse_year(start)
+                rules.setdefault(name, []).append({
+                    'from': start,
+                    'to': parse_year(end, start),
+                    'month': MONTHS.index(month[:3]) + 1,
+                    'on': on,
+                    'at': parse_offset(at),
+                    'save': parse_offset(save)[0],
+                    'letter': '' if letter == '-' else letter,
+                })
+            elif fields[0] == 'Zone' and len(fields) == 5:
+                _, name, offset, rule, form = fields
+                zones[name] = {
+                    'offset': parse_offset(offset)[0],
+                    'rules': None if rule == '-' else rule,
+                    'format': form,
+                }
+            else:
+                raise ValueError('%s: not understood: %s' % (where, line.strip()))
+    return rules, zones
+
+
+def abbreviation(form, letter, save):
+    """A zone's abbreviation, from its FORMAT and the rule in effect."""
+    if '/' in form:
+        return form.split('/')[1 if save else 0]
+    return form.replace('%s', letter)
+
+
+def transitions(zone, rules, first_year, last_year):
+    """The type in effect at the start of the first year, and each change
+    after it, as `(utc, (offset, is_dst, abbreviation))`."""
+    offset = zone['offset']
+    if zone['rules'] is None:
+        return (offset, False, zone['format']), []
+    if zone['rules'] not in rules:
+        raise ValueError('no rules named %s' % zone['rules'])
+    rule_set = rules[zone['rules']]
+
+    # the letter in standard time, before any rule has applied
+    standard = [r for r in rule_set if r['save'] == 0]
+    letter = standard[0]['letter'] if standard else ''
+    save = 0
+    current = (offset, False, abbreviation(zone['format'], letter, 0))
+
+    # a year early, so the type at the start of the first is known
+    start = calendar.timegm((first_year, 1, 1, 0, 0, 0))
+    initial = None
+    changes = []
+    for year in range(first_year - 1, last_year + 1):
+        events = []
+        for rule in rule_set:
+            if rule['from'] <= year <= rule['to']:
+                date = parse_day(year, rule['month'], rule['on'])
+                events.append((date, rule['at'][0], rule))
+        events.sort(key=lambda event: (event[0], event[1]))
+
+        for date, at, rule in events:
+            local = calendar.timegm(date.timetuple()) + at
+            suffix = rule['at'][1]
+            if suffix == 's':
+                utc = local - offset
+            elif suffix in 'ugz':
+                utc = local
+            else:
+                # wall clock time, under the save in effect until now
+                utc = local - offset - save
+            save = rule['save']
+            kind = (offset + save, save != 0,
+                    abbreviation(zone['format'], rule['letter'], save))
+
+            if utc < start:
+                current = kind
+                continue
+            if initial is None:
+                initial = current
+            if kind != current and utc <= MAX_TIME:
+                changes.append((utc, kind))
+            current = kind
+
+    return (initial if initial is not None else current), changes
+
+
+def identifier(name):
+    return re.sub(r'\W', '_', name).lower()
+
+
+def generate(rules, zones, names, first_year, last_year, source):
+    out = ['// generated by tools/tz_rules.py from %s for %d-%d, do not edit\n'
+           % (source, first_year, last_year),
+           '#include "time_zone.h"\n']
+    entries = []
+    for name in names:
+        if name not in zones:
+            raise ValueError('no zone named %s' % name)
+        initial, changes = transitions(zones[name], rules, first_year, last_year)
+        types = [initial]
+        for _, kind in changes:
+            if kind not in types:
+                types.append(kind)
+        prefix = identifier(name)
+
+        out.append('\nstatic const time_zone_type_t %s_types[] = {\n' % prefix)
+        for offset, is_dst, abbr in types:
+            out.append('    {%dl, %s, "%s"},\n' % (offset, 'true' if is_dst else 'false', abbr))
+        out.append('};\n')
+
+        if changes:
+            out.append('static const uint32_t %s_transitions[] = {\n' % prefix)
+            for i in range(0, len(changes), 6):
+                out.append('    ' + ' '.join('%du,' % utc for utc, _ in changes[i:i + 6]) + '\n')
+            out.append('};\n')
+            out.append('static const uint8_t %s_kinds[] = {\n' % prefix)
+            for i in range(0, len(changes), 24):
+                out.append('    ' + ' '.join('%du,' % types.index(kind)
+                                             for _, kind in changes[i:i + 24]) + '\n')
+            out.append('};\n')
+            entries.append('    {"%s", %s_types, %s_transitions, %s_kinds, %du},\n'
+                           % (name, prefix, prefix, prefix, len(changes)))
+        else:
+            entries.append('    {"%s", %s_types, NULL, NULL, 0u},\n' % (name, prefix))
+
+    out.append('\nconst time_zone_t time_zones[] = {\n')
+    out.extend(entries)
+    out.append('};\n')
+    out.append('const uint8_t time_zone_count = %du;\n' % len(names))
+    return ''.join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('rules', help='tzdata-style rule file')
+    parser.add_argument('zones', nargs='+', help='zones to generate, the first is the default')
+    parser.add_argument('-o', '--output', help='C source to write, stdout if omitted')
+    parser.add_argument('--first-year', type=int, default=2025,
+                        help='first year covered (default 2025)')
+    parser.add_argument('--last-year', type=int, default=2100,
+                        help='last year covered (default 2100)')
+    args = parser.parse_args()
+
+    try:
+        rules, zones = load(args.rules)
+        source = generate(rules, zones, args.zones, args.first_year, args.last_year,
+                          args.rules.replace('\\', '/').split('/')[-1])
+    except ValueError as error:
+        print('%s: %s' % (args.rules, error), file=sys.stderr)
+        return 1
+
+    if args.output:
+        with open(args.output, 'w', encoding='utf-8') as f:
+            f.write(source)
+    else:
+        sys.stdout.write(source)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())